@@ -0,0 +1,26 @@
+.include beta.uasm  |; Include beta.uasm file for macro definition
+
+|; fill_screen.asm with the FILL block instruction of the extended ISA
+|; (--extended-isa, in headless and the GUI): 240000 words in 235
+|; chunks instead of 960000 instructions.
+
+BR(main)
+
+video_memory_start:
+    LONG(33554432)
+
+n:
+    LONG(240000)
+    
+blue:
+    LONG(0xFF9933)
+
+main:
+    LD(R31, video_memory_start, R1)
+    LD(R31, n, R2)
+    LD(R31, blue, R3)
+    ADDC(R31, 5, R0)
+    FILL(R1, R2, R3)
+    HALT()
+
+|; End of file
@@ -25,8 +25,12 @@ main:
     |; if interrupt_nb = 0 go to interrupt_1
     BF(R0, interrupt_0)
 
-|; if interrupt_nb = 1
+|; if interrupt_nb = 2 (timer), nothing to do
 interrupt_1:
+    CMPEQC(R0, 2, R4)
+    BT(R4, rtn)
+
+    |; interrupt_nb = 1
     |; Pressed[Char] = 0
     ADD(R3, R1, R0)
     LD(R0,272,R4)
@@ -0,0 +1,126 @@
+#include "aot.h"
+#include "keyboard_hle.h"
+#include "latency.h"
+#include <dlfcn.h>
+#include <string.h>
+
+AotEngine* load_aot_engine(const char* path){
+
+    void* library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+
+    if(library == NULL){
+        fprintf(stderr, "Error: Cannot load %s: %s\n", path, dlerror());
+        return NULL;
+    }
+
+    const int* abi = dlsym(library, "beta_aot_abi");
+    const long* image_size = dlsym(library, "beta_aot_image_size");
+    AotEngine* e = calloc(1, sizeof(AotEngine));
+
+    e->library = library;
+    e->image = dlsym(library, "beta_aot_image");
+    e->entries = dlsym(library, "beta_aot_entries");
+    e->run = (long (*)(AotState*, long)) dlsym(library, "beta_aot_run");
+
+    if(abi == NULL || image_size == NULL || e->image == NULL || e->entries == NULL || e->run == NULL
+       || *abi != AOT_ABI_VERSION){
+        fprintf(stderr, "Error: %s is not a translated program of this emulator version\n", path);
+        dlclose(library);
+        free(e);
+        return NULL;
+    }
+
+    e->image_size = *image_size;
+
+    return e;
+}
+
+static void free_aot_engine(AotEngine* e){
+
+    dlclose(e->library);
+    free(e);
+}
+
+bool attach_aot_engine(Computer* c, AotEngine* e){
+
+    if(e->image_size > c->program_memory_size || memcmp(c->memory, e->image, e->image_size) != 0){
+        fprintf(stderr, "Error: the translated program is not the one loaded\n");
+        free_aot_engine(e);
+        return false;
+    }
+
+    disable_aot(c);
+
+    e->checked_at = c->retired;
+    c->aot = e;
+
+    return true;
+}
+
+void disable_aot(Computer* c){
+
+    if(c->aot == NULL)
+        return;
+
+    free_aot_engine(c->aot);
+    c->aot = NULL;
+}
+
+long aot_steps(Computer* c, long max_steps){
+
+    AotEngine* e = c->aot;
+    long pc = c->cpu.program_counter;
+
+    if(e->dropped || pc >= e->image_size || !e->entries[pc >> 2])
+        return 0;
+
+    if(c->history != NULL || c->pipeline != NULL || c->caches != NULL || c->predictor != NULL
+       || c->write_log != NULL || (c->latency != NULL && c->latency->stage != LATENCY_IDLE)
+       || (c->hle_check != NULL && c->hle_check->pending))
+        return 0;
+
+    // the interpreter may have written into the code
+    if(c->retired != e->checked_at){
+
+        if(memcmp(c->memory, e->image, e->image_size) != 0){
+            fprintf(stderr, "Warning: the program modified its code, back to the interpreter\n");
+            e->dropped = true;
+            return 0;
+        }
+
+        e->checked_at = c->retired;
+    }
+
+    // back in user code: the handler has returned (see end_block() in emulator.c)
+    bool interrupt_raised = c->interrupt_raised;
+    c->interrupt_raised = false;
+
+    AotState s;
+    s.registers = c->cpu.registers;
+    s.pc = pc;
+    s.memory = c->memory;
+    s.memory_size = c->timing_start; // the interpreter serves the timing registers
+    s.video_start = c->program_memory_size;
+    s.video_end = c->program_memory_size + c->video_memory_size;
+    s.dirty_start = &c->dirty_start;
+    s.dirty_end = &c->dirty_end;
+    s.latest_accessed = c->latest_accessed;
+    s.retired = c->retired;
+
+    long n = e->run(&s, max_steps);
+
+    if(n == 0){
+        c->interrupt_raised = interrupt_raised;
+        return 0;
+    }
+
+    c->cpu.program_counter = s.pc;
+    c->latest_accessed = s.latest_accessed;
+    c->retired = s.retired;
+
+    e->checked_at = c->retired;
+    e->runs++;
+    e->steps += n;
+
+    return n;
+}
@@ -0,0 +1,107 @@
+#ifndef AOT_H__
+#define AOT_H__
+
+#include "emulator.h"
+#include <stdint.h>
+
+/* Ahead-of-time translated engines.
+
+   tools/translate turns a program image (.asm.bin) into C: every basic
+   block reachable from address 0 (following branches and the return
+   addresses of linking branches and jumps) becomes a labeled region
+   working on local copies of the registers and on the memory array, and
+   indirect JMPs go through a switch over the block addresses. Compiled
+   into a shared library, it is attached to a Computer with
+   attach_aot_engine(), after which run_steps() runs the translated
+   blocks whenever PC is at one of them.
+
+   The translated code stops, handing the next instruction to the
+   interpreter, on instructions it does not handle (HALT, CPUID, SWAP,
+   CAS, invalid opcodes), on loads and stores outside of memory
+   (including the I/O window, see mmio.h), on jumps out of the known
+   blocks and before stores into translated code. Whenever the
+   interpreter ran in between, the image is compared with memory before
+   running translated code again: once the program modified its code,
+   the engine is dropped and the interpreter takes over.
+
+   Translated code runs only while no interrupt is pending (the
+   interpreter takes it at the end of the block, see raise_interrupt())
+   and no model needing every instruction is attached (history,
+   pipeline, caches, branch predictor, write log, measured interrupt
+   latency, HLE check in progress). Registers, PC, memory, the
+   retired count, latest_accessed and the video dirty range end up
+   exactly as with the interpreter. */
+
+#define AOT_ABI_VERSION 1
+
+// why the translated code returned
+enum{
+    AOT_EXIT_BUDGET,    // not enough steps left for the next block
+    AOT_EXIT_LEAVE,     // PC is not at a translated block
+    AOT_EXIT_INTERPRET  // the instruction at PC must be interpreted
+};
+
+/* Shared with the generated code, which gets a copy of it. */
+#define AOT_STATE_DEFINITION                                                \
+    typedef struct{                                                         \
+        int32_t* registers;                                                 \
+        long pc;                                                            \
+        unsigned char* memory;                                              \
+        long memory_size;                                                   \
+        long video_start;                                                   \
+        long video_end;                                                     \
+        long* dirty_start;                                                  \
+        long* dirty_end;                                                    \
+        long latest_accessed;                                               \
+        unsigned long long retired;                                         \
+        int exit_reason;                                                    \
+    } AotState;
+
+AOT_STATE_DEFINITION
+
+#define AOT_STRINGIFY(...) #__VA_ARGS__
+#define AOT_SOURCE(x) AOT_STRINGIFY(x)
+
+/* Symbols exported by a translated library:
+       const int beta_aot_abi;                 AOT_ABI_VERSION
+       const long beta_aot_image_size;         bytes translated from address 0
+       const unsigned char beta_aot_image[];   the image
+       const unsigned char beta_aot_entries[]; per word, 1 if a block starts there
+       long beta_aot_run(AotState* s, long max_steps);
+   beta_aot_run() executes whole blocks from s -> pc while they fit in
+   $max_steps, and returns the number of instructions executed. */
+
+typedef struct AotEngine{
+
+    void* library;
+    long image_size;
+    const unsigned char* image;
+    const unsigned char* entries;
+    long (*run)(AotState* s, long max_steps);
+
+    bool dropped;                  // the program modified its code
+    unsigned long long checked_at; // retired count when memory last matched the image
+
+    unsigned long long runs;  // calls of the translated code
+    unsigned long long steps; // instructions it executed
+
+} AotEngine;
+
+/* Loads the translated library at $path. Returns NULL (reporting the
+   error) if it cannot be loaded or was built for another ABI. */
+AotEngine* load_aot_engine(const char* path);
+
+/* Attaches $e to $c, which takes ownership of it. Returns false (and
+   frees $e) if $c's memory does not start with $e's image. */
+bool attach_aot_engine(Computer* c, AotEngine* e);
+
+/* Detaches and unloads $c's engine. */
+void disable_aot(Computer* c);
+
+/* Called by run_steps() before interpreting an instruction: runs
+   translated blocks for at most $max_steps instructions if PC is at one
+   and nothing requires the interpreter. Returns the number of
+   instructions executed (0 if the interpreter must go on). */
+long aot_steps(Computer* c, long max_steps);
+
+#endif
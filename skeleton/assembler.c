@@ -0,0 +1,1240 @@
+#include "assembler.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define ASM_MAX_IMAGE (64 * 1024 * 1024)
+#define ASM_MAX_DEPTH 64
+#define ASM_MAX_ARGS 16
+
+enum{
+    TOK_NUM = 0,
+    TOK_IDENT,
+    TOK_STR,
+    TOK_PUNCT,
+    TOK_NEWLINE
+};
+
+typedef struct{
+
+    int type;
+    long value; // TOK_NUM
+    const char* text; // TOK_IDENT, TOK_STR and TOK_PUNCT
+    int file; // index in Assembler.files
+    int line;
+
+} Token;
+
+typedef struct{
+
+    Token* toks;
+    int len;
+    int cap;
+
+} TokenList;
+
+typedef struct{
+
+    const char* name;
+    int nb_params;
+    const char* params[ASM_MAX_ARGS];
+    Token* body;
+    int body_len;
+
+} Macro;
+
+typedef struct{
+
+    const char* name;
+    long value;
+    bool is_label;
+    int pass; // last pass during which the symbol was defined
+
+} Symbol;
+
+typedef struct{
+
+    Assembly* a;
+
+    char** files;
+    int nb_files;
+    char** strings; // storage for identifiers and string literals
+    int nb_strings;
+    int cap_strings;
+
+    Macro* macros;
+    int nb_macros;
+    int* macro_index; // open addressing on the macro name, -1 when empty
+    int macro_index_cap;
+
+    Symbol* symbols;
+    int nb_symbols;
+    int* symbol_index;
+    int symbol_index_cap;
+
+    int pass;
+    long dot; // current location
+    long anchor; // value of "." in expressions of the current statement
+    bool failed;
+
+} Assembler;
+
+static void asm_error(Assembler* as, const Token* t, const char* fmt, const char* arg){
+
+    if(as->failed)
+        return;
+
+    as->failed = true;
+    char msg[ASM_ERROR_LEN / 2];
+    snprintf(msg, sizeof(msg), fmt, arg ? arg : "");
+
+    if(t != NULL)
+        snprintf(as->a->error, ASM_ERROR_LEN, "%s:%d: %s", as->files[t->file], t->line, msg);
+    else
+        snprintf(as->a->error, ASM_ERROR_LEN, "%s", msg);
+}
+
+static const char* intern(Assembler* as, const char* s, size_t len){
+
+    if(as->nb_strings == as->cap_strings){
+        as->cap_strings = as->cap_strings ? as->cap_strings * 2 : 256;
+        as->strings = realloc(as->strings, as->cap_strings * sizeof(char*));
+    }
+
+    char* copy = malloc(len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    as->strings[as->nb_strings++] = copy;
+
+    return copy;
+}
+
+static void push_token(TokenList* l, Token t){
+
+    if(l->len == l->cap){
+        l->cap = l->cap ? l->cap * 2 : 1024;
+        l->toks = realloc(l->toks, l->cap * sizeof(Token));
+    }
+
+    l->toks[l->len++] = t;
+}
+
+static unsigned hash_name(const char* s){
+
+    unsigned h = 5381;
+
+    while(*s)
+        h = h * 33 + (unsigned char) *s++;
+
+    return h;
+}
+
+static Symbol* find_symbol(Assembler* as, const char* name){
+
+    if(as->symbol_index_cap == 0)
+        return NULL;
+
+    unsigned mask = as->symbol_index_cap - 1;
+
+    for(unsigned h = hash_name(name) & mask; as->symbol_index[h] >= 0; h = (h + 1) & mask)
+        if(strcmp(as->symbols[as->symbol_index[h]].name, name) == 0)
+            return &as->symbols[as->symbol_index[h]];
+
+    return NULL;
+}
+
+static void index_symbol(Assembler* as, int idx){
+
+    unsigned mask = as->symbol_index_cap - 1;
+    unsigned h = hash_name(as->symbols[idx].name) & mask;
+
+    while(as->symbol_index[h] >= 0)
+        h = (h + 1) & mask;
+
+    as->symbol_index[h] = idx;
+}
+
+static Symbol* add_symbol(Assembler* as, const char* name){
+
+    if(2 * (as->nb_symbols + 1) > as->symbol_index_cap){
+
+        as->symbol_index_cap = as->symbol_index_cap ? as->symbol_index_cap * 2 : 256;
+        as->symbol_index = realloc(as->symbol_index, as->symbol_index_cap * sizeof(int));
+        as->symbols = realloc(as->symbols, (as->symbol_index_cap / 2) * sizeof(Symbol));
+        memset(as->symbol_index, 0xff, as->symbol_index_cap * sizeof(int));
+
+        for(int i = 0; i < as->nb_symbols; i++)
+            index_symbol(as, i);
+    }
+
+    Symbol* s = &as->symbols[as->nb_symbols];
+    s->name = name;
+    s->value = 0;
+    s->is_label = false;
+    s->pass = 0;
+    index_symbol(as, as->nb_symbols++);
+
+    return s;
+}
+
+/* Returns the macro called $name taking $nb_params arguments, or if
+   $nb_params is negative any macro called $name. */
+static Macro* find_macro(Assembler* as, const char* name, int nb_params){
+
+    if(as->macro_index_cap == 0)
+        return NULL;
+
+    unsigned mask = as->macro_index_cap - 1;
+
+    for(unsigned h = hash_name(name) & mask; as->macro_index[h] >= 0; h = (h + 1) & mask){
+
+        Macro* m = &as->macros[as->macro_index[h]];
+
+        if(strcmp(m->name, name) == 0 && (nb_params < 0 || m->nb_params == nb_params))
+            return m;
+    }
+
+    return NULL;
+}
+
+static void index_macro(Assembler* as, int idx){
+
+    unsigned mask = as->macro_index_cap - 1;
+    unsigned h = hash_name(as->macros[idx].name) & mask;
+
+    while(as->macro_index[h] >= 0)
+        h = (h + 1) & mask;
+
+    as->macro_index[h] = idx;
+}
+
+static Macro* add_macro(Assembler* as, const char* name, int nb_params){
+
+    Macro* m = find_macro(as, name, nb_params);
+
+    if(m != NULL){
+        free(m->body);
+        return m;
+    }
+
+    if(2 * (as->nb_macros + 1) > as->macro_index_cap){
+
+        as->macro_index_cap = as->macro_index_cap ? as->macro_index_cap * 2 : 256;
+        as->macro_index = realloc(as->macro_index, as->macro_index_cap * sizeof(int));
+        as->macros = realloc(as->macros, (as->macro_index_cap / 2) * sizeof(Macro));
+        memset(as->macro_index, 0xff, as->macro_index_cap * sizeof(int));
+
+        for(int i = 0; i < as->nb_macros; i++)
+            index_macro(as, i);
+    }
+
+    m = &as->macros[as->nb_macros];
+    memset(m, 0, sizeof(Macro));
+    m->name = name;
+    m->nb_params = nb_params;
+    index_macro(as, as->nb_macros++);
+
+    return m;
+}
+
+static void clear_macros(Assembler* as){
+
+    for(int i = 0; i < as->nb_macros; i++)
+        free(as->macros[i].body);
+
+    as->nb_macros = 0;
+
+    if(as->macro_index_cap)
+        memset(as->macro_index, 0xff, as->macro_index_cap * sizeof(int));
+}
+
+static char* read_text_file(const char* path){
+
+    FILE* fp = fopen(path, "rb");
+
+    if(fp == NULL)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char* text = malloc(size + 1);
+    size_t read = fread(text, 1, size, fp);
+    text[read] = '\0';
+    fclose(fp);
+
+    return text;
+}
+
+static char* dir_of(const char* path){
+
+    const char* slash = strrchr(path, '/');
+
+    if(slash == NULL)
+        return NULL;
+
+    size_t len = slash - path;
+    char* dir = malloc(len + 2);
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+
+    if(len == 0)
+        strcpy(dir, "/");
+
+    return dir;
+}
+
+static int lex_source(Assembler* as, const char* src, const char* dir,
+                      int file, TokenList* out, int depth);
+
+static int lex_include(Assembler* as, const char* name, const char* dir,
+                       const Token* where, TokenList* out, int depth){
+
+    if(depth >= ASM_MAX_DEPTH){
+        asm_error(as, where, "includes nested too deeply (%s)", name);
+        return -1;
+    }
+
+    char path[4096];
+    char* text = NULL;
+
+    if(name[0] != '/' && dir != NULL){
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        text = read_text_file(path);
+    }
+
+    if(text == NULL){
+        snprintf(path, sizeof(path), "%s", name);
+        text = read_text_file(path);
+    }
+
+    if(text == NULL){
+        asm_error(as, where, "cannot open include file '%s'", name);
+        return -1;
+    }
+
+    as->files = realloc(as->files, (as->nb_files + 1) * sizeof(char*));
+    as->files[as->nb_files] = strdup(path);
+    int file = as->nb_files++;
+
+    char* sub_dir = dir_of(path);
+    int ret = lex_source(as, text, sub_dir, file, out, depth + 1);
+    free(sub_dir);
+    free(text);
+
+    return ret;
+}
+
+static int lex_source(Assembler* as, const char* src, const char* dir,
+                      int file, TokenList* out, int depth){
+
+    static const char* const two_char_ops[] = {"<<", ">>", NULL};
+    const char* p = src;
+    int line = 1;
+
+    while(*p && !as->failed){
+
+        Token t;
+        t.file = file;
+        t.line = line;
+        t.value = 0;
+        t.text = NULL;
+
+        if(*p == '\n'){
+            t.type = TOK_NEWLINE;
+            push_token(out, t);
+            line++;
+            p++;
+        }
+
+        else if(isspace((unsigned char) *p))
+            p++;
+
+        else if(*p == '|'){ // comment until the end of the line
+            while(*p && *p != '\n')
+                p++;
+        }
+
+        else if(p[0] == '/' && p[1] == '/'){
+            while(*p && *p != '\n')
+                p++;
+        }
+
+        else if(p[0] == '/' && p[1] == '*'){
+            p += 2;
+            while(*p && !(p[0] == '*' && p[1] == '/')){
+                if(*p == '\n')
+                    line++;
+                p++;
+            }
+            if(*p)
+                p += 2;
+        }
+
+        else if(isdigit((unsigned char) *p)){
+
+            char* end;
+
+            if(p[0] == '0' && (p[1] == 'b' || p[1] == 'B'))
+                t.value = strtol(p + 2, &end, 2);
+            else
+                t.value = strtol(p, &end, 0);
+
+            if(isalnum((unsigned char) *end) || *end == '_'){
+                asm_error(as, &t, "malformed number", NULL);
+                return -1;
+            }
+
+            t.type = TOK_NUM;
+            push_token(out, t);
+            p = end;
+        }
+
+        else if(*p == '\''){
+
+            if(p[1] == '\\'){
+                switch(p[2]){
+                    case 'n': t.value = '\n'; break;
+                    case 't': t.value = '\t'; break;
+                    case '0': t.value = '\0'; break;
+                    default: t.value = p[2];
+                }
+                p += 3;
+            } else {
+                t.value = (unsigned char) p[1];
+                p += 2;
+            }
+
+            if(*p != '\''){
+                asm_error(as, &t, "malformed character constant", NULL);
+                return -1;
+            }
+
+            p++;
+            t.type = TOK_NUM;
+            push_token(out, t);
+        }
+
+        else if(*p == '"'){
+
+            const char* start = ++p;
+
+            while(*p && *p != '"' && *p != '\n')
+                p += (p[0] == '\\' && p[1]) ? 2 : 1;
+
+            if(*p != '"'){
+                asm_error(as, &t, "unterminated string", NULL);
+                return -1;
+            }
+
+            t.type = TOK_STR;
+            t.text = intern(as, start, p - start);
+            push_token(out, t);
+            p++;
+        }
+
+        else if(isalpha((unsigned char) *p) || *p == '_' || *p == '.'){
+
+            const char* start = p++;
+
+            while(isalnum((unsigned char) *p) || *p == '_' || *p == '.')
+                p++;
+
+            size_t len = p - start;
+
+            if(len == 8 && strncmp(start, ".include", 8) == 0){
+
+                while(*p == ' ' || *p == '\t')
+                    p++;
+
+                // the file name may be quoted, to allow spaces in it
+                bool quoted = *p == '"';
+                const char* name = quoted ? ++p : p;
+
+                while(*p && *p != '\n' && (quoted ? *p != '"' : !isspace((unsigned char) *p) && *p != '|'))
+                    p++;
+
+                if(quoted && *p != '"'){
+                    asm_error(as, &t, "unterminated string", NULL);
+                    return -1;
+                }
+
+                if(p == name){
+                    asm_error(as, &t, ".include without a file name", NULL);
+                    return -1;
+                }
+
+                const char* file = intern(as, name, p - name);
+
+                if(quoted)
+                    p++;
+
+                if(lex_include(as, file, dir, &t, out, depth) < 0)
+                    return -1;
+
+                continue;
+            }
+
+            t.type = TOK_IDENT;
+            t.text = intern(as, start, len);
+            push_token(out, t);
+        }
+
+        else{
+
+            int i;
+            t.type = TOK_PUNCT;
+
+            for(i = 0; two_char_ops[i] != NULL; i++)
+                if(strncmp(p, two_char_ops[i], 2) == 0)
+                    break;
+
+            if(two_char_ops[i] != NULL){
+                t.text = two_char_ops[i];
+                p += 2;
+            } else if(strchr("()[]{},:=+-*/%&^~!", *p)){
+                t.text = intern(as, p, 1);
+                p++;
+            } else {
+                char c[2] = {*p, '\0'};
+                asm_error(as, &t, "unexpected character '%s'", c);
+                return -1;
+            }
+
+            push_token(out, t);
+        }
+    }
+
+    return as->failed ? -1 : 0;
+}
+
+static bool is_punct(const Token* t, const char* op){
+
+    return t->type == TOK_PUNCT && strcmp(t->text, op) == 0;
+}
+
+static int binary_precedence(const Token* t){
+
+    if(t->type != TOK_PUNCT)
+        return -1;
+
+    switch(t->text[0]){
+        case '*': case '/': case '%': return 5;
+        case '+': case '-': return 4;
+        case '<': case '>': return 3;
+        case '&': return 2;
+        case '^': return 1;
+        default: return -1;
+    }
+}
+
+static long parse_binary(Assembler* as, const Token* t, int n, int* i, int min_prec);
+
+static long parse_primary(Assembler* as, const Token* t, int n, int* i){
+
+    if(*i >= n || t[*i].type == TOK_NEWLINE){
+        asm_error(as, *i < n ? &t[*i] : (n ? &t[n - 1] : NULL), "expression expected", NULL);
+        return 0;
+    }
+
+    const Token* tok = &t[(*i)++];
+
+    if(tok->type == TOK_NUM)
+        return tok->value;
+
+    if(tok->type == TOK_IDENT){
+
+        if(strcmp(tok->text, ".") == 0)
+            return as->anchor;
+
+        Symbol* s = find_symbol(as, tok->text);
+
+        if(s == NULL || s->pass == 0){
+            if(as->pass == 2)
+                asm_error(as, tok, "undefined symbol '%s'", tok->text);
+            return 0;
+        }
+
+        return s->value;
+    }
+
+    if(is_punct(tok, "(")){
+
+        long v = parse_binary(as, t, n, i, 0);
+
+        if(*i >= n || !is_punct(&t[*i], ")")){
+            asm_error(as, tok, "missing ')'", NULL);
+            return 0;
+        }
+
+        (*i)++;
+        return v;
+    }
+
+    if(is_punct(tok, "-"))
+        return -parse_primary(as, t, n, i);
+
+    if(is_punct(tok, "+"))
+        return parse_primary(as, t, n, i);
+
+    if(is_punct(tok, "~"))
+        return ~parse_primary(as, t, n, i);
+
+    if(is_punct(tok, "!"))
+        return !parse_primary(as, t, n, i);
+
+    asm_error(as, tok, "unexpected token '%s' in expression",
+              tok->type == TOK_PUNCT ? tok->text : "string");
+    return 0;
+}
+
+static long parse_binary(Assembler* as, const Token* t, int n, int* i, int min_prec){
+
+    long lhs = parse_primary(as, t, n, i);
+
+    while(*i < n && !as->failed){
+
+        const Token* op = &t[*i];
+        int prec = binary_precedence(op);
+
+        if(prec < min_prec || prec < 0)
+            break;
+
+        (*i)++;
+        long rhs = parse_binary(as, t, n, i, prec + 1);
+
+        switch(op->text[0]){
+            case '*': lhs = lhs * rhs; break;
+            case '+': lhs = lhs + rhs; break;
+            case '-': lhs = lhs - rhs; break;
+            case '&': lhs = lhs & rhs; break;
+            case '^': lhs = lhs ^ rhs; break;
+            case '<': lhs = (long) ((unsigned long) lhs << (rhs & 63)); break;
+            case '>': lhs = lhs >> (rhs & 63); break;
+            case '/':
+            case '%':
+                if(rhs == 0){
+                    if(as->pass == 2)
+                        asm_error(as, op, "division by zero", NULL);
+                    lhs = 0;
+                } else if(op->text[0] == '/') {
+                    lhs = lhs / rhs;
+                } else {
+                    // UASM's modulo is never negative: -12 % 0x10000 = 0xfff4
+                    lhs = lhs % rhs;
+                    if(lhs < 0)
+                        lhs += rhs < 0 ? -rhs : rhs;
+                }
+                break;
+        }
+    }
+
+    return lhs;
+}
+
+static long parse_expr(Assembler* as, const Token* t, int n, int* i){
+
+    return parse_binary(as, t, n, i, 0);
+}
+
+static void set_dot(Assembler* as, long dot, const Token* where){
+
+    if(dot < 0 || dot > ASM_MAX_IMAGE){
+        asm_error(as, where, "location out of range", NULL);
+        return;
+    }
+
+    as->dot = dot;
+    as->anchor = dot;
+
+    if(dot > as->a->size)
+        as->a->size = dot;
+}
+
+static void emit_byte(Assembler* as, long value, const Token* where){
+
+    if(as->dot >= ASM_MAX_IMAGE){
+        asm_error(as, where, "image too large", NULL);
+        return;
+    }
+
+    if(as->pass == 2){
+
+        Assembly* a = as->a;
+
+        if(as->dot >= a->capacity){
+
+            long cap = a->capacity ? a->capacity : 4096;
+
+            while(cap <= as->dot)
+                cap *= 2;
+
+            a->image = realloc(a->image, cap);
+            memset(a->image + a->capacity, 0, cap - a->capacity);
+            a->capacity = cap;
+        }
+
+        a->image[as->dot] = (unsigned char) (value & 0xff);
+    }
+
+    as->dot++;
+
+    if(as->dot > as->a->size)
+        as->a->size = as->dot;
+}
+
+static void define_symbol(Assembler* as, const Token* name, long value, bool is_label){
+
+    Symbol* s = find_symbol(as, name->text);
+
+    if(s == NULL)
+        s = add_symbol(as, name->text);
+
+    if(is_label){
+
+        if(s->pass == as->pass && s->is_label){
+            asm_error(as, name, "label '%s' defined twice", name->text);
+            return;
+        }
+
+        if(as->pass == 2 && s->is_label && s->value != value){
+            asm_error(as, name, "label '%s' moved between passes", name->text);
+            return;
+        }
+    }
+
+    s->value = value;
+    s->is_label = is_label;
+    s->pass = as->pass;
+}
+
+/* Parses ".macro NAME(P1, ..., Pn) body" starting at $t[$i] (the
+   .macro token) and returns the index of the first token after the
+   definition. */
+static int define_macro(Assembler* as, const Token* t, int n, int i){
+
+    const Token* start = &t[i++];
+
+    if(i >= n || t[i].type != TOK_IDENT){
+        asm_error(as, start, ".macro without a name", NULL);
+        return n;
+    }
+
+    const char* name = t[i++].text;
+    const char* params[ASM_MAX_ARGS];
+    int nb_params = 0;
+
+    if(i >= n || !is_punct(&t[i], "(")){
+        asm_error(as, start, "macro '%s' needs a parameter list", name);
+        return n;
+    }
+
+    i++;
+
+    while(i < n && !is_punct(&t[i], ")")){
+
+        if(t[i].type != TOK_IDENT || nb_params == ASM_MAX_ARGS){
+            asm_error(as, &t[i], "bad parameter list for macro '%s'", name);
+            return n;
+        }
+
+        params[nb_params++] = t[i++].text;
+
+        if(i < n && is_punct(&t[i], ","))
+            i++;
+    }
+
+    i++; // ')'
+
+    int body_start, body_end;
+
+    if(i < n && is_punct(&t[i], "{")){
+
+        int level = 1;
+        body_start = ++i;
+
+        while(i < n && level > 0){
+            if(is_punct(&t[i], "{"))
+                level++;
+            else if(is_punct(&t[i], "}"))
+                level--;
+            i++;
+        }
+
+        if(level > 0){
+            asm_error(as, start, "unterminated body for macro '%s'", name);
+            return n;
+        }
+
+        body_end = i - 1;
+    }
+
+    else{
+
+        body_start = i;
+
+        while(i < n && t[i].type != TOK_NEWLINE)
+            i++;
+
+        body_end = i;
+    }
+
+    Macro* m = add_macro(as, name, nb_params);
+    memcpy(m->params, params, sizeof(params));
+    m->body_len = body_end - body_start;
+    m->body = malloc((m->body_len ? m->body_len : 1) * sizeof(Token));
+    memcpy(m->body, t + body_start, m->body_len * sizeof(Token));
+
+    return i;
+}
+
+static int run_tokens(Assembler* as, const Token* t, int n, int depth);
+
+/* Expands the call of macro $name whose '(' is $t[$i] and runs the
+   expansion. Returns the index of the first token after the call. */
+static int expand_macro(Assembler* as, const Token* t, int n, int i, int depth){
+
+    const Token* call = &t[i - 1];
+    int arg_start[ASM_MAX_ARGS];
+    int arg_end[ASM_MAX_ARGS];
+    int nb_args = 0;
+    int level = 0;
+
+    i++; // '('
+
+    if(i < n && is_punct(&t[i], ")")){
+        i++;
+    }
+
+    else{
+
+        arg_start[0] = i;
+
+        for(; i < n; i++){
+
+            if(t[i].type == TOK_NEWLINE)
+                break;
+
+            if(is_punct(&t[i], "("))
+                level++;
+
+            else if(is_punct(&t[i], ")") && level-- == 0){
+                arg_end[nb_args++] = i;
+                break;
+            }
+
+            else if(is_punct(&t[i], ",") && level == 0){
+
+                if(nb_args == ASM_MAX_ARGS - 1){
+                    asm_error(as, call, "too many arguments for '%s'", call->text);
+                    return n;
+                }
+
+                arg_end[nb_args++] = i;
+                arg_start[nb_args] = i + 1;
+            }
+        }
+
+        if(i >= n || !is_punct(&t[i], ")")){
+            asm_error(as, call, "missing ')' after arguments of '%s'", call->text);
+            return n;
+        }
+
+        i++;
+    }
+
+    Macro* m = find_macro(as, call->text, nb_args);
+
+    if(m == NULL){
+        asm_error(as, call, "no version of macro '%s' takes this many arguments", call->text);
+        return n;
+    }
+
+    if(depth >= ASM_MAX_DEPTH){
+        asm_error(as, call, "macro '%s' expands too deeply", call->text);
+        return n;
+    }
+
+    TokenList exp = {NULL, 0, 0};
+
+    for(int k = 0; k < m->body_len; k++){
+
+        const Token* b = &m->body[k];
+        int p = -1;
+
+        if(b->type == TOK_IDENT)
+            for(p = m->nb_params - 1; p >= 0; p--)
+                if(strcmp(m->params[p], b->text) == 0)
+                    break;
+
+        if(p < 0){
+            push_token(&exp, *b);
+            continue;
+        }
+
+        // arguments made of several tokens are parenthesized so that
+        // they keep their meaning inside the body's expressions
+        bool wrap = arg_end[p] - arg_start[p] > 1;
+        Token paren = *b;
+        paren.type = TOK_PUNCT;
+
+        if(wrap){
+            paren.text = "(";
+            push_token(&exp, paren);
+        }
+
+        for(int a = arg_start[p]; a < arg_end[p]; a++)
+            push_token(&exp, t[a]);
+
+        if(wrap){
+            paren.text = ")";
+            push_token(&exp, paren);
+        }
+    }
+
+    run_tokens(as, exp.toks, exp.len, depth + 1);
+    free(exp.toks);
+
+    return i;
+}
+
+static void emit_string(Assembler* as, const Token* str, bool terminate){
+
+    for(const char* s = str->text; *s; s++){
+
+        char c = *s;
+
+        if(c == '\\' && s[1]){
+            s++;
+            switch(*s){
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case '0': c = '\0'; break;
+                default: c = *s;
+            }
+        }
+
+        emit_byte(as, (unsigned char) c, str);
+    }
+
+    if(terminate){
+        emit_byte(as, 0, str);
+        while(as->dot % 4)
+            emit_byte(as, 0, str);
+    }
+}
+
+static int run_tokens(Assembler* as, const Token* t, int n, int depth){
+
+    int i = 0;
+
+    while(i < n && !as->failed){
+
+        const Token* tok = &t[i];
+
+        if(depth == 0)
+            as->anchor = as->dot;
+
+        if(tok->type == TOK_NEWLINE){
+            i++;
+            continue;
+        }
+
+        if(tok->type == TOK_IDENT){
+
+            if(strcmp(tok->text, ".macro") == 0){
+                i = define_macro(as, t, n, i);
+                continue;
+            }
+
+            if(strcmp(tok->text, ".align") == 0){
+
+                long align = 4;
+                i++;
+
+                if(i < n && (t[i].type == TOK_NUM || is_punct(&t[i], "(")))
+                    align = parse_expr(as, t, n, &i);
+
+                if(align <= 0){
+                    asm_error(as, tok, "bad alignment", NULL);
+                    break;
+                }
+
+                while(as->dot % align && !as->failed)
+                    emit_byte(as, 0, tok);
+
+                as->anchor = as->dot;
+                continue;
+            }
+
+            if(strcmp(tok->text, ".ascii") == 0 || strcmp(tok->text, ".text") == 0){
+
+                if(i + 1 >= n || t[i + 1].type != TOK_STR){
+                    asm_error(as, tok, "%s expects a string", tok->text);
+                    break;
+                }
+
+                emit_string(as, &t[i + 1], tok->text[1] == 't');
+                i += 2;
+                continue;
+            }
+
+            if(i + 1 < n && is_punct(&t[i + 1], ":")){
+
+                if(strcmp(tok->text, ".") == 0){
+                    asm_error(as, tok, "'.' cannot be a label", NULL);
+                    break;
+                }
+
+                define_symbol(as, tok, as->dot, true);
+                i += 2;
+                continue;
+            }
+
+            if(i + 1 < n && is_punct(&t[i + 1], "=")){
+
+                i += 2;
+                long v = parse_expr(as, t, n, &i);
+
+                if(strcmp(tok->text, ".") == 0)
+                    set_dot(as, v, tok);
+                else
+                    define_symbol(as, tok, v, false);
+
+                continue;
+            }
+
+            if(i + 1 < n && is_punct(&t[i + 1], "(") && find_macro(as, tok->text, -1) != NULL){
+                i = expand_macro(as, t, n, i + 1, depth);
+                continue;
+            }
+
+            if(tok->text[0] == '.' && tok->text[1] != '\0'){
+                asm_error(as, tok, "unknown directive '%s'", tok->text);
+                break;
+            }
+        }
+
+        if(tok->type == TOK_STR){
+            asm_error(as, tok, "unexpected string", NULL);
+            break;
+        }
+
+        // any other expression assembles a single byte
+        long v = parse_expr(as, t, n, &i);
+        emit_byte(as, v, tok);
+    }
+
+    return as->failed ? -1 : 0;
+}
+
+static int compare_labels(const void* x, const void* y){
+
+    const AsmSymbol* a = x;
+    const AsmSymbol* b = y;
+
+    if(a->value != b->value)
+        return a->value < b->value ? -1 : 1;
+
+    return strcmp(a->name, b->name);
+}
+
+static void free_assembler(Assembler* as){
+
+    clear_macros(as);
+    free(as->macros);
+    free(as->macro_index);
+    free(as->symbols);
+    free(as->symbol_index);
+
+    for(int i = 0; i < as->nb_files; i++)
+        free(as->files[i]);
+
+    for(int i = 0; i < as->nb_strings; i++)
+        free(as->strings[i]);
+
+    free(as->files);
+    free(as->strings);
+}
+
+static int assemble(const char* source, const char* dir, const char* name, Assembly* a){
+
+    memset(a, 0, sizeof(Assembly));
+
+    Assembler as;
+    memset(&as, 0, sizeof(Assembler));
+    as.a = a;
+    as.files = malloc(sizeof(char*));
+    as.files[0] = strdup(name);
+    as.nb_files = 1;
+
+    TokenList tokens = {NULL, 0, 0};
+    lex_source(&as, source, dir, 0, &tokens, 0);
+
+    for(as.pass = 1; as.pass <= 2 && !as.failed; as.pass++){
+
+        clear_macros(&as);
+        as.dot = 0;
+        as.anchor = 0;
+        a->size = 0;
+        run_tokens(&as, tokens.toks, tokens.len, 0);
+    }
+
+    if(!as.failed){
+
+        if(a->capacity < a->size){
+            a->image = realloc(a->image, a->size ? a->size : 1);
+            memset(a->image + a->capacity, 0, a->size - a->capacity);
+            a->capacity = a->size;
+        }
+
+        for(int i = 0; i < as.nb_symbols; i++)
+            if(as.symbols[i].is_label)
+                a->nb_labels++;
+
+        a->labels = malloc((a->nb_labels ? a->nb_labels : 1) * sizeof(AsmSymbol));
+
+        for(int i = 0, j = 0; i < as.nb_symbols; i++){
+            if(as.symbols[i].is_label){
+                a->labels[j].name = strdup(as.symbols[i].name);
+                a->labels[j++].value = as.symbols[i].value;
+            }
+        }
+
+        qsort(a->labels, a->nb_labels, sizeof(AsmSymbol), compare_labels);
+    }
+
+    free(tokens.toks);
+    bool failed = as.failed;
+    free_assembler(&as);
+
+    return failed ? -1 : 0;
+}
+
+int assemble_file(const char* path, Assembly* a){
+
+    char* source = read_text_file(path);
+
+    if(source == NULL){
+        memset(a, 0, sizeof(Assembly));
+        snprintf(a->error, ASM_ERROR_LEN, "%s: cannot open file", path);
+        return -1;
+    }
+
+    char* dir = dir_of(path);
+    int ret = assemble(source, dir, path, a);
+    free(dir);
+    free(source);
+
+    return ret;
+}
+
+int assemble_string(const char* source, const char* dir, Assembly* a){
+
+    return assemble(source, dir, "<string>", a);
+}
+
+int write_image(const Assembly* a, FILE* out){
+
+    if(out == NULL)
+        return -1;
+
+    if(a->size > 0 && fwrite(a->image, 1, a->size, out) != (size_t) a->size)
+        return -1;
+
+    return 0;
+}
+
+int write_symbol_table(const Assembly* a, FILE* out){
+
+    if(out == NULL)
+        return -1;
+
+    for(int i = 0; i < a->nb_labels; i++)
+        if(fprintf(out, "%.8lx %s\n", a->labels[i].value, a->labels[i].name) < 0)
+            return -1;
+
+    return 0;
+}
+
+const AsmSymbol* find_label(const Assembly* a, long addr){
+
+    int lo = 0, hi = a->nb_labels - 1;
+    const AsmSymbol* best = NULL;
+
+    while(lo <= hi){
+
+        int mid = (lo + hi) / 2;
+
+        if(a->labels[mid].value <= addr){
+            best = &a->labels[mid];
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return best;
+}
+
+bool is_assembly_source(const char* path){
+
+    size_t len = strlen(path);
+
+    return (len > 4 && strcmp(path + len - 4, ".asm") == 0)
+        || (len > 5 && strcmp(path + len - 5, ".uasm") == 0);
+}
+
+FILE* open_program(const char* path, Assembly* a){
+
+    memset(a, 0, sizeof(Assembly));
+
+    if(!is_assembly_source(path)){
+
+        FILE* fp = fopen(path, "rb");
+
+        if(fp == NULL)
+            fprintf(stderr, "Error: Cannot open %s.\n", path);
+
+        return fp;
+    }
+
+    if(assemble_file(path, a) < 0){
+        fprintf(stderr, "Error: %s\n", a->error);
+        return NULL;
+    }
+
+    char sym_path[4096];
+    snprintf(sym_path, sizeof(sym_path), "%s.sym", path);
+    FILE* sym = fopen(sym_path, "w");
+
+    if(write_symbol_table(a, sym) < 0)
+        fprintf(stderr, "Warning: could not write %s.\n", sym_path);
+
+    if(sym != NULL)
+        fclose(sym);
+
+    // fmemopen() cannot open an empty buffer
+    FILE* fp = a->size > 0 ? fmemopen(a->image, a->size, "rb") : tmpfile();
+
+    if(fp == NULL)
+        fprintf(stderr, "Error: Cannot open the assembled image of %s.\n", path);
+
+    return fp;
+}
+
+void free_assembly(Assembly* a){
+
+    free(a->image);
+
+    for(int i = 0; i < a->nb_labels; i++)
+        free(a->labels[i].name);
+
+    free(a->labels);
+    a->image = NULL;
+    a->labels = NULL;
+    a->nb_labels = 0;
+    a->size = 0;
+    a->capacity = 0;
+}
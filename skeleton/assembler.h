@@ -0,0 +1,78 @@
+#ifndef ASSEMBLER_H__
+#define ASSEMBLER_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/* Native assembler for the UASM macro language used by BSim
+   (beta-assembly/beta.uasm). It understands .include, .macro
+   (single line or { } bodies, overloaded on the number of arguments),
+   .align, .ascii/.text, labels, symbol assignments (including ". = expr")
+   and integer expressions, and produces the same image as the
+   .asm.bin files written by BSim. */
+
+#define ASM_ERROR_LEN 512
+
+typedef struct{
+
+    char* name;
+    long value;
+
+} AsmSymbol;
+
+typedef struct{
+
+    unsigned char* image; // assembled bytes, image[0] is address 0
+    long size; // highest location reached by the source (size of the .asm.bin)
+    long capacity;
+
+    AsmSymbol* labels; // labels (name: ) sorted by address
+    int nb_labels;
+
+    char error[ASM_ERROR_LEN]; // message of the first error, if any
+
+} Assembly;
+
+/* Assembles the UASM source file at $path into $a.
+   .include directives (followed by a bare or double-quoted file name)
+   are resolved relative to the directory of the file containing them,
+   then relative to the working directory.
+   Returns 0 on success and a negative value otherwise, in which
+   case $a -> error describes the problem. $a must be released with
+   free_assembly() in both cases. */
+int assemble_file(const char* path, Assembly* a);
+
+/* Same as assemble_file() but the source is the NUL-terminated
+   string $source. $dir is used to resolve .include directives and
+   can be NULL (working directory). */
+int assemble_string(const char* source, const char* dir, Assembly* a);
+
+/* Writes $a's image to $out, byte for byte what BSim would produce.
+   Returns 0 on success and a negative value otherwise. */
+int write_image(const Assembly* a, FILE* out);
+
+/* Writes $a's symbol table to $out, one "address name" line per label
+   (address in 8 hexadecimal digits), sorted by address.
+   Returns 0 on success and a negative value otherwise. */
+int write_symbol_table(const Assembly* a, FILE* out);
+
+/* Returns the label of $a whose address is the greatest one that
+   is lower than or equal to $addr, NULL if there is none. */
+const AsmSymbol* find_label(const Assembly* a, long addr);
+
+/* Returns true if $path looks like an assembly source (".asm" or
+   ".uasm" suffix) rather than a binary image. */
+bool is_assembly_source(const char* path);
+
+/* Opens the program at $path so that it can be handed to load() or
+   load_interrupt_handler(). Assembly sources are assembled in-process
+   into $a and their symbol table is written next to them ($path.sym);
+   binaries are opened as they are and $a is left empty.
+   Returns NULL (after printing the reason on stderr) on failure.
+   The returned stream must be closed before free_assembly($a). */
+FILE* open_program(const char* path, Assembly* a);
+
+/* Frees all resources allocated for $a. */
+void free_assembly(Assembly* a);
+
+#endif
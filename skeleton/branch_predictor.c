@@ -0,0 +1,194 @@
+#include "branch_predictor.h"
+#include <string.h>
+
+#define LP 28
+
+Predictor* enable_predictor(Computer* c, int kind, int bits){
+
+    disable_predictor(c);
+
+    Predictor* p = calloc(1, sizeof(Predictor));
+
+    p->kind = kind;
+    p->bits = bits > 0 && bits <= 24 ? bits : 12;
+    p->counters = malloc(1L << p->bits);
+    p->per_pc = new_pc_stats(PREDICTOR_NB_COUNTERS);
+
+    // weakly not taken
+    memset(p->counters, 1, 1L << p->bits);
+
+    for(int i = 0; i < JUMP_TARGETS; i++)
+        p->jump_targets[i] = -1;
+
+    c->predictor = p;
+
+    return p;
+}
+
+void disable_predictor(Computer* c){
+
+    if(c->predictor == NULL)
+        return;
+
+    free(c->predictor->counters);
+    free_pc_stats(c->predictor->per_pc);
+    free(c->predictor);
+    c->predictor = NULL;
+}
+
+static inline unsigned counter_index(Predictor* p, long pc){
+
+    unsigned index = (unsigned long) pc >> 2;
+
+    if(p->kind == PREDICTOR_GSHARE)
+        index ^= p->history;
+
+    return index & ((1u << p->bits) - 1);
+}
+
+/* Predicts and trains the conditional branch at $pc, returns true if
+   the prediction was right. */
+static bool predict_branch(Predictor* p, long pc, int32_t literal, bool taken){
+
+    if(p->kind == PREDICTOR_STATIC)
+        return (literal < 0) == taken;
+
+    unsigned char* counter = &p->counters[counter_index(p, pc)];
+    bool right = (*counter >= 2) == taken;
+
+    if(taken && *counter < 3)
+        (*counter)++;
+    else if(!taken && *counter > 0)
+        (*counter)--;
+
+    p->history = (p->history << 1) | taken;
+
+    return right;
+}
+
+static inline void push_return(Predictor* p, long addr){
+
+    p->return_top = (p->return_top + 1) % RETURN_STACK_DEPTH;
+    p->return_stack[p->return_top] = addr;
+
+    if(p->return_count < RETURN_STACK_DEPTH)
+        p->return_count++;
+}
+
+static inline long pop_return(Predictor* p){
+
+    if(p->return_count == 0)
+        return -1;
+
+    long addr = p->return_stack[p->return_top];
+    p->return_top = (p->return_top + RETURN_STACK_DEPTH - 1) % RETURN_STACK_DEPTH;
+    p->return_count--;
+
+    return addr;
+}
+
+void predictor_after_step(Computer* c, long pc, int32_t instruction){
+
+    Predictor* p = c->predictor;
+    Instruction d = decode(instruction);
+    long next = c->cpu.program_counter;
+    bool right;
+
+    p->predicted = false;
+
+    if(d.opcode == 0x1D || d.opcode == 0x1E){ // BEQ, BNE
+
+        bool taken = next != pc + 4;
+
+        // BR(label): the direction is known at decode
+        right = d.opcode == 0x1D && d.ra == 31 ? true : predict_branch(p, pc, d.literal, taken);
+
+        p->branches++;
+        p->branch_misses += !right;
+
+        unsigned long long* counters = pc_counters(p->per_pc, pc);
+        counters[PREDICTOR_EXECUTED]++;
+        counters[PREDICTOR_TAKEN] += taken;
+        counters[PREDICTOR_MISSES] += !right;
+    }
+
+    else if(d.opcode == 0x1B){ // JMP
+
+        if(d.ra == LP){
+            right = pop_return(p) == next;
+            p->returns++;
+            p->return_misses += !right;
+        } else {
+            long* target = &p->jump_targets[((unsigned long) pc >> 2) & (JUMP_TARGETS - 1)];
+            right = *target == next;
+            *target = next;
+            p->jumps++;
+            p->jump_misses += !right;
+        }
+
+        unsigned long long* counters = pc_counters(p->per_pc, pc);
+        counters[PREDICTOR_EXECUTED]++;
+        counters[PREDICTOR_TAKEN]++;
+        counters[PREDICTOR_MISSES] += !right;
+    }
+
+    else
+        return;
+
+    // calls link into LP
+    if(d.rc == LP)
+        push_return(p, pc + 4);
+
+    p->predicted = true;
+    p->mispredicted = !right;
+}
+
+void format_predictor_stats(Computer* c, char* buf, size_t len, int top){
+
+    static const char* kind_names[] = {"static (backward taken)", "bimodal", "gshare"};
+    Predictor* p = c->predictor;
+    unsigned long long total = p->branches + p->jumps + p->returns;
+    unsigned long long misses = p->branch_misses + p->jump_misses + p->return_misses;
+
+    size_t n = snprintf(buf, len, "branch predictor: %s", kind_names[p->kind]);
+
+    if(p->kind != PREDICTOR_STATIC && n < len)
+        n += snprintf(buf + n, len - n, ", %d counters", 1 << p->bits);
+
+    if(n < len)
+        n += snprintf(buf + n, len - n, "\n%-10s %12s %12s %10s\n", "", "executed", "mispredicted", "rate");
+
+    const char* names[] = {"branches", "returns", "jumps", "total"};
+    unsigned long long executed[] = {p->branches, p->returns, p->jumps, total};
+    unsigned long long missed[] = {p->branch_misses, p->return_misses, p->jump_misses, misses};
+
+    for(int i = 0; i < 4 && n < len; i++)
+        n += snprintf(buf + n, len - n, "%-10s %12llu %12llu %9.2f %%\n", names[i], executed[i], missed[i],
+                      executed[i] > 0 ? 100.0 * missed[i] / executed[i] : 0.0);
+
+    if(top <= 0 || n >= len)
+        return;
+
+    long* pcs = malloc(top * sizeof(long));
+    int found = top_pcs(p->per_pc, PREDICTOR_MISSES, pcs, top);
+
+    n += snprintf(buf + n, len - n, "%-10s %-24s %12s %12s %12s %10s\n",
+                  "PC", "instruction", "executed", "taken", "mispredicted", "rate");
+
+    for(int i = 0; i < found && n < len; i++){
+
+        unsigned long long* s = pc_counters(p->per_pc, pcs[i]);
+        char text[64];
+
+        if(pcs[i] >= 0 && pcs[i] + 4 <= c->memory_size)
+            disassemble(*(int32_t*) (c->memory + pcs[i]), text);
+        else
+            strcpy(text, "?");
+
+        n += snprintf(buf + n, len - n, "%.8lx   %-24s %12llu %12llu %12llu %9.2f %%\n", pcs[i], text,
+                      s[PREDICTOR_EXECUTED], s[PREDICTOR_TAKEN], s[PREDICTOR_MISSES],
+                      100.0 * s[PREDICTOR_MISSES] / s[PREDICTOR_EXECUTED]);
+    }
+
+    free(pcs);
+}
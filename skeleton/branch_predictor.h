@@ -0,0 +1,83 @@
+#ifndef BRANCH_PREDICTOR_H__
+#define BRANCH_PREDICTOR_H__
+
+#include "emulator.h"
+#include "pc_stats.h"
+
+/* Branch prediction model, fed by execute_step() with every executed
+   instruction while attached (c -> predictor is NULL otherwise, which
+   costs a single test per instruction).
+
+   BEQ/BNE directions are predicted by one of:
+       PREDICTOR_STATIC   backward taken, forward not taken
+       PREDICTOR_BIMODAL  2-bit saturating counters indexed by the PC
+       PREDICTOR_GSHARE   2-bit counters indexed by the PC xor the global
+                          history of the last $bits directions
+   Their targets are known at decode, as is the direction of BR
+   (BEQ(R31, ...)), which is never mispredicted.
+
+   JMP(LP) returns are predicted with a return-address stack pushed by
+   the instructions linking into LP (BR(label, LP), JMP(RA, LP)); other
+   JMPs, including JMP(XP), are predicted to go where they went last time.
+
+   When the pipeline model is attached (see pipeline.h), only
+   mispredicted branches pay the branch penalty. */
+
+enum{
+    PREDICTOR_STATIC,
+    PREDICTOR_BIMODAL,
+    PREDICTOR_GSHARE
+};
+
+// per-PC counters
+enum{
+    PREDICTOR_EXECUTED,
+    PREDICTOR_TAKEN,
+    PREDICTOR_MISSES,
+    PREDICTOR_NB_COUNTERS
+};
+
+#define RETURN_STACK_DEPTH 16
+#define JUMP_TARGETS 1024
+
+typedef struct Predictor{
+
+    int kind;
+    int bits;                // log2 of the number of counters
+    unsigned char* counters; // 2-bit counters, 0-1 predict not taken, 2-3 taken
+    unsigned history;        // global history, most recent direction in bit 0
+
+    long return_stack[RETURN_STACK_DEPTH]; // circular, overflows drop the oldest
+    int return_top;
+    int return_count;
+    long jump_targets[JUMP_TARGETS]; // last target of indirect jumps, by PC
+
+    bool predicted;    // the last instruction was a branch or a jump
+    bool mispredicted; // and its prediction was wrong
+
+    unsigned long long branches;
+    unsigned long long branch_misses;
+    unsigned long long jumps;
+    unsigned long long jump_misses;
+    unsigned long long returns;
+    unsigned long long return_misses;
+
+    PcStats* per_pc;
+
+} Predictor;
+
+/* Attaches a predictor of the given $kind to $c (replacing any previous
+   one), with 2^$bits counters for the bimodal and gshare predictors. */
+Predictor* enable_predictor(Computer* c, int kind, int bits);
+
+/* Detaches and frees $c's predictor. */
+void disable_predictor(Computer* c);
+
+/* Called by execute_step() after $instruction, fetched at $pc, was executed. */
+void predictor_after_step(Computer* c, long pc, int32_t instruction);
+
+/* Writes the misprediction rates and the $top PCs with the most
+   mispredictions into $buf of size $len. */
+void format_predictor_stats(Computer* c, char* buf, size_t len, int top);
+
+#endif
@@ -0,0 +1,452 @@
+#include "cache.h"
+#include <string.h>
+
+// level that served an access
+enum{
+    SERVED_L1,
+    SERVED_L2,
+    SERVED_MEMORY
+};
+
+static bool power_of_two(long x){
+
+    return x > 0 && (x & (x - 1)) == 0;
+}
+
+bool parse_cache_config(const char* spec, CacheConfig* config){
+
+    char unit = '\0', policy[3] = "wb";
+    long size;
+
+    // SIZE[k|m],ASSOCIATIVITY,LINE[,wb|wt]
+    if(sscanf(spec, "%ld%c", &size, &unit) < 1)
+        return false;
+
+    if(unit == 'k' || unit == 'K')
+        size *= 1024;
+    else if(unit == 'm' || unit == 'M')
+        size *= 1024 * 1024;
+
+    const char* rest = strchr(spec, ',');
+
+    if(rest == NULL || sscanf(rest, ",%d,%d,%2s", &config->associativity, &config->line_size, policy) < 2)
+        return false;
+
+    config->size = size;
+
+    if(strcmp(policy, "wb") == 0)
+        config->write_policy = CACHE_WRITE_BACK;
+    else if(strcmp(policy, "wt") == 0)
+        config->write_policy = CACHE_WRITE_THROUGH;
+    else
+        return false;
+
+    return true;
+}
+
+static bool init_level(CacheLevel* l, CacheConfig* config, const char* name){
+
+    memset(l, 0, sizeof(CacheLevel));
+    l->config = *config;
+
+    if(!power_of_two(config->size) || !power_of_two(config->line_size) || config->line_size < 4
+       || config->associativity <= 0
+       || config->size % ((long) config->associativity * config->line_size) != 0){
+        fprintf(stderr, "Error: invalid %s cache (%ld bytes, %d ways, %d-byte lines)\n",
+                name, config->size, config->associativity, config->line_size);
+        return false;
+    }
+
+    l->nb_sets = config->size / ((long) config->associativity * config->line_size);
+    l->line_shift = __builtin_ctz(config->line_size);
+    l->tags = malloc((long) l->nb_sets * config->associativity * sizeof(long));
+    l->dirty = calloc((long) l->nb_sets * config->associativity, sizeof(bool));
+
+    for(long i = 0; i < (long) l->nb_sets * config->associativity; i++)
+        l->tags[i] = -1;
+
+    return true;
+}
+
+static void free_level(CacheLevel* l){
+
+    free(l->tags);
+    free(l->dirty);
+    l->tags = NULL;
+    l->dirty = NULL;
+}
+
+Caches* enable_caches(Computer* c, CacheConfig* l1i, CacheConfig* l1d, CacheConfig* l2){
+
+    disable_caches(c);
+
+    Caches* h = calloc(1, sizeof(Caches));
+    bool ok = init_level(&h->l1i, l1i, "L1 I") & init_level(&h->l1d, l1d, "L1 D");
+
+    h->has_l2 = l2 != NULL;
+
+    if(h->has_l2)
+        ok &= init_level(&h->l2, l2, "L2");
+
+    if(!ok){
+        free_level(&h->l1i);
+        free_level(&h->l1d);
+        free_level(&h->l2);
+        free(h);
+        return NULL;
+    }
+
+    h->l2_latency = 10;
+    h->memory_latency = 100;
+    h->per_pc = new_pc_stats(CACHE_NB_COUNTERS);
+    c->caches = h;
+
+    return h;
+}
+
+void disable_caches(Computer* c){
+
+    Caches* h = c->caches;
+
+    if(h == NULL)
+        return;
+
+    free_level(&h->l1i);
+    free_level(&h->l1d);
+    free_level(&h->l2);
+    free_pc_stats(h->per_pc);
+    free(h);
+    c->caches = NULL;
+}
+
+static inline int region_of(Computer* c, long addr){
+
+    if(addr < c->program_memory_size)
+        return REGION_PROGRAM;
+
+    return addr < c->program_memory_size + c->video_memory_size ? REGION_VIDEO : REGION_KERNEL;
+}
+
+/* Looks for $line in $l, making it the most recently used of its set.
+   Returns a pointer to its dirty bit, NULL on a miss. */
+static inline bool* lookup(CacheLevel* l, long line){
+
+    int ways = l->config.associativity;
+    long base = (line & (l->nb_sets - 1)) * ways;
+    long* tags = l->tags + base;
+    bool* dirty = l->dirty + base;
+
+    if(tags[0] == line)
+        return dirty;
+
+    for(int w = 1; w < ways; w++){
+
+        if(tags[w] != line)
+            continue;
+
+        bool d = dirty[w];
+        memmove(tags + 1, tags, w * sizeof(long));
+        memmove(dirty + 1, dirty, w * sizeof(bool));
+        tags[0] = line;
+        dirty[0] = d;
+
+        return dirty;
+    }
+
+    return NULL;
+}
+
+/* Inserts $line as the most recently used of its set, evicting the
+   least recently used one. Returns the evicted line if it was dirty,
+   -1 otherwise. */
+static inline long insert(CacheLevel* l, long line, bool dirty_line){
+
+    int ways = l->config.associativity;
+    long base = (line & (l->nb_sets - 1)) * ways;
+    long* tags = l->tags + base;
+    bool* dirty = l->dirty + base;
+    long victim = dirty[ways - 1] ? tags[ways - 1] : -1;
+
+    memmove(tags + 1, tags, (ways - 1) * sizeof(long));
+    memmove(dirty + 1, dirty, (ways - 1) * sizeof(bool));
+    tags[0] = line;
+    dirty[0] = dirty_line;
+
+    if(victim >= 0)
+        l->writebacks++;
+
+    return victim;
+}
+
+/* Writes the word or line at $addr (an L1 store or eviction) below L1. */
+static void write_below(Computer* c, Caches* h, long addr){
+
+    if(!h->has_l2){
+        h->memory_writes++;
+        return;
+    }
+
+    CacheLevel* l2 = &h->l2;
+    int region = region_of(c, addr);
+    long line = addr >> l2->line_shift;
+    bool* dirty = lookup(l2, line);
+
+    if(dirty != NULL){
+
+        l2->hits[region]++;
+
+        if(l2->config.write_policy == CACHE_WRITE_BACK)
+            *dirty = true;
+        else
+            h->memory_writes++;
+
+        return;
+    }
+
+    l2->misses[region]++;
+
+    if(l2->config.write_policy == CACHE_WRITE_THROUGH){
+        h->memory_writes++;
+        return;
+    }
+
+    h->memory_reads++;
+
+    if(insert(l2, line, true) >= 0)
+        h->memory_writes++;
+}
+
+/* Reads the line holding $addr from below L1. */
+static int read_below(Computer* c, Caches* h, long addr){
+
+    if(!h->has_l2){
+        h->memory_reads++;
+        return SERVED_MEMORY;
+    }
+
+    CacheLevel* l2 = &h->l2;
+    int region = region_of(c, addr);
+    long line = addr >> l2->line_shift;
+
+    if(lookup(l2, line) != NULL){
+        l2->hits[region]++;
+        return SERVED_L2;
+    }
+
+    l2->misses[region]++;
+    h->memory_reads++;
+
+    if(insert(l2, line, false) >= 0)
+        h->memory_writes++;
+
+    return SERVED_MEMORY;
+}
+
+static int access_l1(Computer* c, Caches* h, CacheLevel* l1, long addr, bool write){
+
+    int region = region_of(c, addr);
+    long line = addr >> l1->line_shift;
+    bool* dirty = lookup(l1, line);
+    bool write_back = l1->config.write_policy == CACHE_WRITE_BACK;
+
+    if(dirty != NULL){
+
+        l1->hits[region]++;
+
+        if(write && write_back)
+            *dirty = true;
+        else if(write)
+            write_below(c, h, addr);
+
+        return SERVED_L1;
+    }
+
+    l1->misses[region]++;
+
+    // write-through caches do not allocate on write misses, the store
+    // goes through a write buffer without stalling
+    if(write && !write_back){
+        write_below(c, h, addr);
+        return SERVED_L1;
+    }
+
+    int served = read_below(c, h, addr);
+    long victim = insert(l1, line, write);
+
+    if(victim >= 0)
+        write_below(c, h, victim << l1->line_shift);
+
+    return served;
+}
+
+static inline int cycles_of(Caches* h, int served){
+
+    return served == SERVED_L1 ? 0 : served == SERVED_L2 ? h->l2_latency : h->memory_latency;
+}
+
+static unsigned long long total_misses(CacheLevel* l){
+
+    unsigned long long misses = 0;
+
+    for(int r = 0; r < NB_REGIONS; r++)
+        misses += l->misses[r];
+
+    return misses;
+}
+
+/* One data access through L1 D, adding its extra cycles to $cycles and
+   counting in $l2_misses whether it went to memory past L2. */
+static void access_data(Computer* c, Caches* h, long addr, bool write, int* cycles, int* l2_misses){
+
+    int served = access_l1(c, h, &h->l1d, addr, write);
+
+    *cycles += cycles_of(h, served);
+    *l2_misses += h->has_l2 && served == SERVED_MEMORY;
+}
+
+void cache_after_step(Computer* c, long pc, int32_t instruction){
+
+    Caches* h = c->caches;
+    int fetch = access_l1(c, h, &h->l1i, pc, false);
+    int data_cycles = 0;
+    bool missed = fetch != SERVED_L1;
+
+    Instruction d = decode(instruction);
+    Operands o = instruction_operands(c, d, pc);
+    bool memory = o.kind == INSTR_LOAD || o.kind == INSTR_STORE || o.kind == INSTR_ATOMIC;
+    bool block = memory && (d.opcode == 0x14 || d.opcode == 0x15);
+
+    // FILL and COPY chunks that moved nothing access no data
+    if(block && c->block_cost == 0)
+        memory = false;
+
+    if(memory){
+
+        unsigned long long l1d_misses = total_misses(&h->l1d);
+        int accesses = 1;
+        int l2_misses = 0;
+
+        if(block){
+
+            // every word of the chunk, the COPY source read before each
+            // destination word is written (see execute_block_chunk())
+            bool copy = d.opcode == 0x15;
+            long n = copy ? c->block_cost / 2 : c->block_cost;
+            long dst = c->latest_accessed - 4 * (n - 1);
+            long src = (long) get_register(c, d.ra) - 4 * n;
+
+            for(long i = 0; i < n; i++){
+
+                if(copy)
+                    access_data(c, h, src + 4 * i, false, &data_cycles, &l2_misses);
+
+                access_data(c, h, dst + 4 * i, true, &data_cycles, &l2_misses);
+            }
+
+            accesses = c->block_cost;
+        }
+
+        else
+            access_data(c, h, c->latest_accessed, o.kind != INSTR_LOAD, &data_cycles, &l2_misses);
+
+        unsigned long long* counters = pc_counters(h->per_pc, pc);
+        counters[CACHE_DATA_ACCESSES] += accesses;
+        counters[CACHE_DATA_MISSES] += total_misses(&h->l1d) - l1d_misses;
+        counters[CACHE_FETCH_MISSES] += missed;
+        counters[CACHE_L2_MISSES] += h->has_l2 && fetch == SERVED_MEMORY;
+        counters[CACHE_L2_MISSES] += l2_misses;
+    }
+
+    else if(missed){
+        unsigned long long* counters = pc_counters(h->per_pc, pc);
+        counters[CACHE_FETCH_MISSES]++;
+        counters[CACHE_L2_MISSES] += h->has_l2 && fetch == SERVED_MEMORY;
+    }
+
+    h->fetch_cycles = cycles_of(h, fetch);
+    h->data_cycles = data_cycles;
+}
+
+static size_t format_level(CacheLevel* l, const char* name, char* buf, size_t len){
+
+    static const char* region_names[NB_REGIONS] = {"program", "video", "kernel"};
+    unsigned long long hits = 0, misses = 0;
+
+    for(int r = 0; r < NB_REGIONS; r++){
+        hits += l->hits[r];
+        misses += l->misses[r];
+    }
+
+    size_t n = snprintf(buf, len, "%-5s %6ld B %2d-way %3d B lines %s: %llu accesses, hit rate %.2f %%, %llu writebacks\n",
+                        name, l->config.size, l->config.associativity, l->config.line_size,
+                        l->config.write_policy == CACHE_WRITE_BACK ? "wb" : "wt", hits + misses,
+                        hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0, l->writebacks);
+
+    for(int r = 0; r < NB_REGIONS && n < len; r++){
+
+        if(l->hits[r] + l->misses[r] == 0)
+            continue;
+
+        n += snprintf(buf + n, len - n, "      %-8s %12llu accesses, hit rate %.2f %%\n", region_names[r],
+                      l->hits[r] + l->misses[r], 100.0 * l->hits[r] / (l->hits[r] + l->misses[r]));
+    }
+
+    return n;
+}
+
+void format_cache_stats(Computer* c, char* buf, size_t len, int top){
+
+    Caches* h = c->caches;
+    size_t n = format_level(&h->l1i, "L1 I", buf, len);
+
+    if(n < len)
+        n += format_level(&h->l1d, "L1 D", buf + n, len - n);
+
+    if(h->has_l2 && n < len)
+        n += format_level(&h->l2, "L2", buf + n, len - n);
+
+    if(n < len)
+        n += snprintf(buf + n, len - n, "memory: %llu line reads, %llu writes\n",
+                      h->memory_reads, h->memory_writes);
+
+    if(top <= 0 || n >= len)
+        return;
+
+    // rank the PCs by the L1 misses they cause
+    PcStats* totals = new_pc_stats(1);
+
+    for(long i = 0; i < h->per_pc->capacity; i++){
+
+        if(h->per_pc->pcs[i] == -1)
+            continue;
+
+        unsigned long long* s = h->per_pc->counters + i * CACHE_NB_COUNTERS;
+        *pc_counters(totals, h->per_pc->pcs[i]) = s[CACHE_FETCH_MISSES] + s[CACHE_DATA_MISSES];
+    }
+
+    long* pcs = malloc(top * sizeof(long));
+    int found = top_pcs(totals, 0, pcs, top);
+
+    n += snprintf(buf + n, len - n, "%-10s %-24s %12s %10s %12s %10s\n",
+                  "PC", "instruction", "I misses", "data", "D hit rate", "L2 misses");
+
+    for(int i = 0; i < found && n < len; i++){
+
+        unsigned long long* s = pc_counters(h->per_pc, pcs[i]);
+        char text[64], rate[16] = "-";
+
+        if(pcs[i] >= 0 && pcs[i] + 4 <= c->memory_size)
+            disassemble(*(int32_t*) (c->memory + pcs[i]), text);
+        else
+            strcpy(text, "?");
+
+        if(s[CACHE_DATA_ACCESSES] > 0)
+            snprintf(rate, sizeof(rate), "%.2f %%", 100.0 - 100.0 * s[CACHE_DATA_MISSES] / s[CACHE_DATA_ACCESSES]);
+
+        n += snprintf(buf + n, len - n, "%.8lx   %-24s %12llu %10llu %12s %10llu\n", pcs[i], text,
+                      s[CACHE_FETCH_MISSES], s[CACHE_DATA_ACCESSES], rate, s[CACHE_L2_MISSES]);
+    }
+
+    free(pcs);
+    free_pc_stats(totals);
+}
@@ -0,0 +1,106 @@
+#ifndef CACHE_H__
+#define CACHE_H__
+
+#include "emulator.h"
+#include "pc_stats.h"
+
+/* Cache hierarchy model: split L1 instruction and data caches, with an
+   optional unified L2 behind them.
+
+   After every instruction, execute_step() feeds the model with the
+   fetch (L1 I) and, for loads, stores and atomics, the data word
+   accessed (L1 D), every word read and written for FILL and COPY. Caches are set-associative with LRU replacement;
+   write-back caches allocate on write misses and write dirty lines back
+   when evicting them, write-through caches forward every store and do
+   not allocate on write misses. Only tags are modelled, memory contents
+   stay in c -> memory.
+
+   Hits and misses are counted per level and per memory region (program,
+   video, kernel), and misses per PC. When the pipeline model is attached
+   too (see pipeline.h), it adds $l2_latency cycles per L1 miss and
+   $memory_latency cycles per L2 miss (or L1 miss without L2). */
+
+enum{
+    CACHE_WRITE_BACK,
+    CACHE_WRITE_THROUGH
+};
+
+enum{
+    REGION_PROGRAM,
+    REGION_VIDEO,
+    REGION_KERNEL,
+    NB_REGIONS
+};
+
+// per-PC counters
+enum{
+    CACHE_FETCH_MISSES, // L1 I misses fetching the instruction
+    CACHE_DATA_ACCESSES,
+    CACHE_DATA_MISSES,  // L1 D misses of its load/store
+    CACHE_L2_MISSES,    // L2 misses caused by either
+    CACHE_NB_COUNTERS
+};
+
+typedef struct{
+
+    long size;         // bytes
+    int associativity;
+    int line_size;     // bytes, power of two
+    int write_policy;
+
+} CacheConfig;
+
+typedef struct{
+
+    CacheConfig config;
+    int nb_sets;
+    int line_shift;
+    long* tags;    // per set, $associativity line numbers from most to least recently used, -1 if empty
+    bool* dirty;   // parallel to tags
+
+    unsigned long long hits[NB_REGIONS];
+    unsigned long long misses[NB_REGIONS];
+    unsigned long long writebacks;
+
+} CacheLevel;
+
+typedef struct Caches{
+
+    CacheLevel l1i;
+    CacheLevel l1d;
+    CacheLevel l2;
+    bool has_l2;
+
+    int l2_latency;     // cycles added by an L1 miss hitting L2
+    int memory_latency; // cycles added by an access going to memory
+    int fetch_cycles;   // extra cycles of the last fetch and data accesses,
+    int data_cycles;    // read by the pipeline model
+
+    unsigned long long memory_reads;  // lines read from memory
+    unsigned long long memory_writes; // lines or words written to memory
+
+    PcStats* per_pc;
+
+} Caches;
+
+/* Parses "SIZE,ASSOCIATIVITY,LINE[,wb|wt]" (SIZE may end with k or m)
+   into $config. Returns false if $spec is invalid. */
+bool parse_cache_config(const char* spec, CacheConfig* config);
+
+/* Attaches a cache hierarchy to $c, replacing any previous one. $l2 may
+   be NULL. Returns NULL (reporting the error) if a configuration is
+   invalid: sizes and line sizes must be powers of two, with a whole
+   number of sets. */
+Caches* enable_caches(Computer* c, CacheConfig* l1i, CacheConfig* l1d, CacheConfig* l2);
+
+/* Detaches and frees $c's caches. */
+void disable_caches(Computer* c);
+
+/* Called by execute_step() after $instruction, fetched at $pc, was executed. */
+void cache_after_step(Computer* c, long pc, int32_t instruction);
+
+/* Writes the hit rates per level and region and the $top PCs causing
+   the most misses into $buf of size $len. */
+void format_cache_stats(Computer* c, char* buf, size_t len, int top);
+
+#endif
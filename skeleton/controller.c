@@ -0,0 +1,279 @@
+#include "controller.h"
+#include "idle.h"
+#include <string.h>
+#include <time.h>
+
+static double monotonic_seconds(){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* With ctl -> lock held. */
+static void set_state(Controller* ctl, int state){
+
+    __atomic_store_n(&ctl->state, state, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&ctl->changed);
+}
+
+/* Runs one batch of instructions. Returns false once the program has
+   stopped. */
+static bool run_batch(Controller* ctl, double frequency, bool* parked){
+
+    Computer* c = ctl->computer;
+
+    pthread_mutex_lock(ctl->computer_lock);
+
+    // read by the guest (see KERNEL_TIMING)
+    c->frequency = frequency < 0 ? 0 : frequency;
+
+    // timed frequencies already sleep between instructions
+    if(c->idle != NULL)
+        c->idle->park = frequency < 0;
+
+    run_steps(c, frequency < 0 ? CONTROLLER_BATCH : 1);
+
+    bool executing = is_executing(c);
+    *parked = c->idle != NULL && c->idle->parked;
+
+    pthread_mutex_unlock(ctl->computer_lock);
+
+    return executing;
+}
+
+/* Ends the idle wait of a program being paused: the time it spent
+   parked until now counts, the pause does not. */
+static void unpark(Controller* ctl){
+
+    Computer* c = ctl->computer;
+
+    pthread_mutex_lock(ctl->computer_lock);
+
+    if(c->idle != NULL && c->idle->parked)
+        idle_resume(c);
+
+    pthread_mutex_unlock(ctl->computer_lock);
+}
+
+/* Waits with ctl -> lock held until $deadline (monotonic seconds), a
+   command or a frequency change. */
+static void wait_until(Controller* ctl, double deadline){
+
+    double frequency = ctl->frequency;
+
+    while(ctl->command == CONTROLLER_NONE && ctl->frequency == frequency){
+
+        double left = deadline - monotonic_seconds();
+
+        if(left <= 0)
+            return;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += (time_t) left;
+        ts.tv_nsec += (long) ((left - (time_t) left) * 1e9);
+
+        if(ts.tv_nsec >= 1000000000){
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&ctl->changed, &ctl->lock, &ts);
+    }
+}
+
+static void* controller_thread(void* arg){
+
+    Controller* ctl = (Controller*) arg;
+    double last_refresh = 0;
+
+    pthread_mutex_lock(&ctl->lock);
+
+    while(true){
+
+        while(ctl->command == CONTROLLER_NONE && ctl->state != CONTROLLER_RUNNING)
+            pthread_cond_wait(&ctl->changed, &ctl->lock);
+
+        int command = ctl->command;
+        ctl->command = CONTROLLER_NONE;
+
+        if(command == CONTROLLER_QUIT)
+            break;
+
+        if(command == CONTROLLER_LOAD){
+
+            char path[sizeof(ctl->path)];
+            int kind = ctl->load_kind;
+            strcpy(path, ctl->path);
+
+            set_state(ctl, CONTROLLER_LOADING);
+            pthread_mutex_unlock(&ctl->lock);
+
+            bool loaded = ctl->load(ctl->data, path, kind);
+
+            pthread_mutex_lock(&ctl->lock);
+            set_state(ctl, loaded ? CONTROLLER_READY : CONTROLLER_EMPTY);
+            continue;
+        }
+
+        if(command == CONTROLLER_RUN && ctl->state == CONTROLLER_READY)
+            set_state(ctl, CONTROLLER_RUNNING);
+
+        else if(command == CONTROLLER_PAUSE && ctl->state == CONTROLLER_RUNNING){
+
+            // controller_pause() returns once the idle time is credited
+            ctl->pausing = true;
+            pthread_mutex_unlock(&ctl->lock);
+            unpark(ctl);
+            pthread_mutex_lock(&ctl->lock);
+            ctl->pausing = false;
+            set_state(ctl, CONTROLLER_READY);
+        }
+
+        else if(command == CONTROLLER_STEP && ctl->state != CONTROLLER_EMPTY){
+
+            set_state(ctl, CONTROLLER_READY);
+            pthread_mutex_unlock(&ctl->lock);
+            unpark(ctl);
+
+            pthread_mutex_lock(ctl->computer_lock);
+
+            if(is_executing(ctl->computer))
+                run_steps(ctl->computer, 1);
+
+            pthread_mutex_unlock(ctl->computer_lock);
+
+            ctl->refresh(ctl->data, true);
+            pthread_mutex_lock(&ctl->lock);
+        }
+
+        if(ctl->state != CONTROLLER_RUNNING)
+            continue;
+
+        double frequency = ctl->frequency;
+        bool parked;
+
+        pthread_mutex_unlock(&ctl->lock);
+
+        bool executing = run_batch(ctl, frequency, &parked);
+
+        // the program polls for input: sleep until an interrupt or a command comes
+        if(executing && parked)
+            idle_wait(ctl->computer, CONTROLLER_IDLE_WAIT_US);
+
+        double now = monotonic_seconds();
+
+        if(!executing || (frequency > 0 && frequency <= 10)
+           || now - last_refresh > CONTROLLER_REFRESH_MS * 1e-3){
+            last_refresh = now;
+            ctl->refresh(ctl->data, !executing);
+        }
+
+        pthread_mutex_lock(&ctl->lock);
+
+        if(!executing){
+            // a pause posted meanwhile is done
+            if(ctl->command == CONTROLLER_PAUSE)
+                ctl->command = CONTROLLER_NONE;
+
+            set_state(ctl, CONTROLLER_READY);
+        }
+
+        else if(frequency > 0)
+            wait_until(ctl, now + 1 / frequency);
+    }
+
+    set_state(ctl, CONTROLLER_EXITED);
+    pthread_mutex_unlock(&ctl->lock);
+
+    return NULL;
+}
+
+void start_controller(Controller* ctl, Computer* computer, pthread_mutex_t* computer_lock,
+                      double frequency, bool (*load)(void*, const char*, int),
+                      void (*refresh)(void*, bool), void* data){
+
+    ctl->computer = computer;
+    ctl->computer_lock = computer_lock;
+    ctl->load = load;
+    ctl->refresh = refresh;
+    ctl->data = data;
+    ctl->state = CONTROLLER_EMPTY;
+    ctl->command = CONTROLLER_NONE;
+    ctl->pausing = false;
+    ctl->path[0] = '\0';
+    ctl->frequency = frequency;
+
+    pthread_mutex_init(&ctl->lock, NULL);
+    pthread_cond_init(&ctl->changed, NULL);
+    pthread_create(&ctl->thread, NULL, controller_thread, ctl);
+}
+
+void stop_controller(Controller* ctl){
+
+    post_command(ctl, CONTROLLER_QUIT);
+    pthread_join(ctl->thread, NULL);
+    pthread_mutex_destroy(&ctl->lock);
+    pthread_cond_destroy(&ctl->changed);
+}
+
+/* With ctl -> lock held. */
+static void post(Controller* ctl, int command){
+
+    ctl->command = command;
+    pthread_cond_broadcast(&ctl->changed);
+
+    // the computer only changes while loading, on this thread
+    if(ctl->state == CONTROLLER_RUNNING && ctl->computer->idle != NULL)
+        wake_idle_waiters(ctl->computer);
+}
+
+void post_command(Controller* ctl, int command){
+
+    pthread_mutex_lock(&ctl->lock);
+    post(ctl, command);
+    pthread_mutex_unlock(&ctl->lock);
+}
+
+void controller_load(Controller* ctl, const char* path, int kind){
+
+    pthread_mutex_lock(&ctl->lock);
+    strncpy(ctl->path, path, sizeof(ctl->path) - 1);
+    ctl->path[sizeof(ctl->path) - 1] = '\0';
+    ctl->load_kind = kind;
+    post(ctl, CONTROLLER_LOAD);
+    pthread_mutex_unlock(&ctl->lock);
+}
+
+void controller_pause(Controller* ctl){
+
+    pthread_mutex_lock(&ctl->lock);
+
+    if(ctl->state == CONTROLLER_RUNNING)
+        post(ctl, CONTROLLER_PAUSE);
+
+    // unless another command replaced the pause
+    while(ctl->state == CONTROLLER_RUNNING && (ctl->command == CONTROLLER_PAUSE || ctl->pausing))
+        pthread_cond_wait(&ctl->changed, &ctl->lock);
+
+    pthread_mutex_unlock(&ctl->lock);
+}
+
+void set_controller_frequency(Controller* ctl, double frequency){
+
+    pthread_mutex_lock(&ctl->lock);
+    ctl->frequency = frequency;
+    pthread_cond_broadcast(&ctl->changed);
+    pthread_mutex_unlock(&ctl->lock);
+}
+
+double controller_frequency(Controller* ctl){
+
+    pthread_mutex_lock(&ctl->lock);
+    double frequency = ctl->frequency;
+    pthread_mutex_unlock(&ctl->lock);
+
+    return frequency;
+}
@@ -0,0 +1,109 @@
+#ifndef CONTROLLER_H__
+#define CONTROLLER_H__
+
+#include "emulator.h"
+#include <pthread.h>
+
+/* Emulator controller: one thread owning the execution of a Computer,
+   driven by commands posted from other threads (the GUI).
+
+       EMPTY --load--> LOADING --> READY <--run/pause--> RUNNING
+                                     ^                      |
+                                     +--- halted/left ------+
+
+   The controller thread sleeps on a condition variable whenever there
+   is nothing to run, between two instructions at timed frequencies and
+   while the program is parked in an idle loop (see idle.h): posting a
+   command wakes it at once. It runs instructions holding the lock
+   protecting the Computer, one batch at a time, so other threads can
+   inspect or modify the Computer between two batches by taking that
+   lock.
+
+   The state can be read at any time without locking; commands are
+   processed in order, a new command replacing a pending one. */
+
+#define CONTROLLER_BATCH 10000 // instructions run per lock at unbounded frequency
+#define CONTROLLER_REFRESH_MS 100 // display refreshes while running fast
+#define CONTROLLER_IDLE_WAIT_US 100000 // longest sleep of a parked program
+
+enum{
+    CONTROLLER_EMPTY,   // no program loaded
+    CONTROLLER_LOADING, // the load callback is running
+    CONTROLLER_READY,   // a program is loaded, not running
+    CONTROLLER_RUNNING,
+    CONTROLLER_EXITED   // the thread has quit
+};
+
+enum{
+    CONTROLLER_NONE,
+    CONTROLLER_RUN,
+    CONTROLLER_PAUSE,
+    CONTROLLER_STEP,  // pauses, then runs one instruction
+    CONTROLLER_LOAD,  // stops, then calls the load callback
+    CONTROLLER_QUIT
+};
+
+typedef struct Controller{
+
+    Computer* computer;
+    pthread_mutex_t* computer_lock; // taken around every batch
+
+    /* Called on the controller thread, without any lock held, to load
+       $path ($kind is the one given to controller_load()). Returns true
+       if the Computer holds a program afterwards. */
+    bool (*load)(void* data, const char* path, int kind);
+
+    /* Called on the controller thread, without any lock held, after
+       instructions were run: after every instruction at low frequencies,
+       every CONTROLLER_REFRESH_MS otherwise, and when the program stops
+       ($stopped). */
+    void (*refresh)(void* data, bool stopped);
+
+    void* data; // passed to the callbacks
+
+    int state;      // read atomically, written with lock held
+    int command;    // pending command, protected by lock
+    bool pausing;   // a pause is being processed, protected by lock
+    char path[4096];
+    int load_kind;
+    double frequency; // instructions per second, negative if unbounded, protected by lock
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // a command was posted or the state changed
+    pthread_t thread;
+
+} Controller;
+
+/* Starts the controller thread of $computer, in the EMPTY state, at
+   $frequency. The callbacks are described above. */
+void start_controller(Controller* ctl, Computer* computer, pthread_mutex_t* computer_lock,
+                      double frequency, bool (*load)(void*, const char*, int),
+                      void (*refresh)(void*, bool), void* data);
+
+/* Quits the controller thread and waits for it. */
+void stop_controller(Controller* ctl);
+
+/* Current state (CONTROLLER_EMPTY...). */
+static inline int controller_state(Controller* ctl){
+
+    return __atomic_load_n(&ctl->state, __ATOMIC_ACQUIRE);
+}
+
+/* Posts $command (CONTROLLER_RUN, PAUSE, STEP or QUIT). */
+void post_command(Controller* ctl, int command);
+
+/* Posts a CONTROLLER_LOAD of $path. */
+void controller_load(Controller* ctl, const char* path, int kind);
+
+/* Pauses and waits until the controller is not running anymore, so
+   that the Computer can be changed without the program resuming (unless
+   another thread posts a command meanwhile). */
+void controller_pause(Controller* ctl);
+
+/* Changes the frequency, taking effect at once (a long wait between two
+   instructions is cut short). */
+void set_controller_frequency(Controller* ctl, double frequency);
+
+double controller_frequency(Controller* ctl);
+
+#endif
@@ -1,19 +1,151 @@
 #include "emulator.h"
+#include "loop_idioms.h"
+#include "replay.h"
+#include "latency.h"
+#include "keyboard_hle.h"
+#include "history.h"
+#include "pipeline.h"
+#include "cache.h"
+#include "branch_predictor.h"
+#include "mmio.h"
+#include "aot.h"
+#include "write_log.h"
+#include "idle.h"
+#include <math.h>
 #include <string.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
-void init_computer(Computer* c, long program_memory_size, long video_memory_size, long kernel_memory_size){
+/* Size of the memory mapping, a whole number of pages. */
+static long mapping_size(Computer* c){
+
+    return (c->memory_size + MEMORY_PAGE_SZ - 1) / MEMORY_PAGE_SZ * MEMORY_PAGE_SZ;
+}
+
+/* Memory sizes and the addresses derived from them. */
+static void set_layout(Computer* c, long program_memory_size, long video_memory_size, long kernel_memory_size){
 
     c->memory_size = program_memory_size + video_memory_size + kernel_memory_size;
     c->program_memory_size = program_memory_size;
     c->video_memory_size = video_memory_size;
     c->kernel_memory_size = kernel_memory_size;
+    c->timing_start = kernel_memory_size >= KERNEL_TIMING + KERNEL_TIMING_SZ
+                      ? program_memory_size + video_memory_size + KERNEL_TIMING : c->memory_size;
+}
+
+/* Everything but the memory. */
+static void init_state(Computer* c, long program_memory_size, long video_memory_size, long kernel_memory_size){
+
+    set_layout(c, program_memory_size, video_memory_size, kernel_memory_size);
+
+    // RGB32, 3:2 aspect ratio
+    long area = video_memory_size / 4;
+    c->video_format = VIDEO_RGB32;
+    c->video_height = sqrt((area * 2.0) / 3.0);
+    c->video_width = c->video_height > 0 ? area / c->video_height : 0;
+
+    c->frequency = 0;
     c->cpu.program_counter = 0;
     c->program_size = 0;
     c->latest_accessed = -1;
     c->halted = false;
     c->interrupt_raised = false;
-    c->memory = (unsigned char*) malloc(c->memory_size * sizeof(unsigned char));
+    c->kernel_area = 0;
+    c->pending_interrupt = 0;
+    c->host_event_ns = 0;
+    c->queued_ns = 0;
+    c->queued_retired = 0;
+    memset(c->cpu.registers, 0, sizeof(c->cpu.registers));
+    c->retired = 0;
+    c->dirty_start = 0;
+    c->dirty_end = 0;
+    c->extended_isa = false;
+    c->block_cycles = 0;
+    c->block_cost = 0;
+    c->loop_idioms = true;
+    c->loop_cache = new_loop_cache();
+    c->interrupt_record = NULL;
+    c->record_last = 0;
+    c->latency = NULL;
+    c->keyboard_hle = KEYBOARD_HLE_OFF;
+    c->hle_check = NULL;
+    c->history = NULL;
+    c->pipeline = NULL;
+    c->caches = NULL;
+    c->predictor = NULL;
+    c->aot = NULL;
+    c->write_log = NULL;
+    c->idle = NULL;
+    c->bus = NULL;
+    c->next_device_event = NO_DEVICE_EVENT;
+    c->cpu.id = 0;
+    c->nb_cpus = 1;
+    c->shared_memory = false;
+}
+
+static void map_memory(Computer* c){
+
+    // anonymous pages are zero-filled and only allocated when first written
+    c->memory = mmap(NULL, mapping_size(c), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(c->memory == MAP_FAILED){
+        fprintf(stderr, "Error: could not allocate %ld bytes of memory\n", c->memory_size);
+        c->memory = NULL;
+    }
+}
+
+void init_computer(Computer* c, long program_memory_size, long video_memory_size, long kernel_memory_size){
+
+    init_state(c, program_memory_size, video_memory_size, kernel_memory_size);
+    map_memory(c);
+}
+
+void init_shared_computer(Computer* c, Computer* owner, int id){
+
+    init_state(c, owner->program_memory_size, owner->video_memory_size, owner->kernel_memory_size);
+    c->memory = owner->memory;
+    c->shared_memory = true;
+    c->program_size = owner->program_size;
+    c->cpu.id = id;
+}
+
+bool set_video_mode(Computer* c, int width, int height, int format){
+
+    if(width < 1 || width > VIDEO_MAX_WIDTH || height < 1 || height > VIDEO_MAX_HEIGHT
+       || format < VIDEO_RGB32 || format > VIDEO_INDEXED8){
+        fprintf(stderr, "Error: unsupported video mode %dx%d (format %d).\n", width, height, format);
+        return false;
+    }
+
+    if(c->shared_memory || c->nb_cpus > 1){
+        fprintf(stderr, "Error: the video mode of a shared memory cannot change.\n");
+        return false;
+    }
+
+    // a whole number of words, so that the kernel memory stays aligned
+    long video_memory_size = ((long) width * height * video_pixel_size(format) + 3) / 4 * 4;
+
+    if(c->memory != NULL)
+        munmap(c->memory, mapping_size(c));
+
+    set_layout(c, c->program_memory_size, video_memory_size, c->kernel_memory_size);
+    c->video_width = width;
+    c->video_height = height;
+    c->video_format = format;
+    c->dirty_start = 0;
+    c->dirty_end = 0;
+    map_memory(c);
+
+    return c->memory != NULL;
+}
+
+void clear_memory(Computer* c){
+
+    if(mmap(c->memory, mapping_size(c), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        memset(c->memory, 0, c->memory_size);
 }
 
 int get_word(Computer* c, long addr){
@@ -23,12 +155,10 @@ int get_word(Computer* c, long addr){
     } else if( addr + 4 > c->memory_size) {
         int word = 0;
         memcpy(&word,&c->memory[addr],c->memory_size - addr);
-        c->latest_accessed = addr;
         return word;
     } else {
         int word = 0;
         memcpy(&word,&c->memory[addr],4);
-        c->latest_accessed = addr;
         return word;
     }
 }
@@ -45,10 +175,61 @@ int get_register(Computer* c, int reg){
 }
 
 void free_computer(Computer* c){
-    if (c->memory != NULL) {
-        free(c->memory);
-        c->memory = NULL; 
+    if (c->memory != NULL && !c->shared_memory) {
+        munmap(c->memory, mapping_size(c));
     }
+    c->memory = NULL;
+
+    free_loop_cache(c->loop_cache);
+    c->loop_cache = NULL;
+    stop_interrupt_recording(c);
+    disable_latency_stats(c);
+    set_keyboard_hle(c, KEYBOARD_HLE_OFF);
+    disable_history(c);
+    disable_pipeline(c);
+    disable_caches(c);
+    disable_predictor(c);
+    disable_bus(c);
+    disable_aot(c);
+    disable_write_log(c);
+    disable_idle_detection(c);
+}
+
+void mark_video_dirty(Computer* c, long start, long end){
+
+    long video_start = c->program_memory_size;
+    long video_end = video_start + c->video_memory_size;
+
+    if(start < video_start)
+        start = video_start;
+
+    if(end > video_end)
+        end = video_end;
+
+    if(start >= end)
+        return;
+
+    if(c->dirty_start >= c->dirty_end){
+        c->dirty_start = start;
+        c->dirty_end = end;
+        return;
+    }
+
+    if(start < c->dirty_start)
+        c->dirty_start = start;
+
+    if(end > c->dirty_end)
+        c->dirty_end = end;
+}
+
+bool take_video_dirty(Computer* c, long* start, long* end){
+
+    *start = c->dirty_start;
+    *end = c->dirty_end;
+    c->dirty_start = 0;
+    c->dirty_end = 0;
+
+    return *start < *end;
 }
 
 void load(Computer* c, FILE* binary){
@@ -93,12 +274,15 @@ void load_interrupt_handler(Computer* c, FILE* binary){
     size_t size = ftell(binary);
     fseek(binary, 0, SEEK_SET);
 
-    if (size > c->kernel_memory_size - 400) {
+    // up to the palette
+    long handler_end = c->kernel_memory_size < KERNEL_PALETTE ? c->kernel_memory_size : KERNEL_PALETTE;
+
+    if ((long) size > handler_end - KERNEL_HANDLER) {
         fprintf(stderr, "Interrupt handler too large for kernel memory.\n");
         return;
     }
     
-    size_t read = fread(c->memory + c->program_memory_size + c->video_memory_size + 400, 1, size, binary);
+    size_t read = fread(c->memory + c->program_memory_size + c->video_memory_size + KERNEL_HANDLER, 1, size, binary);
     if (read < size) {
         fprintf(stderr, "Could not read the entire kernel binary.\n");
         exit(1);
@@ -106,9 +290,9 @@ void load_interrupt_handler(Computer* c, FILE* binary){
 
     long progVidMemSize = c->program_memory_size + c->video_memory_size;
     if(read >= 4) {
-        c->latest_accessed = (long)(progVidMemSize + 400 + read - 4);
+        c->latest_accessed = (long)(progVidMemSize + KERNEL_HANDLER + read - 4);
     } else {
-        c->latest_accessed = (long)(progVidMemSize + 400);
+        c->latest_accessed = (long)(progVidMemSize + KERNEL_HANDLER);
     }
     
 }
@@ -124,44 +308,339 @@ int arithmetic_right_shift(int x, int y) {
     return x >> y;
 }
 
-void execute_step(Computer* c){
-    if(c->cpu.program_counter < c->program_memory_size) {
+/* Delivers the interrupt made pending by raise_interrupt(). */
+static void take_interrupt(Computer* c){
+
+    // re-executing the history (see history.h) leaves it pending
+    if(c->history != NULL && c->history->replaying)
+        return;
+
+    uint32_t pending = __atomic_load_n(&c->pending_interrupt, __ATOMIC_ACQUIRE);
+
+    // not raised yet, or still being filled: taken next time
+    if(!(pending & INTERRUPT_PENDING))
+        return;
+
+    // read before the line is freed, a new raise_interrupt() replaces them
+    unsigned long long host_ns = __atomic_load_n(&c->host_event_ns, __ATOMIC_RELAXED);
+    unsigned long long queued_ns = __atomic_load_n(&c->queued_ns, __ATOMIC_RELAXED);
+    unsigned long long queued_retired = __atomic_load_n(&c->queued_retired, __ATOMIC_RELAXED);
+
+    // raisers only ever replace a free line: nobody else writes it now
+    __atomic_store_n(&c->pending_interrupt, 0, __ATOMIC_RELEASE);
+
+    char type = (char) (pending >> 8);
+    char keyval = (char) pending;
+
+    if(c->interrupt_record != NULL)
+        record_interrupt(c, type, keyval);
+
+    if(c->latency != NULL)
+        latency_interrupt(c, !c->interrupt_raised, host_ns, queued_ns, queued_retired);
+
+    deliver_interrupt(c, type, keyval);
+}
+
+/* Hooks of the models observing every instruction. */
+static inline void after_step(Computer* c, long instruction_pc, int instruction){
+
+    if(c->latency != NULL && c->latency->stage != LATENCY_IDLE)
+        latency_after_step(c, instruction_pc);
+
+    // the pipeline uses the results of the cache and predictor models
+    if(c->caches != NULL)
+        cache_after_step(c, instruction_pc, instruction);
+
+    if(c->predictor != NULL)
+        predictor_after_step(c, instruction_pc, instruction);
+
+    if(c->pipeline != NULL)
+        pipeline_after_step(c, instruction_pc, instruction);
+}
+
+/* Called after the jumps and branches, once the models have seen them:
+   only they can leave the interrupt handler, and pending interrupts
+   are taken there rather than before every instruction. */
+static inline void end_block(Computer* c){
+
+    if(c->interrupt_raised && c->cpu.program_counter < c->program_memory_size) {
+        // back in user code: the handler has returned
+        if(c->hle_check != NULL && c->hle_check->pending)
+            keyboard_hle_check(c);
+
         c->interrupt_raised = false;
     }
 
-    int instruction = get_word(c, c->cpu.program_counter);
-    int32_t opcode = (instruction >> 26) & 0x3F;
-    int32_t Rc = (instruction >> 21) & 0x1F;
-    int32_t Ra = (instruction >> 16) & 0x1F;
-    int32_t Rb = (instruction >> 11) & 0x1F;
-    int32_t int32 = instruction;
-    int32_t literal = extract_literal(int32);
+    if(__atomic_load_n(&c->pending_interrupt, __ATOMIC_RELAXED) != 0)
+        take_interrupt(c);
+}
+
+/* Loads the $size bytes at $addr into $value, those of the timing
+   registers (see KERNEL_TIMING) computed from $c's own counters rather
+   than read from the memory, which other processors may share. */
+static void load_timing_registers(Computer* c, long addr, void* value, int size){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    unsigned long long us = (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    int32_t frequency = 0;
+
+    if(c->frequency > 0)
+        frequency = c->frequency < 1 ? 1 : c->frequency >= INT32_MAX ? INT32_MAX : (int32_t) (c->frequency + 0.5);
+
+    int32_t r[KERNEL_TIMING_SZ / 4];
+    r[0] = (int32_t) c->retired;
+    r[1] = (int32_t) (c->retired >> 32);
+    r[2] = (int32_t) us;
+    r[3] = (int32_t) (us >> 32);
+    r[4] = frequency;
+
+    for(int i = 0; i < size; i++){
+        long offset = addr + i - c->timing_start;
+        ((unsigned char*) value)[i] = offset < KERNEL_TIMING_SZ ? ((unsigned char*) r)[offset]
+                                                                : c->memory[addr + i];
+    }
+}
+
+/* Does a load at $addr, not below c -> timing_start, read the timing
+   registers? */
+static inline bool is_timing_access(Computer* c, long addr){
+
+    // no timing registers in a too small kernel memory
+    return c->timing_start < c->memory_size && addr < c->timing_start + KERNEL_TIMING_SZ;
+}
+
+/* LDB, LDH, STB and STH: loads and stores of $size bytes (see
+   extended_isa in emulator.h). */
+static void execute_narrow_access(Computer* c, Instruction d, int size, bool store){
+
+    int32_t mask = size == 1 ? 0xFF : 0xFFFF;
+    long addr = (long) get_register(c, d.ra) + d.literal;
+
+    c->cpu.program_counter += 4;
+    c->latest_accessed = addr;
+
+    if(addr >= c->timing_start){
+
+        // devices are accessed by words
+        if(is_mmio(addr)){
+            if(store)
+                fprintf(stderr, "Error: %d-byte store to device address 0x%lx ignored.\n", size, addr);
+            else
+                c->cpu.registers[d.rc] = ((uint32_t) mmio_read(c, addr & ~3L) >> 8 * (addr & 3)) & mask;
+            return;
+        }
+
+        if(!store && is_timing_access(c, addr)){
+            uint16_t value = 0;
+            load_timing_registers(c, addr, &value, size);
+            c->cpu.registers[d.rc] = value;
+            return;
+        }
+    }
+
+    if(store){
+        int32_t value = get_register(c, d.rc);
+        if(c->history != NULL)
+            history_write(c, addr, size);
+        memcpy(c->memory + addr, &value, size);
+        mark_video_dirty(c, addr, addr + size);
+        log_write(c, addr, size, value & mask);
+    } else {
+        uint16_t value = 0;
+        memcpy(&value, c->memory + addr, size);
+        c->cpu.registers[d.rc] = value;
+    }
+}
+
+/* One chunk of FILL or COPY (see extended_isa in emulator.h). Returns
+   false if words are left, PC then stays on the instruction. */
+static bool execute_block_chunk(Computer* c, Instruction d){
+
+    bool copy = d.opcode == 0x15;
+    long count = get_register(c, d.rb);
+    long n = count < BLOCK_CHUNK_WORDS ? count : BLOCK_CHUNK_WORDS;
+    long dst = get_register(c, copy ? d.rc : d.ra);
+    long src = get_register(c, d.ra);
+
+    c->block_cost = 0;
+
+    if(n <= 0){
+        c->cpu.program_counter += 4;
+        return true;
+    }
+
+    if(dst < 0 || dst + 4 * n > c->timing_start || (copy && (src < 0 || src + 4 * n > c->timing_start))){
+        fprintf(stderr, "Error: %s outside of memory at 0x%lx.\n", copy ? "COPY" : "FILL",
+                c->cpu.program_counter);
+        c->cpu.program_counter += 4;
+        return true;
+    }
+
+    if(c->history != NULL)
+        history_write(c, dst, 4 * n);
+
+    if(!copy)
+        fill_words(c->memory + dst, get_register(c, d.rc), n);
+    else if(dst > src && dst < src + 4 * n){
+        // increasing addresses, as a loop would
+        for(long i = 0; i < n; i++)
+            memmove(c->memory + dst + 4 * i, c->memory + src + 4 * i, 4);
+    } else
+        memmove(c->memory + dst, c->memory + src, 4 * n);
+
+    mark_video_dirty(c, dst, dst + 4 * n);
+    c->latest_accessed = dst + 4 * (n - 1);
+
+    if(c->write_log != NULL){
+        int32_t first;
+        memcpy(&first, c->memory + dst, 4);
+        log_write(c, dst, 4 * n, first);
+    }
+
+    // a memory cycle per word read or written
+    c->block_cost = copy ? 2 * n : n;
+    c->block_cycles += c->block_cost - 1;
+
+    c->cpu.registers[d.ra] = (int) (src + 4 * n);
+    if(copy)
+        c->cpu.registers[d.rc] = (int) (dst + 4 * n);
+    c->cpu.registers[d.rb] = (int) (count - n);
+
+    if(count > n)
+        return false;
+
+    c->cpu.program_counter += 4;
+    return true;
+}
+
+void execute_step(Computer* c){
+    long instruction_pc = c->cpu.program_counter;
+    int instruction = get_word(c, instruction_pc);
+    c->latest_accessed = instruction_pc;
+    Instruction decoded = decode(instruction);
+    int32_t opcode = decoded.opcode;
+    int32_t Rc = decoded.rc;
+    int32_t Ra = decoded.ra;
+    int32_t Rb = decoded.rb;
+    int32_t literal = decoded.literal;
 
     int temp = 0;
     int temp2 = 0;
+    c->retired++;
 
     switch(opcode) {
         case 0x00:  // HALT
             c->halted = true;
             break;
+        case 0x01: // CPUID
+            if(!c->extended_isa){
+                fprintf(stderr, "Error: Opcode %d not yet implemented.\n",opcode);
+                break;
+            }
+            c->cpu.program_counter += 4;
+            c->cpu.registers[Rc] = literal == 1 ? c->nb_cpus : c->cpu.id;
+            break;
+        case 0x10: // LDB
+        case 0x11: // STB
+        case 0x12: // LDH
+        case 0x13: // STH
+            if(!c->extended_isa){
+                fprintf(stderr, "Error: Opcode %d not yet implemented.\n",opcode);
+                break;
+            }
+            execute_narrow_access(c, decoded, opcode >= 0x12 ? 2 : 1, opcode & 1);
+            break;
+        case 0x14: // FILL
+        case 0x15: // COPY
+            if(!c->extended_isa){
+                fprintf(stderr, "Error: Opcode %d not yet implemented.\n",opcode);
+                break;
+            }
+            // a chunk is done: like a jump to itself, interrupts can be taken
+            if(!execute_block_chunk(c, decoded)){
+                after_step(c, instruction_pc, instruction);
+                end_block(c);
+                return;
+            }
+            break;
         case 0x18: // LD
             c->cpu.program_counter += 4;
             temp = get_register(c,Ra);
-            c->cpu.registers[Rc] = *((int32_t*) &(c->memory[temp + literal]));
             c->latest_accessed = (long)(temp + literal);
+            // the timing registers end the memory (but for the areas of
+            // SMP processors), the devices come after it
+            if(c->latest_accessed >= c->timing_start){
+                if(is_mmio(c->latest_accessed)){
+                    c->cpu.registers[Rc] = mmio_read(c, c->latest_accessed);
+                    break;
+                }
+                if(is_timing_access(c, c->latest_accessed)){
+                    int32_t value;
+                    load_timing_registers(c, c->latest_accessed, &value, 4);
+                    c->cpu.registers[Rc] = value;
+                    break;
+                }
+            }
+            // relaxed: other processors may access the word at the same time (see smp.h)
+            c->cpu.registers[Rc] = __atomic_load_n((int32_t*) &(c->memory[temp + literal]), __ATOMIC_RELAXED);
             break;
     	case 0x19: // ST
             c->cpu.program_counter += 4;
             temp2 = get_register(c,Rc);
             temp = get_register(c,Ra);
-            *((int32_t*) &(c->memory[temp + literal])) = temp2;
             c->latest_accessed = (long)(temp + literal);
+            if(is_mmio(c->latest_accessed)){
+                mmio_write(c, c->latest_accessed, temp2);
+                break;
+            }
+            if(c->history != NULL)
+                history_write(c, (long)(temp + literal), 4);
+            __atomic_store_n((int32_t*) &(c->memory[temp + literal]), temp2, __ATOMIC_RELAXED);
+            mark_video_dirty(c, c->latest_accessed, c->latest_accessed + 4);
+            log_write(c, c->latest_accessed, 4, temp2);
+            break;
+        case 0x1A: // SWAP
+            if(!c->extended_isa){
+                fprintf(stderr, "Error: Opcode %d not yet implemented.\n",opcode);
+                break;
+            }
+            c->cpu.program_counter += 4;
+            temp2 = get_register(c,Rc);
+            temp = get_register(c,Ra);
+            if(c->history != NULL)
+                history_write(c, (long)(temp + literal), 4);
+            c->cpu.registers[Rc] = __atomic_exchange_n((int32_t*) &(c->memory[temp + literal]),
+                                                       temp2, __ATOMIC_SEQ_CST);
+            c->latest_accessed = (long)(temp + literal);
+            mark_video_dirty(c, c->latest_accessed, c->latest_accessed + 4);
+            log_write(c, c->latest_accessed, 4, temp2);
             break;
         case 0x1B: // JMP
             c->cpu.program_counter += 4;
             c->cpu.registers[Rc]=c->cpu.program_counter;
             temp = get_register(c,Ra);
             c->cpu.program_counter = temp & 0xFFFFFFFC; 
+            after_step(c, instruction_pc, instruction);
+            end_block(c);
+            return;
+        case 0x1C: // CAS
+            if(!c->extended_isa){
+                fprintf(stderr, "Error: Opcode %d not yet implemented.\n",opcode);
+                break;
+            }
+            c->cpu.program_counter += 4;
+            temp2 = get_register(c,Rc);
+            temp = get_register(c,Ra);
+            if(c->history != NULL)
+                history_write(c, (long) temp, 4);
+            if(__atomic_compare_exchange_n((int32_t*) &(c->memory[temp]), &temp2, get_register(c,Rb),
+                                           false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+                log_write(c, temp, 4, get_register(c,Rb));
+            c->cpu.registers[Rc] = temp2;
+            c->latest_accessed = (long) temp;
+            mark_video_dirty(c, c->latest_accessed, c->latest_accessed + 4);
             break;
         case 0x1D: // BEQ
             c->cpu.program_counter += 4;
@@ -170,7 +649,9 @@ void execute_step(Computer* c){
             if(temp == 0) {
                 c->cpu.program_counter = c->cpu.program_counter + 4 * literal; 
             }
-            break;
+            after_step(c, instruction_pc, instruction);
+            end_block(c);
+            return;
         case 0x1E: // BNE
             c->cpu.program_counter += 4;
             c->cpu.registers[Rc]=c->cpu.program_counter;
@@ -178,16 +659,23 @@ void execute_step(Computer* c){
             if(temp != 0) {
                 c->cpu.program_counter = c->cpu.program_counter + 4 * literal; 
             }
-            break;
+            after_step(c, instruction_pc, instruction);
+            end_block(c);
+            return;
         case 0x1F: // LDR
             if(c->cpu.program_counter + 4 + 4 * literal > c->program_memory_size + c->video_memory_size) {
                 c->cpu.program_counter += 4;
                 temp2 = get_register(c,Rc);
-                *((int32_t*) &(c->memory[c->cpu.program_counter + 4*literal])) = temp2;
+                if(c->history != NULL)
+                    history_write(c, c->cpu.program_counter + 4*literal, 4);
+                __atomic_store_n((int32_t*) &(c->memory[c->cpu.program_counter + 4*literal]), temp2, __ATOMIC_RELAXED);
                 c->latest_accessed = (long)(c->cpu.program_counter + 4*literal);
+                mark_video_dirty(c, c->latest_accessed, c->latest_accessed + 4);
+                log_write(c, c->latest_accessed, 4, temp2);
             } else {
                 c->cpu.program_counter += 4;
-                c->cpu.registers[Rc] = *((int32_t*) &(c->memory[c->cpu.program_counter + 4*literal]));
+                c->cpu.registers[Rc] = __atomic_load_n((int32_t*) &(c->memory[c->cpu.program_counter + 4*literal]),
+                                                       __ATOMIC_RELAXED);
                 c->latest_accessed = (long)(c->cpu.program_counter + 4*literal);
             }
             break;
@@ -341,29 +829,304 @@ void execute_step(Computer* c){
         default:
             fprintf(stderr, "Error: Opcode %d not yet implemented.\n",opcode);
     }
+
+    after_step(c, instruction_pc, instruction);
 }
 
-void raise_interrupt(Computer* c, char type, char keyval){
-    if(!c->interrupt_raised) {
-        c->interrupt_raised =  true;
+bool is_executing(Computer* c){
 
-        long addr = c->program_memory_size + c->video_memory_size;
-        c->cpu.registers[30] = c->cpu.program_counter;
-        c->cpu.program_counter = addr + 400;
+    long pc = c->cpu.program_counter;
 
-        c->cpu.registers[29] = c->program_size+4;
-        *((int32_t*) (c->memory + c->program_size)) = c->program_memory_size + c->video_memory_size;
- 
-        if(type == 0) {
-            c->memory[addr+13] = type;
-            c->latest_accessed = (long)(addr+13);
-            c->memory[addr+13+1] = keyval;
-            c->latest_accessed = (long)(addr+14);
-        } else if (type == 1) {
-            c->memory[addr+13] = type;
-            c->latest_accessed = (long)(addr+13);
+    return (!c->halted && pc < c->program_size)
+           || (pc > c->program_memory_size + c->video_memory_size && pc < c->memory_size);
+}
+
+/* Caps $max_steps so that bulk execution stops at the next device event. */
+static inline long device_event_limit(Computer* c, long max_steps){
+
+    if(c->next_device_event == NO_DEVICE_EVENT)
+        return max_steps;
+
+    if(c->next_device_event <= c->retired)
+        return 0;
+
+    return c->next_device_event - c->retired < (unsigned long long) max_steps
+           ? (long) (c->next_device_event - c->retired) : max_steps;
+}
+
+long run_steps(Computer* c, long max_steps){
+
+    long steps = 0;
+
+    if(c->history != NULL)
+        history_resume(c);
+
+    if(c->idle != NULL && c->idle->parked)
+        idle_resume(c);
+
+    if(__atomic_load_n(&c->pending_interrupt, __ATOMIC_RELAXED) != 0)
+        take_interrupt(c);
+
+    while(steps < max_steps && is_executing(c)){
+
+        if(c->retired >= c->next_device_event)
+            run_device_events(c);
+
+        if(c->history != NULL && c->retired >= c->history->next_checkpoint)
+            history_checkpoint(c);
+
+        // translated blocks chain without looking at the interrupt line:
+        // a pending interrupt is left to the interpreter, which takes it
+        // at the end of the block
+        if(c->aot != NULL && __atomic_load_n(&c->pending_interrupt, __ATOMIC_RELAXED) == 0){
+
+            long n = aot_steps(c, device_event_limit(c, max_steps - steps));
+            steps += n;
+
+            if(n > 0){
+                forget_idle_loop(c);
+
+                if(__atomic_load_n(&c->pending_interrupt, __ATOMIC_RELAXED) != 0)
+                    take_interrupt(c);
+
+                continue;
+            }
+        }
+
+        long pc = c->cpu.program_counter;
+        execute_step(c);
+        steps++;
+
+        // a backward jump closes a loop that may be idle, a fill or a
+        // copy (timing models need every instruction), it must stop at
+        // the next device event
+        if(c->cpu.program_counter < pc
+           && c->pipeline == NULL && c->caches == NULL && c->predictor == NULL){
+
+            long limit = device_event_limit(c, max_steps - steps);
+            long n = 0;
+
+            if(c->idle != NULL && c->nb_cpus == 1){
+
+                n = run_idle_loop(c, pc, limit);
+
+                if(c->idle->parked)
+                    break;
+            }
+
+            if(n == 0 && limit > 0 && c->loop_idioms)
+                n = run_loop_idiom(c, pc, limit);
+
+            steps += n;
         }
     }
+
+    return steps;
+}
+
+bool raise_interrupt(Computer* c, char type, char keyval){
+
+    return raise_host_interrupt(c, type, keyval, 0);
+}
+
+bool raise_host_interrupt(Computer* c, char type, char keyval, unsigned long long event_ns){
+    uint32_t none = 0;
+    uint32_t pending = INTERRUPT_PENDING | (unsigned char) type << 8 | (unsigned char) keyval;
+
+    // a single line: lost if the previous one was not taken yet
+    if(!__atomic_compare_exchange_n(&c->pending_interrupt, &none, INTERRUPT_RESERVED,
+                                    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        if(c->latency != NULL)
+            latency_interrupt_lost(c);
+        return false;
+    }
+
+    // the line is ours until it is published: the CPU cannot take it
+    // with the time of another event
+    __atomic_store_n(&c->host_event_ns, event_ns, __ATOMIC_RELAXED);
+
+    // the queued stage starts now, not when the CPU takes the line (see latency.h)
+    bool stamped = c->latency != NULL;
+    __atomic_store_n(&c->queued_ns, stamped ? latency_clock_ns() : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->queued_retired, stamped ? __atomic_load_n(&c->retired, __ATOMIC_RELAXED) : 0,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&c->pending_interrupt, pending, __ATOMIC_RELEASE);
+
+    // a parked computer takes it as soon as it resumes
+    if(c->idle != NULL)
+        wake_idle_waiters(c);
+
+    return true;
+}
+
+bool deliver_interrupt(Computer* c, char type, char keyval){
+    if(c->interrupt_raised)
+        return false;
+
+    c->interrupt_raised =  true;
+
+    // the handler reads the address of its data in the word before its
+    // stack: the kernel memory and the end of the program, or the area
+    // of a processor of an SMP machine (see smp.h)
+    long kernel = c->program_memory_size + c->video_memory_size;
+    long addr = c->kernel_area != 0 ? c->kernel_area : kernel;
+    long frame = c->kernel_area != 0 ? c->kernel_area + KERNEL_AREA_FRAME : c->program_size;
+
+    if(c->history != NULL){
+        history_resume(c);
+        history_write(c, frame, 4);
+        history_write(c, addr + KERNEL_INTERRUPT_TYPE, 2);
+    }
+
+    c->cpu.registers[30] = c->cpu.program_counter;
+    c->cpu.program_counter = kernel + KERNEL_HANDLER;
+
+    c->cpu.registers[29] = frame + 4;
+    *((int32_t*) (c->memory + frame)) = addr;
+    log_write(c, frame, 4, addr);
+ 
+    if(type == INTERRUPT_KEY_PRESSED) {
+        c->memory[addr+KERNEL_INTERRUPT_TYPE] = type;
+        c->latest_accessed = (long)(addr+KERNEL_INTERRUPT_TYPE);
+        c->memory[addr+KERNEL_INTERRUPT_KEYVAL] = keyval;
+        c->latest_accessed = (long)(addr+KERNEL_INTERRUPT_KEYVAL);
+        log_write(c, addr+KERNEL_INTERRUPT_TYPE, 2, (unsigned char) type | (unsigned char) keyval << 8);
+    } else {
+        c->memory[addr+KERNEL_INTERRUPT_TYPE] = type;
+        c->latest_accessed = (long)(addr+KERNEL_INTERRUPT_TYPE);
+        log_write(c, addr+KERNEL_INTERRUPT_TYPE, 1, (unsigned char) type);
+    }
+
+    if(c->keyboard_hle != KEYBOARD_HLE_OFF)
+        keyboard_hle_interrupt(c);
+
+    // seeking never has to re-raise an interrupt
+    if(c->history != NULL)
+        history_checkpoint(c);
+
+    return true;
+}
+
+static inline void add_source(Operands* o, int reg){
+
+    if(reg != 31)
+        o->sources[o->nb_sources++] = reg;
+}
+
+Operands instruction_operands(Computer* c, Instruction d, long pc){
+
+    Operands o;
+    o.kind = INSTR_ALU;
+    o.nb_sources = 0;
+    o.destination = d.rc;
+
+    switch(d.opcode){
+        case 0x00: // HALT
+            o.kind = INSTR_HALT;
+            o.destination = -1;
+            break;
+        case 0x01: // CPUID
+            if(!c->extended_isa){
+                o.kind = INSTR_INVALID;
+                o.destination = -1;
+                break;
+            }
+            break;
+        case 0x10: // LDB
+        case 0x12: // LDH
+            if(!c->extended_isa){
+                o.kind = INSTR_INVALID;
+                o.destination = -1;
+                break;
+            }
+            // fall through
+        case 0x18: // LD
+            o.kind = INSTR_LOAD;
+            add_source(&o, d.ra);
+            break;
+        case 0x14: // FILL
+        case 0x15: // COPY
+            if(!c->extended_isa){
+                o.kind = INSTR_INVALID;
+                o.destination = -1;
+                break;
+            }
+            // the address register is the one read back soonest
+            o.kind = INSTR_STORE;
+            add_source(&o, d.ra);
+            add_source(&o, d.rb);
+            add_source(&o, d.rc);
+            o.destination = d.ra;
+            break;
+        case 0x11: // STB
+        case 0x13: // STH
+            if(!c->extended_isa){
+                o.kind = INSTR_INVALID;
+                o.destination = -1;
+                break;
+            }
+            // fall through
+        case 0x19: // ST
+            o.kind = INSTR_STORE;
+            add_source(&o, d.ra);
+            add_source(&o, d.rc);
+            o.destination = -1;
+            break;
+        case 0x1A: // SWAP
+            if(!c->extended_isa){
+                o.kind = INSTR_INVALID;
+                o.destination = -1;
+                break;
+            }
+            o.kind = INSTR_ATOMIC;
+            add_source(&o, d.ra);
+            add_source(&o, d.rc);
+            break;
+        case 0x1B: // JMP
+            o.kind = INSTR_JUMP;
+            add_source(&o, d.ra);
+            break;
+        case 0x1C: // CAS
+            if(!c->extended_isa){
+                o.kind = INSTR_INVALID;
+                o.destination = -1;
+                break;
+            }
+            o.kind = INSTR_ATOMIC;
+            add_source(&o, d.ra);
+            add_source(&o, d.rb);
+            add_source(&o, d.rc);
+            break;
+        case 0x1D: // BEQ
+        case 0x1E: // BNE
+            o.kind = INSTR_BRANCH;
+            add_source(&o, d.ra);
+            break;
+        case 0x1F: // LDR
+            if(pc + 4 + 4 * d.literal > c->program_memory_size + c->video_memory_size){
+                o.kind = INSTR_STORE;
+                add_source(&o, d.rc);
+                o.destination = -1;
+            } else {
+                o.kind = INSTR_LOAD;
+            }
+            break;
+        default:
+            if(d.opcode >= 0x20 && d.opcode <= 0x2F){
+                add_source(&o, d.ra);
+                add_source(&o, d.rb);
+            } else if(d.opcode >= 0x30){
+                add_source(&o, d.ra);
+            } else {
+                o.kind = INSTR_INVALID;
+                o.destination = -1;
+            }
+    }
+
+    if(o.destination == 31)
+        o.destination = -1;
+
+    return o;
 }
 
 int32_t extract_literal(int32_t input) {
@@ -377,26 +1140,53 @@ int32_t extract_literal(int32_t input) {
 }
 
 int disassemble(int instruction, char* buf) {
-    int opcode = (instruction >> 26) & 0x3F;
-    int Rc = (instruction >> 21) & 0x1F;
-    int Ra = (instruction >> 16) & 0x1F;
-    int Rb = (instruction >> 11) & 0x1F;
-    int32_t int32 = instruction;
-    int32_t literal = extract_literal(int32);
+    Instruction decoded = decode(instruction);
+    int opcode = decoded.opcode;
+    int Rc = decoded.rc;
+    int Ra = decoded.ra;
+    int Rb = decoded.rb;
+    int32_t literal = decoded.literal;
 
     switch (opcode) {
         case 0x00:
             sprintf(buf, "HALT");
             break;
+        case 0x01:
+            sprintf(buf, literal == 1 ? "NCPUS(R%d)" : "CPUID(R%d)", Rc);
+            break;
+        case 0x10:
+            sprintf(buf, "LDB(R%d,%d,R%d)", Ra, literal, Rc);
+            break;
+        case 0x11:
+            sprintf(buf, "STB(R%d,%d,R%d)", Rc, literal, Ra);
+            break;
+        case 0x12:
+            sprintf(buf, "LDH(R%d,%d,R%d)", Ra, literal, Rc);
+            break;
+        case 0x13:
+            sprintf(buf, "STH(R%d,%d,R%d)", Rc, literal, Ra);
+            break;
+        case 0x14:
+            sprintf(buf, "FILL(R%d,R%d,R%d)", Ra, Rb, Rc);
+            break;
+        case 0x15:
+            sprintf(buf, "COPY(R%d,R%d,R%d)", Ra, Rc, Rb);
+            break;
         case 0x18:
             sprintf(buf, "LD(R%d,%d,R%d)", Ra, literal, Rc);
             break;
         case 0x19:
             sprintf(buf, "ST(R%d,%d,R%d)", Rc, literal, Ra);
             break;
+        case 0x1A:
+            sprintf(buf, "SWAP(R%d,%d,R%d)", Ra, literal, Rc);
+            break;
         case 0x1B: 
             sprintf(buf, "JMP(R%d,R%d)", Ra, Rc);
             break;
+        case 0x1C:
+            sprintf(buf, "CAS(R%d,R%d,R%d)", Ra, Rb, Rc);
+            break;
         case 0x1D:
             sprintf(buf, "BEQ(R%d,%d,R%d)", Ra, literal, Rc);
             break;
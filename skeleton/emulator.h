@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* suggested parameters for init_computer() calls by the GUI
    Editing PROGRAM_MEMORY (32MB is plenty) and VIDEO_MEMORY most likely will
@@ -11,8 +12,98 @@
    according to the size of your interrupt handler and other
    kernel facilities */ 
 #define PROGRAM_MEMORY_SZ (32 * 1024 * 1024)
-#define VIDEO_MEMORY_SZ (600 * 400 * 4) // must be 3:2 aspect ratio
-#define KERNEL_MEMORY_SZ 800
+#define VIDEO_MEMORY_SZ (600 * 400 * 4) // 600x400 RGB32 unless set_video_mode() is called
+#define KERNEL_MEMORY_SZ 1856
+
+// granularity of the memory mapping, memory is allocated page by page on first write
+#define MEMORY_PAGE_SZ 4096
+
+// kernel memory layout, offsets from the start of kernel memory
+#define KERNEL_INTERRUPT_TYPE 13   // set by raise_interrupt()
+#define KERNEL_INTERRUPT_KEYVAL 14 // set for INTERRUPT_KEY_PRESSED only
+#define KERNEL_HANDLER 400         // the interrupt handler is loaded there, up to KERNEL_PALETTE
+#define KERNEL_PALETTE 800         // VIDEO_PALETTE_SZ 0x00BBGGRR words, colors of VIDEO_INDEXED8 pixels
+#define KERNEL_TIMING 1824         // timing registers, computed when loads read them (see below)
+#define KERNEL_TIMING_SZ 20
+
+// SMP machines (see smp.h): every processor but the first has its own
+// area after the kernel memory, with its interrupt type and key at
+// KERNEL_INTERRUPT_TYPE and KERNEL_INTERRUPT_KEYVAL, the handler's data
+// after them and its interrupt frame from KERNEL_AREA_FRAME on
+#define KERNEL_AREA_SZ 1024
+#define KERNEL_AREA_FRAME 960
+
+/* Video modes, chosen with set_video_mode() before loading anything:
+       VIDEO_RGB32     a 0x00BBGGRR word per pixel
+       VIDEO_RGB565    a halfword per pixel, red in bits 15-11, green in
+                       10-5 and blue in 4-0
+       VIDEO_INDEXED8  a byte per pixel, the index of its color in the
+                       palette at KERNEL_PALETTE (black until written)
+   Pixels are stored row by row from the start of video memory, whose
+   size is width * height * bytes per pixel rounded up to a word; the
+   kernel memory follows it, so its address depends on the mode. */
+enum{
+    VIDEO_RGB32,
+    VIDEO_RGB565,
+    VIDEO_INDEXED8
+};
+
+#define VIDEO_PALETTE_SZ 256
+#define VIDEO_MAX_WIDTH 4096
+#define VIDEO_MAX_HEIGHT 4096
+
+/* Bytes per pixel of the video $format. */
+static inline int video_pixel_size(int format){
+
+    return format == VIDEO_RGB32 ? 4 : format == VIDEO_RGB565 ? 2 : 1;
+}
+
+/* Timing registers, read-only words at KERNEL_TIMING:
+       +0/+4   instructions retired lo/hi (the LD reading it included)
+       +8/+12  host monotonic time in microseconds lo/hi
+       +16     emulated frequency, instructions per second (rounded, at
+               least 1), 0 if unbounded
+   LD, LDB and LDH compute them from the processor's own counters when
+   they read kernel memory from KERNEL_TIMING on, so they cost a single
+   comparison per load when the guest does not use them, and processors
+   sharing their memory (see smp.h) each read their own. Stores into
+   them change the memory underneath, which loads do not see. The host
+   time makes a program reading it nondeterministic: replays (see
+   replay.h) and the history (see history.h) only reproduce it if the
+   program does not branch on it. */
+
+/* Extended ISA, valid only when c -> extended_isa is set (classic
+   programs see them as unimplemented opcodes):
+       0x01 CPUID(RC)        RC <- processor number (NCPUS(RC): count, see smp.h)
+       0x1A SWAP(RA, CC, RC) RC <-> Mem[RA+CC], atomically
+       0x1C CAS(RA, RB, RC)  if Mem[RA] = RC then Mem[RA] <- RB; RC <- old Mem[RA], atomically
+       0x10 LDB(RA, CC, RC)  RC <- Mem8[RA+CC], zero-extended
+       0x11 STB(RC, CC, RA)  Mem8[RA+CC] <- RC[7:0]
+       0x12 LDH(RA, CC, RC)  RC <- Mem16[RA+CC], zero-extended
+       0x13 STH(RC, CC, RA)  Mem16[RA+CC] <- RC[15:0]
+       0x14 FILL(RA, RB, RC) Mem[RA+4i] <- RC for i < RB
+       0x15 COPY(RA, RC, RB) Mem[RC+4i] <- Mem[RA+4i] for i < RB, in increasing i
+   Memory is little-endian and halfwords need not be aligned. Devices
+   (see mmio.h) are accessed by words: narrow loads extract their bytes
+   from the word, narrow stores into them are ignored.
+   FILL and COPY move at most BLOCK_CHUNK_WORDS words per execution, then
+   advance their address registers, decrease the count RB and stay at the
+   same PC until it reaches 0 (a negative count does nothing). Interrupts
+   are taken between two chunks, the handler returning to the
+   instruction, which resumes where it stopped; the registers must thus
+   be distinct and not R31. Each word costs a memory cycle (two for
+   COPY), counted in block_cycles and by the pipeline model. Ranges
+   must lie below the timing registers, otherwise the instruction only
+   reports an error. */
+
+#define BLOCK_CHUNK_WORDS 1024
+
+// interrupt types
+enum{
+    INTERRUPT_KEY_PRESSED,
+    INTERRUPT_KEY_RELEASED,
+    INTERRUPT_TIMER // see mmio.h
+};
 
 typedef struct{
 	 
@@ -21,6 +112,7 @@ typedef struct{
     // add your own fields here !
     int registers[32];
     int backup;
+    int id; // processor number returned by CPUID (see smp.h)
     
 } CPU;
 
@@ -32,16 +124,62 @@ typedef struct{
     long program_memory_size;
     long video_memory_size;
     long kernel_memory_size;
-    long latest_accessed; // address of the word most recently loaded/stored from/into memory
+    int video_width, video_height; // framebuffer size in pixels
+    int video_format;              // VIDEO_RGB32, VIDEO_RGB565 or VIDEO_INDEXED8
+    long latest_accessed; // address of the word the guest most recently fetched, loaded or stored
+                          // (host reads through get_word() leave it alone, see write_log.h for writes)
+    long timing_start; // address of the timing registers, memory_size if the kernel memory is too small
+    double frequency;  // instructions per second the host runs the program at, 0 if unbounded
     bool halted; // was the HALT() instruction executed (stopping the program's execution)
     unsigned program_size; // user-space program size (code + stack)
     
     // add your own fields here !
     unsigned char* memory;
-    bool interrupt_raised;
+    bool interrupt_raised; // the interrupt handler is running
+    long kernel_area; // address of this processor's kernel area, 0 if it uses the kernel memory (see smp.h)
+    uint32_t pending_interrupt; // INTERRUPT_PENDING | type << 8 | keyval set by raise_interrupt(), 0 if none
+    unsigned long long host_event_ns; // host event time of the pending interrupt, 0 if none (see latency.h)
+    unsigned long long queued_ns;      // when it became pending, 0 without latency statistics
+    unsigned long long queued_retired; // c -> retired at that time, as seen by the raising thread
     char interrupt_type;
     char interrupt_keyval;
-    
+
+    unsigned long long retired; // number of instructions executed since init_computer()
+    long dirty_start; // video memory range [dirty_start, dirty_end[ written since
+    long dirty_end;   // the last call to take_video_dirty() (empty if start >= end)
+
+    bool extended_isa; // accept the extended instructions (see below), false by default
+    unsigned long long block_cycles; // memory cycles of FILL and COPY beyond one per instruction
+    long block_cost; // memory cycles of the last FILL or COPY execution
+    bool loop_idioms; // let run_steps() execute fill/copy loops as bulk operations
+    struct LoopCache* loop_cache;
+
+    FILE* interrupt_record; // interrupts taken from pending_interrupt are logged there if not NULL (see replay.h)
+    unsigned long long record_last; // retired count of the previous record
+
+    struct LatencyStats* latency; // interrupt latency statistics, NULL if disabled (see latency.h)
+
+    int keyboard_hle; // how keyboard interrupts are handled (see keyboard_hle.h)
+    struct HleCheck* hle_check; // KEYBOARD_HLE_CHECK mode state, NULL otherwise
+
+    struct History* history; // reverse execution history, NULL if disabled (see history.h)
+
+    struct Pipeline* pipeline; // pipeline timing model, NULL if disabled (see pipeline.h)
+    struct Caches* caches;     // cache hierarchy model, NULL if disabled (see cache.h)
+    struct Predictor* predictor; // branch predictor model, NULL if disabled (see branch_predictor.h)
+
+    struct AotEngine* aot; // translated program, NULL if none (see aot.h)
+
+    struct WriteLog* write_log; // guest memory writes, NULL if not logged (see write_log.h)
+
+    struct IdleLoop* idle; // idle loop detection, NULL if disabled (see idle.h)
+
+    struct Bus* bus; // memory-mapped devices, NULL if none (see mmio.h)
+    unsigned long long next_device_event; // retired count of the next device event
+
+    int nb_cpus;        // processors sharing the memory (see smp.h), 1 by default
+    bool shared_memory; // the memory belongs to another Computer, free_computer() keeps it
+
 } Computer;
 
 static char* reg_symbols[32] = {"R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "R8", "R9",
@@ -54,13 +192,29 @@ static char* reg_symbols[32] = {"R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7",
 void init_computer(Computer* c, long program_memory_size, 
                                 long video_memory_size, long kernel_memory_size);
 
+/* Initializes $c as another processor of the machine $owner: $c gets
+   its own registers, counters and interrupt line but uses $owner's memory,
+   which must outlive it. */
+void init_shared_computer(Computer* c, Computer* owner, int id);
+
+/* Gives $c a $width x $height framebuffer in the video $format, resizing
+   its video memory (VIDEO_RGB32 3:2 by default, from the size given to
+   init_computer()). Its memory is reallocated, zeroed: this must be done
+   before loading anything, and before other processors share it.
+   Returns false (reporting the error) if the mode is not supported. */
+bool set_video_mode(Computer* c, int width, int height, int format);
+
+/* Resets every byte of $c's memory to 0, releasing the pages in use. */
+void clear_memory(Computer* c);
+
 /*  Reads a 32-bit word at the address $addr from the computer's 
     memory.
     Return value: the word found at addr. If addr > c -> 
     memory_size, 0 will be returned. If addr is a valid address 
     found at the boundary of the computer's memory (i.e. there is 
     less than a full 4-byte word to return, then the function 
-    will return the valid bytes followed by a padding of 0-bytes. */
+    will return the valid bytes followed by a padding of 0-bytes.
+    This is a host read: it changes nothing in $c. */
 int get_word(Computer* c, long addr);
 
 /* Returns the value of a given register of computer c, reg is 
@@ -81,10 +235,11 @@ void load(Computer* c, FILE* binary);
 void load_interrupt_handler(Computer* c, FILE* binary);
 
 /* Runs one fetch + decode + execute cycle of $c's CPU,
-   If an interrupt line is raised (and the computer is not
-   already executing the interrupt handler), the program counter
-   becomes the start address of the interrupt handler 
-   and its first instruction is executed. 
+   If the instruction ends a basic block (JMP, BEQ, BNE) and an
+   interrupt is pending (see raise_interrupt()), it is taken: unless the
+   computer is already executing the interrupt handler, the program
+   counter becomes the start address of the interrupt handler,
+   whose first instruction is executed by the next call.
    Before handing control to the interrupt handler, the CPU
    places the interrupt number and associated character at
    the adequate place in kernel memory (see statement) and     
@@ -92,10 +247,64 @@ void load_interrupt_handler(Computer* c, FILE* binary);
    return. */
 void execute_step(Computer* c);
 
-/* Raise an interrupt line of computer $c if no other already is. 
-   Otherwise, this does nothing.  $type is the interrupt number
-   while $keyval is the associated character. */
-void raise_interrupt(Computer* c, char type, char keyval);
+/* Returns true while $c's program is running: it has not halted and
+   executes its own code (below program_size) or the interrupt handler. */
+bool is_executing(Computer* c);
+
+/* Runs up to $max_steps fetch + decode + execute cycles of $c's CPU,
+   stopping early as soon as is_executing() becomes false.
+   The resulting state is exactly the one obtained by calling
+   execute_step() the same number of times.
+   Returns the number of instructions executed.
+   When $c -> loop_idioms is set, counted fill and copy loops are
+   recognized and executed as bulk memory operations (see loop_idioms.h);
+   they never run past $max_steps so interrupts injected between two
+   calls still land on the same instruction. Idle loops are skipped the
+   same way when $c -> idle is set, and run_steps() also stops early
+   when the computer parks (see idle.h).
+   A pending interrupt is taken when run_steps() starts, after
+   translated blocks (see aot.h) and by execute_step(). */
+long run_steps(Computer* c, long max_steps);
+
+/* Records that the bytes [$start, $end[ of $c's video memory were written.
+   Addresses outside of video memory are ignored. */
+void mark_video_dirty(Computer* c, long start, long end);
+
+/* Stores in $start and $end the video memory range written since the
+   previous call and clears it. Returns false if nothing was written. */
+bool take_video_dirty(Computer* c, long* start, long* end);
+
+/* Makes an interrupt pending on computer $c if no other already is.
+   Otherwise, this does nothing and returns false (the interrupt is
+   counted as dropped by the latency statistics, see latency.h).
+   $type is the interrupt number while $keyval is the associated character.
+   Only c -> pending_interrupt, c -> host_event_ns and the queued
+   stamps are written (atomically), so any thread can call it without locking $c; a parked
+   computer is woken (see idle.h).
+   The CPU takes the interrupt at the end of the next basic block or
+   when run_steps() is next called, whichever comes first: at most the
+   rest of the running batch of instructions (CONTROLLER_BATCH in the
+   GUI), and at most the instructions up to the next JMP, BEQ or BNE.
+   Taking it delivers it with deliver_interrupt(), which ignores it if
+   the handler is still running. Every interrupt taken (even ignored
+   ones) is recorded if a recording was started with
+   start_interrupt_recording(). */
+bool raise_interrupt(Computer* c, char type, char keyval);
+
+/* raise_interrupt() for an interrupt caused by a host input event
+   received at $event_ns (see latency_clock_ns()): the time is attached
+   to the interrupt only if it becomes pending. */
+bool raise_host_interrupt(Computer* c, char type, char keyval, unsigned long long event_ns);
+
+#define INTERRUPT_PENDING 0x10000
+#define INTERRUPT_RESERVED 0x20000 // a raise_interrupt() call is filling the line
+
+/* Raises an interrupt line at once, on the thread running $c: used for
+   the interrupts of emulated devices (see mmio.h), which are raised
+   again when replaying, so they are neither recorded nor counted in
+   the latency statistics.
+   Returns false if another interrupt line is already raised. */
+bool deliver_interrupt(Computer* c, char type, char keyval);
 
 /* Stores a textual representation of the disassembly of 
    $instruction in the buffer $buf. We assume that $buf
@@ -110,6 +319,52 @@ int disassemble(int instruction, char* buf);
 /* Extracts a 16-bit literal value from a 32-bit input. */
 int32_t extract_literal(int32_t input);
 
+/* Fields of an instruction, as decoded by execute_step() and disassemble(). */
+typedef struct{
+
+    int opcode;
+    int rc, ra, rb;
+    int32_t literal;
+
+} Instruction;
+
+static inline Instruction decode(int32_t instruction){
+
+    Instruction d;
+    d.opcode = (instruction >> 26) & 0x3F;
+    d.rc = (instruction >> 21) & 0x1F;
+    d.ra = (instruction >> 16) & 0x1F;
+    d.rb = (instruction >> 11) & 0x1F;
+    d.literal = extract_literal(instruction);
+
+    return d;
+}
+
+enum{
+    INSTR_ALU,
+    INSTR_LOAD,   // LD, LDB, LDH, LDR reading program memory
+    INSTR_STORE,  // ST, STB, STH, LDR writing kernel memory
+    INSTR_ATOMIC, // SWAP, CAS: load and store
+    INSTR_BRANCH, // BEQ, BNE
+    INSTR_JUMP,   // JMP
+    INSTR_HALT,
+    INSTR_INVALID
+};
+
+/* Registers read and written by an instruction (R31 is never listed). */
+typedef struct{
+
+    int kind;
+    int nb_sources;
+    int sources[3];
+    int destination; // -1 if none
+
+} Operands;
+
+/* Classifies the instruction $d located at $pc in $c's memory, for the
+   timing models (see pipeline.h, cache.h). */
+Operands instruction_operands(Computer* c, Instruction d, long pc);
+
 /* Arithmetic right shift operation. */
 int arithmetic_right_shift(int x, int y);
 
@@ -0,0 +1,134 @@
+#include "framebuffer.h"
+#include <string.h>
+
+typedef void (*ConvertKernel)(const unsigned char* video, const uint32_t* palette,
+                              uint32_t* out, long n, uint32_t alpha);
+
+static void convert_rgb32(const unsigned char* video, const uint32_t* palette,
+                          uint32_t* out, long n, uint32_t alpha){
+
+    const uint32_t* in = (const uint32_t*) video;
+
+    (void) palette;
+
+    for(long i = 0; i < n; i++)
+        out[i] = (in[i] & 0xffffff) | alpha;
+}
+
+static void convert_rgb565(const unsigned char* video, const uint32_t* palette,
+                           uint32_t* out, long n, uint32_t alpha){
+
+    const uint16_t* in = (const uint16_t*) video;
+
+    (void) palette;
+
+    for(long i = 0; i < n; i++){
+
+        uint32_t r = in[i] >> 11, g = (in[i] >> 5) & 0x3f, b = in[i] & 0x1f;
+
+        // the high bits repeated in the low ones, so that white stays white
+        r = (r << 3) | (r >> 2);
+        g = (g << 2) | (g >> 4);
+        b = (b << 3) | (b >> 2);
+
+        out[i] = r | (g << 8) | (b << 16) | alpha;
+    }
+}
+
+static void convert_indexed8(const unsigned char* video, const uint32_t* palette,
+                             uint32_t* out, long n, uint32_t alpha){
+
+    for(long i = 0; i < n; i++)
+        out[i] = (palette[video[i]] & 0xffffff) | alpha;
+}
+
+static const ConvertKernel kernels[] = {
+    [VIDEO_RGB32] = convert_rgb32,
+    [VIDEO_RGB565] = convert_rgb565,
+    [VIDEO_INDEXED8] = convert_indexed8
+};
+
+// palette of kernel memories too small to hold one
+static const uint32_t black_palette[VIDEO_PALETTE_SZ];
+
+static const uint32_t* palette_of(Computer* c){
+
+    if(c->kernel_memory_size < KERNEL_PALETTE + 4 * VIDEO_PALETTE_SZ)
+        return black_palette;
+
+    return (const uint32_t*) (c->memory + c->program_memory_size + c->video_memory_size + KERNEL_PALETTE);
+}
+
+void convert_framebuffer(Computer* c, long first, long last, uint32_t* out, uint32_t alpha){
+
+    long area = (long) c->video_width * c->video_height;
+
+    if(last > area)
+        last = area;
+
+    if(first < 0 || first >= last)
+        return;
+
+    const unsigned char* video = c->memory + c->program_memory_size
+                                 + first * video_pixel_size(c->video_format);
+
+    kernels[c->video_format](video, palette_of(c), out, last - first, alpha);
+}
+
+void video_range_pixels(Computer* c, long start, long end, long* first, long* last){
+
+    long video_start = c->program_memory_size;
+    long video_end = video_start + c->video_memory_size;
+    int size = video_pixel_size(c->video_format);
+
+    if(start < video_start)
+        start = video_start;
+
+    if(end > video_end)
+        end = video_end;
+
+    if(start >= end){
+        *first = 0;
+        *last = 0;
+        return;
+    }
+
+    *first = (start - video_start) / size;
+    *last = (end - video_start + size - 1) / size;
+
+    if(*last > (long) c->video_width * c->video_height)
+        *last = (long) c->video_width * c->video_height;
+}
+
+bool palette_changed(Computer* c, uint32_t* palette){
+
+    const uint32_t* current = palette_of(c);
+
+    if(memcmp(palette, current, 4 * VIDEO_PALETTE_SZ) == 0)
+        return false;
+
+    memcpy(palette, current, 4 * VIDEO_PALETTE_SZ);
+
+    return c->video_format == VIDEO_INDEXED8;
+}
+
+bool parse_video_mode(const char* spec, int* width, int* height, int* format){
+
+    int consumed = 0;
+
+    if(sscanf(spec, "%dx%d%n", width, height, &consumed) != 2)
+        return false;
+
+    const char* name = spec + consumed;
+
+    if(*name == '\0' || strcmp(name, ":rgb32") == 0)
+        *format = VIDEO_RGB32;
+    else if(strcmp(name, ":rgb565") == 0)
+        *format = VIDEO_RGB565;
+    else if(strcmp(name, ":indexed8") == 0)
+        *format = VIDEO_INDEXED8;
+    else
+        return false;
+
+    return true;
+}
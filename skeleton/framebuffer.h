@@ -0,0 +1,39 @@
+#ifndef FRAMEBUFFER_H__
+#define FRAMEBUFFER_H__
+
+#include "emulator.h"
+#include <stdint.h>
+
+/* Conversion of the framebuffer (the video memory, in the mode set by
+   set_video_mode()) into 0x00BBGGRR words, one per pixel, for the
+   screen and the video export.
+
+   Each format has its own conversion kernel, a plain loop over a run of
+   pixels that the compiler vectorizes (a palette lookup for
+   VIDEO_INDEXED8): the format is dispatched once per run, never per
+   pixel. Callers hold whatever lock protects the Computer during the
+   call, once for all the pixels they convert.
+
+   Palette writes do not mark the video memory dirty (see
+   mark_video_dirty()): renderers keep a copy of the palette and check
+   it with palette_changed() before each update. */
+
+/* Converts the pixels [$first, $last[ of $c's framebuffer (row by row)
+   into out[0 .. $last - $first[, or-ing $alpha into every word. */
+void convert_framebuffer(Computer* c, long first, long last, uint32_t* out, uint32_t alpha);
+
+/* Stores in $first and $last the pixels covering the bytes [$start,
+   $end[ of $c's memory (empty if they are not in video memory). */
+void video_range_pixels(Computer* c, long start, long end, long* first, long* last);
+
+/* Compares $palette (VIDEO_PALETTE_SZ words) with $c's palette and
+   copies the latter into it. Returns true if it changed while $c is in
+   VIDEO_INDEXED8 mode: every pixel must then be converted again. */
+bool palette_changed(Computer* c, uint32_t* palette);
+
+/* Parses a video mode WIDTHxHEIGHT[:FORMAT], FORMAT being rgb32 (the
+   default), rgb565 or indexed8. Returns false if $spec is not one
+   (set_video_mode() checks the limits). */
+bool parse_video_mode(const char* spec, int* width, int* height, int* format);
+
+#endif
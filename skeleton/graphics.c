@@ -1,30 +1,58 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <gtk/gtk.h>
 #include <pthread.h>
-#include <sys/time.h>
 
 #include "emulator.h"
+#include "assembler.h"
+#include "replay.h"
+#include "latency.h"
+#include "keyboard_hle.h"
+#include "savestate.h"
+#include "history.h"
+#include "mmio.h"
+#include "write_log.h"
+#include "idle.h"
+#include "controller.h"
+#include "framebuffer.h"
+#include "renderer.h"
 
 #define MAX_PATH_LEN 4096
+#define WRITE_BATCH 4096 // write log records drained at once
+#define HIGHLIGHT_COLOR "#fff3a0" // memory words written since the previous refresh
 
 static GtkWidget* main_window = NULL;
 static char filename[MAX_PATH_LEN];
 static Computer computer;
-static bool computer_init = false;
+static bool computer_init = false; // only changed by the controller thread, with computer_mutex held
+static Controller controller;
+
+/* Is there a computer to display and control? */
+static inline bool has_computer(){
+
+    return __atomic_load_n(&computer_init, __ATOMIC_ACQUIRE);
+}
 static GtkWidget* code_view;
 static GtkListStore* code_store;
 static GtkWidget* memory_view;
 static GtkListStore* memory_store;
+static WriteCursor memory_cursor;
+static unsigned long long memory_written_at[8]; // last write into each word of the memory view
+static int memory_view_start = -1;
+static WriteRecord write_batch[WRITE_BATCH];
 static double temp_frequency;
-static double frequency = 1.0;
 
-static GdkPixbuf* pixels_buf = NULL;
+static Renderer renderer;
+static GdkTexture* screen_texture = NULL; // next frame to show, protected by screen_mutex
+static bool screen_swap_pending = false;  // protected by screen_mutex
+static pthread_mutex_t screen_mutex = PTHREAD_MUTEX_INITIALIZER;
 static GtkWidget* screen_window = NULL;
 static GtkWidget* canvas = NULL;
-static int screen_area;
-static int screen_width;
-static int screen_height;
+static int screen_width = 600; // video mode of the computers, see --video-mode
+static int screen_height = 400;
+static int screen_format = VIDEO_RGB32;
+static bool extended_isa = false; // see --extended-isa
 
 #define NB_REGS_STORES 3
 static int regs_store_index = 0;
@@ -37,23 +65,27 @@ static GtkWidget* address_search;
 static GtkWidget* address_button;
 static int selected_address = 0x0;
 
-static bool running = false;
-static bool open_blocked = false;
-static bool run_blocked = false;
-static bool run_paused = false;
-static bool stop_emulator = false;
 static bool first_open = true;
 static bool frequency_window_opened = false;
+static bool record_interrupts = false;
+static int keyboard_hle = KEYBOARD_HLE_OFF;
+static GtkWidget* latency_label = NULL; // NULL while the latency window is closed
 
 pthread_mutex_t computer_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t paused_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t frequency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// what controller_load() loads
+enum{
+    LOAD_PROGRAM,
+    LOAD_STATE
+};
 
 enum
 
 {
   MEMORY_TABLE_COL_ADDRESS = 0,
   MEMORY_TABLE_COL_VAL,
+  MEMORY_TABLE_COL_WRITTEN,
+  MEMORY_TABLE_COL_BACKGROUND,
   MEMORY_TABLE_NUM_COLS
 };
 
@@ -61,6 +93,8 @@ enum
 static GtkTreeModel* create_memory_model (void){
 
     GtkListStore *store = gtk_list_store_new (MEMORY_TABLE_NUM_COLS,
+                                              G_TYPE_STRING,
+                                              G_TYPE_STRING,
                                               G_TYPE_STRING,
                                               G_TYPE_STRING);
     memory_store = store;
@@ -72,6 +106,8 @@ static GtkTreeModel* create_memory_model (void){
       gtk_list_store_set (store, &iter,
                           MEMORY_TABLE_COL_ADDRESS, "",
                           MEMORY_TABLE_COL_VAL, "",
+                          MEMORY_TABLE_COL_WRITTEN, "",
+                          MEMORY_TABLE_COL_BACKGROUND, NULL,
                           -1);
     }
 
@@ -98,6 +134,16 @@ static GtkWidget* create_memory_view_and_model (void){
                                                "Value",  
                                                renderer,
                                                "text", MEMORY_TABLE_COL_VAL,
+                                               "cell-background", MEMORY_TABLE_COL_BACKGROUND,
+                                               NULL);
+
+  renderer = gtk_cell_renderer_text_new ();
+  gtk_tree_view_insert_column_with_attributes (GTK_TREE_VIEW (view),
+                                               -1,      
+                                               "Written at",  
+                                               renderer,
+                                               "text", MEMORY_TABLE_COL_WRITTEN,
+                                               "cell-background", MEMORY_TABLE_COL_BACKGROUND,
                                                NULL);
 
   GtkTreeModel *model = create_memory_model ();
@@ -252,11 +298,15 @@ static gboolean event_key_pressed (GtkWidget* widget,
                       GdkModifierType        state,
                       GtkEventControllerKey* event_controller){
     
-    if(keyval >= 128 || !computer_init)
+    if(keyval >= 128 || !has_computer())
         return TRUE;
     
+    unsigned long long event_ns = latency_clock_ns();
+    
+    // only keeps a load from replacing the computer meanwhile: the
+    // controller thread takes the interrupt at the end of a block
     pthread_mutex_lock(&computer_mutex);
-    raise_interrupt(&computer, 0, keyval);
+    raise_host_interrupt(&computer, INTERRUPT_KEY_PRESSED, keyval, event_ns);
     pthread_mutex_unlock(&computer_mutex);
     fprintf(stderr, "key pressed event %c %d %c %d\n", keyval, keyval, keycode, keycode);
     return TRUE;
@@ -268,20 +318,63 @@ static gboolean event_key_released (GtkWidget* widget,
                       GdkModifierType        state,
                       GtkEventControllerKey* event_controller){
     
-    if(keyval >= 128 || !computer_init)
+    if(keyval >= 128 || !has_computer())
         return FALSE;
     
+    unsigned long long event_ns = latency_clock_ns();
+    
     pthread_mutex_lock(&computer_mutex);
-    raise_interrupt(&computer, 1, keyval);
+    raise_host_interrupt(&computer, INTERRUPT_KEY_RELEASED, keyval, event_ns);
     pthread_mutex_unlock(&computer_mutex);
     fprintf(stderr, "key released event %c\n", keyval);
     return FALSE;
 }
 
+/* Starts following the guest writes from now on (see write_log.h). */
+static void enable_gui_write_log(){
+
+    if(enable_write_log(&computer, WRITE_LOG_DEFAULT_LOG2) == NULL)
+        return;
+
+    init_write_cursor(computer.write_log, &memory_cursor);
+    init_write_cursor(computer.write_log, &renderer.cursor); // with computer_mutex held
+    memory_view_start = -1;
+}
+
 void update_memory_state(){
 
     gtk_list_store_clear(memory_store);
     int start = selected_address;
+    bool written[8] = {false};
+    
+    if(start != memory_view_start){
+        memset(memory_written_at, 0, sizeof(memory_written_at));
+        memory_view_start = start;
+    }
+    
+    // words of the view written since the previous refresh
+    long n;
+    
+    pthread_mutex_lock(&computer_mutex);
+    
+    while(computer.write_log != NULL
+          && (n = drain_writes(computer.write_log, &memory_cursor, write_batch, WRITE_BATCH)) > 0){
+        
+        for(long i = 0; i < n; i++){
+            
+            long first = write_batch[i].address;
+            long last = first + write_batch[i].length;
+            
+            for(int w = 0; w < 8; w++){
+                if(first < start + 4 * w + 4 && last > start + 4 * w){
+                    written[w] = true;
+                    memory_written_at[w] = write_batch[i].retired;
+                }
+            }
+        }
+    }
+    
+    pthread_mutex_unlock(&computer_mutex);
     
     for(int addr = start; addr <= start + 28 ; addr += 4){
       
@@ -289,18 +382,26 @@ void update_memory_state(){
       int word = get_word(&computer, addr);
       pthread_mutex_unlock(&computer_mutex);
       
+      int w = (addr - start) / 4;
       char buf[10];
       char buf2[10];
-      char disassembly[512];
+      char buf3[24];
       
       sprintf(buf, "%.8x", addr);
       sprintf(buf2, "%.8x", word);
       
+      if(memory_written_at[w] > 0)
+          sprintf(buf3, "%llu", memory_written_at[w]);
+      else
+          buf3[0] = '\0';
+      
       GtkTreeIter iter;
       gtk_list_store_append (memory_store, &iter);
       gtk_list_store_set (memory_store, &iter,
                           MEMORY_TABLE_COL_ADDRESS, buf,
                           MEMORY_TABLE_COL_VAL, buf2,
+                          MEMORY_TABLE_COL_WRITTEN, buf3,
+                          MEMORY_TABLE_COL_BACKGROUND, written[w] ? HIGHLIGHT_COLOR : NULL,
                           -1);
     }
 }
@@ -366,74 +467,65 @@ void update_regs_state(){
     }
 }
 
-void init_screen(){
-
-    int n_channels = gdk_pixbuf_get_n_channels (pixels_buf);
-    int rowstride = gdk_pixbuf_get_rowstride (pixels_buf);
-    guchar* pixels = gdk_pixbuf_get_pixels (pixels_buf);
+/* Shows the latest frame published by the renderer, on the GUI thread. */
+static gboolean swap_screen_texture(){
     
-    int row_byte_length = screen_width * 4;
+    pthread_mutex_lock(&screen_mutex);
+    GdkTexture* texture = screen_texture;
+    screen_texture = NULL;
+    screen_swap_pending = false;
+    pthread_mutex_unlock(&screen_mutex);
     
-    for(int y = 0; y < screen_height; y++){
-        for(int x = 0; x < screen_width; x++){
-        
-            pthread_mutex_lock(&computer_mutex);
-            unsigned int pixel = get_word(&computer, 
-                                          computer.program_memory_size
-                                          + y * row_byte_length
-                                          + x * 4);
-            pthread_mutex_unlock(&computer_mutex);
-            
-            guchar* p = pixels + y * rowstride + x * n_channels;
-            p[0] = pixel & 0xff;
-            p[1] = (pixel >> 8) & 0xff;
-            p[2] = (pixel >> 16) & 0xff;
-        }
-    } 
+    if(texture != NULL){
+        gtk_picture_set_paintable((GtkPicture*) canvas, GDK_PAINTABLE(texture));
+        g_object_unref(texture);
+    }
     
-    gtk_picture_set_pixbuf((GtkPicture*) canvas, pixels_buf);
+    // the largest integer upscaling fitting in the window, for the next frames
+    int scale_x = gtk_widget_get_width(canvas) / screen_width;
+    int scale_y = gtk_widget_get_height(canvas) / screen_height;
+    set_render_scale(&renderer, scale_x < scale_y ? scale_x : scale_y);
+    
+    return FALSE;
 }
 
-void update_screen(){
+/* Publish callback of the renderer, runs on its thread: wraps the frame
+   into a texture and lets the GUI thread swap it in. */
+static void publish_screen(void* data, const uint32_t* pixels, int width, int height){
 
-    if(first_open)
-        return;
+    GBytes* bytes = g_bytes_new(pixels, (gsize) width * height * 4);
+    GdkTexture* texture = gdk_memory_texture_new(width, height, GDK_MEMORY_R8G8B8A8, 
+                                                 bytes, width * 4);
+    g_bytes_unref(bytes);
     
-    Computer* c = &computer;
-    pthread_mutex_lock(&computer_mutex);
+    pthread_mutex_lock(&screen_mutex);
     
-    if(c -> latest_accessed < c -> program_memory_size
-        || c -> latest_accessed >= c -> program_memory_size 
-                                   + c -> video_memory_size){
-        
-        pthread_mutex_unlock(&computer_mutex);
-        return;
-    }
-  
+    // a frame not shown yet is dropped
+    GdkTexture* dropped = screen_texture;
+    bool pending = screen_swap_pending;
+    screen_texture = texture;
+    screen_swap_pending = true;
     
-    unsigned int video_memory_offset = c-> program_memory_size;
-    unsigned int pixel_start = c -> latest_accessed 
-                               - (((c -> latest_accessed) 
-                                    - video_memory_offset)) % 4;
+    pthread_mutex_unlock(&screen_mutex);
     
-    unsigned int pixel = get_word(&computer, 
-                                  pixel_start);
+    if(dropped != NULL)
+        g_object_unref(dropped);
     
-    pthread_mutex_unlock(&computer_mutex);
-                                  
-    unsigned int x = ((pixel_start - video_memory_offset) / 4)  % screen_width;
-    unsigned int y = ((pixel_start - video_memory_offset) / 4)  / screen_width;
-   
-    int n_channels = gdk_pixbuf_get_n_channels (pixels_buf);
-    int rowstride = gdk_pixbuf_get_rowstride (pixels_buf);
-    guchar *pixels = gdk_pixbuf_get_pixels (pixels_buf);
-            
-    guchar *p = pixels + y * rowstride + x * n_channels;
-    p[0] = pixel & 0xff;
-    p[1] = (pixel >> 8) & 0xff;
-    p[2] = (pixel >> 16) & 0xff;
-     
-    gtk_picture_set_pixbuf((GtkPicture*) canvas, pixels_buf);
+    if(!pending)
+        g_idle_add((GSourceFunc) swap_screen_texture, NULL);
+}
+
+void init_screen(){
+
+    request_frame(&renderer, true);
+}
+
+void update_screen(){
+
+    if(first_open)
+        return;
+    
+    request_frame(&renderer, false);
 }
 
 
@@ -441,7 +533,7 @@ gboolean update_display_state(gpointer* par){
     
     bool do_screen = (bool) (void*) par;
     
-    if(!computer_init)
+    if(!has_computer())
         return FALSE;
         
     update_code_state();
@@ -456,7 +548,7 @@ gboolean update_display_state(gpointer* par){
 
 gboolean full_update_display_state(){
     
-    if(!computer_init)
+    if(!has_computer())
         return FALSE;
         
     update_code_state();
@@ -500,37 +592,100 @@ void make_responsive(GtkWidget* window){
 
 }
 
-void* open_thread(void *arg) {
+static bool file_exists(const char* path){
 
-    char* filename = (char*) arg;
-    FILE* fp = fopen(filename, "rb");
-            
+    FILE* fp = fopen(path, "r");
+    
     if(fp == NULL)
-        return NULL;
-        
-    while(running && !run_paused) ;
-    stop_emulator = false;
+        return false;
         
+    fclose(fp);
+    return true;
+}
+
+/* Sets up a fresh computer with the GUI's features, with computer_mutex held. */
+static void new_computer(){
+
     if(computer_init)
         free_computer(&computer);
     
     init_computer(&computer, PROGRAM_MEMORY_SZ, VIDEO_MEMORY_SZ, KERNEL_MEMORY_SZ);
+    set_video_mode(&computer, screen_width, screen_height, screen_format);
+    computer.extended_isa = extended_isa;
+    enable_latency_stats(&computer);
+    set_keyboard_hle(&computer, keyboard_hle);
+    enable_history(&computer, HISTORY_DEFAULT_INTERVAL, HISTORY_DEFAULT_BUDGET);
+    enable_default_devices(&computer);
+    enable_gui_write_log();
+    enable_idle_detection(&computer, true, IDLE_DEFAULT_RATE);
+    __atomic_store_n(&computer_init, true, __ATOMIC_RELEASE);
+}
+
+/* Load callback of the controller, runs on its thread. */
+static bool load_into_computer(void* data, const char* path, int kind){
+
+    if(kind == LOAD_STATE){
+        
+        pthread_mutex_lock(&computer_mutex);
+        
+        if(!computer_init)
+            new_computer();
+        
+        load_state(&computer, path);
+        pthread_mutex_unlock(&computer_mutex);
+        
+        g_idle_add((GSourceFunc) full_update_display_state, NULL);
+        return true;
+    }
+    
+    Assembly assembly;
+    FILE* fp = open_program(path, &assembly);
+            
+    if(fp == NULL){
+        free_assembly(&assembly);
+        return computer_init;
+    }
+    
+    pthread_mutex_lock(&computer_mutex);
+    new_computer();
     load(&computer, fp);
     fclose(fp);
+    free_assembly(&assembly);
+    
     fp = fopen("interrupt_handler.asm.bin", "rb");
+    
+    if(fp == NULL && file_exists("interrupt_handler.asm"))
+        fp = open_program("interrupt_handler.asm", &assembly);
+    
     load_interrupt_handler(&computer, fp);
-    computer_init = true;
     
-    init_screen();
-    g_idle_add((GSourceFunc) update_display_state, (gpointer) (void*) FALSE);
+    if(fp != NULL)
+        fclose(fp);
+        
+    free_assembly(&assembly);
     
-    open_blocked = false;
-    run_blocked = false;
+    if(record_interrupts){
+        
+        char record_path[MAX_PATH_LEN + 8];
+        snprintf(record_path, sizeof(record_path), "%s.irq", path);
+        
+        if(start_interrupt_recording(&computer, record_path))
+            fprintf(stderr, "recording keyboard interrupts into %s\n", record_path);
+    }
+    
+    pthread_mutex_unlock(&computer_mutex);
     
-    pthread_mutex_trylock(&paused_mutex);
-    pthread_mutex_unlock(&paused_mutex);
+    g_idle_add((GSourceFunc) full_update_display_state, NULL);
     
-    pthread_exit(NULL);
+    return true;
+}
+
+/* Refresh callback of the controller, runs on its thread. */
+static void refresh_display(void* data, bool stopped){
+
+    // the screen is rendered off the GUI thread
+    request_frame(&renderer, false);
+    g_idle_add((GSourceFunc) update_display_state, (gpointer) (void*) FALSE);
 }
 
 static void on_open_response (GtkDialog *dialog, int response){
@@ -543,16 +698,8 @@ static void on_open_response (GtkDialog *dialog, int response){
         strncpy(filename, name, MAX_PATH_LEN);
         g_free(name);
         
-        pthread_t thread;
-        open_blocked = true;
-        run_blocked = true;
-        
-        if(!first_open){
-            stop_emulator = true;
-        }
-        
         first_open = false;
-        pthread_create(&thread, NULL, open_thread, (void*) filename);
+        controller_load(&controller, filename, LOAD_PROGRAM);
     }
     
     if(response == GTK_RESPONSE_ACCEPT || response == GTK_RESPONSE_CANCEL)
@@ -562,7 +709,7 @@ static void on_open_response (GtkDialog *dialog, int response){
 
 static void open_file_selector(GtkWidget *widget, gpointer data){
     
-    if(open_blocked)
+    if(controller_state(&controller) == CONTROLLER_LOADING)
         return;
 
     GtkWidget* dialog;
@@ -579,177 +726,200 @@ static void open_file_selector(GtkWidget *widget, gpointer data){
     gtk_widget_show(dialog);
 }
 
-static inline unsigned long get_time_millis(){
-
-    struct timeval  tv;
-    gettimeofday(&tv, NULL);
-    double time_in_mill =  (tv.tv_sec) * 1000 + (tv.tv_usec) / 1000;
+static void on_state_response (GtkDialog *dialog, int response){
     
-    return time_in_mill;
-}
-
-void* execute_thread(void* arg){
+    bool saving = gtk_file_chooser_get_action(GTK_FILE_CHOOSER (dialog)) 
+                  == GTK_FILE_CHOOSER_ACTION_SAVE;
     
-    run_blocked = true;
-    int pc = computer.cpu.program_counter;
-    bool halted = false;
-    int program_size = computer.program_size;
-    char buf[1024];
-    running = true;
-    unsigned long prev_time = get_time_millis();
-    unsigned long now_time;
-    double f;
-    
-    while(!halted && (pc < program_size) 
-                     || ((pc > computer.program_memory_size
-                          + computer.video_memory_size)
-                        && (pc < computer.memory_size))){
-        
-    	if(run_paused){
-    	    
-    	    run_blocked = false;
-    	    pthread_mutex_lock(&paused_mutex);
-    	    run_blocked = true;
-    	    pthread_mutex_unlock(&paused_mutex);
-    	    run_paused = false;
-    	}
-    	
-    	if(stop_emulator) {
-    	    
-    	    stop_emulator = false;   
-    	    break;
-    	}
-        
-        pthread_mutex_lock(&computer_mutex);
-        int instruction = get_word(&computer, pc);
-        pthread_mutex_unlock(&computer_mutex);
-        
-        pthread_mutex_lock(&computer_mutex);
-        execute_step(&computer);
-        halted = computer.halted;
-        pc = computer.cpu.program_counter;
-        pthread_mutex_unlock(&computer_mutex);
-        
-        pthread_mutex_lock(&frequency_mutex);
-        f = frequency;
-        pthread_mutex_unlock(&frequency_mutex);
+    if (response == GTK_RESPONSE_ACCEPT){
+    
+        g_autoptr(GFile) file = gtk_file_chooser_get_file (GTK_FILE_CHOOSER (dialog));
+        char* name = g_file_get_path(file);
         
-        if(f < 0 || f > 10){
-            
-            now_time = get_time_millis();
-
-            if(now_time - prev_time > 100){
+        // saving happens between two instructions, even while running
+        if(saving){
             
-                prev_time = now_time;
-                g_idle_add((GSourceFunc) full_update_display_state, NULL);
-            }
+            pthread_mutex_lock(&computer_mutex);
+            save_state(&computer, name);
+            pthread_mutex_unlock(&computer_mutex);
         }
         
-        else
-            g_idle_add((GSourceFunc) update_display_state, (gpointer) (void*) TRUE);
-       
-
-        if(f > 0){
-            
-            int to_wait = 1000000 / f;
-            
-            if(to_wait > 800000){
-                
-                int us;
-                
-                do{
-                    
-                    us = (to_wait > 100000) ? 100000 : to_wait; 
-                    usleep(us);
-                    to_wait -= us;
-                    
-                    if(run_paused)
-                        continue;
-                    
-                    if(stop_emulator)
-                        break;
-                    
-                } while(to_wait > 0);
-            
-            }
+        else{
             
-            else
-            	usleep(to_wait);
+            first_open = false;
+            controller_load(&controller, name, LOAD_STATE);
         }
+        
+        g_free(name);
     }
     
-    if(f < 0 || f > 10)
-        g_idle_add((GSourceFunc) full_update_display_state, NULL);
-      
-    run_blocked = false;
-    running = false;
-    pthread_exit(NULL);
+    if(response == GTK_RESPONSE_ACCEPT || response == GTK_RESPONSE_CANCEL)
+        gtk_window_destroy (GTK_WINDOW (dialog));
 }
 
-void start_executing(GtkWidget *widget, gpointer data){
-
-    if(run_blocked || !computer_init)
-        return;
-        
-    if(run_paused){
+static void open_state_selector(GtkWidget *widget, gpointer data){
+    
+    bool saving = (bool) data;
     
-        pthread_mutex_unlock(&paused_mutex);
-        run_paused = false;
+    if(controller_state(&controller) == CONTROLLER_LOADING || (saving && !has_computer()))
         return;
-    }
 
-    pthread_t thread;
-    pthread_create(&thread, NULL, execute_thread, NULL);
+    GtkWidget* dialog;
+    dialog = gtk_file_chooser_dialog_new (saving ? "Save state" : "Load state",
+                                        GTK_WINDOW(main_window),
+                                        saving ? GTK_FILE_CHOOSER_ACTION_SAVE 
+                                               : GTK_FILE_CHOOSER_ACTION_OPEN,
+                                        "_Cancel",
+                                        GTK_RESPONSE_CANCEL,
+                                        saving ? "_Save" : "_Open",
+                                        GTK_RESPONSE_ACCEPT,
+                                        NULL);
+    
+    g_signal_connect (dialog, "response", G_CALLBACK (on_state_response), NULL);
+    gtk_widget_show(dialog);
+}
+
+void start_executing(GtkWidget *widget, gpointer data){
+
+    post_command(&controller, CONTROLLER_RUN);
 }
 
 void pause_execution(GtkWidget *widget, gpointer data){
     
-    static bool pausing = false;
-    
-    if(pausing || run_paused || !running)
-        return;
-    
-    pausing = true;
-    pthread_mutex_trylock(&paused_mutex);
-    run_paused = true;
-    pausing = false;  
+    post_command(&controller, CONTROLLER_PAUSE);
 }
 
 void reset_emulator(GtkWidget *widget, gpointer data){
     
     if(first_open)
         return;
-        
-    open_blocked = true;
-    run_blocked = true;
-    stop_emulator = true;
-    pthread_mutex_trylock(&paused_mutex);
-    pthread_mutex_unlock(&paused_mutex);
-    run_paused = false;
     
-    pthread_t thread;
-    pthread_create(&thread, NULL, open_thread, (void*) filename);
+    controller_load(&controller, filename, LOAD_PROGRAM);
 }
 
 void single_step(GtkWidget *widget, gpointer data){
 
-    if(!computer_init)
+    post_command(&controller, CONTROLLER_STEP);
+}
+
+void step_back(GtkWidget *widget, gpointer data){
+
+    if(!has_computer() || computer.history == NULL)
         return;
     
-    int pc = computer.cpu.program_counter;
-    bool halted = computer.halted;
+    controller_pause(&controller);
+    
+    pthread_mutex_lock(&computer_mutex);
+    reverse_step(&computer);
+    pthread_mutex_unlock(&computer_mutex);
+    
+    full_update_display_state();
+}
+
+/* Goes back to the last store into the word typed in the address field,
+   or to the oldest state in the history if the field is empty. */
+void reverse_execution(GtkWidget *widget, gpointer data){
+
+    if(!has_computer() || computer.history == NULL)
+        return;
+    
+    GtkEntryBuffer* buffer = gtk_entry_get_buffer((GtkEntry*) address_search);
+    const char* text = gtk_entry_buffer_get_text(buffer);
+    long addr = text[0] != '\0' ? strtol(text, NULL, 16) : -1;
+    
+    controller_pause(&controller);
+    
+    pthread_mutex_lock(&computer_mutex);
+    
+    if(addr >= 0)
+        reverse_continue(&computer, stop_at_write, &addr);
+    else
+        history_seek(&computer, history_start(&computer));
+    
+    pthread_mutex_unlock(&computer_mutex);
+    
+    full_update_display_state();
+}
+
+void toggle_recording(GtkWidget *widget, gpointer data){
+    
+    record_interrupts = gtk_toggle_button_get_active((GtkToggleButton*) widget);
+    
+    // a recording can only be replayed from the start of the program,
+    // so it begins with a reset
+    if(record_interrupts){
         
-    if(!halted && (pc < computer.program_size) 
-                     || ((pc > computer.program_memory_size
-                          + computer.video_memory_size)
-                        && (pc < computer.memory_size))){
-
-        pause_execution(NULL, NULL);
-        execute_step(&computer);
-        g_idle_add((GSourceFunc) update_display_state, (gpointer) (void*) TRUE);
+        if(!first_open)
+            reset_emulator(NULL, NULL);
+    }
+    
+    else if(has_computer()){
+        
+        pthread_mutex_lock(&computer_mutex);
+        stop_interrupt_recording(&computer);
+        pthread_mutex_unlock(&computer_mutex);
     }
 }
 
+void toggle_keyboard_hle(GtkWidget *widget, gpointer data){
+    
+    keyboard_hle = gtk_toggle_button_get_active((GtkToggleButton*) widget) 
+                   ? KEYBOARD_HLE_ON : KEYBOARD_HLE_OFF;
+    
+    if(!has_computer())
+        return;
+    
+    pthread_mutex_lock(&computer_mutex);
+    set_keyboard_hle(&computer, keyboard_hle);
+    pthread_mutex_unlock(&computer_mutex);
+}
+
+gboolean update_latency_window(gpointer data){
+    
+    char buf[2048];
+    
+    if(latency_label == NULL)
+        return FALSE;
+    
+    buf[0] = '\0';
+    pthread_mutex_lock(&computer_mutex);
+    
+    if(computer_init && computer.latency != NULL)
+        format_latency_stats(computer.latency, buf, sizeof(buf));
+    
+    pthread_mutex_unlock(&computer_mutex);
+    
+    gtk_label_set_text((GtkLabel*) latency_label, buf);
+    
+    return TRUE;
+}
+
+void close_latency(GtkWidget *widget, gpointer data){
+    
+    latency_label = NULL;
+}
+
+void open_latency_window(GtkWidget *widget, gpointer data){
+    
+    if(latency_label != NULL)
+        return;
+    
+    GtkWidget* window = gtk_window_new();
+    gtk_window_set_title (GTK_WINDOW (window), "Interrupt latency");
+    
+    latency_label = gtk_label_new("");
+    gtk_label_set_selectable((GtkLabel*) latency_label, TRUE);
+    gtk_widget_add_css_class(latency_label, "monospace");
+    gtk_window_set_child (GTK_WINDOW (window), latency_label);
+    g_signal_connect(latency_label, "destroy", G_CALLBACK (close_latency), NULL);
+    
+    update_latency_window(NULL);
+    g_timeout_add(500, (GSourceFunc) update_latency_window, NULL);
+    
+    make_responsive(window);
+    gtk_widget_show(window);
+}
+
 void close_frequency(GtkWidget *widget, gpointer data){
     
     frequency_window_opened = false;
@@ -769,10 +939,8 @@ void set_temp_frequency(GtkWidget *widget, gpointer data){
 
 void set_frequency(GtkWidget *widget, gpointer data){
     
-    pthread_mutex_lock(&frequency_mutex);
-    frequency = temp_frequency;
+    set_controller_frequency(&controller, temp_frequency);
     full_update_display_state();
-    pthread_mutex_unlock(&frequency_mutex);
     
     frequency_window_opened = false;
     gtk_window_destroy (GTK_WINDOW (data));
@@ -788,7 +956,7 @@ void open_frequency_window(GtkWidget *widget, gpointer data){
         return;
           
     frequency_window_opened = true;
-    temp_frequency = frequency;
+    temp_frequency = controller_frequency(&controller);
     
     window = gtk_window_new();
     gtk_window_set_title (GTK_WINDOW (window), "Choose a CPU frequency");
@@ -839,24 +1007,20 @@ void open_drawing_window(GtkWidget *widget, gpointer data){
 
     GtkWidget *window;
     
-    screen_area = VIDEO_MEMORY_SZ / 4;
-    screen_height = sqrt((screen_area * 2.0) / 3.0);
-    screen_width = screen_area / screen_height;
-    
     window = gtk_window_new();
     screen_window = window;
     gtk_window_set_title (GTK_WINDOW (window), "Screen");
     gtk_window_set_deletable(GTK_WINDOW (window), FALSE);
-    pixels_buf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, 
-                                FALSE, 8, 
-                                screen_width, screen_height);
     
-    
-    canvas = gtk_picture_new_for_pixbuf(pixels_buf);
+    // the frames are textures published by the renderer
+    canvas = gtk_picture_new();
     update_screen();
-    //gtk_picture_set_pixbuf((GtkPicture*) canvas, pixels_buf);
     gtk_window_set_child (GTK_WINDOW (window), canvas);
-    gtk_widget_set_size_request(canvas, screen_width, screen_height);
+    
+    // large framebuffers start reduced to fit 1200x800
+    int shrink = (screen_width + 1199) / 1200 > (screen_height + 799) / 800
+               ? (screen_width + 1199) / 1200 : (screen_height + 799) / 800;
+    gtk_widget_set_size_request(canvas, screen_width / shrink, screen_height / shrink);
     make_responsive(window);
     gtk_widget_show(window);
 }
@@ -866,7 +1030,8 @@ static void activate(GtkApplication *app, gpointer user_data){
     GtkWidget *window, *file_button, *box1, *box2, *grid, *hbox;
     GtkWidget *hbox2, *action_box, *action_bar, *run_button;
     GtkWidget *vbox, *pause_button, *regs_table, *step_button;
-    GtkWidget *reset_button, *frequency_button;
+    GtkWidget *reset_button, *frequency_button, *record_button, *latency_button;
+    GtkWidget *hle_button, *save_button, *load_button, *back_button, *reverse_button;
 
     window = gtk_application_window_new (app);
     main_window = window;
@@ -903,9 +1068,16 @@ static void activate(GtkApplication *app, gpointer user_data){
     action_bar = gtk_action_bar_new();
     run_button = gtk_button_new_with_label("Run");
     step_button = gtk_button_new_with_label ("Single\n  step");
+    back_button = gtk_button_new_with_label ("Step\nback");
+    reverse_button = gtk_button_new_with_label ("Reverse");
     pause_button = gtk_button_new_with_label("Pause");
     reset_button = gtk_button_new_with_label("Reset");
     frequency_button = gtk_button_new_with_label ("       Set\nfrequency");
+    record_button = gtk_toggle_button_new_with_label ("Record\n  keys");
+    latency_button = gtk_button_new_with_label ("Latency");
+    hle_button = gtk_toggle_button_new_with_label ("Native\n  keys");
+    save_button = gtk_button_new_with_label ("Save\nstate");
+    load_button = gtk_button_new_with_label ("Load\nstate");
     
     gtk_window_set_child (GTK_WINDOW (window),vbox);
     
@@ -913,15 +1085,29 @@ static void activate(GtkApplication *app, gpointer user_data){
     gtk_action_bar_pack_start((GtkActionBar*) action_bar, reset_button);
     gtk_action_bar_pack_start((GtkActionBar*) action_bar, run_button);
     gtk_action_bar_pack_start((GtkActionBar*) action_bar, step_button);
+    gtk_action_bar_pack_start((GtkActionBar*) action_bar, back_button);
+    gtk_action_bar_pack_start((GtkActionBar*) action_bar, reverse_button);
     gtk_action_bar_pack_start((GtkActionBar*) action_bar, pause_button);
     gtk_action_bar_pack_start((GtkActionBar*) action_bar, frequency_button);
+    gtk_action_bar_pack_start((GtkActionBar*) action_bar, record_button);
+    gtk_action_bar_pack_start((GtkActionBar*) action_bar, latency_button);
+    gtk_action_bar_pack_start((GtkActionBar*) action_bar, hle_button);
+    gtk_action_bar_pack_start((GtkActionBar*) action_bar, save_button);
+    gtk_action_bar_pack_start((GtkActionBar*) action_bar, load_button);
 
     g_signal_connect (run_button, "clicked", G_CALLBACK (start_executing), NULL);
     g_signal_connect (step_button, "clicked", G_CALLBACK (single_step), NULL);
+    g_signal_connect (back_button, "clicked", G_CALLBACK (step_back), NULL);
+    g_signal_connect (reverse_button, "clicked", G_CALLBACK (reverse_execution), NULL);
     g_signal_connect (file_button, "clicked", G_CALLBACK (open_file_selector), NULL);
     g_signal_connect (pause_button, "clicked", G_CALLBACK (pause_execution), NULL);
     g_signal_connect (reset_button, "clicked", G_CALLBACK (reset_emulator), NULL);
     g_signal_connect (frequency_button, "clicked", G_CALLBACK (open_frequency_window), NULL);
+    g_signal_connect (record_button, "toggled", G_CALLBACK (toggle_recording), NULL);
+    g_signal_connect (latency_button, "clicked", G_CALLBACK (open_latency_window), NULL);
+    g_signal_connect (hle_button, "toggled", G_CALLBACK (toggle_keyboard_hle), NULL);
+    g_signal_connect (save_button, "clicked", G_CALLBACK (open_state_selector), (gpointer) TRUE);
+    g_signal_connect (load_button, "clicked", G_CALLBACK (open_state_selector), (gpointer) FALSE);
     g_signal_connect (address_button, "clicked", G_CALLBACK (update_memory_address), NULL);
     
     code_view = create_code_view_and_model ();
@@ -972,11 +1158,52 @@ int main(int argc, char **argv){
 
     GtkApplication *app;
     int status;
+    
+    // --video-mode and --extended-isa are ours, the other arguments are GTK's
+    for(int i = 1; i < argc; i++){
+        
+        if(strcmp(argv[i], "--extended-isa") == 0){
+            extended_isa = true;
+            memmove(argv + i, argv + i + 1, (argc - i) * sizeof(char*));
+            argc--;
+            i--;
+            continue;
+        }
+        
+        if(strcmp(argv[i], "--video-mode") != 0 || i + 1 == argc)
+            continue;
+        
+        int width, height, format;
+        
+        if(!parse_video_mode(argv[i + 1], &width, &height, &format)
+           || width < 1 || width > VIDEO_MAX_WIDTH || height < 1 || height > VIDEO_MAX_HEIGHT){
+            fprintf(stderr, "Error: --video-mode expects WIDTHxHEIGHT[:rgb32|rgb565|indexed8], "
+                            "up to %dx%d\n", VIDEO_MAX_WIDTH, VIDEO_MAX_HEIGHT);
+            return 1;
+        }
+        
+        screen_width = width;
+        screen_height = height;
+        screen_format = format;
+        
+        memmove(argv + i, argv + i + 2, (argc - i - 1) * sizeof(char*));
+        argc -= 2;
+        i--;
+    }
 
     app = gtk_application_new ("be.uliege.emulator", G_APPLICATION_DEFAULT_FLAGS);
     g_signal_connect (app, "activate", G_CALLBACK (activate), NULL);
+    start_renderer(&renderer, &computer, &computer_mutex, screen_width, screen_height,
+                   publish_screen, NULL);
+    start_controller(&controller, &computer, &computer_mutex, 1.0,
+                     load_into_computer, refresh_display, NULL);
     status = g_application_run (G_APPLICATION (app), argc, argv);
     g_object_unref (app);
+    stop_controller(&controller);
+    stop_renderer(&renderer);
+    
+    if(screen_texture != NULL)
+        g_object_unref(screen_texture);
     
     if(computer_init)
         free_computer(&computer);
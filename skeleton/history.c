@@ -0,0 +1,460 @@
+#include "history.h"
+#include "latency.h"
+#include "keyboard_hle.h"
+#include "idle.h"
+#include "mmio.h"
+#include <stdint.h>
+#include <string.h>
+
+// a log entry is: address (8 bytes), length (4), saved bytes, length (4)
+#define ENTRY_HEADER 12
+#define ENTRY_OVERHEAD 16
+
+static inline Checkpoint* checkpoint_at(History* h, int i){
+
+    return &h->checkpoints[(h->first + i) % h->capacity];
+}
+
+static void ring_read(History* h, unsigned long long pos, void* dst, long len){
+
+    long offset = pos % h->log_capacity;
+    long first = len < h->log_capacity - offset ? len : h->log_capacity - offset;
+
+    memcpy(dst, h->log + offset, first);
+    memcpy((unsigned char*) dst + first, h->log, len - first);
+}
+
+static void ring_write(History* h, unsigned long long pos, const void* src, long len){
+
+    long offset = pos % h->log_capacity;
+    long first = len < h->log_capacity - offset ? len : h->log_capacity - offset;
+
+    memcpy(h->log + offset, src, first);
+    memcpy(h->log, (const unsigned char*) src + first, len - first);
+}
+
+/* Exchanges the $len bytes at log position $pos with $mem. */
+static void ring_swap(History* h, unsigned long long pos, unsigned char* mem, long len){
+
+    unsigned char tmp[256];
+
+    while(len > 0){
+        long n = len < (long) sizeof(tmp) ? len : (long) sizeof(tmp);
+        ring_read(h, pos, tmp, n);
+        ring_write(h, pos, mem, n);
+        memcpy(mem, tmp, n);
+        pos += n;
+        mem += n;
+        len -= n;
+    }
+}
+
+static void drop_oldest(History* h){
+
+    h->first = (h->first + 1) % h->capacity;
+    h->count--;
+    h->log_tail = h->count > 0 ? checkpoint_at(h, 0)->log_pos : h->log_head;
+}
+
+/* Appends an entry saving $old (the $len bytes at $addr) to the main log. */
+static void append(Computer* c, long addr, long len, const unsigned char* old){
+
+    History* h = c->history;
+    unsigned long long need = len + ENTRY_OVERHEAD;
+    int64_t addr64 = addr;
+    uint32_t len32 = len;
+
+    while(h->count > 0 && h->log_head + need - h->log_tail > (unsigned long long) h->log_capacity)
+        drop_oldest(h);
+
+    // nothing left to go back to, start again from the next instruction
+    if(h->count == 0){
+        h->log_tail = h->log_head;
+        h->mem_pos = h->log_head;
+        h->next_checkpoint = c->retired;
+        return;
+    }
+
+    ring_write(h, h->log_head, &addr64, 8);
+    ring_write(h, h->log_head + 8, &len32, 4);
+    ring_write(h, h->log_head + ENTRY_HEADER, old, len);
+    ring_write(h, h->log_head + ENTRY_HEADER + len, &len32, 4);
+    h->log_head += need;
+    h->mem_pos = h->log_head;
+}
+
+static void scratch_append(History* h, long addr, long len, const unsigned char* old){
+
+    int64_t addr64 = addr;
+    uint32_t len32 = len;
+
+    if(h->scratch_len + len + ENTRY_OVERHEAD > h->scratch_capacity){
+        h->scratch_capacity = 2 * (h->scratch_len + len + ENTRY_OVERHEAD);
+        h->scratch = realloc(h->scratch, h->scratch_capacity);
+    }
+
+    unsigned char* p = h->scratch + h->scratch_len;
+    memcpy(p, &addr64, 8);
+    memcpy(p + 8, &len32, 4);
+    memcpy(p + ENTRY_HEADER, old, len);
+    memcpy(p + ENTRY_HEADER + len, &len32, 4);
+    h->scratch_len += len + ENTRY_OVERHEAD;
+}
+
+/* Restores the memory the re-executed instructions overwrote. */
+static void undo_scratch(Computer* c){
+
+    History* h = c->history;
+
+    while(h->scratch_len > 0){
+
+        int64_t addr;
+        uint32_t len;
+
+        memcpy(&len, h->scratch + h->scratch_len - 4, 4);
+        h->scratch_len -= len + ENTRY_OVERHEAD;
+        memcpy(&addr, h->scratch + h->scratch_len, 8);
+        memcpy(c->memory + addr, h->scratch + h->scratch_len + ENTRY_HEADER, len);
+        mark_video_dirty(c, addr, addr + len);
+    }
+}
+
+/* Walks the main log from mem_pos to $pos, swapping each entry with
+   memory: backwards it undoes the writes, forwards it redoes them. */
+static void move_memory(Computer* c, unsigned long long pos){
+
+    History* h = c->history;
+    int64_t addr;
+    uint32_t len;
+
+    while(h->mem_pos > pos){
+        ring_read(h, h->mem_pos - 4, &len, 4);
+        h->mem_pos -= len + ENTRY_OVERHEAD;
+        ring_read(h, h->mem_pos, &addr, 8);
+        ring_swap(h, h->mem_pos + ENTRY_HEADER, c->memory + addr, len);
+        mark_video_dirty(c, addr, addr + len);
+    }
+
+    while(h->mem_pos < pos){
+        ring_read(h, h->mem_pos, &addr, 8);
+        ring_read(h, h->mem_pos + 8, &len, 4);
+        ring_swap(h, h->mem_pos + ENTRY_HEADER, c->memory + addr, len);
+        mark_video_dirty(c, addr, addr + len);
+        h->mem_pos += len + ENTRY_OVERHEAD;
+    }
+}
+
+void enable_history(Computer* c, long interval, long budget){
+
+    disable_history(c);
+
+    History* h = calloc(1, sizeof(History));
+
+    h->log_capacity = budget;
+    h->log = malloc(budget);
+    h->capacity = budget / 16 / sizeof(Checkpoint);
+
+    if(h->capacity < 16)
+        h->capacity = 16;
+
+    h->checkpoints = malloc(h->capacity * sizeof(Checkpoint));
+    h->interval = interval > 0 ? interval : HISTORY_DEFAULT_INTERVAL;
+
+    c->history = h;
+    history_checkpoint(c);
+}
+
+void disable_history(Computer* c){
+
+    if(c->history == NULL)
+        return;
+
+    free(c->history->log);
+    free(c->history->checkpoints);
+    free(c->history->device_states);
+    free(c->history->scratch);
+    free(c->history);
+    c->history = NULL;
+}
+
+void reset_history(Computer* c){
+
+    History* h = c->history;
+
+    if(h == NULL)
+        return;
+
+    h->count = 0;
+    h->first = 0;
+    h->log_head = h->log_tail = h->mem_pos = 0;
+    h->parked = false;
+    h->replaying = false;
+    h->scratch_len = 0;
+    history_checkpoint(c);
+}
+
+/* Device state of the checkpoint $cp. */
+static inline unsigned char* device_state(History* h, Checkpoint* cp){
+
+    return h->device_states + (cp - h->checkpoints) * h->device_state_size;
+}
+
+void history_write(Computer* c, long addr, long len){
+
+    History* h = c->history;
+
+    if(addr < 0){
+        len += addr;
+        addr = 0;
+    }
+
+    if(addr + len > c->memory_size)
+        len = c->memory_size - addr;
+
+    if(len <= 0)
+        return;
+
+    if(h->replaying){
+        scratch_append(h, addr, len, c->memory + addr);
+        return;
+    }
+
+    history_resume(c);
+    append(c, addr, len, c->memory + addr);
+}
+
+void history_checkpoint(Computer* c){
+
+    History* h = c->history;
+
+    if(h->replaying)
+        return;
+
+    history_resume(c);
+
+    if(h->count == h->capacity)
+        drop_oldest(h);
+
+    // the devices only change when the history is reset (see map_device())
+    if(h->count == 0 && bus_state_size(c) != h->device_state_size){
+        h->device_state_size = bus_state_size(c);
+        free(h->device_states);
+        h->device_states = malloc(h->capacity * h->device_state_size);
+    }
+
+    Checkpoint* cp = checkpoint_at(h, h->count++);
+
+    cp->retired = c->retired;
+    cp->log_pos = h->log_head;
+    cp->pc = c->cpu.program_counter;
+    memcpy(cp->registers, c->cpu.registers, sizeof(cp->registers));
+    cp->backup = c->cpu.backup;
+    cp->latest_accessed = c->latest_accessed;
+    cp->halted = c->halted;
+    cp->interrupt_raised = c->interrupt_raised;
+    cp->interrupt_type = c->interrupt_type;
+    cp->interrupt_keyval = c->interrupt_keyval;
+    cp->block_cycles = c->block_cycles;
+    save_bus_state(c, device_state(h, cp));
+
+    h->next_checkpoint = c->retired + h->interval;
+}
+
+void history_resume(Computer* c){
+
+    History* h = c->history;
+
+    if(!h->parked || h->replaying)
+        return;
+
+    // the recorded future of the base checkpoint is abandoned, the undo
+    // entries of the instructions re-executed since then replace it
+    Checkpoint* base = checkpoint_at(h, h->base);
+
+    h->parked = false;
+    h->log_head = h->mem_pos;
+    h->count = h->base + 1;
+    h->next_checkpoint = base->retired + h->interval;
+
+    for(long pos = 0; pos < h->scratch_len; ){
+
+        int64_t addr;
+        uint32_t len;
+
+        memcpy(&addr, h->scratch + pos, 8);
+        memcpy(&len, h->scratch + pos + 8, 4);
+        append(c, addr, len, h->scratch + pos + ENTRY_HEADER);
+        pos += len + ENTRY_OVERHEAD;
+    }
+
+    h->scratch_len = 0;
+}
+
+unsigned long long history_start(Computer* c){
+
+    History* h = c->history;
+
+    return h->count > 0 ? checkpoint_at(h, 0)->retired : c->retired;
+}
+
+/* Most recent instruction count recorded in the history. */
+static unsigned long long history_end(Computer* c){
+
+    return c->history->parked ? c->history->newest : c->retired;
+}
+
+bool history_seek(Computer* c, unsigned long long target){
+
+    History* h = c->history;
+    int k = h->count - 1;
+
+    if(target > history_end(c))
+        return false;
+
+    forget_idle_loop(c);
+
+    while(k >= 0 && checkpoint_at(h, k)->retired > target)
+        k--;
+
+    if(k < 0)
+        return false;
+
+    if(!h->parked)
+        h->newest = c->retired;
+
+    Checkpoint* cp = checkpoint_at(h, k);
+
+    undo_scratch(c);
+    move_memory(c, cp->log_pos);
+
+    c->retired = cp->retired;
+    c->cpu.program_counter = cp->pc;
+    memcpy(c->cpu.registers, cp->registers, sizeof(cp->registers));
+    c->cpu.backup = cp->backup;
+    c->latest_accessed = cp->latest_accessed;
+    c->halted = cp->halted;
+    c->interrupt_raised = cp->interrupt_raised;
+    c->interrupt_type = cp->interrupt_type;
+    c->interrupt_keyval = cp->interrupt_keyval;
+    c->block_cycles = cp->block_cycles;
+    restore_bus_state(c, device_state(h, cp));
+
+    if(c->hle_check != NULL)
+        c->hle_check->pending = false;
+
+    if(c->latency != NULL)
+        c->latency->stage = LATENCY_IDLE;
+
+    h->parked = true;
+    h->base = k;
+    h->next_checkpoint = ~0ULL;
+
+    // no interrupt was raised between the checkpoint and $target
+    h->replaying = true;
+
+    while(c->retired < target && run_steps(c, target - c->retired) > 0)
+        ;
+
+    h->replaying = false;
+
+    return c->retired == target;
+}
+
+bool reverse_step(Computer* c){
+
+    return c->retired > history_start(c) && history_seek(c, c->retired - 1);
+}
+
+bool reverse_continue(Computer* c, bool (*stop)(Computer* c, void* arg), void* arg){
+
+    History* h = c->history;
+    unsigned long long end = c->retired;
+
+    // scan the segments between checkpoints from the most recent one,
+    // re-executing each of them to find the last stop before $end
+    for(int k = h->count - 1; k >= 0; k--){
+
+        unsigned long long start = checkpoint_at(h, k)->retired;
+
+        if(start >= end)
+            continue;
+
+        history_seek(c, start);
+
+        bool found = false;
+        unsigned long long hit = 0;
+
+        h->replaying = true;
+
+        while(c->retired < end){
+
+            if(stop(c, arg)){
+                found = true;
+                hit = c->retired;
+            }
+
+            if(run_steps(c, 1) == 0)
+                break;
+        }
+
+        h->replaying = false;
+
+        if(found)
+            return history_seek(c, hit);
+
+        end = start;
+    }
+
+    history_seek(c, history_start(c));
+
+    return false;
+}
+
+bool stop_at_pc(Computer* c, void* arg){
+
+    return c->cpu.program_counter == *(long*) arg;
+}
+
+bool stop_at_write(Computer* c, void* arg){
+
+    long pc = c->cpu.program_counter;
+
+    if(pc < 0 || pc + 4 > c->memory_size)
+        return false;
+
+    int32_t instruction;
+    memcpy(&instruction, c->memory + pc, 4);
+
+    int opcode = (instruction >> 26) & 0x3F;
+    int literal = extract_literal(instruction);
+    long addr;
+    int size = 4;
+
+    if(opcode == 0x19) // ST
+        addr = (long) get_register(c, (instruction >> 16) & 0x1F) + literal;
+    else if(c->extended_isa && (opcode == 0x11 || opcode == 0x13)){ // STB, STH
+        addr = (long) get_register(c, (instruction >> 16) & 0x1F) + literal;
+        size = opcode == 0x11 ? 1 : 2;
+    }
+    else if(c->extended_isa && (opcode == 0x14 || opcode == 0x15)){ // FILL, COPY: the next chunk
+        long count = get_register(c, (instruction >> 11) & 0x1F);
+        addr = get_register(c, (instruction >> (opcode == 0x14 ? 16 : 21)) & 0x1F);
+        size = 4 * (count < BLOCK_CHUNK_WORDS ? count : BLOCK_CHUNK_WORDS);
+    }
+    else if(c->extended_isa && opcode == 0x1A) // SWAP
+        addr = (long) get_register(c, (instruction >> 16) & 0x1F) + literal;
+    else if(c->extended_isa && opcode == 0x1C){ // CAS: writes only if the comparison succeeds
+        addr = get_register(c, (instruction >> 16) & 0x1F);
+        if(addr < 0 || addr + 4 > c->memory_size
+           || get_word(c, addr) != get_register(c, (instruction >> 21) & 0x1F))
+            return false;
+    }
+    else if(opcode == 0x1F && pc + 4 + 4 * literal > c->program_memory_size + c->video_memory_size)
+        addr = pc + 4 + 4 * literal; // LDR into kernel memory stores
+    else
+        return false;
+
+    long watched = *(long*) arg;
+
+    return addr < watched + 4 && watched < addr + size;
+}
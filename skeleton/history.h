@@ -0,0 +1,121 @@
+#ifndef HISTORY_H__
+#define HISTORY_H__
+
+#include "emulator.h"
+
+/* Execution history for reverse debugging.
+
+   While enabled, run_steps() takes a checkpoint of the CPU and device
+   state (no memory, see mmio.h) every $interval instructions and after
+   every accepted interrupt, and every guest memory write first appends the bytes it
+   overwrites to a bounded undo log. Seeking to an earlier instruction
+   count restores the memory of the nearest checkpoint by walking the log
+   (entries are swapped with memory, so the same log also replays
+   forward), restores its registers, then re-executes the few remaining
+   instructions. Since a checkpoint follows every interrupt, that
+   re-execution never has to raise one, except those of the devices,
+   which come back from their restored state.
+
+   After a seek the computer is "parked" in the past: seeking again can
+   go anywhere in the history, including back to the newest instruction.
+   Resuming normal execution (run_steps(), deliver_interrupt()) abandons
+   the recorded future.
+
+   When the log exceeds its budget, the oldest checkpoints are dropped. */
+
+#define HISTORY_DEFAULT_INTERVAL 100000
+#define HISTORY_DEFAULT_BUDGET (64L * 1024 * 1024)
+
+typedef struct{
+
+    unsigned long long retired;
+    unsigned long long log_pos; // log position when the checkpoint was taken
+    long pc;
+    int registers[32];
+    int backup;
+    long latest_accessed;
+    bool halted;
+    bool interrupt_raised;
+    char interrupt_type;
+    char interrupt_keyval;
+    unsigned long long block_cycles; // read by the cycle counter (see mmio.h)
+
+} Checkpoint;
+
+typedef struct History{
+
+    // undo log, a ring buffer addressed by ever-increasing positions
+    unsigned char* log;
+    long log_capacity;
+    unsigned long long log_head; // where the next entry goes
+    unsigned long long log_tail; // oldest byte still needed
+    unsigned long long mem_pos;  // log position matching the memory contents
+
+    Checkpoint* checkpoints; // ring, oldest first
+    unsigned char* device_states; // parallel to checkpoints, device_state_size bytes each
+    size_t device_state_size;     // bus_state_size() when the history was reset (see mmio.h)
+    int capacity;
+    int first;
+    int count;
+
+    long interval;
+    unsigned long long next_checkpoint; // retired count of the next periodic checkpoint
+
+    bool parked;    // a seek moved the computer into the past
+    bool replaying; // a seek is re-executing instructions
+    int base;       // checkpoint the parked state was rebuilt from
+    unsigned long long newest; // retired count before the first seek
+
+    // undo log of the instructions re-executed since $base (linear)
+    unsigned char* scratch;
+    long scratch_len;
+    long scratch_capacity;
+
+} History;
+
+/* Starts recording $c's history from its current state, with a
+   checkpoint every $interval instructions and about $budget bytes of
+   undo log (checkpoints use another 1/16th of it). */
+void enable_history(Computer* c, long interval, long budget);
+
+/* Stops recording and frees $c's history. */
+void disable_history(Computer* c);
+
+/* Forgets $c's history and restarts it from the current state (after
+   loading a program or a save-state). */
+void reset_history(Computer* c);
+
+/* Saves the $len bytes at $addr before a guest-visible write overwrites
+   them. Called by every function writing into guest memory. */
+void history_write(Computer* c, long addr, long len);
+
+/* Takes a checkpoint of the current state, called by run_steps() when
+   c -> retired reaches next_checkpoint and after an interrupt. */
+void history_checkpoint(Computer* c);
+
+/* Called by run_steps() and deliver_interrupt() before they make $c move
+   forward: if $c is parked, its recorded future is dropped. */
+void history_resume(Computer* c);
+
+/* Oldest instruction count reachable by history_seek(). */
+unsigned long long history_start(Computer* c);
+
+/* Brings $c to the state it had after $target instructions.
+   Returns false (leaving $c unchanged) if $target is older than the
+   history or newer than the most recent instruction. */
+bool history_seek(Computer* c, unsigned long long target);
+
+/* Goes back one instruction. Returns false at the start of the history. */
+bool reverse_step(Computer* c);
+
+/* Goes back to the most recent earlier instruction boundary at which
+   $stop($c, $arg) returns true, or to the start of the history if there
+   is none (then returns false). */
+bool reverse_continue(Computer* c, bool (*stop)(Computer* c, void* arg), void* arg);
+
+/* reverse_continue() predicates: PC equals *(long*) $arg, or the next
+   instruction stores into the word at *(long*) $arg. */
+bool stop_at_pc(Computer* c, void* arg);
+bool stop_at_write(Computer* c, void* arg);
+
+#endif
@@ -0,0 +1,232 @@
+#include "idle.h"
+#include "mmio.h"
+#include "history.h"
+#include <string.h>
+#include <time.h>
+
+static double monotonic_seconds(){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+IdleLoop* enable_idle_detection(Computer* c, bool park, double rate){
+
+    disable_idle_detection(c);
+
+    IdleLoop* l = calloc(1, sizeof(IdleLoop));
+    l->branch_pc = -1;
+    l->park = park;
+    l->rate = rate;
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->wake, NULL);
+
+    c->idle = l;
+
+    return l;
+}
+
+void disable_idle_detection(Computer* c){
+
+    if(c->idle == NULL)
+        return;
+
+    pthread_mutex_destroy(&c->idle->lock);
+    pthread_cond_destroy(&c->idle->wake);
+    free(c->idle);
+    c->idle = NULL;
+}
+
+/* Can the code from $head to the branch at $branch_pc loop without side
+   effects? */
+static bool idle_candidate(Computer* c, long head, long branch_pc){
+
+    if(branch_pc - head >= 4 * IDLE_MAX_LEN || branch_pc + 4 > c->memory_size)
+        return false;
+
+    for(long pc = head; pc <= branch_pc; pc += 4){
+
+        int32_t instruction;
+        memcpy(&instruction, c->memory + pc, 4);
+        Instruction d = decode(instruction);
+        int kind = instruction_operands(c, d, pc).kind;
+
+        if(kind == INSTR_BRANCH){
+
+            long target = pc + 4 + 4 * (long) d.literal;
+
+            if(target < head || target > branch_pc)
+                return false;
+        }
+
+        else if(kind != INSTR_ALU && kind != INSTR_LOAD)
+            return false;
+    }
+
+    return true;
+}
+
+/* Remembers the state of the watched loop at its head. */
+static void watch(Computer* c){
+
+    IdleLoop* l = c->idle;
+
+    memcpy(l->registers, c->cpu.registers, sizeof(l->registers));
+    l->retired = c->retired;
+    l->bus_reads = c->bus != NULL ? c->bus->reads : 0;
+}
+
+long check_idle_loop(Computer* c, long branch_pc, long max_steps){
+
+    IdleLoop* l = c->idle;
+
+    if(branch_pc != l->branch_pc || c->cpu.program_counter != l->head){
+
+        l->head = c->cpu.program_counter;
+        l->branch_pc = branch_pc;
+        l->candidate = idle_candidate(c, l->head, branch_pc);
+
+        l->backoff = 0;
+        l->countdown = 0;
+
+        if(l->candidate)
+            watch(c);
+
+        return 0;
+    }
+
+    if(!l->candidate)
+        return 0;
+
+    // a loop that keeps changing is compared less and less often
+    if(l->countdown > 0){
+
+        if(--l->countdown == 0)
+            watch(c);
+
+        return 0;
+    }
+
+    unsigned long long period = c->retired - l->retired;
+
+    // anything changed during the last iteration: watch the next one
+    if(c->interrupt_raised || (c->bus != NULL && c->bus->reads != l->bus_reads)
+       || memcmp(l->registers, c->cpu.registers, sizeof(l->registers)) != 0 || period == 0){
+
+        if(l->backoff < IDLE_MAX_BACKOFF)
+            l->backoff = 2 * l->backoff + 1;
+
+        l->countdown = l->backoff;
+
+        return 0;
+    }
+
+    l->detected++;
+
+    // re-executing the history (see history.h) must not stop
+    if(l->park && c->next_device_event == NO_DEVICE_EVENT
+       && __atomic_load_n(&c->pending_interrupt, __ATOMIC_RELAXED) == 0
+       && (c->history == NULL || !c->history->replaying)){
+
+        pthread_mutex_lock(&l->lock);
+        l->parked = true;
+        l->parked_since = monotonic_seconds();
+        l->parks++;
+        pthread_mutex_unlock(&l->lock);
+
+        return 0;
+    }
+
+    long k = max_steps / (long) period;
+
+    if(k == 0)
+        return 0;
+
+    c->retired += k * period;
+    l->retired = c->retired;
+    l->skipped += k * period;
+
+    return k * period;
+}
+
+void forget_idle_loop(Computer* c){
+
+    if(c->idle != NULL)
+        c->idle->branch_pc = -1;
+}
+
+void idle_resume(Computer* c){
+
+    IdleLoop* l = c->idle;
+
+    pthread_mutex_lock(&l->lock);
+
+    if(l->parked){
+
+        double elapsed = monotonic_seconds() - l->parked_since;
+        unsigned long long period = c->retired - l->retired;
+        unsigned long long credit = (unsigned long long) (elapsed * l->rate);
+
+        // whole iterations only, so that the loop is still at its head
+        if(period > 0){
+            credit -= credit % period;
+            c->retired += credit;
+            l->retired = c->retired;
+            l->skipped += credit;
+        }
+
+        l->parked_time += elapsed;
+        l->parked = false;
+        pthread_cond_broadcast(&l->wake);
+    }
+
+    pthread_mutex_unlock(&l->lock);
+}
+
+bool idle_wait(Computer* c, long timeout_us){
+
+    IdleLoop* l = c->idle;
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_us / 1000000;
+    deadline.tv_nsec += (timeout_us % 1000000) * 1000;
+
+    if(deadline.tv_nsec >= 1000000000){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&l->lock);
+
+    // a single wait: wake_idle_waiters() does not unpark
+    if(l->parked && !l->interrupted)
+        pthread_cond_timedwait(&l->wake, &l->lock, &deadline);
+
+    bool parked = l->parked;
+    l->interrupted = false;
+    pthread_mutex_unlock(&l->lock);
+
+    return parked;
+}
+
+void wake_idle_waiters(Computer* c){
+
+    IdleLoop* l = c->idle;
+
+    pthread_mutex_lock(&l->lock);
+    l->interrupted = true;
+    pthread_cond_broadcast(&l->wake);
+    pthread_mutex_unlock(&l->lock);
+}
+
+void format_idle_stats(Computer* c, char* buf, size_t len){
+
+    IdleLoop* l = c->idle;
+
+    snprintf(buf, len, "idle: %llu loops detected, %llu instructions skipped, "
+             "parked %llu times for %.3f s\n",
+             l->detected, l->skipped, l->parks, l->parked_time);
+}
@@ -0,0 +1,126 @@
+#ifndef IDLE_H__
+#define IDLE_H__
+
+#include "emulator.h"
+#include <pthread.h>
+
+/* Idle loop detection.
+
+   Interactive programs wait for input by polling kernel memory in a
+   short loop, e.g.
+       wait: LD(R31, KEYBOARD_BUF_INDEX, R1)
+             CMPEQ(R1, R2, R3)
+             BT(R3, wait)
+   A loop is a candidate when its backward branch is a BEQ/BNE closing
+   at most IDLE_MAX_LEN instructions that only compute and load (no
+   store, no jump, inner branches staying in the loop). When such a loop
+   comes back to its head with every register unchanged, without reading
+   a device and without an interrupt in between, it is a fixed point:
+   nothing but an interrupt or a device event can get it out, every
+   further iteration being the same.
+
+   run_steps() then skips whole iterations in bulk, crediting their
+   instructions to c -> retired, up to the next device event or the end
+   of its budget: the resulting state is exactly the interpreted one.
+
+   If parking is enabled and no device event is pending, run_steps()
+   instead stops with c -> idle -> parked set and the host thread can
+   block in idle_wait() until raise_interrupt() wakes it. The time spent
+   parked is credited as whole iterations at $rate instructions per
+   second when the computer resumes (before the pending interrupt is
+   taken);
+   these instructions are not part of run_steps()' return value.
+
+   Idle loops are not looked for while a timing model is attached, on
+   processors sharing their memory (see smp.h) nor in translated code
+   (see aot.h). The history (see history.h) re-executes skipped
+   iterations in bulk as well, and never parks. */
+
+#define IDLE_MAX_LEN 16
+#define IDLE_MAX_BACKOFF 1023
+#define IDLE_DEFAULT_RATE 50e6 // roughly the interpreter's speed
+
+typedef struct IdleLoop{
+
+    // loop being watched
+    long head;
+    long branch_pc;   // -1 if none
+    bool candidate;   // the code between head and branch_pc can be idle
+    int backoff;      // iterations skipped between two comparisons
+    int countdown;    // iterations left before the next comparison
+    int registers[32];
+    unsigned long long retired; // when the loop was last at its head
+    unsigned long long bus_reads;
+
+    // parking
+    bool park;        // block instead of spinning when there is no device event
+    double rate;      // instructions per second credited while parked
+    bool parked;      // protected by lock
+    bool interrupted; // wake_idle_waiters() was called, protected by lock
+    double parked_since;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+
+    // statistics
+    unsigned long long detected;  // loops found idle
+    unsigned long long skipped;   // instructions skipped (parked time included)
+    unsigned long long parks;
+    double parked_time;           // seconds
+
+} IdleLoop;
+
+/* Starts looking for idle loops in $c. $park and $rate are described
+   above ($rate is ignored without parking). */
+IdleLoop* enable_idle_detection(Computer* c, bool park, double rate);
+
+/* Stops looking for idle loops and frees the detector. */
+void disable_idle_detection(Computer* c);
+
+/* Slow path of run_idle_loop(). */
+long check_idle_loop(Computer* c, long branch_pc, long max_steps);
+
+/* Called by run_steps() right after the backward branch at $branch_pc
+   was taken. Returns the number of instructions skipped (at most
+   $max_steps); c -> idle -> parked is set instead if the computer
+   parks. */
+static inline long run_idle_loop(Computer* c, long branch_pc, long max_steps){
+
+    IdleLoop* l = c->idle;
+
+    // the loop being watched, not compared at this iteration
+    if(branch_pc == l->branch_pc && c->cpu.program_counter == l->head){
+
+        if(!l->candidate)
+            return 0;
+
+        if(l->countdown > 1){
+            l->countdown--;
+            return 0;
+        }
+    }
+
+    return check_idle_loop(c, branch_pc, max_steps);
+}
+
+/* Forgets the loop being watched, after $c's state was changed from
+   outside of run_steps() (save-state loaded, history seek). */
+void forget_idle_loop(Computer* c);
+
+/* Credits the time spent parked and leaves the parked state, waking
+   idle_wait(). Called by run_steps(). */
+void idle_resume(Computer* c);
+
+/* Blocks while $c is parked, for at most $timeout_us microseconds or
+   until idle_resume() or wake_idle_waiters() is called (returning at
+   once if wake_idle_waiters() was called since the last wait). Must be called
+   without holding the lock the caller uses to protect $c. Returns true
+   if $c is still parked. */
+bool idle_wait(Computer* c, long timeout_us);
+
+/* Makes idle_wait() return (to pause or stop the computer). */
+void wake_idle_waiters(Computer* c);
+
+/* Writes the idle detection statistics into $buf. */
+void format_idle_stats(Computer* c, char* buf, size_t len);
+
+#endif
@@ -0,0 +1,127 @@
+#include "keyboard_hle.h"
+#include "latency.h"
+#include "history.h"
+#include "write_log.h"
+#include <string.h>
+
+bool set_keyboard_hle(Computer* c, int mode){
+
+    if(mode != KEYBOARD_HLE_OFF && c->kernel_memory_size < KEYBOARD_PRESSED + 256){
+        fprintf(stderr, "Error: kernel memory too small for the keyboard structures\n");
+        return false;
+    }
+
+    if(c->hle_check != NULL){
+        free(c->hle_check->kernel);
+        free(c->hle_check);
+        c->hle_check = NULL;
+    }
+
+    if(mode == KEYBOARD_HLE_CHECK){
+        c->hle_check = calloc(1, sizeof(HleCheck));
+        c->hle_check->kernel = malloc(c->kernel_memory_size);
+    }
+
+    c->keyboard_hle = mode;
+
+    return true;
+}
+
+/* What interrupt_handler.asm does to the kernel memory starting at $kernel. */
+static void update_keyboard(unsigned char* kernel){
+
+    unsigned char ch = kernel[KEYBOARD_CHAR];
+    unsigned char index = kernel[KEYBOARD_BUF_INDEX];
+
+    if(kernel[KEYBOARD_INTERRUPT_NB] == 0){
+        kernel[KEYBOARD_BUF + index] = ch;
+        kernel[KEYBOARD_PRESSED + ch] = 1;
+        kernel[KEYBOARD_BUF_INDEX] = index + 1; // wraps from 255 to 0
+    } else if(kernel[KEYBOARD_INTERRUPT_NB] != INTERRUPT_TIMER){
+        kernel[KEYBOARD_PRESSED + ch] = 0;
+    }
+}
+
+void keyboard_hle_interrupt(Computer* c){
+
+    unsigned char* kernel = c->memory + c->program_memory_size + c->video_memory_size;
+
+    if(c->keyboard_hle == KEYBOARD_HLE_ON){
+
+        if(c->history != NULL){
+            long base = kernel - c->memory;
+            history_write(c, base + KEYBOARD_BUF_INDEX, 1);
+            history_write(c, base + KEYBOARD_BUF + kernel[KEYBOARD_BUF_INDEX], 1);
+            history_write(c, base + KEYBOARD_PRESSED + kernel[KEYBOARD_CHAR], 1);
+        }
+
+        unsigned char index = kernel[KEYBOARD_BUF_INDEX];
+        unsigned char ch = kernel[KEYBOARD_CHAR];
+
+        update_keyboard(kernel);
+
+        if(c->write_log != NULL && kernel[KEYBOARD_INTERRUPT_NB] != INTERRUPT_TIMER){
+            long base = kernel - c->memory;
+
+            if(kernel[KEYBOARD_INTERRUPT_NB] == 0){
+                log_write(c, base + KEYBOARD_BUF + index, 1, ch);
+                log_write(c, base + KEYBOARD_BUF_INDEX, 1, kernel[KEYBOARD_BUF_INDEX]);
+            }
+
+            log_write(c, base + KEYBOARD_PRESSED + ch, 1, kernel[KEYBOARD_PRESSED + ch]);
+        }
+
+        // JMP(XP): the handler saves and restores every other register
+        c->cpu.program_counter = c->cpu.registers[30];
+        c->interrupt_raised = false;
+
+        if(c->latency != NULL)
+            latency_native_handler(c);
+    }
+
+    else if(c->keyboard_hle == KEYBOARD_HLE_CHECK){
+
+        HleCheck* check = c->hle_check;
+
+        memcpy(check->registers, c->cpu.registers, sizeof(check->registers));
+        memcpy(check->kernel, kernel, c->kernel_memory_size);
+        update_keyboard(check->kernel);
+        check->pc = c->cpu.registers[30];
+        check->pending = true;
+    }
+}
+
+void keyboard_hle_check(Computer* c){
+
+    HleCheck* check = c->hle_check;
+    unsigned char* kernel = c->memory + c->program_memory_size + c->video_memory_size;
+    bool same = true;
+
+    check->pending = false;
+    check->checked++;
+
+    if(c->cpu.program_counter != check->pc){
+        fprintf(stderr, "Error: HLE keyboard handler: PC %.8lx, handler returned to %.8lx\n",
+                check->pc, c->cpu.program_counter);
+        same = false;
+    }
+
+    for(int r = 0; r < 31; r++){
+        if(c->cpu.registers[r] != check->registers[r]){
+            fprintf(stderr, "Error: HLE keyboard handler: %s = %.8x, handler left %.8x\n",
+                    reg_symbols[r], check->registers[r], c->cpu.registers[r]);
+            same = false;
+        }
+    }
+
+    for(long i = 0; i < c->kernel_memory_size; i++){
+        if(kernel[i] != check->kernel[i]){
+            fprintf(stderr, "Error: HLE keyboard handler: kernel[%ld] = %d, handler left %d\n",
+                    i, check->kernel[i], kernel[i]);
+            same = false;
+        }
+    }
+
+    if(!same)
+        check->mismatches++;
+}
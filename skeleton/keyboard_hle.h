@@ -0,0 +1,62 @@
+#ifndef KEYBOARD_HLE_H__
+#define KEYBOARD_HLE_H__
+
+#include "emulator.h"
+
+/* High-level emulation of the keyboard interrupt handler
+   (beta-assembly/interrupt_handler.asm).
+
+   In KEYBOARD_HLE_ON mode, deliver_interrupt() updates the kernel keyboard
+   structures itself and returns to the interrupted instruction, instead
+   of running the ~60 guest instructions of the handler. The update
+   happens inside deliver_interrupt(), hence atomically with respect to
+   guest execution. The resulting registers and kernel memory are the ones
+   the real handler leaves behind (its dead stack slots above SP aside);
+   only the retired instruction count differs, so recordings (replay.h)
+   must be replayed in the mode they were made in.
+
+   In KEYBOARD_HLE_CHECK mode, the real handler runs but the native
+   update is computed on a copy at each interrupt and compared with the
+   registers and kernel memory found when the handler returns. */
+
+// kernel memory layout used by interrupt_handler.asm
+#define KEYBOARD_INTERRUPT_NB KERNEL_INTERRUPT_TYPE // 0: key pressed, 2: timer, otherwise key released
+#define KEYBOARD_CHAR KERNEL_INTERRUPT_KEYVAL
+#define KEYBOARD_BUF_INDEX 15
+#define KEYBOARD_BUF 16 // circular buffer of 256 chars
+#define KEYBOARD_PRESSED 272 // pressed[char] is 1 while the key is down
+
+enum{
+    KEYBOARD_HLE_OFF,
+    KEYBOARD_HLE_ON,
+    KEYBOARD_HLE_CHECK
+};
+
+typedef struct HleCheck{
+
+    bool pending; // an interrupt is being handled by the real handler
+    long pc;
+    int registers[32];
+    unsigned char* kernel; // expected kernel memory
+
+    unsigned long long checked;
+    unsigned long long mismatches;
+
+} HleCheck;
+
+/* Selects how $c's keyboard interrupts are handled, $mode is one of
+   KEYBOARD_HLE_OFF, KEYBOARD_HLE_ON and KEYBOARD_HLE_CHECK.
+   Returns false (and leaves the mode unchanged) if $c's kernel memory
+   is too small to hold the keyboard structures. */
+bool set_keyboard_hle(Computer* c, int mode);
+
+/* Called by deliver_interrupt() once an interrupt was accepted and PC
+   points to the handler. Handles it natively in KEYBOARD_HLE_ON mode,
+   prepares the comparison in KEYBOARD_HLE_CHECK mode. */
+void keyboard_hle_interrupt(Computer* c);
+
+/* Called in KEYBOARD_HLE_CHECK mode when the handler returns to user
+   code, reports any difference with the native update on stderr. */
+void keyboard_hle_check(Computer* c);
+
+#endif
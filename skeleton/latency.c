@@ -0,0 +1,193 @@
+#include "latency.h"
+#include <string.h>
+#include <time.h>
+
+unsigned long long latency_clock_ns(){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Values below 32 get their own bucket, then each power of two is split
+   into 16 buckets. */
+static int bucket_index(unsigned long long v){
+
+    if(v < 32)
+        return v;
+
+    int e = 63 - __builtin_clzll(v);
+
+    return 32 + (e - 5) * 16 + ((v >> (e - 4)) & 15);
+}
+
+static unsigned long long bucket_upper(int index){
+
+    if(index < 32)
+        return index;
+
+    int e = (index - 32) / 16 + 5;
+    unsigned long long low = (unsigned long long) (16 + (index - 32) % 16) << (e - 4);
+
+    return low + (1ULL << (e - 4)) - 1;
+}
+
+static void histogram_add(Histogram* h, unsigned long long v){
+
+    h->buckets[bucket_index(v)]++;
+    h->count++;
+
+    if(v > h->max)
+        h->max = v;
+}
+
+unsigned long long histogram_percentile(Histogram* h, double percent){
+
+    if(h->count == 0)
+        return 0;
+
+    unsigned long long rank = (unsigned long long) (h->count * percent / 100.0);
+    unsigned long long seen = 0;
+
+    if(rank >= h->count)
+        rank = h->count - 1;
+
+    for(int i = 0; i < LATENCY_BUCKETS; i++){
+
+        seen += h->buckets[i];
+
+        if(seen > rank)
+            return bucket_upper(i) < h->max ? bucket_upper(i) : h->max;
+    }
+
+    return h->max;
+}
+
+LatencyStats* enable_latency_stats(Computer* c){
+
+    if(c->latency == NULL){
+        c->latency = calloc(1, sizeof(LatencyStats));
+        c->latency->stage = LATENCY_IDLE;
+    }
+
+    return c->latency;
+}
+
+void disable_latency_stats(Computer* c){
+
+    free(c->latency);
+    c->latency = NULL;
+}
+
+void latency_interrupt_lost(Computer* c){
+
+    __atomic_fetch_add(&c->latency->dropped, 1, __ATOMIC_RELAXED);
+}
+
+void latency_interrupt(Computer* c, bool accepted, unsigned long long host_ns,
+                       unsigned long long queued_ns, unsigned long long queued_retired){
+
+    LatencyStats* s = c->latency;
+
+    if(!accepted){
+        __atomic_fetch_add(&s->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    s->host_ns = host_ns;
+    s->stage = LATENCY_QUEUED;
+    s->queued_ns = queued_ns != 0 ? queued_ns : latency_clock_ns();
+    s->queued_retired = queued_ns != 0 ? queued_retired : c->retired;
+
+    if(s->host_ns != 0)
+        histogram_add(&s->wall[LATENCY_HOST_TO_QUEUED], s->queued_ns - s->host_ns);
+}
+
+static void enter_handler(Computer* c, unsigned long long retired){
+
+    LatencyStats* s = c->latency;
+
+    s->stage = LATENCY_IN_HANDLER;
+    s->entry_ns = latency_clock_ns();
+    s->entry_retired = retired;
+    histogram_add(&s->wall[LATENCY_QUEUED_TO_ENTRY], s->entry_ns - s->queued_ns);
+    histogram_add(&s->instructions[LATENCY_INSTR_QUEUED_TO_ENTRY],
+                  s->entry_retired - s->queued_retired);
+}
+
+static void leave_handler(Computer* c){
+
+    LatencyStats* s = c->latency;
+    unsigned long long return_ns = latency_clock_ns();
+
+    histogram_add(&s->wall[LATENCY_ENTRY_TO_RETURN], return_ns - s->entry_ns);
+    histogram_add(&s->instructions[LATENCY_INSTR_ENTRY_TO_RETURN],
+                  c->retired - s->entry_retired);
+
+    if(s->host_ns != 0)
+        histogram_add(&s->wall[LATENCY_HOST_TO_RETURN], return_ns - s->host_ns);
+
+    s->host_ns = 0;
+    s->stage = LATENCY_IDLE;
+    s->delivered++;
+}
+
+void latency_after_step(Computer* c, long pc){
+
+    LatencyStats* s = c->latency;
+
+    // c -> retired already counts the first handler instruction
+    if(s->stage == LATENCY_QUEUED && pc == c->program_memory_size + c->video_memory_size + KERNEL_HANDLER)
+        enter_handler(c, c->retired - 1);
+
+    // JMP(XP) back to user code
+    if(s->stage == LATENCY_IN_HANDLER && c->cpu.program_counter < c->program_memory_size)
+        leave_handler(c);
+}
+
+void latency_native_handler(Computer* c){
+
+    if(c->latency->stage != LATENCY_QUEUED)
+        return;
+
+    enter_handler(c, c->retired);
+    leave_handler(c);
+}
+
+void format_latency_stats(LatencyStats* s, char* buf, size_t len){
+
+    static const char* wall_names[LATENCY_NB_WALL] = {
+        "host event -> queued", "queued -> handler entry",
+        "handler entry -> return", "host event -> return"
+    };
+    static const char* instr_names[LATENCY_NB_INSTR] = {
+        "queued -> handler entry", "handler entry -> return"
+    };
+
+    size_t n = snprintf(buf, len, "interrupts delivered %llu, dropped %llu\n"
+                        "%-26s %10s %10s %10s\n", s->delivered, __atomic_load_n(&s->dropped, __ATOMIC_RELAXED),
+                        "wall-clock (us)", "p50", "p99", "max");
+
+    for(int i = 0; i < LATENCY_NB_WALL && n < len; i++){
+
+        Histogram* h = &s->wall[i];
+
+        if(h->count == 0)
+            n += snprintf(buf + n, len - n, "%-26s %10s %10s %10s\n", wall_names[i], "-", "-", "-");
+        else
+            n += snprintf(buf + n, len - n, "%-26s %10.1f %10.1f %10.1f\n", wall_names[i],
+                          histogram_percentile(h, 50) / 1e3, histogram_percentile(h, 99) / 1e3,
+                          h->max / 1e3);
+    }
+
+    if(n < len)
+        n += snprintf(buf + n, len - n, "%-26s %10s %10s %10s\n", "instructions", "p50", "p99", "max");
+
+    for(int i = 0; i < LATENCY_NB_INSTR && n < len; i++){
+
+        Histogram* h = &s->instructions[i];
+        n += snprintf(buf + n, len - n, "%-26s %10llu %10llu %10llu\n", instr_names[i],
+                      histogram_percentile(h, 50), histogram_percentile(h, 99), h->max);
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef LATENCY_H__
+#define LATENCY_H__
+
+#include "emulator.h"
+
+/* Interrupt latency instrumentation. Each keyboard interrupt goes
+   through four stages:
+       host event      the GUI received the key event (raise_host_interrupt())
+       queued          it became pending in c -> pending_interrupt (see raise_interrupt())
+       handler entry   the first handler instruction (kernel + 400) executes
+       handler return  the handler jumps back to user code (JMP(XP))
+   The CPU takes a pending interrupt at the end of a basic block, so the
+   wait for it falls between queued and handler entry. For every
+   interrupt, the wall-clock time (ns) and the number of guest
+   instructions between stages are added to histograms (the retired
+   count at the queued stage is read by the raising thread, so it can
+   be early by the instructions the CPU was running at that moment). Interrupts
+   raised while another one was still pending, or taken while another
+   one was still being handled, are counted as dropped. The hooks cost
+   nothing beyond a NULL test when $c -> latency is NULL (the default). */
+
+#define LATENCY_BUCKETS 976
+
+enum{
+    LATENCY_IDLE,
+    LATENCY_QUEUED,
+    LATENCY_IN_HANDLER
+};
+
+typedef struct{
+
+    unsigned long long buckets[LATENCY_BUCKETS]; // log-linear, ~6% precision
+    unsigned long long count;
+    unsigned long long max;
+
+} Histogram;
+
+enum{
+    LATENCY_HOST_TO_QUEUED,
+    LATENCY_QUEUED_TO_ENTRY,
+    LATENCY_ENTRY_TO_RETURN,
+    LATENCY_HOST_TO_RETURN,
+    LATENCY_NB_WALL
+};
+
+enum{
+    LATENCY_INSTR_QUEUED_TO_ENTRY,
+    LATENCY_INSTR_ENTRY_TO_RETURN,
+    LATENCY_NB_INSTR
+};
+
+typedef struct LatencyStats{
+
+    int stage; // stage of the interrupt in flight (LATENCY_IDLE if none)
+    unsigned long long host_ns; // 0 if the interrupt does not come from a host event
+    unsigned long long queued_ns;
+    unsigned long long entry_ns;
+    unsigned long long queued_retired;
+    unsigned long long entry_retired;
+
+    Histogram wall[LATENCY_NB_WALL]; // nanoseconds
+    Histogram instructions[LATENCY_NB_INSTR];
+    unsigned long long delivered; // interrupts that reached the handler return
+    unsigned long long dropped;   // interrupts lost or ignored (updated atomically)
+
+} LatencyStats;
+
+/* Allocates $c's latency statistics (if not done yet) and starts collecting. */
+LatencyStats* enable_latency_stats(Computer* c);
+
+/* Stops collecting and frees $c's latency statistics. */
+void disable_latency_stats(Computer* c);
+
+/* Monotonic clock used for all the timestamps, in nanoseconds. */
+unsigned long long latency_clock_ns();
+
+/* Called by raise_interrupt() when the interrupt is lost because another
+   one is still pending, from any thread. */
+void latency_interrupt_lost(Computer* c);
+
+/* Called when a pending interrupt is taken, $accepted is false if the
+   interrupt was ignored because another one was being handled, $host_ns
+   is the time of its host event (0 if none), $queued_ns and
+   $queued_retired the stamps raise_interrupt() attached to it (0 if the
+   statistics were enabled after it was raised). */
+void latency_interrupt(Computer* c, bool accepted, unsigned long long host_ns,
+                       unsigned long long queued_ns, unsigned long long queued_retired);
+
+/* Called by execute_step() after the instruction at $pc was executed
+   while an interrupt is in flight. */
+void latency_after_step(Computer* c, long pc);
+
+/* Called by deliver_interrupt() when the interrupt it just accepted was
+   handled natively (see keyboard_hle.h): handler entry and return happen
+   at once, without guest instructions. */
+void latency_native_handler(Computer* c);
+
+/* Returns the value below which $percent % of the samples of $h fall
+   (upper bound of the bucket), 0 if $h is empty. */
+unsigned long long histogram_percentile(Histogram* h, double percent);
+
+/* Writes a table of p50/p99/max per stage into $buf of size $len. */
+void format_latency_stats(LatencyStats* s, char* buf, size_t len);
+
+#endif
@@ -0,0 +1,614 @@
+#include "libbeta.h"
+#include "emulator.h"
+#include "framebuffer.h"
+#include "history.h"
+#include "idle.h"
+#include "mmio.h"
+#include "savestate.h"
+#include "write_log.h"
+#include <string.h>
+#include <unistd.h>
+
+/* The whole library is built with -fvisibility=hidden: only the
+   functions of libbeta.h are exported, the emulator's own symbols stay
+   internal to the shared library. */
+#define BETA_EXPORT __attribute__((visibility("default")))
+
+// records drained at once before the write callback is called
+#define WRITE_BATCH 1024
+
+struct BetaMachine{
+
+    Computer computer;
+
+    BetaWriteCallback on_write;
+    void* on_write_data;
+    WriteCursor cursor;
+    WriteRecord* batch;
+};
+
+typedef struct{
+
+    uint32_t page;
+    unsigned char bytes[MEMORY_PAGE_SZ];
+
+} SnapshotPage;
+
+struct BetaSnapshot{
+
+    int video_width, video_height, video_format;
+    long memory_size;
+
+    CPU cpu;
+    unsigned program_size;
+    unsigned long long retired;
+    long latest_accessed;
+    bool halted;
+    bool interrupt_raised;
+    uint32_t pending_interrupt;
+    char interrupt_type;
+    char interrupt_keyval;
+    unsigned long long block_cycles;
+    unsigned char* devices; // see save_bus_state()
+    size_t devices_size;
+
+    long nb_pages;
+    SnapshotPage* pages; // only the pages that are not all zero
+};
+
+// user device registers mapped by beta_map_device()
+typedef struct{
+
+    BetaReadCallback read;
+    BetaStoreCallback store;
+    void* data;
+
+} UserDevice;
+
+BETA_EXPORT int beta_api_version(void){
+
+    return BETA_API_VERSION;
+}
+
+BETA_EXPORT BetaMachine* beta_create(int width, int height, int video_format, unsigned flags){
+
+    BetaMachine* m = calloc(1, sizeof(BetaMachine));
+
+    if(m == NULL)
+        return NULL;
+
+    Computer* c = &m->computer;
+
+    init_computer(c, PROGRAM_MEMORY_SZ, VIDEO_MEMORY_SZ, KERNEL_MEMORY_SZ);
+
+    if(c->memory == NULL || (width != 0 && !set_video_mode(c, width, height, video_format))){
+        free_computer(c);
+        free(m);
+        return NULL;
+    }
+
+    c->extended_isa = flags & BETA_EXTENDED_ISA;
+    c->loop_idioms = !(flags & BETA_NO_LOOP_IDIOMS);
+
+    if(flags & BETA_DEVICES)
+        enable_default_devices(c);
+
+    if(flags & BETA_HISTORY)
+        enable_history(c, HISTORY_DEFAULT_INTERVAL, HISTORY_DEFAULT_BUDGET);
+
+    return m;
+}
+
+BETA_EXPORT void beta_destroy(BetaMachine* m){
+
+    if(m == NULL)
+        return;
+
+    free_computer(&m->computer);
+    free(m->batch);
+    free(m);
+}
+
+/* Host changes of the state that the guest did not make: the history
+   cannot undo them and the idle loop may no longer be one. */
+static void host_changed_state(Computer* c){
+
+    reset_history(c);
+    forget_idle_loop(c);
+}
+
+/* Reads everything left in $fd into a buffer stored in $out. Returns its
+   size, -1 on error. */
+static long read_fd(int fd, unsigned char** out){
+
+    size_t size = 0, capacity = 64 * 1024;
+    unsigned char* buf = malloc(capacity);
+
+    while(buf != NULL){
+
+        if(size == capacity){
+            unsigned char* bigger = realloc(buf, capacity * 2);
+            if(bigger == NULL)
+                break;
+            buf = bigger;
+            capacity *= 2;
+        }
+
+        ssize_t n = read(fd, buf + size, capacity - size);
+
+        if(n == 0){
+            *out = buf;
+            return size;
+        }
+
+        if(n < 0)
+            break;
+
+        size += n;
+    }
+
+    fprintf(stderr, "Error: could not read the binary from file descriptor %d\n", fd);
+    free(buf);
+
+    return -1;
+}
+
+BETA_EXPORT int beta_load_program(BetaMachine* m, const void* binary, size_t size){
+
+    Computer* c = &m->computer;
+
+    if(size > (size_t) c->program_memory_size){
+        fprintf(stderr, "Error: Binary file is too large for the program memory.\n");
+        return -1;
+    }
+
+    // load() reads a FILE, fmemopen() cannot open an empty buffer
+    FILE* f = size > 0 ? fmemopen((void*) binary, size, "rb") : NULL;
+
+    if(size > 0 && f == NULL){
+        fprintf(stderr, "Error: could not open the binary\n");
+        return -1;
+    }
+
+    c->cpu.program_counter = 0;
+    memset(c->cpu.registers, 0, sizeof(c->cpu.registers));
+    c->cpu.backup = 0;
+    c->retired = 0;
+    c->block_cycles = 0;
+    c->halted = false;
+    c->interrupt_raised = false;
+    __atomic_store_n(&c->pending_interrupt, 0, __ATOMIC_RELAXED);
+
+    if(f != NULL){
+        load(c, f);
+        fclose(f);
+    }
+
+    else
+        c->program_size = 0;
+
+    host_changed_state(c);
+
+    return 0;
+}
+
+BETA_EXPORT int beta_load_program_fd(BetaMachine* m, int fd){
+
+    unsigned char* binary;
+    long size = read_fd(fd, &binary);
+
+    if(size < 0)
+        return -1;
+
+    int result = beta_load_program(m, binary, size);
+    free(binary);
+
+    return result;
+}
+
+BETA_EXPORT int beta_load_handler(BetaMachine* m, const void* binary, size_t size){
+
+    Computer* c = &m->computer;
+    long handler_end = c->kernel_memory_size < KERNEL_PALETTE ? c->kernel_memory_size : KERNEL_PALETTE;
+
+    if((long) size > handler_end - KERNEL_HANDLER){
+        fprintf(stderr, "Interrupt handler too large for kernel memory.\n");
+        return -1;
+    }
+
+    if(size == 0)
+        return 0;
+
+    FILE* f = fmemopen((void*) binary, size, "rb");
+
+    if(f == NULL){
+        fprintf(stderr, "Error: could not open the interrupt handler\n");
+        return -1;
+    }
+
+    load_interrupt_handler(c, f);
+    fclose(f);
+    host_changed_state(c);
+
+    return 0;
+}
+
+BETA_EXPORT int beta_load_handler_fd(BetaMachine* m, int fd){
+
+    unsigned char* binary;
+    long size = read_fd(fd, &binary);
+
+    if(size < 0)
+        return -1;
+
+    int result = beta_load_handler(m, binary, size);
+    free(binary);
+
+    return result;
+}
+
+/* Hands the writes logged since the previous call to the write callback. */
+static void dispatch_writes(BetaMachine* m){
+
+    long n;
+
+    while((n = drain_writes(m->computer.write_log, &m->cursor, m->batch, WRITE_BATCH)) > 0)
+        for(long i = 0; i < n; i++)
+            m->on_write(m->on_write_data, m->batch[i].address, m->batch[i].length,
+                        m->batch[i].value, m->batch[i].retired);
+}
+
+BETA_EXPORT long beta_run(BetaMachine* m, long steps){
+
+    Computer* c = &m->computer;
+    long done = 0;
+
+    // an instruction logs at most a couple of writes: a quarter of the
+    // ring per call to run_steps() never wraps around before it is drained
+    long chunk = m->on_write != NULL ? (long) (c->write_log->capacity / 4) : steps;
+
+    while(done < steps && is_executing(c)){
+
+        long n = run_steps(c, steps - done < chunk ? steps - done : chunk);
+
+        if(m->on_write != NULL)
+            dispatch_writes(m);
+
+        if(n == 0)
+            break;
+
+        done += n;
+    }
+
+    return done;
+}
+
+BETA_EXPORT long beta_step_back(BetaMachine* m, long steps){
+
+    Computer* c = &m->computer;
+
+    if(c->history == NULL || steps <= 0)
+        return 0;
+
+    unsigned long long start = history_start(c);
+    unsigned long long before = c->retired;
+    unsigned long long target = before - start > (unsigned long long) steps ? before - steps : start;
+
+    if(!history_seek(c, target))
+        return 0;
+
+    return before - c->retired;
+}
+
+BETA_EXPORT bool beta_is_running(BetaMachine* m){
+
+    return is_executing(&m->computer);
+}
+
+BETA_EXPORT uint64_t beta_retired(BetaMachine* m){
+
+    return m->computer.retired;
+}
+
+BETA_EXPORT void beta_raise_interrupt(BetaMachine* m, int type, int keyval){
+
+    raise_interrupt(&m->computer, type, keyval);
+}
+
+BETA_EXPORT int32_t beta_get_register(BetaMachine* m, int reg){
+
+    if(reg < 0 || reg > 31)
+        return 0;
+
+    return get_register(&m->computer, reg);
+}
+
+BETA_EXPORT int beta_set_register(BetaMachine* m, int reg, int32_t value){
+
+    if(reg < 0 || reg > 31){
+        fprintf(stderr, "Error: no register R%d\n", reg);
+        return -1;
+    }
+
+    if(reg == 31)
+        return 0;
+
+    m->computer.cpu.registers[reg] = value;
+    host_changed_state(&m->computer);
+
+    return 0;
+}
+
+BETA_EXPORT uint32_t beta_get_pc(BetaMachine* m){
+
+    return m->computer.cpu.program_counter;
+}
+
+BETA_EXPORT int beta_set_pc(BetaMachine* m, uint32_t pc){
+
+    Computer* c = &m->computer;
+
+    if(pc % 4 != 0 || pc >= c->memory_size){
+        fprintf(stderr, "Error: PC %.8x is not a word of memory\n", pc);
+        return -1;
+    }
+
+    c->cpu.program_counter = pc;
+    host_changed_state(c);
+
+    return 0;
+}
+
+static bool in_memory(Computer* c, uint32_t address, size_t size){
+
+    if(address > c->memory_size || size > (size_t) (c->memory_size - address)){
+        fprintf(stderr, "Error: [%.8x, +%zu[ is not in memory\n", address, size);
+        return false;
+    }
+
+    return true;
+}
+
+BETA_EXPORT int beta_read_memory(BetaMachine* m, uint32_t address, void* out, size_t size){
+
+    Computer* c = &m->computer;
+
+    if(!in_memory(c, address, size))
+        return -1;
+
+    memcpy(out, c->memory + address, size);
+
+    return 0;
+}
+
+BETA_EXPORT int beta_write_memory(BetaMachine* m, uint32_t address, const void* in, size_t size){
+
+    Computer* c = &m->computer;
+
+    if(!in_memory(c, address, size))
+        return -1;
+
+    memcpy(c->memory + address, in, size);
+    mark_video_dirty(c, address, address + size);
+    host_changed_state(c);
+
+    return 0;
+}
+
+BETA_EXPORT uint32_t beta_memory_size(BetaMachine* m){
+
+    return m->computer.memory_size;
+}
+
+BETA_EXPORT uint32_t beta_video_address(BetaMachine* m){
+
+    return m->computer.program_memory_size;
+}
+
+BETA_EXPORT uint32_t beta_kernel_address(BetaMachine* m){
+
+    return m->computer.program_memory_size + m->computer.video_memory_size;
+}
+
+BETA_EXPORT void beta_read_screen(BetaMachine* m, uint32_t* out){
+
+    Computer* c = &m->computer;
+
+    convert_framebuffer(c, 0, (long) c->video_width * c->video_height, out, 0);
+}
+
+BETA_EXPORT int beta_set_write_callback(BetaMachine* m, BetaWriteCallback callback, void* data){
+
+    Computer* c = &m->computer;
+
+    if(callback == NULL){
+        disable_write_log(c);
+        m->on_write = NULL;
+        return 0;
+    }
+
+    if(c->write_log == NULL && enable_write_log(c, WRITE_LOG_DEFAULT_LOG2) == NULL){
+        fprintf(stderr, "Error: could not allocate the write log\n");
+        return -1;
+    }
+
+    if(m->batch == NULL)
+        m->batch = malloc(WRITE_BATCH * sizeof(WriteRecord));
+
+    m->on_write = callback;
+    m->on_write_data = data;
+    init_write_cursor(c->write_log, &m->cursor);
+
+    return 0;
+}
+
+static int32_t user_device_read(Computer* c, Device* d, long offset){
+
+    (void) c;
+    UserDevice* u = d->data;
+
+    return u->read != NULL ? u->read(u->data, offset) : 0;
+}
+
+static void user_device_write(Computer* c, Device* d, long offset, int32_t value){
+
+    (void) c;
+    UserDevice* u = d->data;
+
+    if(u->store != NULL)
+        u->store(u->data, offset, value);
+}
+
+BETA_EXPORT int beta_map_device(BetaMachine* m, uint32_t address, uint32_t size,
+                                BetaReadCallback read, BetaStoreCallback store, void* data){
+
+    Device* d = calloc(1, sizeof(Device));
+    UserDevice* u = calloc(1, sizeof(UserDevice));
+
+    u->read = read;
+    u->store = store;
+    u->data = data;
+
+    d->name = "libbeta device";
+    d->start = address;
+    d->end = (long) address + size;
+    d->read = user_device_read;
+    d->write = user_device_write;
+    d->deadline = NO_DEVICE_EVENT;
+    d->data = u;
+
+    // map_device() frees it on error
+    return map_device(&m->computer, d) ? 0 : -1;
+}
+
+BETA_EXPORT BetaSnapshot* beta_snapshot(BetaMachine* m){
+
+    Computer* c = &m->computer;
+    BetaSnapshot* s = calloc(1, sizeof(BetaSnapshot));
+    long nb_total = (c->memory_size + MEMORY_PAGE_SZ - 1) / MEMORY_PAGE_SZ;
+    static const unsigned char zero[MEMORY_PAGE_SZ];
+
+    if(s == NULL)
+        return NULL;
+
+    s->video_width = c->video_width;
+    s->video_height = c->video_height;
+    s->video_format = c->video_format;
+    s->memory_size = c->memory_size;
+    s->cpu = c->cpu;
+    s->program_size = c->program_size;
+    s->retired = c->retired;
+    s->latest_accessed = c->latest_accessed;
+    s->halted = c->halted;
+    s->interrupt_raised = c->interrupt_raised;
+    s->pending_interrupt = __atomic_load_n(&c->pending_interrupt, __ATOMIC_ACQUIRE);
+
+    // still being raised by another thread: not pending yet
+    if(!(s->pending_interrupt & INTERRUPT_PENDING))
+        s->pending_interrupt = 0;
+    s->interrupt_type = c->interrupt_type;
+    s->interrupt_keyval = c->interrupt_keyval;
+    s->block_cycles = c->block_cycles;
+    s->devices_size = bus_state_size(c);
+    s->devices = malloc(s->devices_size + 1);
+
+    if(s->devices == NULL){
+        fprintf(stderr, "Error: could not allocate the snapshot\n");
+        free(s);
+        return NULL;
+    }
+
+    save_bus_state(c, s->devices);
+
+    // the memory is mapped zeroed: most pages are never written
+    for(long i = 0; i < nb_total; i++){
+
+        long size = c->memory_size - i * MEMORY_PAGE_SZ < MEMORY_PAGE_SZ
+                    ? c->memory_size - i * MEMORY_PAGE_SZ : MEMORY_PAGE_SZ;
+
+        if(memcmp(c->memory + i * MEMORY_PAGE_SZ, zero, size) == 0)
+            continue;
+
+        if(s->nb_pages % 64 == 0){
+
+            SnapshotPage* pages = realloc(s->pages, (s->nb_pages + 64) * sizeof(SnapshotPage));
+
+            if(pages == NULL){
+                fprintf(stderr, "Error: could not allocate the snapshot\n");
+                beta_free_snapshot(s);
+                return NULL;
+            }
+
+            s->pages = pages;
+        }
+
+        SnapshotPage* p = &s->pages[s->nb_pages++];
+        p->page = i;
+        memset(p->bytes, 0, MEMORY_PAGE_SZ);
+        memcpy(p->bytes, c->memory + i * MEMORY_PAGE_SZ, size);
+    }
+
+    return s;
+}
+
+BETA_EXPORT int beta_restore(BetaMachine* m, const BetaSnapshot* s){
+
+    Computer* c = &m->computer;
+
+    if(s->video_width != c->video_width || s->video_height != c->video_height
+       || s->video_format != c->video_format || s->memory_size != c->memory_size){
+        fprintf(stderr, "Error: snapshot of a machine with a different video mode\n");
+        return -1;
+    }
+
+    if(s->devices_size != bus_state_size(c) || !restore_bus_state(c, s->devices)){
+        fprintf(stderr, "Error: snapshot of a machine with different devices\n");
+        return -1;
+    }
+
+    c->cpu = s->cpu;
+    c->program_size = s->program_size;
+    c->retired = s->retired;
+    c->latest_accessed = s->latest_accessed;
+    c->halted = s->halted;
+    c->interrupt_raised = s->interrupt_raised;
+    __atomic_store_n(&c->pending_interrupt, s->pending_interrupt, __ATOMIC_RELAXED);
+    c->interrupt_type = s->interrupt_type;
+    c->interrupt_keyval = s->interrupt_keyval;
+    c->block_cycles = s->block_cycles;
+
+    clear_memory(c);
+
+    for(long i = 0; i < s->nb_pages; i++){
+
+        long offset = (long) s->pages[i].page * MEMORY_PAGE_SZ;
+        long size = c->memory_size - offset < MEMORY_PAGE_SZ ? c->memory_size - offset : MEMORY_PAGE_SZ;
+
+        memcpy(c->memory + offset, s->pages[i].bytes, size);
+    }
+
+    mark_video_dirty(c, c->program_memory_size, c->program_memory_size + c->video_memory_size);
+    host_changed_state(c);
+
+    return 0;
+}
+
+BETA_EXPORT void beta_free_snapshot(BetaSnapshot* s){
+
+    if(s == NULL)
+        return;
+
+    free(s->pages);
+    free(s->devices);
+    free(s);
+}
+
+BETA_EXPORT int beta_save_state(BetaMachine* m, const char* path){
+
+    return save_state(&m->computer, path);
+}
+
+BETA_EXPORT int beta_load_state(BetaMachine* m, const char* path){
+
+    return load_state(&m->computer, path);
+}
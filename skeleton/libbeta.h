@@ -0,0 +1,143 @@
+#ifndef LIBBETA_H__
+#define LIBBETA_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* libbeta: the emulator core as a library (tools/compile.sh builds
+   libbeta.a and libbeta.so), for test harnesses, fuzzers and front-ends
+   that drive a Beta machine in-process, without GTK and without files.
+
+   A machine is an opaque BetaMachine handle; nothing of the emulator's
+   own structures (emulator.h) is part of this interface, which only
+   changes in backward compatible ways while BETA_API_VERSION stays the
+   same. Functions returning int return 0 on success and -1 on error,
+   reported on stderr. Addresses are the guest's byte addresses.
+
+   A machine is not thread-safe: calls on the same handle must not run
+   concurrently, except beta_raise_interrupt() which may be called from
+   any thread at any time. Callbacks run on the thread calling
+   beta_run(). */
+
+#define BETA_API_VERSION 1
+
+// beta_create() flags
+#define BETA_EXTENDED_ISA 1    // LDB, STB, LDH, STH, FILL and COPY (see emulator.h)
+#define BETA_NO_LOOP_IDIOMS 2  // interpret fill/copy loops instruction by instruction
+#define BETA_DEVICES 4         // map the cycle counter and the interval timer (see mmio.h)
+#define BETA_HISTORY 8         // record the history, needed by beta_step_back()
+
+// video formats, as in emulator.h
+#define BETA_VIDEO_RGB32 0
+#define BETA_VIDEO_RGB565 1
+#define BETA_VIDEO_INDEXED8 2
+
+// interrupt types, as in emulator.h
+#define BETA_INTERRUPT_KEY_PRESSED 0
+#define BETA_INTERRUPT_KEY_RELEASED 1
+
+typedef struct BetaMachine BetaMachine;
+typedef struct BetaSnapshot BetaSnapshot;
+
+/* Called for each guest write into memory, in order, once beta_run()
+   has run the writing instruction: $length bytes from $address, $value
+   being the word stored (the first one of bulk writes), $retired the
+   instruction count after the write. */
+typedef void (*BetaWriteCallback)(void* data, uint32_t address, uint32_t length,
+                                  int32_t value, uint64_t retired);
+
+/* Device registers: called for the guest's LD and ST of the words at
+   $offset from the start of a range mapped by beta_map_device(). */
+typedef int32_t (*BetaReadCallback)(void* data, uint32_t offset);
+typedef void (*BetaStoreCallback)(void* data, uint32_t offset, int32_t value);
+
+/* BETA_API_VERSION of the library. */
+int beta_api_version(void);
+
+/* Creates a machine with the default memory sizes and a $width x $height
+   framebuffer in $video_format (600x400 RGB32 if $width is 0), $flags
+   being a combination of the BETA_ flags above. Returns NULL on error. */
+BetaMachine* beta_create(int width, int height, int video_format, unsigned flags);
+
+void beta_destroy(BetaMachine* m);
+
+/* Loads an assembled program ($size bytes, as written by the assembler
+   into .asm.bin) at address 0, from a buffer or from everything left to
+   read in $fd (which is not closed). The registers, PC, counters and
+   interrupt state are reset, the rest of memory is left as it is. */
+int beta_load_program(BetaMachine* m, const void* binary, size_t size);
+int beta_load_program_fd(BetaMachine* m, int fd);
+
+/* Loads an assembled interrupt handler into kernel memory. */
+int beta_load_handler(BetaMachine* m, const void* binary, size_t size);
+int beta_load_handler_fd(BetaMachine* m, int fd);
+
+/* Runs up to $steps instructions, stopping early if the program halts
+   or leaves its code. Returns the number of instructions run. */
+long beta_run(BetaMachine* m, long steps);
+
+/* Goes back $steps instructions (BETA_HISTORY only). Returns the number
+   of instructions actually undone. */
+long beta_step_back(BetaMachine* m, long steps);
+
+/* Is the program still running (not halted, executing its own code or
+   the interrupt handler)? */
+bool beta_is_running(BetaMachine* m);
+
+/* Instructions retired since the machine was created or loaded. */
+uint64_t beta_retired(BetaMachine* m);
+
+/* Makes a keyboard interrupt pending, taken at the next block boundary.
+   Ignored if another is already pending. */
+void beta_raise_interrupt(BetaMachine* m, int type, int keyval);
+
+/* Registers R0..R31 (R31 reads 0, writes to it are ignored) and PC. */
+int32_t beta_get_register(BetaMachine* m, int reg);
+int beta_set_register(BetaMachine* m, int reg, int32_t value);
+uint32_t beta_get_pc(BetaMachine* m);
+int beta_set_pc(BetaMachine* m, uint32_t pc);
+
+/* Copies $size bytes of memory from or to $address. Writes are not
+   guest writes: they are not reported to the write callback and they
+   restart the history. */
+int beta_read_memory(BetaMachine* m, uint32_t address, void* out, size_t size);
+int beta_write_memory(BetaMachine* m, uint32_t address, const void* in, size_t size);
+
+/* Total memory size, and the start addresses of video and kernel memory
+   (which depend on the video mode). */
+uint32_t beta_memory_size(BetaMachine* m);
+uint32_t beta_video_address(BetaMachine* m);
+uint32_t beta_kernel_address(BetaMachine* m);
+
+/* Converts the whole framebuffer into $out, one 0x00BBGGRR word per
+   pixel row after row ($width * $height words). */
+void beta_read_screen(BetaMachine* m, uint32_t* out);
+
+/* Calls $callback for every guest write from now on ($callback NULL
+   stops). */
+int beta_set_write_callback(BetaMachine* m, BetaWriteCallback callback, void* data);
+
+/* Maps device registers on $size bytes at $address, a page aligned
+   range of the I/O window (0x40000000 to 0x40100000, see mmio.h) not
+   used by another device. $read or $store can be NULL (reads then
+   return 0, stores are ignored). */
+int beta_map_device(BetaMachine* m, uint32_t address, uint32_t size,
+                    BetaReadCallback read, BetaStoreCallback store, void* data);
+
+/* Copies the whole architectural state (registers, PC, interrupt state,
+   counters, the state of the devices and memory) in memory, only the
+   pages in use. Returns NULL on error. */
+BetaSnapshot* beta_snapshot(BetaMachine* m);
+
+/* Restores a snapshot of $m (or of a machine with the same video mode
+   and devices). */
+int beta_restore(BetaMachine* m, const BetaSnapshot* s);
+
+void beta_free_snapshot(BetaSnapshot* s);
+
+/* Save-states (see savestate.h), for snapshots kept in files. */
+int beta_save_state(BetaMachine* m, const char* path);
+int beta_load_state(BetaMachine* m, const char* path);
+
+#endif
@@ -0,0 +1,331 @@
+#include "loop_idioms.h"
+#include "history.h"
+#include "write_log.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LOOP_CACHE_SIZE 64
+
+enum{
+    LOOP_NONE = 0,
+    LOOP_FILL,
+    LOOP_COPY
+};
+
+typedef struct{
+
+    int reg; // base register, always one of the loop's pointers
+    int offset;
+    int pre; // 1 if the base is incremented before the access in the body
+
+} Access;
+
+typedef struct{
+
+    long branch_pc; // -1 when the entry is unused
+    long head;
+    int len; // number of instructions of the body (branch included), 0 if rejected early
+    int32_t body[LOOP_MAX_LEN]; // copy of the code, to notice self-modifications
+    int kind;
+
+    int counter;
+    int link; // Rc of the branch, written on every iteration
+    int nb_updates;
+    int update_reg[LOOP_MAX_LEN];
+    int update_delta[LOOP_MAX_LEN];
+    int delta[32]; // per register increment per iteration, 0 if not updated
+
+    Access store;
+    int value_reg;
+    Access load;
+    int load_target;
+
+} LoopIdiom;
+
+struct LoopCache{
+
+    LoopIdiom entries[LOOP_CACHE_SIZE];
+
+};
+
+struct LoopCache* new_loop_cache(){
+
+    struct LoopCache* cache = malloc(sizeof(struct LoopCache));
+
+    for(int i = 0; i < LOOP_CACHE_SIZE; i++)
+        cache->entries[i].branch_pc = -1;
+
+    return cache;
+}
+
+void free_loop_cache(struct LoopCache* cache){
+
+    free(cache);
+}
+
+static bool read_code(Computer* c, long addr, int32_t* word){
+
+    if(addr < 0 || addr + 4 > c->memory_size)
+        return false;
+
+    memcpy(word, c->memory + addr, 4);
+    return true;
+}
+
+static void analyze(Computer* c, long branch_pc, LoopIdiom* e){
+
+    int32_t branch;
+
+    e->branch_pc = branch_pc;
+    e->kind = LOOP_NONE;
+    e->len = 0;
+
+    if(!read_code(c, branch_pc, &branch))
+        return;
+
+    e->body[0] = branch;
+
+    if(((branch >> 26) & 0x3F) != 0x1E) // BNE
+        return;
+
+    long head = branch_pc + 4 + 4 * (long) extract_literal(branch);
+    long len = (branch_pc - head) / 4 + 1;
+
+    if(head < 0 || head > branch_pc || len > LOOP_MAX_LEN)
+        return;
+
+    for(int i = 0; i < len; i++)
+        read_code(c, head + 4 * i, &e->body[i]);
+
+    e->head = head;
+    e->len = len;
+    e->counter = (branch >> 16) & 0x1F;
+    e->link = (branch >> 21) & 0x1F;
+    e->nb_updates = 0;
+    memset(e->delta, 0, sizeof(e->delta));
+
+    int update_pos[32];
+    int store_pos = -1, load_pos = -1;
+
+    for(int r = 0; r < 32; r++)
+        update_pos[r] = -1;
+
+    for(int i = 0; i < len - 1; i++){
+
+        int32_t instruction = e->body[i];
+        int opcode = (instruction >> 26) & 0x3F;
+        int rc = (instruction >> 21) & 0x1F;
+        int ra = (instruction >> 16) & 0x1F;
+        int literal = extract_literal(instruction);
+
+        switch(opcode){
+            case 0x30: // ADDC
+            case 0x31: // SUBC
+                if(rc != ra || rc == 31 || update_pos[rc] >= 0)
+                    return;
+                update_pos[rc] = i;
+                e->delta[rc] = opcode == 0x30 ? literal : -literal;
+                e->update_reg[e->nb_updates] = rc;
+                e->update_delta[e->nb_updates++] = e->delta[rc];
+                break;
+            case 0x18: // LD
+                if(load_pos >= 0 || rc == 31)
+                    return;
+                load_pos = i;
+                e->load.reg = ra;
+                e->load.offset = literal;
+                e->load_target = rc;
+                break;
+            case 0x19: // ST
+                if(store_pos >= 0)
+                    return;
+                store_pos = i;
+                e->store.reg = ra;
+                e->store.offset = literal;
+                e->value_reg = rc;
+                break;
+            default:
+                return;
+        }
+    }
+
+    int counter = e->counter;
+    int link = e->link;
+
+    if(store_pos < 0 || counter == 31 || update_pos[counter] < 0
+       || (e->delta[counter] != 1 && e->delta[counter] != -1))
+        return;
+
+    if(link != 31 && (link == counter || update_pos[link] >= 0))
+        return;
+
+    if(e->store.reg == counter || (e->delta[e->store.reg] != 4 && e->delta[e->store.reg] != -4))
+        return;
+
+    e->store.pre = update_pos[e->store.reg] < store_pos;
+
+    if(load_pos >= 0){
+
+        int target = e->load_target;
+
+        if(e->load.reg == counter || (e->delta[e->load.reg] != 4 && e->delta[e->load.reg] != -4))
+            return;
+
+        if(load_pos > store_pos || e->value_reg != target || update_pos[target] >= 0
+           || target == link || target == e->load.reg)
+            return;
+
+        e->load.pre = update_pos[e->load.reg] < load_pos;
+        e->kind = LOOP_COPY;
+    }
+
+    else{
+
+        if(e->value_reg != 31 && (update_pos[e->value_reg] >= 0 || e->value_reg == link))
+            return;
+
+        e->kind = LOOP_FILL;
+    }
+}
+
+static LoopIdiom* lookup(Computer* c, long branch_pc){
+
+    LoopIdiom* e = &c->loop_cache->entries[(branch_pc >> 2) & (LOOP_CACHE_SIZE - 1)];
+
+    if(e->branch_pc == branch_pc){
+
+        if(e->len > 0 && e->head >= 0 && e->head + 4 * e->len <= c->memory_size
+           && memcmp(c->memory + e->head, e->body, 4 * e->len) == 0)
+            return e;
+
+        int32_t branch;
+
+        if(e->len == 0 && read_code(c, branch_pc, &branch) && branch == e->body[0])
+            return e;
+    }
+
+    analyze(c, branch_pc, e);
+
+    return e;
+}
+
+/* Computes the range [$lo, $hi[ touched by $k iterations of access $a
+   and returns false if it leaves memory. $first is the first address. */
+static bool access_range(Computer* c, LoopIdiom* e, Access* a, long k,
+                         long* first, long* lo, long* hi){
+
+    long delta = e->delta[a->reg];
+    *first = (long) get_register(c, a->reg) + delta * a->pre + a->offset;
+    long last = *first + delta * (k - 1);
+
+    *lo = *first < last ? *first : last;
+    *hi = (*first < last ? last : *first) + 4;
+
+    return *lo >= 0 && *hi <= c->memory_size;
+}
+
+static bool overlap(long lo1, long hi1, long lo2, long hi2){
+
+    return lo1 < hi2 && lo2 < hi1;
+}
+
+void fill_words(unsigned char* dst, int32_t value, long count){
+
+    unsigned char b = value & 0xff;
+
+    if((uint32_t) value == b * 0x01010101u){
+        memset(dst, b, count * 4);
+        return;
+    }
+
+    memcpy(dst, &value, 4);
+
+    for(long done = 1; done < count; ){
+        long n = done < count - done ? done : count - done;
+        memcpy(dst + done * 4, dst, n * 4);
+        done += n;
+    }
+}
+
+long run_loop_idiom(Computer* c, long branch_pc, long max_steps){
+
+    if(c->loop_cache == NULL)
+        return 0;
+
+    LoopIdiom* e = lookup(c, branch_pc);
+
+    if(e->kind == LOOP_NONE || c->cpu.program_counter != e->head)
+        return 0;
+
+    // iterations left: the branch falls through when the counter reaches 0
+    long count = get_register(c, e->counter);
+    long n = e->delta[e->counter] < 0 ? count : -count;
+    long k = max_steps / e->len;
+
+    if(k > n)
+        k = n;
+
+    if(k < 2)
+        return 0;
+
+    long store_first, store_lo, store_hi;
+
+    if(!access_range(c, e, &e->store, k, &store_first, &store_lo, &store_hi)
+       || overlap(store_lo, store_hi, e->head, branch_pc + 4))
+        return 0;
+
+    if(e->kind == LOOP_FILL){
+
+        if(c->history != NULL)
+            history_write(c, store_lo, store_hi - store_lo);
+
+        fill_words(c->memory + store_lo, get_register(c, e->value_reg), k);
+    }
+
+    else{
+
+        long load_first, load_lo, load_hi;
+
+        // loads of the timing registers compute them (see KERNEL_TIMING)
+        if(!access_range(c, e, &e->load, k, &load_first, &load_lo, &load_hi)
+           || overlap(store_lo, store_hi, load_lo, load_hi)
+           || overlap(load_lo, load_hi, c->timing_start, c->timing_start + KERNEL_TIMING_SZ))
+            return 0;
+
+        if(c->history != NULL)
+            history_write(c, store_lo, store_hi - store_lo);
+
+        long load_delta = e->delta[e->load.reg];
+        long store_delta = e->delta[e->store.reg];
+
+        if(load_delta == store_delta){
+            memcpy(c->memory + store_lo, c->memory + load_lo, 4 * k);
+        } else {
+            for(long i = 0; i < k; i++)
+                memcpy(c->memory + store_first + store_delta * i,
+                       c->memory + load_first + load_delta * i, 4);
+        }
+
+        memcpy(&c->cpu.registers[e->load_target],
+               c->memory + load_first + load_delta * (k - 1), 4);
+    }
+
+    for(int i = 0; i < e->nb_updates; i++){
+        int r = e->update_reg[i];
+        c->cpu.registers[r] = (int) ((unsigned) c->cpu.registers[r] + (unsigned) (e->update_delta[i] * k));
+    }
+
+    c->cpu.registers[e->link] = branch_pc + 4;
+    c->cpu.program_counter = k == n ? branch_pc + 4 : e->head;
+    c->latest_accessed = branch_pc; // the branch was the last instruction fetched
+    c->retired += k * e->len;
+    mark_video_dirty(c, store_lo, store_hi);
+
+    if(c->write_log != NULL){
+        int32_t first;
+        memcpy(&first, c->memory + store_first, 4);
+        log_write(c, store_lo, store_hi - store_lo, first);
+    }
+
+    return k * e->len;
+}
@@ -0,0 +1,41 @@
+#ifndef LOOP_IDIOMS_H__
+#define LOOP_IDIOMS_H__
+
+#include "emulator.h"
+
+/* Loop idiom recognition: counted loops whose body only stores one
+   register into contiguous words (fills, e.g. fill_screen.asm) or
+   loads words and stores them to another contiguous range (copies)
+   are executed as a single host memset/memcpy-like operation.
+
+   A recognized loop looks like (in any order, branch last)
+       ST(Rv, off, Rp)            | or LD(Rs, off, Rt) ... ST(Rt, off, Rd)
+       ADDC/SUBC(Rp, 4, Rp)       | one update per pointer, stride +-4
+       SUBC/ADDC(Rn, 1, Rn)       | counter
+       BNE(Rn, loop, Rl)
+   Registers, PC, the retired instruction counter, latest_accessed and
+   the video dirty range end up exactly as if the loop had been
+   interpreted. Loops whose stores would hit their own code, leave
+   memory or overlap their source, and copies loading the timing
+   registers (see KERNEL_TIMING), are left to the interpreter. */
+
+#define LOOP_MAX_LEN 8
+
+/* Stores $value into $count words from $dst, with memset() or by
+   doubling memcpy() calls. */
+void fill_words(unsigned char* dst, int32_t value, long count);
+
+/* Allocates the cache of analyzed loops used by run_loop_idiom(). */
+struct LoopCache* new_loop_cache();
+
+/* Frees a cache allocated by new_loop_cache(), $cache can be NULL. */
+void free_loop_cache(struct LoopCache* cache);
+
+/* Called right after the backward branch at $branch_pc was taken (so
+   PC is at the head of the loop). If the loop is a fill or a copy, runs
+   as many whole iterations as fit in $max_steps instructions in bulk.
+   Returns the number of instructions retired that way (0 if the loop
+   was not recognized or is not worth it). */
+long run_loop_idiom(Computer* c, long branch_pc, long max_steps);
+
+#endif
@@ -0,0 +1,314 @@
+#include "mmio.h"
+#include "pipeline.h"
+#include "history.h"
+#include <string.h>
+
+static void free_device(Device* d){
+
+    free(d->data);
+    free(d);
+}
+
+bool map_device(Computer* c, Device* d){
+
+    if(d->start < MMIO_BASE || d->end > MMIO_BASE + MMIO_SIZE || d->start >= d->end
+       || (d->start - MMIO_BASE) % MEMORY_PAGE_SZ != 0){
+        fprintf(stderr, "Error: device %s [%.8lx, %.8lx[ is not a page aligned range of the I/O window\n",
+                d->name, d->start, d->end);
+        free_device(d);
+        return false;
+    }
+
+    if(c->bus == NULL)
+        c->bus = calloc(1, sizeof(Bus));
+
+    Bus* b = c->bus;
+    long first = (d->start - MMIO_BASE) / MEMORY_PAGE_SZ;
+    long last = (d->end - 1 - MMIO_BASE) / MEMORY_PAGE_SZ;
+
+    for(long page = first; page <= last; page++){
+        if(b->pages[page] != NULL){
+            fprintf(stderr, "Error: device %s overlaps device %s\n", d->name, b->pages[page]->name);
+            free_device(d);
+            return false;
+        }
+    }
+
+    if(b->nb_devices == MMIO_MAX_DEVICES){
+        fprintf(stderr, "Error: too many devices\n");
+        free_device(d);
+        return false;
+    }
+
+    for(long page = first; page <= last; page++)
+        b->pages[page] = d;
+
+    b->devices[b->nb_devices++] = d;
+    schedule_device_event(c, d, d->deadline);
+
+    // older checkpoints do not have its state
+    reset_history(c);
+
+    return true;
+}
+
+void enable_default_devices(Computer* c){
+
+    map_device(c, new_cycle_counter());
+    map_device(c, new_interval_timer());
+}
+
+void disable_bus(Computer* c){
+
+    if(c->bus == NULL)
+        return;
+
+    for(int i = 0; i < c->bus->nb_devices; i++)
+        free_device(c->bus->devices[i]);
+
+    free(c->bus);
+    c->bus = NULL;
+    c->next_device_event = NO_DEVICE_EVENT;
+    reset_history(c);
+}
+
+static inline Device* device_at(Computer* c, long addr){
+
+    if(c->bus == NULL)
+        return NULL;
+
+    Device* d = c->bus->pages[(addr - MMIO_BASE) / MEMORY_PAGE_SZ];
+
+    return d != NULL && addr < d->end ? d : NULL;
+}
+
+int32_t mmio_read(Computer* c, long addr){
+
+    Device* d = device_at(c, addr);
+
+    if(d == NULL || d->read == NULL)
+        return 0;
+
+    c->bus->reads++;
+
+    return d->read(c, d, (addr - d->start) & ~3L);
+}
+
+void mmio_write(Computer* c, long addr, int32_t value){
+
+    Device* d = device_at(c, addr);
+
+    if(d == NULL || d->write == NULL)
+        return;
+
+    c->bus->writes++;
+    d->write(c, d, (addr - d->start) & ~3L, value);
+}
+
+void schedule_device_event(Computer* c, Device* d, unsigned long long deadline){
+
+    d->deadline = deadline;
+
+    if(deadline < c->next_device_event){
+        c->next_device_event = deadline;
+        return;
+    }
+
+    c->next_device_event = NO_DEVICE_EVENT;
+
+    for(int i = 0; i < c->bus->nb_devices; i++)
+        if(c->bus->devices[i]->deadline < c->next_device_event)
+            c->next_device_event = c->bus->devices[i]->deadline;
+}
+
+void run_device_events(Computer* c){
+
+    for(int i = 0; i < c->bus->nb_devices; i++){
+
+        Device* d = c->bus->devices[i];
+
+        if(d->deadline <= c->retired && d->event != NULL)
+            d->event(c, d);
+    }
+}
+
+// a device's state: its start address, deadline and $state_size bytes
+#define DEVICE_STATE_HEADER 16
+
+size_t bus_state_size(Computer* c){
+
+    size_t size = 0;
+
+    for(int i = 0; c->bus != NULL && i < c->bus->nb_devices; i++)
+        size += DEVICE_STATE_HEADER + c->bus->devices[i]->state_size;
+
+    return size;
+}
+
+void save_bus_state(Computer* c, unsigned char* state){
+
+    for(int i = 0; c->bus != NULL && i < c->bus->nb_devices; i++){
+
+        Device* d = c->bus->devices[i];
+        int64_t start = d->start;
+        uint64_t deadline = d->deadline;
+
+        memcpy(state, &start, 8);
+        memcpy(state + 8, &deadline, 8);
+        memcpy(state + DEVICE_STATE_HEADER, d->data, d->state_size);
+        state += DEVICE_STATE_HEADER + d->state_size;
+    }
+}
+
+bool restore_bus_state(Computer* c, const unsigned char* state){
+
+    const unsigned char* p = state;
+
+    // the same devices, in the same order
+    for(int i = 0; c->bus != NULL && i < c->bus->nb_devices; i++){
+
+        int64_t start;
+        memcpy(&start, p, 8);
+
+        if(start != c->bus->devices[i]->start)
+            return false;
+
+        p += DEVICE_STATE_HEADER + c->bus->devices[i]->state_size;
+    }
+
+    c->next_device_event = NO_DEVICE_EVENT;
+
+    for(int i = 0; c->bus != NULL && i < c->bus->nb_devices; i++){
+
+        Device* d = c->bus->devices[i];
+        uint64_t deadline;
+
+        memcpy(&deadline, state + 8, 8);
+        memcpy(d->data, state + DEVICE_STATE_HEADER, d->state_size);
+        state += DEVICE_STATE_HEADER + d->state_size;
+
+        d->deadline = deadline;
+
+        if(deadline < c->next_device_event)
+            c->next_device_event = deadline;
+    }
+
+    return true;
+}
+
+/* Cycle counter */
+
+typedef struct{
+
+    uint32_t cycles_hi;
+    uint32_t retired_hi;
+
+} CycleCounter;
+
+static int32_t cycle_counter_read(Computer* c, Device* d, long offset){
+
+    CycleCounter* counter = d->data;
+    unsigned long long cycles = c->pipeline != NULL ? pipeline_cycles(c->pipeline) : c->retired + c->block_cycles;
+
+    switch(offset){
+        case CYCLE_COUNTER_CYCLES_LO:
+            counter->cycles_hi = cycles >> 32;
+            return cycles;
+        case CYCLE_COUNTER_CYCLES_HI:
+            return counter->cycles_hi;
+        case CYCLE_COUNTER_RETIRED_LO:
+            counter->retired_hi = c->retired >> 32;
+            return c->retired;
+        case CYCLE_COUNTER_RETIRED_HI:
+            return counter->retired_hi;
+        default:
+            return 0;
+    }
+}
+
+Device* new_cycle_counter(void){
+
+    Device* d = calloc(1, sizeof(Device));
+
+    d->name = "cycle counter";
+    d->start = CYCLE_COUNTER_BASE;
+    d->end = CYCLE_COUNTER_BASE + 16;
+    d->read = cycle_counter_read;
+    d->deadline = NO_DEVICE_EVENT;
+    d->data = calloc(1, sizeof(CycleCounter));
+    d->state_size = sizeof(CycleCounter);
+
+    return d;
+}
+
+/* Interval timer */
+
+typedef struct{
+
+    uint32_t period;
+    uint32_t ticks;
+
+} IntervalTimer;
+
+static int32_t timer_read(Computer* c, Device* d, long offset){
+
+    IntervalTimer* t = d->data;
+
+    switch(offset){
+        case TIMER_PERIOD:
+            return t->period;
+        case TIMER_COUNT:
+            return d->deadline == NO_DEVICE_EVENT ? 0
+                 : d->deadline > c->retired ? d->deadline - c->retired : 0;
+        case TIMER_TICKS:
+            return t->ticks;
+        default:
+            return 0;
+    }
+}
+
+static void timer_write(Computer* c, Device* d, long offset, int32_t value){
+
+    IntervalTimer* t = d->data;
+
+    switch(offset){
+        case TIMER_PERIOD:
+            t->period = value;
+            schedule_device_event(c, d, t->period > 0 ? c->retired + t->period : NO_DEVICE_EVENT);
+            break;
+        case TIMER_TICKS:
+            t->ticks = value;
+            break;
+    }
+}
+
+static void timer_event(Computer* c, Device* d){
+
+    IntervalTimer* t = d->data;
+
+    // another interrupt is being handled: retried before every instruction until it returns
+    if(c->interrupt_raised)
+        return;
+
+    // before delivering: the history checkpoint it takes must see the next tick
+    t->ticks++;
+    schedule_device_event(c, d, c->retired + t->period);
+    deliver_interrupt(c, INTERRUPT_TIMER, 0);
+}
+
+Device* new_interval_timer(void){
+
+    Device* d = calloc(1, sizeof(Device));
+
+    d->name = "interval timer";
+    d->start = TIMER_BASE;
+    d->end = TIMER_BASE + 12;
+    d->read = timer_read;
+    d->write = timer_write;
+    d->event = timer_event;
+    d->deadline = NO_DEVICE_EVENT;
+    d->data = calloc(1, sizeof(IntervalTimer));
+    d->state_size = sizeof(IntervalTimer);
+
+    return d;
+}
@@ -0,0 +1,115 @@
+#ifndef MMIO_H__
+#define MMIO_H__
+
+#include "emulator.h"
+#include <stdint.h>
+
+/* Memory-mapped devices.
+
+   Devices live in a window of MMIO_PAGES pages at MMIO_BASE, far above
+   the memory. LD and ST whose address falls in the window (one subtract
+   and compare, RAM accesses pay nothing else) are dispatched to the
+   device mapped on that page; reads of unmapped pages return 0 and
+   writes to them are ignored. Only aligned words are supported, and
+   SWAP, CAS and LDR always access memory.
+
+   Devices can also ask run_steps() to call them back once c -> retired
+   reaches a deadline, which is how they raise interrupts.
+
+   The state of a device is its deadline and the first $state_size bytes
+   of its $data: history checkpoints (see history.h), save-states (see
+   savestate.h) and libbeta snapshots save and restore it with the rest
+   of the machine, so that the interrupts of the timer come back at the
+   same instructions after seeking or loading. Mapping a device or
+   detaching the bus restarts the history. */
+
+#define MMIO_BASE 0x40000000L
+#define MMIO_PAGES 256
+#define MMIO_SIZE (MMIO_PAGES * MEMORY_PAGE_SZ)
+#define MMIO_MAX_DEVICES 16
+
+#define NO_DEVICE_EVENT (~0ULL)
+
+/* Cycle counter, read-only. Reading a low word latches the high word
+   read next, so that the 64-bit value is consistent. Cycles are the ones
+   of the pipeline model when attached (see pipeline.h), one per
+   instruction plus the memory cycles of FILL and COPY otherwise. */
+#define CYCLE_COUNTER_BASE MMIO_BASE
+#define CYCLE_COUNTER_CYCLES_LO 0
+#define CYCLE_COUNTER_CYCLES_HI 4
+#define CYCLE_COUNTER_RETIRED_LO 8
+#define CYCLE_COUNTER_RETIRED_HI 12
+
+/* Programmable interval timer, raising an INTERRUPT_TIMER interrupt
+   every PERIOD instructions. Writing PERIOD restarts it, 0 stops it.
+   A tick arriving while another interrupt is being handled waits for the
+   handler to return; the next one is PERIOD instructions after it was
+   delivered. */
+#define TIMER_BASE (MMIO_BASE + MEMORY_PAGE_SZ)
+#define TIMER_PERIOD 0
+#define TIMER_COUNT 4 // instructions until the next tick (read-only)
+#define TIMER_TICKS 8 // ticks delivered (writing sets it)
+
+typedef struct Device{
+
+    const char* name;
+    long start, end; // [start, end[, start is page aligned
+
+    int32_t (*read)(Computer* c, struct Device* d, long offset);
+    void (*write)(Computer* c, struct Device* d, long offset, int32_t value);
+    void (*event)(Computer* c, struct Device* d); // called once c -> retired >= deadline
+    unsigned long long deadline; // NO_DEVICE_EVENT if none
+
+    void* data; // freed with the device
+    size_t state_size; // bytes at the start of $data saved with the deadline (0 if stateless)
+
+} Device;
+
+typedef struct Bus{
+
+    Device* devices[MMIO_MAX_DEVICES];
+    int nb_devices;
+    Device* pages[MMIO_PAGES]; // device mapped on each page of the window, NULL if none
+
+    unsigned long long reads;
+    unsigned long long writes;
+
+} Bus;
+
+static inline bool is_mmio(long addr){
+
+    return (unsigned long) (addr - MMIO_BASE) < MMIO_SIZE;
+}
+
+/* Maps $d on $c's bus (attaching a bus to $c if it has none); $c then
+   owns it. Returns false (reporting the error and freeing $d) if its
+   range leaves the window or overlaps another device. */
+bool map_device(Computer* c, Device* d);
+
+/* Maps the cycle counter and the interval timer on $c's bus. */
+void enable_default_devices(Computer* c);
+
+/* Detaches $c's bus and frees its devices. */
+void disable_bus(Computer* c);
+
+/* Called by execute_step() for LD and ST with an address inside the window. */
+int32_t mmio_read(Computer* c, long addr);
+void mmio_write(Computer* c, long addr, int32_t value);
+
+/* Sets the deadline of $d, c -> next_device_event is kept up to date. */
+void schedule_device_event(Computer* c, Device* d, unsigned long long deadline);
+
+/* Called by run_steps() once c -> retired reaches c -> next_device_event. */
+void run_device_events(Computer* c);
+
+/* Size of the state of $c's devices (0 without a bus), then saving it
+   into $state and restoring it from there. restore_bus_state() returns
+   false, changing nothing, if $state was saved from other devices. */
+size_t bus_state_size(Computer* c);
+void save_bus_state(Computer* c, unsigned char* state);
+bool restore_bus_state(Computer* c, const unsigned char* state);
+
+Device* new_cycle_counter(void);
+Device* new_interval_timer(void);
+
+#endif
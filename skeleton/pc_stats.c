@@ -0,0 +1,126 @@
+#include "pc_stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY 1024
+
+static void allocate(PcStats* s, long capacity){
+
+    s->capacity = capacity;
+    s->count = 0;
+    s->pcs = malloc(capacity * sizeof(long));
+    s->counters = calloc(capacity * s->nb_counters, sizeof(unsigned long long));
+
+    for(long i = 0; i < capacity; i++)
+        s->pcs[i] = -1;
+}
+
+PcStats* new_pc_stats(int nb_counters){
+
+    PcStats* s = malloc(sizeof(PcStats));
+    s->nb_counters = nb_counters;
+    allocate(s, INITIAL_CAPACITY);
+
+    return s;
+}
+
+void free_pc_stats(PcStats* s){
+
+    if(s == NULL)
+        return;
+
+    free(s->pcs);
+    free(s->counters);
+    free(s);
+}
+
+void clear_pc_stats(PcStats* s){
+
+    free(s->pcs);
+    free(s->counters);
+    allocate(s, INITIAL_CAPACITY);
+}
+
+static inline long slot_of(PcStats* s, long pc){
+
+    unsigned long h = ((unsigned long) pc >> 2) * 0x9E3779B97F4A7C15UL;
+    long mask = s->capacity - 1;
+    long i = (h >> 20) & mask;
+
+    while(s->pcs[i] != pc && s->pcs[i] != -1)
+        i = (i + 1) & mask;
+
+    return i;
+}
+
+static void grow(PcStats* s){
+
+    long old_capacity = s->capacity;
+    long* old_pcs = s->pcs;
+    unsigned long long* old_counters = s->counters;
+
+    allocate(s, 2 * old_capacity);
+
+    for(long i = 0; i < old_capacity; i++){
+
+        if(old_pcs[i] == -1)
+            continue;
+
+        long j = slot_of(s, old_pcs[i]);
+        s->pcs[j] = old_pcs[i];
+        memcpy(s->counters + j * s->nb_counters, old_counters + i * s->nb_counters,
+               s->nb_counters * sizeof(unsigned long long));
+        s->count++;
+    }
+
+    free(old_pcs);
+    free(old_counters);
+}
+
+unsigned long long* pc_counters(PcStats* s, long pc){
+
+    long i = slot_of(s, pc);
+
+    if(s->pcs[i] == -1){
+
+        if(2 * (s->count + 1) > s->capacity){
+            grow(s);
+            i = slot_of(s, pc);
+        }
+
+        s->pcs[i] = pc;
+        s->count++;
+    }
+
+    return s->counters + i * s->nb_counters;
+}
+
+int top_pcs(PcStats* s, int counter, long* pcs, int n){
+
+    int found = 0;
+
+    // insertion into the short sorted list $pcs
+    for(long i = 0; i < s->capacity; i++){
+
+        if(s->pcs[i] == -1)
+            continue;
+
+        unsigned long long value = s->counters[i * s->nb_counters + counter];
+
+        if(value == 0)
+            continue;
+
+        int j = found < n ? found++ : n;
+
+        while(j > 0 && *(pc_counters(s, pcs[j - 1]) + counter) < value){
+            if(j < n)
+                pcs[j] = pcs[j - 1];
+            j--;
+        }
+
+        if(j < n)
+            pcs[j] = s->pcs[i];
+    }
+
+    return found;
+}
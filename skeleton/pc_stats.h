@@ -0,0 +1,36 @@
+#ifndef PC_STATS_H__
+#define PC_STATS_H__
+
+#include <stdbool.h>
+
+/* Per-instruction counters: a hash table from a PC to a fixed number of
+   unsigned long long counters, used by the timing models to attribute
+   stalls, misses and mispredictions to the instructions causing them. */
+
+typedef struct{
+
+    int nb_counters;
+    long capacity; // power of two
+    long count;
+    long* pcs;     // -1 for an empty slot
+    unsigned long long* counters; // nb_counters per slot
+
+} PcStats;
+
+/* Allocates a table with $nb_counters counters per PC. */
+PcStats* new_pc_stats(int nb_counters);
+
+void free_pc_stats(PcStats* s);
+
+/* Forgets every PC. */
+void clear_pc_stats(PcStats* s);
+
+/* Returns the counters of $pc, zeroed the first time $pc is seen. */
+unsigned long long* pc_counters(PcStats* s, long pc);
+
+/* Stores in $pcs the (at most $n) PCs with the largest $counter,
+   largest first, and returns how many were stored. PCs whose counter is
+   0 are skipped. */
+int top_pcs(PcStats* s, int counter, long* pcs, int n);
+
+#endif
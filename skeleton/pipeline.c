@@ -0,0 +1,194 @@
+#include "pipeline.h"
+#include "cache.h"
+#include "branch_predictor.h"
+#include <string.h>
+
+Pipeline* enable_pipeline(Computer* c, int bypass, int branch_penalty){
+
+    disable_pipeline(c);
+
+    Pipeline* p = calloc(1, sizeof(Pipeline));
+
+    p->bypass = bypass;
+    p->branch_penalty = branch_penalty;
+    p->last_fetch = -1;
+    p->last_execute = -1;
+    p->last_writeback = -1;
+    p->expected_pc = c->cpu.program_counter;
+    p->per_pc = new_pc_stats(PIPELINE_NB_COUNTERS);
+
+    c->pipeline = p;
+
+    return p;
+}
+
+void disable_pipeline(Computer* c){
+
+    if(c->pipeline == NULL)
+        return;
+
+    free_pc_stats(c->pipeline->per_pc);
+    free(c->pipeline);
+    c->pipeline = NULL;
+}
+
+static inline long long max_cycle(long long a, long long b){
+
+    return a > b ? a : b;
+}
+
+void pipeline_after_step(Computer* c, long pc, int32_t instruction){
+
+    Pipeline* p = c->pipeline;
+    Instruction d = decode(instruction);
+    Operands o = instruction_operands(c, d, pc);
+    unsigned long long* counters = pc_counters(p->per_pc, pc);
+
+    // IF: after the previous fetch, and ID must have been freed
+    long long fetch = max_cycle(p->last_fetch + 1, p->last_execute - 1);
+
+    // the previous instruction redirected the fetch (taken or mispredicted
+    // branch, jump or interrupt): the target is fetched once it resolved
+    if(pc != p->expected_pc && p->instructions > 0){
+
+        long long redirected = max_cycle(fetch, p->last_execute + p->branch_penalty - 1);
+
+        p->stalls[PIPELINE_BRANCH_STALLS] += redirected - fetch;
+        pc_counters(p->per_pc, p->last_pc)[PIPELINE_BRANCH_STALLS] += redirected - fetch;
+        counters = pc_counters(p->per_pc, pc); // the table may have grown
+        fetch = redirected;
+    }
+
+    int fetch_cycles = c->caches != NULL ? c->caches->fetch_cycles : 0;
+    int data_cycles = c->caches != NULL ? c->caches->data_cycles : 0;
+
+    // FILL and COPY stay in MEM for each word they access
+    if((d.opcode == 0x14 || d.opcode == 0x15) && o.kind != INSTR_INVALID && c->block_cost > 1)
+        data_cycles += c->block_cost - 1;
+
+    if(fetch_cycles + data_cycles > 0){
+        p->stalls[PIPELINE_MEMORY_STALLS] += fetch_cycles + data_cycles;
+        counters[PIPELINE_MEMORY_STALLS] += fetch_cycles + data_cycles;
+    }
+
+    // an instruction cache miss keeps it in IF
+    fetch += fetch_cycles;
+
+    // EX: once every source can be forwarded
+    long long natural = max_cycle(fetch + 2, p->last_execute + 1);
+    long long execute = natural;
+    bool load_use = false;
+
+    for(int i = 0; i < o.nb_sources; i++){
+
+        int r = o.sources[i];
+
+        if(p->ready[r] > execute){
+            execute = p->ready[r];
+            load_use = p->loaded[r];
+        }
+    }
+
+    if(execute > natural){
+        int kind = load_use ? PIPELINE_LOAD_USE_STALLS : PIPELINE_DATA_STALLS;
+        p->stalls[kind] += execute - natural;
+        counters[kind] += execute - natural;
+    }
+
+    if(o.destination >= 0){
+
+        bool from_memory = o.kind == INSTR_LOAD || o.kind == INSTR_ATOMIC;
+
+        // value available at the end of EX (or MEM for loads), written in WB
+        if(p->bypass == PIPELINE_BYPASS_FULL)
+            p->ready[o.destination] = execute + (from_memory ? 2 : 1);
+        else if(p->bypass == PIPELINE_BYPASS_MEM)
+            p->ready[o.destination] = execute + 2;
+        else
+            p->ready[o.destination] = execute + 3;
+
+        p->loaded[o.destination] = from_memory;
+    }
+
+    // a data cache miss keeps it in MEM, and the next one in EX
+    if(o.destination >= 0 && (o.kind == INSTR_LOAD || o.kind == INSTR_ATOMIC))
+        p->ready[o.destination] += data_cycles;
+
+    execute += data_cycles;
+
+    counters[PIPELINE_EXECUTED]++;
+    p->stalls[PIPELINE_EXECUTED]++;
+    p->instructions++;
+    p->last_fetch = fetch;
+    p->last_execute = execute;
+    p->last_writeback = execute + 2; // WB follows MEM
+    p->last_pc = pc;
+
+    // instructions are fetched sequentially, or from the predicted target
+    if(c->predictor != NULL && c->predictor->predicted)
+        p->expected_pc = c->predictor->mispredicted ? -1 : c->cpu.program_counter;
+    else
+        p->expected_pc = pc + 4;
+}
+
+unsigned long long pipeline_cycles(Pipeline* p){
+
+    return p->last_writeback + 1;
+}
+
+void format_pipeline_stats(Computer* c, char* buf, size_t len, int top){
+
+    Pipeline* p = c->pipeline;
+    unsigned long long cycles = pipeline_cycles(p);
+    static const char* bypass_names[] = {"none", "from MEM", "full"};
+
+    size_t n = snprintf(buf, len, "pipeline: bypass %s, branch penalty %d\n"
+                        "%llu instructions, %llu cycles, CPI %.3f\n"
+                        "stall cycles: data %llu, load-use %llu, branch %llu, memory %llu\n",
+                        bypass_names[p->bypass], p->branch_penalty, p->instructions, cycles,
+                        p->instructions > 0 ? (double) cycles / p->instructions : 0.0,
+                        p->stalls[PIPELINE_DATA_STALLS], p->stalls[PIPELINE_LOAD_USE_STALLS],
+                        p->stalls[PIPELINE_BRANCH_STALLS], p->stalls[PIPELINE_MEMORY_STALLS]);
+
+    if(top <= 0 || n >= len)
+        return;
+
+    // rank the PCs by their total stall cycles
+    PcStats* totals = new_pc_stats(1);
+
+    for(long i = 0; i < p->per_pc->capacity; i++){
+
+        if(p->per_pc->pcs[i] == -1)
+            continue;
+
+        unsigned long long* s = p->per_pc->counters + i * PIPELINE_NB_COUNTERS;
+        *pc_counters(totals, p->per_pc->pcs[i]) = s[PIPELINE_DATA_STALLS]
+                                                  + s[PIPELINE_LOAD_USE_STALLS]
+                                                  + s[PIPELINE_BRANCH_STALLS]
+                                                  + s[PIPELINE_MEMORY_STALLS];
+    }
+
+    long* pcs = malloc(top * sizeof(long));
+    int found = top_pcs(totals, 0, pcs, top);
+
+    n += snprintf(buf + n, len - n, "%-10s %-24s %12s %10s %10s %10s %10s\n",
+                  "PC", "instruction", "executed", "data", "load-use", "branch", "memory");
+
+    for(int i = 0; i < found && n < len; i++){
+
+        unsigned long long* s = pc_counters(p->per_pc, pcs[i]);
+        char text[64];
+
+        if(pcs[i] >= 0 && pcs[i] + 4 <= c->memory_size)
+            disassemble(*(int32_t*) (c->memory + pcs[i]), text);
+        else
+            strcpy(text, "?");
+
+        n += snprintf(buf + n, len - n, "%.8lx   %-24s %12llu %10llu %10llu %10llu %10llu\n", pcs[i], text,
+                      s[PIPELINE_EXECUTED], s[PIPELINE_DATA_STALLS], s[PIPELINE_LOAD_USE_STALLS],
+                      s[PIPELINE_BRANCH_STALLS], s[PIPELINE_MEMORY_STALLS]);
+    }
+
+    free(pcs);
+    free_pc_stats(totals);
+}
@@ -0,0 +1,84 @@
+#ifndef PIPELINE_H__
+#define PIPELINE_H__
+
+#include "emulator.h"
+#include "pc_stats.h"
+
+/* Timing model of a classic in-order IF/ID/EX/MEM/WB pipeline.
+
+   The functional core still executes every instruction; after each one,
+   the model receives it (decoded with decode() and instruction_operands())
+   and computes the cycle at which it enters every stage, so the
+   architectural state is exactly the one of the functional core. It
+   models:
+   - data hazards: an instruction waits in ID until its sources can be
+     forwarded to EX. With PIPELINE_BYPASS_FULL, ALU results are forwarded
+     from the end of EX and loaded values from the end of MEM (one cycle
+     load-use stall); PIPELINE_BYPASS_MEM only forwards from the end of
+     MEM; PIPELINE_BYPASS_NONE reads the register file in ID, written in
+     the first half of WB.
+   - control hazards: instructions are fetched sequentially and taken
+     BEQ/BNE, JMP and interrupts annul the $branch_penalty instructions
+     fetched after them (2 when resolved at the end of EX). With a branch
+     predictor (see branch_predictor.h) only mispredictions pay it.
+   - memory: when the cache model is attached, IF and MEM last longer on
+     misses and stall the instructions behind them. FILL and COPY stay
+     in MEM one cycle per word accessed (see emulator.h).
+   Stall cycles are counted per PC. While a timing model is attached,
+   run_steps() does not execute loops in bulk. */
+
+enum{
+    PIPELINE_BYPASS_NONE,
+    PIPELINE_BYPASS_MEM,
+    PIPELINE_BYPASS_FULL
+};
+
+// per-PC counters
+enum{
+    PIPELINE_EXECUTED,
+    PIPELINE_DATA_STALLS,     // cycles waiting for an ALU result
+    PIPELINE_LOAD_USE_STALLS, // cycles waiting for a loaded value
+    PIPELINE_BRANCH_STALLS,   // cycles annulled after this instruction
+    PIPELINE_MEMORY_STALLS,   // cycles waiting for cache misses (see cache.h) or FILL/COPY words
+    PIPELINE_NB_COUNTERS
+};
+
+typedef struct Pipeline{
+
+    int bypass;
+    int branch_penalty;
+
+    unsigned long long instructions;
+    unsigned long long stalls[PIPELINE_NB_COUNTERS]; // totals, same indexes as per PC
+
+    long long last_fetch;    // IF cycle of the previous instruction
+    long long last_execute;  // EX cycle of the previous instruction
+    long long last_writeback;
+    long last_pc;
+    long expected_pc;        // address fetched after the previous instruction
+
+    long long ready[32];     // first cycle a consumer of each register can be in EX
+    bool loaded[32];         // the pending value of the register comes from memory
+
+    PcStats* per_pc;
+
+} Pipeline;
+
+/* Attaches a pipeline model to $c (replacing any previous one), starting
+   from an empty pipeline. */
+Pipeline* enable_pipeline(Computer* c, int bypass, int branch_penalty);
+
+/* Detaches and frees $c's pipeline model. */
+void disable_pipeline(Computer* c);
+
+/* Called by execute_step() after $instruction, fetched at $pc, was executed. */
+void pipeline_after_step(Computer* c, long pc, int32_t instruction);
+
+/* Total cycles: until the write-back of the last instruction. */
+unsigned long long pipeline_cycles(Pipeline* p);
+
+/* Writes the CPI, the stall breakdown and the $top PCs with the most
+   stall cycles (disassembled from $c's memory) into $buf of size $len. */
+void format_pipeline_stats(Computer* c, char* buf, size_t len, int top);
+
+#endif
@@ -0,0 +1,392 @@
+#include "renderer.h"
+#include "framebuffer.h"
+#include <string.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Marks the tiles holding the pixels [first, last[. */
+static void mark_pixels(Renderer* r, long first, long last){
+
+    if(first >= last)
+        return;
+
+    int y0 = first / r->width, y1 = (last - 1) / r->width;
+    int tx0 = 0, tx1 = r->tiles_x - 1;
+
+    // within a row: only the tiles it crosses
+    if(y0 == y1){
+        tx0 = first % r->width / RENDER_TILE;
+        tx1 = (last - 1) % r->width / RENDER_TILE;
+    }
+
+    for(int ty = y0 / RENDER_TILE; ty <= y1 / RENDER_TILE; ty++)
+        memset(r->dirty + ty * r->tiles_x + tx0, 1, tx1 - tx0 + 1);
+}
+
+static void mark_range(Renderer* r, Computer* c, long start, long end){
+
+    long first, last;
+
+    video_range_pixels(c, start, end, &first, &last);
+    mark_pixels(r, first, last);
+}
+
+/* Marks the tiles written since the previous frame, with the computer
+   lock held. */
+static void collect_writes(Renderer* r, bool full){
+
+    Computer* c = r->computer;
+    long start, end;
+    bool dirty = take_video_dirty(c, &start, &end);
+
+    // every pixel may have changed color
+    if(palette_changed(c, r->palette))
+        full = true;
+
+    if(full){
+
+        memset(r->dirty, 1, r->tiles_x * r->tiles_y);
+
+        if(c->write_log != NULL)
+            init_write_cursor(c->write_log, &r->cursor);
+
+        return;
+    }
+
+    if(c->write_log == NULL){
+
+        if(dirty)
+            mark_range(r, c, start, end);
+
+        return;
+    }
+
+    unsigned long long lost = r->cursor.lost;
+    long n;
+
+    while((n = drain_writes(c->write_log, &r->cursor, r->batch, RENDER_WRITE_BATCH)) > 0)
+        for(long i = 0; i < n; i++)
+            mark_range(r, c, r->batch[i].address, r->batch[i].address + r->batch[i].length);
+
+    // the log wrapped around: the dirty range covers what was missed
+    if(r->cursor.lost != lost && dirty)
+        mark_range(r, c, start, end);
+}
+
+static void convert_tile(Renderer* r, int tile){
+
+    int x0 = tile % r->tiles_x * RENDER_TILE, y0 = tile / r->tiles_x * RENDER_TILE;
+    int x1 = x0 + RENDER_TILE < r->width ? x0 + RENDER_TILE : r->width;
+    int y1 = y0 + RENDER_TILE < r->height ? y0 + RENDER_TILE : r->height;
+
+    for(int y = y0; y < y1; y++){
+        long row = (long) y * r->width;
+        convert_framebuffer(r->computer, row + x0, row + x1, r->native + row + x0, 0xff000000);
+    }
+}
+
+/* Writes each of the $n pixels of $src $scale times into $dst. */
+static void scale_row(const uint32_t* src, uint32_t* dst, int n, int scale){
+
+    int i = 0;
+
+    if(scale == 1){
+        memcpy(dst, src, n * 4);
+        return;
+    }
+
+#ifdef __SSE2__
+    if(scale == 2){
+
+        for(; i + 4 <= n; i += 4){
+            __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+            _mm_storeu_si128((__m128i*) (dst + 2 * i), _mm_unpacklo_epi32(v, v));
+            _mm_storeu_si128((__m128i*) (dst + 2 * i + 4), _mm_unpackhi_epi32(v, v));
+        }
+    }
+
+    else if(scale >= 4){
+
+        for(; i < n; i++){
+
+            __m128i v = _mm_set1_epi32(src[i]);
+            uint32_t* p = dst + i * scale;
+
+            // the last store overlaps the previous one if scale is not a multiple of 4
+            for(int j = 0; j + 4 <= scale; j += 4)
+                _mm_storeu_si128((__m128i*) (p + j), v);
+
+            _mm_storeu_si128((__m128i*) (p + scale - 4), v);
+        }
+    }
+#endif
+
+    for(; i < n; i++)
+        for(int j = 0; j < scale; j++)
+            dst[i * scale + j] = src[i];
+}
+
+static void scale_tile(Renderer* r, int tile){
+
+    int x0 = tile % r->tiles_x * RENDER_TILE, y0 = tile / r->tiles_x * RENDER_TILE;
+    int x1 = x0 + RENDER_TILE < r->width ? x0 + RENDER_TILE : r->width;
+    int y1 = y0 + RENDER_TILE < r->height ? y0 + RENDER_TILE : r->height;
+    int s = r->output_scale;
+    long stride = (long) r->width * s;
+
+    for(int y = y0; y < y1; y++){
+
+        uint32_t* dst = r->output + (long) y * s * stride + x0 * s;
+
+        scale_row(r->native + (long) y * r->width + x0, dst, x1 - x0, s);
+
+        for(int k = 1; k < s; k++)
+            memcpy(dst + k * stride, dst, (x1 - x0) * s * 4);
+    }
+}
+
+/* Processes tiles of the current phase until there are none left. */
+static void work(Renderer* r){
+
+    int job;
+
+    while((job = __atomic_fetch_add(&r->next_job, 1, __ATOMIC_RELAXED)) < r->nb_jobs){
+
+        if(r->phase == RENDER_CONVERT)
+            convert_tile(r, r->jobs[job]);
+        else
+            scale_tile(r, r->jobs[job]);
+    }
+}
+
+static void* worker_thread(void* arg){
+
+    Renderer* r = arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&r->pool_lock);
+
+    while(true){
+
+        while(r->generation == seen && !r->quitting)
+            pthread_cond_wait(&r->start, &r->pool_lock);
+
+        if(r->quitting)
+            break;
+
+        seen = r->generation;
+        pthread_mutex_unlock(&r->pool_lock);
+
+        work(r);
+
+        pthread_mutex_lock(&r->pool_lock);
+
+        if(++r->finished == r->nb_workers)
+            pthread_cond_signal(&r->done);
+    }
+
+    pthread_mutex_unlock(&r->pool_lock);
+
+    return NULL;
+}
+
+/* Runs $phase on the $nb_jobs tiles in r -> jobs with every worker,
+   returning once they are all done. */
+static void run_phase(Renderer* r, int phase, int nb_jobs){
+
+    if(nb_jobs == 0)
+        return;
+
+    pthread_mutex_lock(&r->pool_lock);
+    r->phase = phase;
+    r->nb_jobs = nb_jobs;
+    r->next_job = 0;
+    r->finished = 0;
+    r->generation++;
+    pthread_cond_broadcast(&r->start);
+    pthread_mutex_unlock(&r->pool_lock);
+
+    work(r);
+
+    // no worker is left behind to claim tiles of the next phase
+    pthread_mutex_lock(&r->pool_lock);
+
+    while(r->finished < r->nb_workers)
+        pthread_cond_wait(&r->done, &r->pool_lock);
+
+    pthread_mutex_unlock(&r->pool_lock);
+}
+
+static void render(Renderer* r, bool full, int scale){
+
+    int nb_tiles = r->tiles_x * r->tiles_y;
+    bool rescale = scale != r->output_scale;
+
+    if(rescale){
+        free(r->output);
+        r->output = malloc((size_t) r->width * scale * r->height * scale * 4);
+        r->output_scale = scale;
+    }
+
+    pthread_mutex_lock(r->computer_lock);
+
+    collect_writes(r, full);
+
+    int nb_jobs = 0;
+
+    for(int t = 0; t < nb_tiles; t++)
+        if(r->dirty[t])
+            r->jobs[nb_jobs++] = t;
+
+    run_phase(r, RENDER_CONVERT, nb_jobs);
+
+    pthread_mutex_unlock(r->computer_lock);
+
+    // the whole native image is scaled again at a new factor
+    if(rescale){
+        nb_jobs = nb_tiles;
+        for(int t = 0; t < nb_tiles; t++)
+            r->jobs[t] = t;
+    }
+
+    if(nb_jobs == 0)
+        return;
+
+    run_phase(r, RENDER_SCALE, nb_jobs);
+    memset(r->dirty, 0, nb_tiles);
+
+    r->publish(r->data, r->output, r->width * scale, r->height * scale);
+}
+
+static void* render_thread(void* arg){
+
+    Renderer* r = arg;
+
+    pthread_mutex_lock(&r->lock);
+
+    while(true){
+
+        while(!r->requested && !r->quitting)
+            pthread_cond_wait(&r->wake, &r->lock);
+
+        if(r->quitting)
+            break;
+
+        bool full = r->full;
+        int scale = r->scale;
+        r->requested = false;
+        r->full = false;
+
+        pthread_mutex_unlock(&r->lock);
+        render(r, full, scale);
+        pthread_mutex_lock(&r->lock);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+
+    return NULL;
+}
+
+void start_renderer(Renderer* r, Computer* computer, pthread_mutex_t* computer_lock,
+                    int width, int height,
+                    void (*publish)(void*, const uint32_t*, int, int), void* data){
+
+    memset(r, 0, sizeof(Renderer));
+
+    r->computer = computer;
+    r->computer_lock = computer_lock;
+    r->publish = publish;
+    r->data = data;
+    r->width = width;
+    r->height = height;
+    r->tiles_x = (width + RENDER_TILE - 1) / RENDER_TILE;
+    r->tiles_y = (height + RENDER_TILE - 1) / RENDER_TILE;
+    r->dirty = calloc(r->tiles_x * r->tiles_y, 1);
+    r->jobs = malloc(r->tiles_x * r->tiles_y * sizeof(int));
+    r->native = malloc((size_t) width * height * 4);
+    r->batch = malloc(RENDER_WRITE_BATCH * sizeof(WriteRecord));
+    r->scale = 1;
+
+    // opaque black until converted
+    for(long i = 0; i < (long) width * height; i++)
+        r->native[i] = 0xff000000;
+
+    // the render thread works too
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    r->nb_workers = cpus - 1 < RENDER_MAX_WORKERS ? cpus - 1 : RENDER_MAX_WORKERS;
+
+    if(r->nb_workers < 0)
+        r->nb_workers = 0;
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+    pthread_mutex_init(&r->pool_lock, NULL);
+    pthread_cond_init(&r->start, NULL);
+    pthread_cond_init(&r->done, NULL);
+
+    for(int i = 0; i < r->nb_workers; i++)
+        pthread_create(&r->workers[i], NULL, worker_thread, r);
+
+    pthread_create(&r->thread, NULL, render_thread, r);
+}
+
+void stop_renderer(Renderer* r){
+
+    pthread_mutex_lock(&r->lock);
+    r->quitting = true;
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+
+    pthread_mutex_lock(&r->pool_lock);
+    pthread_cond_broadcast(&r->start);
+    pthread_mutex_unlock(&r->pool_lock);
+
+    for(int i = 0; i < r->nb_workers; i++)
+        pthread_join(r->workers[i], NULL);
+
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->wake);
+    pthread_mutex_destroy(&r->pool_lock);
+    pthread_cond_destroy(&r->start);
+    pthread_cond_destroy(&r->done);
+
+    free(r->dirty);
+    free(r->jobs);
+    free(r->native);
+    free(r->output);
+    free(r->batch);
+}
+
+void request_frame(Renderer* r, bool full){
+
+    pthread_mutex_lock(&r->lock);
+    r->requested = true;
+    r->full = r->full || full;
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void set_render_scale(Renderer* r, int scale){
+
+    if(scale > RENDER_MAX_SIZE / r->width)
+        scale = RENDER_MAX_SIZE / r->width;
+
+    if(scale > RENDER_MAX_SIZE / r->height)
+        scale = RENDER_MAX_SIZE / r->height;
+
+    if(scale < 1)
+        scale = 1;
+
+    pthread_mutex_lock(&r->lock);
+
+    if(scale != r->scale){
+        r->scale = scale;
+        r->requested = true;
+        pthread_cond_signal(&r->wake);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+}
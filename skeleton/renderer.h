@@ -0,0 +1,99 @@
+#ifndef RENDERER_H__
+#define RENDERER_H__
+
+#include "emulator.h"
+#include "write_log.h"
+#include <pthread.h>
+#include <stdint.h>
+
+/* Screen renderer: turns the framebuffer into a scaled image on its own
+   thread, so that the GUI thread only has to display the result.
+
+   The framebuffer is split into RENDER_TILE x RENDER_TILE tiles. When a
+   frame is requested, the render thread takes the lock protecting the
+   Computer once, marks the tiles written since the previous frame (from
+   the write log if there is one, from the video dirty range otherwise,
+   see write_log.h) and converts them in parallel with a small pool of
+   workers (see framebuffer.h). It then releases the lock and the pool
+   upscales the converted tiles by an integer factor, nearest neighbor,
+   into the output image, which is handed to the publish callback: one
+   opaque 0xAABBGGRR word per pixel, row after row.
+
+   Requests made while a frame is being rendered are merged into the
+   next one. */
+
+#define RENDER_TILE 64
+#define RENDER_MAX_WORKERS 4  // threads besides the render thread
+#define RENDER_MAX_SIZE 4096  // largest side of the output image
+#define RENDER_WRITE_BATCH 4096
+
+enum{
+    RENDER_CONVERT, // framebuffer -> native, computer lock held
+    RENDER_SCALE    // native -> output
+};
+
+typedef struct Renderer{
+
+    Computer* computer;
+    pthread_mutex_t* computer_lock;
+
+    /* Called on the render thread with the new $width x $height image,
+       which is only valid during the call. */
+    void (*publish)(void* data, const uint32_t* pixels, int width, int height);
+    void* data;
+
+    int width, height; // of the framebuffer
+    int tiles_x, tiles_y;
+    unsigned char* dirty; // per tile: written since its last conversion
+    int* jobs;            // tiles of the current phase
+    uint32_t* native;     // converted framebuffer
+    uint32_t* output;     // scaled image
+    int output_scale;
+    uint32_t palette[VIDEO_PALETTE_SZ];
+    WriteCursor cursor;   // protected by the computer lock
+    WriteRecord* batch;
+
+    // requests, protected by lock
+    bool requested;
+    bool full;     // convert every tile, the computer may have been replaced
+    int scale;     // wanted upscaling factor
+    bool quitting;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+
+    // worker pool, protected by pool_lock
+    int nb_workers;
+    pthread_t workers[RENDER_MAX_WORKERS];
+    int phase;
+    int nb_jobs;
+    int next_job;           // claimed atomically
+    unsigned long generation; // incremented for each phase
+    int finished;           // workers done with the current phase
+    pthread_mutex_t pool_lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+
+} Renderer;
+
+/* Starts the render thread and its workers for a $width x $height
+   framebuffer, the video mode of $computer. $computer_lock is taken while
+   tiles are converted. */
+void start_renderer(Renderer* r, Computer* computer, pthread_mutex_t* computer_lock,
+                    int width, int height,
+                    void (*publish)(void*, const uint32_t*, int, int), void* data);
+
+/* Stops the threads and frees the buffers. */
+void stop_renderer(Renderer* r);
+
+/* Asks for a frame, made of the tiles written since the previous one or
+   of every tile if $full (after the Computer was loaded or replaced).
+   Returns at once. */
+void request_frame(Renderer* r, bool full);
+
+/* Changes the upscaling factor (at least 1, and such that the output
+   fits in RENDER_MAX_SIZE) from the next frame on, requesting one if it
+   changed. */
+void set_render_scale(Renderer* r, int scale);
+
+#endif
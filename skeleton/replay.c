@@ -0,0 +1,153 @@
+#include "replay.h"
+#include <string.h>
+
+static const char replay_magic[4] = {'B', 'I', 'R', 'Q'};
+
+bool start_interrupt_recording(Computer* c, const char* path){
+
+    stop_interrupt_recording(c);
+
+    FILE* fp = fopen(path, "wb");
+
+    if(fp == NULL){
+        fprintf(stderr, "Error: could not create the recording %s\n", path);
+        return false;
+    }
+
+    fwrite(replay_magic, 1, sizeof(replay_magic), fp);
+    fputc(REPLAY_VERSION, fp);
+
+    c->interrupt_record = fp;
+    c->record_last = c->retired;
+
+    return true;
+}
+
+void stop_interrupt_recording(Computer* c){
+
+    if(c->interrupt_record == NULL)
+        return;
+
+    fclose(c->interrupt_record);
+    c->interrupt_record = NULL;
+}
+
+void record_interrupt(Computer* c, char type, char keyval){
+
+    unsigned long long delta = c->retired - c->record_last;
+    c->record_last = c->retired;
+
+    do{
+        unsigned char byte = delta & 0x7F;
+        delta >>= 7;
+        fputc(delta ? byte | 0x80 : byte, c->interrupt_record);
+    } while(delta);
+
+    fputc(type, c->interrupt_record);
+    fputc(keyval, c->interrupt_record);
+
+    // key events are rare, flushing keeps the recording usable after a crash
+    fflush(c->interrupt_record);
+}
+
+/* Reads the next record of $r, has_next becomes false at the end of the file. */
+static void read_next(InterruptReplay* r){
+
+    unsigned long long delta = 0;
+    int shift = 0;
+    int byte;
+
+    r->has_next = false;
+
+    do{
+        if((byte = fgetc(r->fp)) == EOF || shift > 63)
+            return;
+
+        delta |= (unsigned long long) (byte & 0x7F) << shift;
+        shift += 7;
+    } while(byte & 0x80);
+
+    int type = fgetc(r->fp);
+    int keyval = fgetc(r->fp);
+
+    if(type == EOF || keyval == EOF){
+        fprintf(stderr, "Error: truncated interrupt recording\n");
+        return;
+    }
+
+    r->next.retired += delta;
+    r->next.type = type;
+    r->next.keyval = keyval;
+    r->has_next = true;
+}
+
+bool open_interrupt_replay(InterruptReplay* r, const char* path){
+
+    char header[sizeof(replay_magic) + 1];
+
+    r->has_next = false;
+    r->nb_replayed = 0;
+    r->next.retired = 0;
+    r->fp = fopen(path, "rb");
+
+    if(r->fp == NULL){
+        fprintf(stderr, "Error: could not open the recording %s\n", path);
+        return false;
+    }
+
+    if(fread(header, 1, sizeof(header), r->fp) != sizeof(header)
+       || memcmp(header, replay_magic, sizeof(replay_magic)) != 0
+       || header[sizeof(replay_magic)] != REPLAY_VERSION){
+
+        fprintf(stderr, "Error: %s is not an interrupt recording (version %d)\n",
+                path, REPLAY_VERSION);
+        fclose(r->fp);
+        r->fp = NULL;
+        return false;
+    }
+
+    read_next(r);
+
+    return true;
+}
+
+long replay_steps(Computer* c, InterruptReplay* r, long max_steps){
+
+    long steps = 0;
+
+    while(true){
+
+        // taken before the instruction that follows them, as in the GUI
+        while(r->has_next && r->next.retired <= c->retired){
+            raise_interrupt(c, r->next.type, r->next.keyval);
+            run_steps(c, 0);
+            r->nb_replayed++;
+            read_next(r);
+        }
+
+        if(steps >= max_steps || !is_executing(c))
+            break;
+
+        long budget = max_steps - steps;
+
+        if(r->has_next && r->next.retired - c->retired < (unsigned long long) budget)
+            budget = r->next.retired - c->retired;
+
+        long n = run_steps(c, budget);
+        steps += n;
+
+        if(n == 0)
+            break;
+    }
+
+    return steps;
+}
+
+void close_interrupt_replay(InterruptReplay* r){
+
+    if(r->fp != NULL)
+        fclose(r->fp);
+
+    r->fp = NULL;
+    r->has_next = false;
+}
@@ -0,0 +1,62 @@
+#ifndef REPLAY_H__
+#define REPLAY_H__
+
+#include "emulator.h"
+
+/* Deterministic record/replay of keyboard interrupts.
+
+   A recording starts with a 5-byte header ("BIRQ" followed by the format
+   version) and holds one record per interrupt the CPU took from
+   c -> pending_interrupt (see raise_interrupt()): the number of
+   instructions retired since the previous record (LEB128 varint), then
+   the interrupt type and keyval bytes. A key press usually takes 3 to 5
+   bytes.
+
+   Replaying a recording on the same program and interrupt handler raises
+   the same interrupts at the same retired instruction counts, so the
+   session is reproduced exactly, at full emulation speed. */
+
+#define REPLAY_VERSION 1
+
+typedef struct{
+
+    unsigned long long retired; // value of c -> retired when the interrupt was taken
+    char type;
+    char keyval;
+
+} InterruptEvent;
+
+typedef struct{
+
+    FILE* fp;
+    InterruptEvent next; // next event to raise, valid if has_next
+    bool has_next;
+    long nb_replayed;
+
+} InterruptReplay;
+
+/* Starts logging every interrupt $c takes into the file $path
+   (overwritten). Should be called right after the program was loaded so
+   that the recording can be replayed from the start.
+   Returns false if the file cannot be created. */
+bool start_interrupt_recording(Computer* c, const char* path);
+
+/* Flushes and closes $c's recording, if any. */
+void stop_interrupt_recording(Computer* c);
+
+/* Appends a record to $c's recording, called when an interrupt is taken. */
+void record_interrupt(Computer* c, char type, char keyval);
+
+/* Opens the recording $path for replay in $r.
+   Returns false if the file cannot be read or is not a recording. */
+bool open_interrupt_replay(InterruptReplay* r, const char* path);
+
+/* Same as run_steps() but raises the interrupts of $r when $c's retired
+   instruction count reaches their timestamps.
+   Returns the number of instructions executed. */
+long replay_steps(Computer* c, InterruptReplay* r, long max_steps);
+
+/* Closes a recording opened by open_interrupt_replay(). */
+void close_interrupt_replay(InterruptReplay* r);
+
+#endif
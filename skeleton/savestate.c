@@ -0,0 +1,504 @@
+#include "savestate.h"
+#include "keyboard_hle.h"
+#include "history.h"
+#include "aot.h"
+#include "idle.h"
+#include "mmio.h"
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PAGE_WORDS (MEMORY_PAGE_SZ / 4)
+#define HEADER_SZ 256
+#define ENTRY_SZ 17
+#define MAX_PACKED_SZ (MEMORY_PAGE_SZ + PAGE_WORDS) // worst case of pack_page()
+
+enum{
+    PAGE_RAW,
+    PAGE_PACKED
+};
+
+static const char savestate_magic[4] = {'B', 'S', 'A', 'V'};
+
+static unsigned char* put(unsigned char* p, const void* value, size_t size){
+
+    memcpy(p, value, size);
+
+    return p + size;
+}
+
+static const unsigned char* get(const unsigned char* p, void* value, size_t size){
+
+    memcpy(value, p, size);
+
+    return p + size;
+}
+
+static bool is_zero_page(const unsigned char* page, long size){
+
+    const uint64_t* words = (const uint64_t*) page;
+
+    for(long i = 0; i < size / 8; i++)
+        if(words[i] != 0)
+            return false;
+
+    for(long i = size / 8 * 8; i < size; i++)
+        if(page[i] != 0)
+            return false;
+
+    return true;
+}
+
+/* Run-length encodes the $n words of $words into $out: a tag byte t is
+   followed either by one word repeated (t & 0x7F) + 1 times (t & 0x80)
+   or by t + 1 literal words. Returns the encoded size. */
+static long pack_page(const uint32_t* words, int n, unsigned char* out){
+
+    long size = 0;
+    int i = 0;
+
+    while(i < n){
+
+        int run = 1;
+
+        while(i + run < n && run < 128 && words[i + run] == words[i])
+            run++;
+
+        if(run >= 2){
+            out[size++] = 0x80 | (run - 1);
+            memcpy(out + size, words + i, 4);
+            size += 4;
+            i += run;
+            continue;
+        }
+
+        int len = 1;
+
+        while(i + len < n && len < 128
+              && !(i + len + 1 < n && words[i + len] == words[i + len + 1]))
+            len++;
+
+        out[size++] = len - 1;
+        memcpy(out + size, words + i, 4 * len);
+        size += 4 * len;
+        i += len;
+    }
+
+    return size;
+}
+
+/* Decodes $size bytes packed by pack_page() into $n words.
+   Returns false if the data is corrupted. */
+static bool unpack_page(const unsigned char* in, long size, uint32_t* words, int n){
+
+    long pos = 0;
+    int i = 0;
+
+    while(pos < size){
+
+        unsigned char tag = in[pos++];
+        int count = (tag & 0x7F) + 1;
+
+        if(i + count > n)
+            return false;
+
+        if(tag & 0x80){
+
+            uint32_t word;
+
+            if(pos + 4 > size)
+                return false;
+
+            memcpy(&word, in + pos, 4);
+            pos += 4;
+
+            for(int j = 0; j < count; j++)
+                words[i++] = word;
+        }
+
+        else{
+
+            if(pos + 4 * count > size)
+                return false;
+
+            memcpy(words + i, in + pos, 4 * count);
+            pos += 4 * count;
+            i += count;
+        }
+    }
+
+    return i == n;
+}
+
+static void write_header(Computer* c, uint32_t nb_pages, uint32_t devices_size, unsigned char* header){
+
+    unsigned char* p = header;
+    uint32_t version = SAVESTATE_VERSION, page_size = MEMORY_PAGE_SZ;
+    uint64_t sizes[3] = {c->program_memory_size, c->video_memory_size, c->kernel_memory_size};
+    int64_t pc = c->cpu.program_counter, latest = c->latest_accessed;
+    uint32_t program_size = c->program_size;
+    uint64_t retired = c->retired;
+    unsigned char flags[4] = {c->halted, c->interrupt_raised,
+                              c->interrupt_type, c->interrupt_keyval};
+    uint32_t video_mode[3] = {c->video_width, c->video_height, c->video_format};
+    uint32_t pending = __atomic_load_n(&c->pending_interrupt, __ATOMIC_ACQUIRE);
+    unsigned char extended_isa = c->extended_isa;
+    uint64_t block_cycles = c->block_cycles;
+
+    // still being raised by another thread: not pending yet
+    if(!(pending & INTERRUPT_PENDING))
+        pending = 0;
+
+    memset(header, 0, HEADER_SZ);
+    p = put(p, savestate_magic, 4);
+    p = put(p, &version, 4);
+    p = put(p, &page_size, 4);
+    p = put(p, &nb_pages, 4);
+    p = put(p, sizes, sizeof(sizes));
+    p = put(p, video_mode, sizeof(video_mode));
+    p = put(p, &pc, 8);
+    p = put(p, c->cpu.registers, sizeof(c->cpu.registers));
+    p = put(p, &c->cpu.backup, 4);
+    p = put(p, &program_size, 4);
+    p = put(p, &retired, 8);
+    p = put(p, &latest, 8);
+    p = put(p, flags, 4);
+    p = put(p, &pending, 4);
+    p = put(p, &extended_isa, 1);
+    p = put(p, &block_cycles, 8);
+    put(p, &devices_size, 4);
+}
+
+int save_state(Computer* c, const char* path){
+
+    long nb_total = (c->memory_size + MEMORY_PAGE_SZ - 1) / MEMORY_PAGE_SZ;
+    uint32_t* pages = malloc(nb_total * sizeof(uint32_t));
+    unsigned char* encodings = malloc(nb_total);
+    uint32_t* sizes = malloc(nb_total * sizeof(uint32_t));
+    unsigned char* packed = malloc(MAX_PACKED_SZ);
+    long packed_total = 0;
+    uint32_t nb_pages = 0;
+    uint32_t buffer[PAGE_WORDS];
+
+    // classify the pages: zero (skipped), packed or raw
+    for(long i = 0; i < nb_total; i++){
+
+        long size = i == nb_total - 1 ? c->memory_size - i * MEMORY_PAGE_SZ : MEMORY_PAGE_SZ;
+
+        if(is_zero_page(c->memory + i * MEMORY_PAGE_SZ, size))
+            continue;
+
+        memset(buffer, 0, sizeof(buffer));
+        memcpy(buffer, c->memory + i * MEMORY_PAGE_SZ, size);
+        long packed_size = pack_page(buffer, PAGE_WORDS, packed);
+
+        pages[nb_pages] = i;
+        encodings[nb_pages] = packed_size < MEMORY_PAGE_SZ / 2 ? PAGE_PACKED : PAGE_RAW;
+        sizes[nb_pages] = encodings[nb_pages] == PAGE_PACKED ? packed_size : MEMORY_PAGE_SZ;
+
+        if(encodings[nb_pages] == PAGE_PACKED)
+            packed_total += packed_size;
+
+        nb_pages++;
+    }
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* fp = fopen(tmp_path, "wb");
+
+    if(fp == NULL){
+        fprintf(stderr, "Error: could not create %s\n", tmp_path);
+        free(pages); free(encodings); free(sizes); free(packed);
+        return -1;
+    }
+
+    unsigned char header[HEADER_SZ];
+    uint32_t devices_size = bus_state_size(c);
+    unsigned char* devices = malloc(devices_size + 1);
+
+    write_header(c, nb_pages, devices_size, header);
+    save_bus_state(c, devices);
+    fwrite(header, 1, HEADER_SZ, fp);
+    fwrite(devices, 1, devices_size, fp);
+    free(devices);
+
+    // the directory follows the devices, packed pages follow the
+    // directory and raw pages start on the next page boundary
+    uint64_t packed_offset = HEADER_SZ + devices_size + (uint64_t) nb_pages * ENTRY_SZ;
+    uint64_t raw_offset = (packed_offset + packed_total + MEMORY_PAGE_SZ - 1)
+                          / MEMORY_PAGE_SZ * MEMORY_PAGE_SZ;
+
+    for(uint32_t i = 0; i < nb_pages; i++){
+
+        unsigned char entry[ENTRY_SZ], *p = entry;
+        uint64_t* offset = encodings[i] == PAGE_PACKED ? &packed_offset : &raw_offset;
+
+        p = put(p, &pages[i], 4);
+        p = put(p, &encodings[i], 1);
+        p = put(p, &sizes[i], 4);
+        put(p, offset, 8);
+        *offset += sizes[i];
+        fwrite(entry, 1, ENTRY_SZ, fp);
+    }
+
+    for(uint32_t i = 0; i < nb_pages; i++){
+
+        if(encodings[i] != PAGE_PACKED)
+            continue;
+
+        memset(buffer, 0, sizeof(buffer));
+        memcpy(buffer, c->memory + (long) pages[i] * MEMORY_PAGE_SZ,
+               c->memory_size - (long) pages[i] * MEMORY_PAGE_SZ < MEMORY_PAGE_SZ
+               ? c->memory_size - (long) pages[i] * MEMORY_PAGE_SZ : MEMORY_PAGE_SZ);
+        fwrite(packed, 1, pack_page(buffer, PAGE_WORDS, packed), fp);
+    }
+
+    bool first_raw = true;
+
+    for(uint32_t i = 0; i < nb_pages; i++){
+
+        if(encodings[i] != PAGE_RAW)
+            continue;
+
+        if(first_raw){ // pad up to the page boundary
+            long pos = ftell(fp);
+            for(long j = pos; j % MEMORY_PAGE_SZ != 0; j++)
+                fputc(0, fp);
+            first_raw = false;
+        }
+
+        long offset = (long) pages[i] * MEMORY_PAGE_SZ;
+        long size = c->memory_size - offset < MEMORY_PAGE_SZ ? c->memory_size - offset : MEMORY_PAGE_SZ;
+
+        fwrite(c->memory + offset, 1, size, fp);
+
+        for(long j = size; j < MEMORY_PAGE_SZ; j++)
+            fputc(0, fp);
+    }
+
+    bool ok = !ferror(fp);
+    ok &= fclose(fp) == 0;
+
+    // renaming keeps the old file alive for the computers that mapped its pages
+    if(ok)
+        ok = rename(tmp_path, path) == 0;
+
+    if(!ok){
+        fprintf(stderr, "Error: could not write the state into %s\n", path);
+        remove(tmp_path);
+    }
+
+    free(pages);
+    free(encodings);
+    free(sizes);
+    free(packed);
+
+    return ok ? 0 : -1;
+}
+
+/* Checks that the $nb_pages entries of $directory describe pages of a
+   memory of $nb_total pages stored within the $file_size bytes of the
+   file: raw pages are mapped whole, and touching a mapping past the end
+   of the file would fault long after loading. */
+static bool check_directory(const unsigned char* directory, uint32_t nb_pages,
+                            long nb_total, uint64_t file_size){
+
+    for(uint32_t i = 0; i < nb_pages; i++){
+
+        const unsigned char* e = directory + (size_t) i * ENTRY_SZ;
+        uint32_t page, size;
+        unsigned char encoding;
+        uint64_t offset;
+
+        e = get(e, &page, 4);
+        e = get(e, &encoding, 1);
+        e = get(e, &size, 4);
+        get(e, &offset, 8);
+
+        uint64_t extent = encoding == PAGE_RAW ? MEMORY_PAGE_SZ : size;
+
+        if(page >= nb_total || size > MAX_PACKED_SZ || encoding > PAGE_PACKED
+           || offset > file_size || extent > file_size - offset)
+            return false;
+    }
+
+    return true;
+}
+
+static int fail(int fd, unsigned char* buffer, const char* message, const char* path){
+
+    fprintf(stderr, "Error: %s: %s\n", path, message);
+
+    if(buffer != NULL)
+        free(buffer);
+
+    close(fd);
+
+    return -1;
+}
+
+int load_state(Computer* c, const char* path){
+
+    int fd = open(path, O_RDONLY);
+    unsigned char header[HEADER_SZ];
+
+    if(fd < 0){
+        fprintf(stderr, "Error: could not open %s\n", path);
+        return -1;
+    }
+
+    if(pread(fd, header, HEADER_SZ, 0) != HEADER_SZ || memcmp(header, savestate_magic, 4) != 0)
+        return fail(fd, NULL, "not a save-state", path);
+
+    const unsigned char* p = header + 4;
+    uint32_t version, page_size, nb_pages;
+    uint64_t sizes[3];
+    uint32_t video_mode[3];
+
+    p = get(p, &version, 4);
+    p = get(p, &page_size, 4);
+    p = get(p, &nb_pages, 4);
+    p = get(p, sizes, sizeof(sizes));
+    p = get(p, video_mode, sizeof(video_mode));
+
+    if(version != SAVESTATE_VERSION)
+        return fail(fd, NULL, "unsupported save-state version", path);
+
+    if(page_size != MEMORY_PAGE_SZ)
+        return fail(fd, NULL, "unsupported page size", path);
+
+    if(sizes[0] != (uint64_t) c->program_memory_size || sizes[1] != (uint64_t) c->video_memory_size
+       || sizes[2] != (uint64_t) c->kernel_memory_size)
+        return fail(fd, NULL, "saved from a machine with different memory sizes", path);
+
+    if(video_mode[0] != (uint32_t) c->video_width || video_mode[1] != (uint32_t) c->video_height
+       || video_mode[2] != (uint32_t) c->video_format)
+        return fail(fd, NULL, "saved with a different video mode", path);
+
+    int64_t pc, latest;
+    int32_t registers[32], backup;
+    uint32_t program_size;
+    uint64_t retired;
+    unsigned char flags[4];
+    uint32_t pending;
+    unsigned char extended_isa;
+    uint64_t block_cycles;
+    uint32_t devices_size;
+
+    p = get(p, &pc, 8);
+    p = get(p, registers, sizeof(registers));
+    p = get(p, &backup, 4);
+    p = get(p, &program_size, 4);
+    p = get(p, &retired, 8);
+    p = get(p, &latest, 8);
+    p = get(p, flags, 4);
+    p = get(p, &pending, 4);
+    p = get(p, &extended_isa, 1);
+    p = get(p, &block_cycles, 8);
+    get(p, &devices_size, 4);
+
+    if(devices_size != bus_state_size(c))
+        return fail(fd, NULL, "saved with different devices", path);
+
+    long nb_total = (c->memory_size + MEMORY_PAGE_SZ - 1) / MEMORY_PAGE_SZ;
+
+    if(nb_pages > nb_total)
+        return fail(fd, NULL, "corrupted directory", path);
+
+    // the device state and the directory in a single buffer
+    size_t directory_size = (size_t) nb_pages * ENTRY_SZ;
+    unsigned char* devices = malloc(devices_size + directory_size + 1);
+    unsigned char* directory = devices + devices_size;
+
+    if(pread(fd, devices, devices_size + directory_size, HEADER_SZ) != (ssize_t) (devices_size + directory_size))
+        return fail(fd, devices, "truncated directory", path);
+
+    struct stat st;
+
+    if(fstat(fd, &st) != 0 || !check_directory(directory, nb_pages, nb_total, st.st_size))
+        return fail(fd, devices, "truncated or corrupted", path);
+
+    if(!restore_bus_state(c, devices))
+        return fail(fd, devices, "saved with different devices", path);
+
+    c->cpu.program_counter = pc;
+    memcpy(c->cpu.registers, registers, sizeof(registers));
+    c->cpu.backup = backup;
+    c->program_size = program_size;
+    c->retired = retired;
+    c->latest_accessed = latest;
+    c->halted = flags[0];
+    c->interrupt_raised = flags[1];
+    c->interrupt_type = flags[2];
+    c->interrupt_keyval = flags[3];
+    c->extended_isa = extended_isa;
+    c->block_cycles = block_cycles;
+    c->host_event_ns = 0;
+    c->queued_ns = 0;
+    __atomic_store_n(&c->pending_interrupt, pending & INTERRUPT_PENDING ? pending : 0, __ATOMIC_RELEASE);
+
+    if(c->hle_check != NULL)
+        c->hle_check->pending = false;
+
+    clear_memory(c);
+
+    unsigned char packed[MAX_PACKED_SZ];
+    uint32_t buffer[PAGE_WORDS];
+
+    for(uint32_t i = 0; i < nb_pages; i++){
+
+        const unsigned char* e = directory + (size_t) i * ENTRY_SZ;
+        uint32_t page, size;
+        unsigned char encoding;
+        uint64_t offset;
+
+        e = get(e, &page, 4);
+        e = get(e, &encoding, 1);
+        e = get(e, &size, 4);
+        get(e, &offset, 8);
+
+        if(page >= nb_total || size > MAX_PACKED_SZ)
+            return fail(fd, devices, "corrupted directory", path);
+
+        unsigned char* dst = c->memory + (long) page * MEMORY_PAGE_SZ;
+        long dst_size = c->memory_size - (long) page * MEMORY_PAGE_SZ < MEMORY_PAGE_SZ
+                        ? c->memory_size - (long) page * MEMORY_PAGE_SZ : MEMORY_PAGE_SZ;
+
+        if(encoding == PAGE_PACKED){
+
+            if(pread(fd, packed, size, offset) != size
+               || !unpack_page(packed, size, buffer, PAGE_WORDS))
+                return fail(fd, devices, "corrupted page", path);
+
+            memcpy(dst, buffer, dst_size);
+        }
+
+        else{
+
+            // mapped copy-on-write: read from the file only when first accessed
+            if(offset % MEMORY_PAGE_SZ != 0
+               || mmap(dst, MEMORY_PAGE_SZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                       fd, offset) == MAP_FAILED){
+
+                if(pread(fd, dst, dst_size, offset) != dst_size)
+                    return fail(fd, devices, "truncated page", path);
+            }
+        }
+    }
+
+    // the mappings keep the file alive
+    free(devices);
+    close(fd);
+
+    mark_video_dirty(c, c->program_memory_size, c->program_memory_size + c->video_memory_size);
+    reset_history(c);
+
+    // the translated code may not be the restored program's
+    disable_aot(c);
+    forget_idle_loop(c);
+
+    return 0;
+}
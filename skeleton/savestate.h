@@ -0,0 +1,37 @@
+#ifndef SAVESTATE_H__
+#define SAVESTATE_H__
+
+#include "emulator.h"
+
+/* Save-states: the whole architectural state of a Computer (registers,
+   PC, interrupt flags, counters, devices and memory) in a versioned
+   binary file.
+
+   Layout (little-endian):
+       header        "BSAV", format version, page size, number of pages,
+                     memory sizes, video mode, CPU and interrupt state
+                     (pending interrupt included), extended ISA flag
+       devices       the state of every mapped device (see mmio.h)
+       directory     per stored page: index, encoding, size, file offset
+       packed pages  word-level run-length encoded pages
+       raw pages     pages that do not compress, aligned on MEMORY_PAGE_SZ
+   Pages that are entirely zero are not stored at all. Raw pages are
+   mapped copy-on-write from the file when loading, so they are only read
+   if the guest touches them. */
+
+#define SAVESTATE_VERSION 1
+
+/* Writes $c's state into the file $path (replaced atomically).
+   Returns 0 on success, -1 on error (reported on stderr). */
+int save_state(Computer* c, const char* path);
+
+/* Restores the state saved in $path into $c, which must have been
+   initialized with the same memory sizes and video mode, and have the
+   same devices mapped. The interrupt handler and program are part of
+   the memory, nothing else needs to be loaded; c -> extended_isa is
+   restored too.
+   Returns 0 on success, -1 on error (reported on stderr), in which case
+   $c may be left zeroed. */
+int load_state(Computer* c, const char* path);
+
+#endif
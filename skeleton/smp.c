@@ -0,0 +1,96 @@
+#include "smp.h"
+
+typedef struct{
+
+    Smp* smp;
+    int cpu;
+    long max_steps;
+    long steps;
+
+} SmpThread;
+
+void init_smp(Smp* s, int nb_cpus, long program_memory_size,
+              long video_memory_size, long kernel_memory_size){
+
+    s->nb_cpus = nb_cpus > 0 ? nb_cpus : 1;
+    s->cpus = malloc(s->nb_cpus * sizeof(Computer));
+
+    // the areas of the other processors follow the kernel memory, aligned
+    long areas = (kernel_memory_size + 3) / 4 * 4;
+
+    init_computer(&s->cpus[0], program_memory_size, video_memory_size,
+                  areas + (s->nb_cpus - 1) * KERNEL_AREA_SZ);
+
+    for(int i = 0; i < s->nb_cpus; i++){
+
+        if(i > 0){
+            init_shared_computer(&s->cpus[i], &s->cpus[0], i);
+            s->cpus[i].kernel_area = program_memory_size + video_memory_size + areas + (i - 1) * KERNEL_AREA_SZ;
+        }
+
+        s->cpus[i].nb_cpus = s->nb_cpus;
+    }
+}
+
+void free_smp(Smp* s){
+
+    // the processors sharing the memory first, its owner last
+    for(int i = s->nb_cpus - 1; i >= 0; i--)
+        free_computer(&s->cpus[i]);
+
+    free(s->cpus);
+    s->cpus = NULL;
+}
+
+static void* run_thread(void* arg){
+
+    SmpThread* t = (SmpThread*) arg;
+    Computer* c = &t->smp->cpus[t->cpu];
+    long n;
+
+    do{
+        long batch = t->max_steps - t->steps < SMP_BATCH ? t->max_steps - t->steps : SMP_BATCH;
+
+        n = run_steps(c, batch);
+
+        t->steps += n;
+    } while(n > 0 && t->steps < t->max_steps);
+
+    return NULL;
+}
+
+long smp_run(Smp* s, long max_steps){
+
+    pthread_t* threads = malloc(s->nb_cpus * sizeof(pthread_t));
+    SmpThread* args = malloc(s->nb_cpus * sizeof(SmpThread));
+    long total = 0;
+
+    // the program was loaded through the first processor
+    for(int i = 1; i < s->nb_cpus; i++)
+        s->cpus[i].program_size = s->cpus[0].program_size;
+
+    for(int i = 0; i < s->nb_cpus; i++){
+        args[i] = (SmpThread) {s, i, max_steps, 0};
+        pthread_create(&threads[i], NULL, run_thread, &args[i]);
+    }
+
+    for(int i = 0; i < s->nb_cpus; i++){
+        pthread_join(threads[i], NULL);
+        total += args[i].steps;
+    }
+
+    free(threads);
+    free(args);
+
+    return total;
+}
+
+bool smp_raise_interrupt(Smp* s, int cpu, char type, char keyval){
+
+    if(cpu < 0 || cpu >= s->nb_cpus){
+        fprintf(stderr, "Error: no processor %d to interrupt.\n", cpu);
+        return false;
+    }
+
+    return raise_interrupt(&s->cpus[cpu], type, keyval);
+}
@@ -0,0 +1,68 @@
+#ifndef SMP_H__
+#define SMP_H__
+
+#include "emulator.h"
+#include <pthread.h>
+
+/* Symmetric multiprocessing: N Beta processors sharing one memory
+   (program, video and kernel), each running on its own host thread.
+
+   Every processor starts at address 0 with zeroed registers; programs
+   tell them apart with CPUID(RC) (processor number, 0 to N-1) and
+   NCPUS(RC), then give each one its own stack.
+
+   Memory model:
+   - aligned word LD/ST are single-copy atomic, but a processor may see
+     the ordinary stores of the others late and in any order;
+   - SWAP(RA, CC, RC) and CAS(RA, RB, RC) are sequentially consistent
+     atomic read-modify-writes that also act as full fences: the accesses
+     preceding one in program order are visible to every processor before
+     those following it.
+   Locks must therefore be taken with SWAP/CAS and released with SWAP,
+   not with a plain ST.
+
+   On the host, the interpreter's LD, ST and LDR are relaxed __atomic
+   word accesses and SWAP/CAS sequentially consistent ones, so threads
+   never race on them. Byte and halfword accesses, FILL, COPY and the
+   bulk loops of loop_idioms.h are plain memory copies: a word they
+   write while another processor accesses it may be seen torn, so such
+   ranges must be protected by a lock like any other shared data.
+
+   Interrupts are per processor: each has its own interrupt line, raised
+   from any thread by smp_raise_interrupt(), and its own devices (see
+   mmio.h), so the timer a processor programs interrupts it alone. They
+   all run the same handler, but the interrupt type and key and the
+   handler's frame and data are private: the first processor uses the
+   kernel memory as a lone one does, the others their KERNEL_AREA_SZ
+   area after it (see emulator.h), whose address the handler finds where
+   it finds the kernel's. */
+
+// instructions each processor runs per call to run_steps()
+#define SMP_BATCH 10000
+
+typedef struct{
+
+    int nb_cpus;
+    Computer* cpus; // cpus[0] owns the memory
+
+} Smp;
+
+/* Creates a machine of $nb_cpus processors with the given memory sizes,
+   the kernel memory growing by the areas of processors 1 to N-1.
+   Programs and handlers are loaded through s -> cpus[0]. */
+void init_smp(Smp* s, int nb_cpus, long program_memory_size,
+              long video_memory_size, long kernel_memory_size);
+
+/* Frees all the processors and the shared memory. */
+void free_smp(Smp* s);
+
+/* Runs every processor on its own thread for up to $max_steps
+   instructions, or until it stops executing (see is_executing()).
+   Returns the total number of instructions executed. */
+long smp_run(Smp* s, long max_steps);
+
+/* raise_interrupt() on processor $cpu, from any thread, running or not.
+   Returns false if $cpu does not exist or its line is already raised. */
+bool smp_raise_interrupt(Smp* s, int cpu, char type, char keyval);
+
+#endif
@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Builds the command line tools against the emulator core (no GTK needed).
+CORE="../emulator.c ../assembler.c ../loop_idioms.c ../replay.c ../latency.c ../keyboard_hle.c ../savestate.c ../history.c ../smp.c ../pc_stats.c ../pipeline.c ../cache.c ../branch_predictor.c ../video_export.c ../framebuffer.c ../renderer.c ../mmio.c ../aot.c ../write_log.c ../idle.c ../controller.c"
+
+gcc -O2 $CORE headless.c -o headless -lm -pthread -ldl 2> error.log &&
+gcc -O2 $CORE fuzz.c -o fuzz -lm -pthread -ldl 2>> error.log &&
+gcc -O2 $CORE translate.c -o translate -lm -pthread -ldl 2>> error.log &&
+
+# libbeta, the core as a library (see libbeta.h): only its API is exported.
+# The archive holds a single object linked from the core, whose other
+# symbols are made local so that they cannot clash with the program's.
+mkdir -p obj && rm -f obj/*.o libbeta.a &&
+(cd obj && gcc -O2 -fPIC -fvisibility=hidden -c $(printf '../%s ' $CORE) ../../libbeta.c 2>> ../error.log) &&
+ld -r obj/*.o -o libbeta.o 2>> error.log &&
+objcopy -w --keep-global-symbol='beta_*' libbeta.o 2>> error.log &&
+ar rcs libbeta.a libbeta.o && rm libbeta.o &&
+gcc -O2 test_libbeta.c libbeta.a -o test_libbeta -lm -pthread -ldl 2>> error.log &&
+gcc -O2 -shared -fPIC -fvisibility=hidden $CORE ../libbeta.c -o libbeta.so -lm -pthread -ldl 2>> error.log
+
+if [ $? -eq 0 ]; then
+  echo "Compilation successful."
+else
+  echo "Error occurred during compilation. Check error.log for details."
+fi
@@ -0,0 +1,939 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../emulator.h"
+#include "../mmio.h"
+#include "../aot.h"
+#include "../idle.h"
+
+/* Differential fuzzer: generates random valid Beta programs and memory
+   states, runs them through the reference interpreter (execute_step())
+   and through every candidate engine of $engines, compares the final
+   states and, on a mismatch, bisects on the step budget to report the
+   first diverging instruction with its disassembly. Programs include
+   counted fill/copy loops to exercise the loop idiom fast path.
+
+   The aot engine runs the program translated by tools/translate (see
+   aot.h). Translating and compiling take a fraction of a second, so
+   only one test in --aot-every gets a translated library. The idle
+   engine detects idle loops and parks (see idle.h), at a rate of 0 so
+   that the time spent parked credits nothing.
+
+   Each test is generated in one of these modes:
+       classic     the original instruction set, DIV included
+       extended    plus LDB, STB, LDH, STH, FILL, COPY, SWAP, CAS and
+                   CPUID (c -> extended_isa set)
+       interrupts  plus an interrupt handler, the default devices and a
+                   doorbell device raising an interrupt when stored
+                   into, so that interrupts are taken at the end of
+                   blocks, at device events and, when injected between
+                   two calls of the engine, when the next call starts */
+
+#define CODE_WORDS 256
+#define CODE_SIZE (CODE_WORDS * 4)
+#define DATA_BASE 0x1000
+#define DATA_SIZE 0x2000
+#define TEST_SIZE (DATA_BASE + DATA_SIZE)
+
+// small enough for kernel addresses to fit in a literal
+#define PROGRAM_MEMORY (16 * 1024)
+
+// R24 only ever holds divisors other than 0 and -1, R25 only valid code
+// addresses (JMP targets) and R26 the base of the data region, so that
+// every generated division and access stays valid. Templates use R0-R23.
+#define REG_DIVISOR 24
+#define REG_JUMP 25
+#define REG_DATA 26
+#define NB_TEMPLATE_REGS 24
+
+#define KERNEL_SCRATCH 16 // where the handler saves R1
+#define DOORBELL_BASE (MMIO_BASE + 2 * MEMORY_PAGE_SZ)
+#define MAX_INJECTIONS 8
+
+enum{
+    MODE_CLASSIC,
+    MODE_EXTENDED,
+    MODE_INTERRUPTS
+};
+
+static const char* mode_names[] = {"classic", "extended", "interrupts"};
+
+typedef struct{
+
+    const char* name;
+    bool (*prepare)(Computer* c); // attaches the engine after setup(), false to skip the test
+    long (*run)(Computer* c, long max_steps);
+
+} EngineEntry;
+
+static long no_loop_idioms_run(Computer* c, long max_steps);
+static bool aot_prepare(Computer* c);
+static bool idle_prepare(Computer* c);
+static long idle_run(Computer* c, long max_steps);
+
+static const EngineEntry engines[] = {
+    {"run_steps", NULL, run_steps},
+    {"no_loop_idioms", NULL, no_loop_idioms_run},
+    {"aot", aot_prepare, run_steps},
+    {"idle", idle_prepare, idle_run},
+};
+
+#define NB_ENGINES ((int) (sizeof(engines) / sizeof(engines[0])))
+
+typedef struct{
+
+    long at; // engine steps before the interrupt is raised
+    char keyval;
+
+} Injection;
+
+typedef struct{
+
+    unsigned char memory[TEST_SIZE];
+    int registers[32];
+    int mode;
+    Injection injections[MAX_INJECTIONS];
+    int nb_injections;
+
+} TestCase;
+
+static uint64_t rng_state;
+
+static char aot_library[4096]; // translation of the current test, empty if none
+
+static inline uint64_t next_random(){
+
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline int random_below(int n){
+
+    return (int) ((next_random() >> 33) % n);
+}
+
+static inline int random_dest_register(){
+
+    int r = random_below(30);
+
+    return (r == REG_DIVISOR || r == REG_JUMP || r == REG_DATA) ? 31 : r;
+}
+
+/* Random divisor for R24: neither 0 nor -1. */
+static inline int random_divisor(){
+
+    int literal = (int16_t) next_random();
+
+    return literal == 0 || literal == -1 ? 7 : literal;
+}
+
+static inline int32_t encode(int opcode, int rc, int ra, int rb_or_literal){
+
+    return (opcode << 26) | (rc << 21) | (ra << 16) | (rb_or_literal & 0xFFFF);
+}
+
+static inline int32_t encode_rrr(int opcode, int rc, int ra, int rb){
+
+    return (opcode << 26) | (rc << 21) | (ra << 16) | (rb << 11);
+}
+
+/* Literal of a PC-relative access from $pc to $target. */
+static inline int relative_literal(int pc, int target){
+
+    return (target - (pc + 4)) / 4;
+}
+
+static const int alu_opcodes[] = {0x20, 0x21, 0x22, 0x24, 0x25, 0x26, 0x28, 0x29,
+                                  0x2A, 0x2C, 0x2D, 0x2E};
+static const int aluc_opcodes[] = {0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x38,
+                                   0x39, 0x3A, 0x3C, 0x3D, 0x3E};
+
+static int template_start[CODE_WORDS]; // first word of the template covering each word
+
+/* Random branch target: any word of the code but the inside of a template. */
+static int random_target(){
+
+    return template_start[random_below(CODE_WORDS)] * 4;
+}
+
+/* Random offset in the data region for a pointer walking $count words with
+   $stride, keeping a margin for the +-4 access literal. */
+static int random_pointer_offset(int count, int stride){
+
+    int span = 4 * count + 8;
+    int offset = 8 + random_below((DATA_SIZE - 2 * span) / 4) * 4;
+
+    return stride > 0 ? offset : offset + span;
+}
+
+/* Stores in $regs $n distinct registers a template can use. */
+static void random_template_registers(int* regs, int n){
+
+    for(int i = 0; i < n; i++){
+        regs[i] = random_below(NB_TEMPLATE_REGS);
+        for(int j = 0; j < i; j++)
+            if(regs[j] == regs[i]){
+                i--;
+                break;
+            }
+    }
+}
+
+/* Emits at $code a counted fill or copy loop (the shapes run_loop_idiom()
+   looks for, sometimes slightly off) and returns its length in words. */
+static int generate_loop(int32_t* code, int pc){
+
+    int regs[6];
+
+    random_template_registers(regs, 6);
+
+    int counter = regs[0], dst = regs[1], src = regs[2], tmp = regs[3];
+    int link = random_below(2) ? 31 : regs[4];
+    int value = random_below(4) ? regs[5] : random_below(32);
+    bool copy = random_below(2);
+    int count = 2 + random_below(60);
+    int counter_delta = random_below(2) ? -1 : 1;
+    int dst_stride = random_below(2) ? 4 : -4;
+    int src_stride = random_below(2) ? 4 : -4;
+    int n = 0;
+
+    code[n++] = encode(0x30, counter, 31, counter_delta < 0 ? count : -count); // CMOVE
+    code[n++] = encode(0x30, dst, REG_DATA, random_pointer_offset(count, dst_stride));
+
+    if(copy)
+        code[n++] = encode(0x30, src, REG_DATA, random_pointer_offset(count, src_stride));
+
+    int head = n;
+    int32_t body[5];
+    int len = 0;
+
+    // pointer and counter updates go anywhere, the load always comes before the store
+    body[len++] = encode(counter_delta < 0 ? 0x31 : 0x30, counter, counter, 1);
+    body[len++] = encode(dst_stride > 0 ? 0x30 : 0x31, dst, dst, 4);
+
+    if(copy){
+        body[len++] = encode(src_stride > 0 ? 0x30 : 0x31, src, src, 4);
+        body[len++] = encode(0x18, tmp, src, 4 * (random_below(3) - 1));
+        body[len++] = encode(0x19, tmp, dst, 4 * (random_below(3) - 1));
+    } else {
+        body[len++] = encode(0x19, value, dst, 4 * (random_below(3) - 1));
+    }
+
+    for(int i = len - 1; i > 0; i--){
+        int j = random_below(i + 1);
+        int32_t swap = body[i];
+        body[i] = body[j];
+        body[j] = swap;
+    }
+
+    int load = -1, store = -1;
+
+    for(int i = 0; i < len; i++){
+        int opcode = (body[i] >> 26) & 0x3F;
+        if(opcode == 0x18)
+            load = i;
+        if(opcode == 0x19)
+            store = i;
+    }
+
+    if(load > store){ // the load always comes before the store
+        int32_t swap = body[load];
+        body[load] = body[store];
+        body[store] = swap;
+    }
+
+    memcpy(code + n, body, len * sizeof(int32_t));
+    n += len;
+    code[n] = encode(0x1E, link, counter, relative_literal(pc + 4 * n, pc + 4 * head)); // BNE
+
+    return n + 1;
+}
+
+/* Emits at $code a loop waiting for the interrupt handler to count one
+   more interrupt, the shape idle loop detection looks for, and returns
+   its length in words. Without interrupts, it spins until the end. */
+static int generate_wait_loop(int32_t* code, int pc){
+
+    int regs[3];
+
+    random_template_registers(regs, 3);
+
+    int link = random_below(2) ? 31 : random_dest_register();
+
+    code[0] = encode(0x18, regs[0], 31, DATA_BASE);                     // LD(R31, DATA_BASE, Ra)
+    code[1] = encode(0x18, regs[1], 31, DATA_BASE);                     // wait: LD(R31, DATA_BASE, Rb)
+    code[2] = encode_rrr(0x24, regs[2], regs[0], regs[1]);              // CMPEQ(Ra, Rb, Rc)
+    code[3] = encode(0x1E, link, regs[2], relative_literal(pc + 12, pc + 4)); // BNE(Rc, wait)
+
+    return 4;
+}
+
+/* Emits at $code a FILL or a COPY inside the data region, sometimes
+   longer than BLOCK_CHUNK_WORDS, and returns its length in words. */
+static int generate_block(int32_t* code){
+
+    int regs[3];
+
+    random_template_registers(regs, 3);
+
+    bool copy = random_below(2);
+    int count = random_below(8) ? random_below(128) : random_below(DATA_SIZE / 4);
+    int n = 0;
+
+    code[n++] = encode(0x30, regs[0], REG_DATA, random_below(DATA_SIZE / 4 - count + 1) * 4);
+
+    if(copy)
+        code[n++] = encode(0x30, regs[2], REG_DATA, random_below(DATA_SIZE / 4 - count + 1) * 4);
+
+    code[n++] = encode(0x30, regs[1], 31, random_below(16) ? count : -count);
+    code[n++] = copy ? encode_rrr(0x15, regs[2], regs[0], regs[1])  // COPY(Ra, Rc, Rb)
+                     : encode_rrr(0x14, regs[2], regs[0], regs[1]); // FILL(Ra, Rb, Rc)
+
+    return n;
+}
+
+/* Emits at $code a CAS on a word of the data region, expecting its
+   current value half of the time, and returns its length in words. */
+static int generate_cas(int32_t* code){
+
+    int regs[2];
+
+    random_template_registers(regs, 2);
+
+    int n = 0;
+
+    code[n++] = encode(0x30, regs[0], REG_DATA, random_below(DATA_SIZE / 4) * 4);
+
+    if(random_below(2))
+        code[n++] = encode(0x18, regs[1], regs[0], 0);
+
+    code[n++] = encode_rrr(0x1C, regs[1], regs[0], random_below(32)); // CAS(Ra, Rb, Rc)
+
+    return n;
+}
+
+/* Emits at $code an access to a device register (the timer period, the
+   doorbell followed by a short countdown loop, or a read of the cycle
+   counter or the timer) and returns its length in words. */
+static int generate_device_access(int32_t* code, int pc){
+
+    int regs[2];
+
+    random_template_registers(regs, 2);
+
+    int base = regs[0], value = regs[1];
+    int n = 0;
+
+    code[n++] = encode(0x30, base, 31, MMIO_BASE >> 16);
+    code[n++] = encode(0x3C, base, base, 16); // SHLC
+
+    switch(random_below(4)){
+        case 0:
+            code[n++] = encode(0x30, value, 31, random_below(8) ? 20 + random_below(1000) : 0);
+            code[n++] = encode(0x19, value, base, TIMER_BASE - MMIO_BASE + TIMER_PERIOD);
+            break;
+        case 1: // the interrupt is taken at the end of the first iteration
+            code[n++] = encode(0x19, random_below(32), base, DOORBELL_BASE - MMIO_BASE);
+            code[n++] = encode(0x30, value, 31, 1 + random_below(8));
+            code[n++] = encode(0x31, value, value, 1); // SUBC
+            code[n] = encode(0x1E, 31, value, relative_literal(pc + 4 * n, pc + 4 * (n - 1)));
+            n++;
+            break;
+        case 2:
+            code[n++] = encode(0x18, random_dest_register(), base, CYCLE_COUNTER_BASE - MMIO_BASE
+                               + 4 * random_below(4));
+            break;
+        default:
+            code[n++] = encode(0x18, random_dest_register(), base, TIMER_BASE - MMIO_BASE
+                               + 4 * random_below(3));
+    }
+
+    return n;
+}
+
+/* Emits at $code one of the multi-word sequences of the $mode. */
+static int generate_template(int32_t* code, int pc, int mode){
+
+    switch(random_below(4)){
+        case 1:
+            return generate_wait_loop(code, pc);
+        case 2:
+            if(mode != MODE_CLASSIC)
+                return random_below(2) ? generate_block(code) : generate_cas(code);
+            break;
+        case 3:
+            if(mode == MODE_INTERRUPTS)
+                return generate_device_access(code, pc);
+            break;
+    }
+
+    return generate_loop(code, pc);
+}
+
+/* One instruction of the extended ISA that needs no template. */
+static int32_t generate_extended(){
+
+    int offset = random_below(DATA_SIZE - 1);
+
+    switch(random_below(4)){
+        case 0: // LDB, LDH
+            return random_below(2) ? encode(random_below(2) ? 0x10 : 0x12, random_dest_register(), REG_DATA, offset)
+                                   : encode(random_below(2) ? 0x10 : 0x12, random_dest_register(), 31, DATA_BASE + offset);
+        case 1: // STB, STH
+            return random_below(2) ? encode(random_below(2) ? 0x11 : 0x13, random_below(32), REG_DATA, offset)
+                                   : encode(random_below(2) ? 0x11 : 0x13, random_below(32), 31, DATA_BASE + offset);
+        case 2: // SWAP
+            return encode(0x1A, random_dest_register(), REG_DATA, offset & ~3);
+        default: // CPUID, NCPUS
+            return encode(0x01, random_dest_register(), 0, random_below(2));
+    }
+}
+
+static void generate(TestCase* t, long max_steps){
+
+    int32_t* code = (int32_t*) t->memory;
+
+    t->mode = random_below(3);
+
+    for(int i = DATA_BASE; i < TEST_SIZE; i++)
+        t->memory[i] = next_random();
+
+    for(int i = 0; i < CODE_WORDS; i++)
+        template_start[i] = i;
+
+    // templates are laid out first so that no branch lands inside one
+    bool is_template[CODE_WORDS] = {false};
+
+    for(int nb = random_below(8); nb > 0; nb--){
+
+        int start = random_below(CODE_WORDS - 16);
+        bool free_words = true;
+
+        for(int i = start; i < start + 12; i++)
+            free_words &= !is_template[i];
+
+        if(!free_words)
+            continue;
+
+        int len = generate_template(code + start, start * 4, t->mode);
+
+        for(int i = start; i < start + len; i++){
+            is_template[i] = true;
+            template_start[i] = start;
+        }
+    }
+
+    for(int pc = 0; pc < CODE_SIZE - 4; pc += 4){
+
+        if(is_template[pc / 4])
+            continue;
+
+        int kind = random_below(100);
+        int rc = random_dest_register();
+        int ra = random_below(32);
+
+        if(t->mode != MODE_CLASSIC && kind < 8){
+            code[pc / 4] = generate_extended();
+        }
+
+        else if(kind < 35){
+            code[pc / 4] = encode_rrr(alu_opcodes[random_below(sizeof(alu_opcodes) / sizeof(int))],
+                                      rc, ra, random_below(32));
+        }
+
+        else if(kind < 38){ // DIV by R24, or a new divisor
+            code[pc / 4] = random_below(4) ? encode_rrr(0x23, rc, ra, REG_DIVISOR)
+                                           : encode(0x39, REG_DIVISOR, 31, random_divisor()); // ORC
+        }
+
+        else if(kind < 65){
+
+            int opcode = aluc_opcodes[random_below(sizeof(aluc_opcodes) / sizeof(int))];
+            int literal = (int16_t) next_random();
+
+            if(opcode == 0x33 && (literal == 0 || literal == -1)) // DIVC
+                literal = 7;
+
+            if(opcode == 0x3E) // SRAC
+                literal &= 0x1F;
+
+            code[pc / 4] = encode(opcode, rc, ra, literal);
+        }
+
+        else if(kind < 75){ // LD from the data region
+            int offset = random_below(DATA_SIZE / 4) * 4;
+            code[pc / 4] = random_below(2) ? encode(0x18, rc, REG_DATA, offset)
+                                           : encode(0x18, rc, 31, DATA_BASE + offset);
+        }
+
+        else if(kind < 85){ // ST into the data region
+            int offset = random_below(DATA_SIZE / 4) * 4;
+            code[pc / 4] = random_below(2) ? encode(0x19, random_below(32), REG_DATA, offset)
+                                           : encode(0x19, random_below(32), 31, DATA_BASE + offset);
+        }
+
+        else if(kind < 88){ // LDR from the data region
+            int target = DATA_BASE + random_below(DATA_SIZE / 4) * 4;
+            code[pc / 4] = encode(0x1F, rc, 31, relative_literal(pc, target));
+        }
+
+        else if(kind < 97){ // BEQ / BNE anywhere in the code
+            code[pc / 4] = encode(random_below(2) ? 0x1D : 0x1E, rc, ra, relative_literal(pc, random_target()));
+        }
+
+        else if(pc + 8 < CODE_SIZE && !is_template[pc / 4 + 1]){ // CMOVE(target, R25) JMP(R25, Rc)
+            code[pc / 4] = encode(0x30, REG_JUMP, 31, random_target());
+            pc += 4;
+            code[pc / 4] = encode(0x1B, rc, REG_JUMP, 0);
+        }
+
+        else{
+            code[pc / 4] = 0; // HALT
+        }
+    }
+
+    code[CODE_WORDS - 1] = 0; // HALT
+
+    memset(t->memory + CODE_SIZE, 0, DATA_BASE - CODE_SIZE);
+
+    for(int i = 0; i < 32; i++)
+        t->registers[i] = (int) next_random();
+
+    t->registers[REG_DIVISOR] = random_divisor();
+    t->registers[REG_JUMP] = 0;
+    t->registers[REG_DATA] = DATA_BASE;
+    t->registers[31] = 0;
+
+    t->nb_injections = t->mode == MODE_INTERRUPTS ? random_below(MAX_INJECTIONS + 1) : 0;
+
+    for(int i = 0; i < t->nb_injections; i++){
+        t->injections[i].at = (i > 0 ? t->injections[i - 1].at : 0) + random_below(2 * max_steps / MAX_INJECTIONS);
+        t->injections[i].keyval = next_random();
+    }
+}
+
+/* Doorbell: a store into it raises a keyboard interrupt with the value,
+   taken by the CPU at the end of the block. */
+static void doorbell_write(Computer* c, Device* d, long offset, int32_t value){
+
+    (void) d;
+    (void) offset;
+
+    raise_interrupt(c, INTERRUPT_KEY_PRESSED, (char) value);
+}
+
+static Device* new_doorbell(void){
+
+    Device* d = calloc(1, sizeof(Device));
+
+    d->name = "doorbell";
+    d->start = DOORBELL_BASE;
+    d->end = DOORBELL_BASE + 4;
+    d->write = doorbell_write;
+    d->deadline = NO_DEVICE_EVENT;
+
+    return d;
+}
+
+/* Loads the interrupt handler of the interrupts mode: it counts the
+   interrupts in the first word of the data region, preserving every
+   register but XP. */
+static void load_handler(Computer* c){
+
+    long kernel = c->program_memory_size + c->video_memory_size;
+    int32_t handler[] = {
+        encode(0x19, 1, 31, kernel + KERNEL_SCRATCH), // ST(R1, scratch)
+        encode(0x18, 1, 31, DATA_BASE),               // LD(R31, DATA_BASE, R1)
+        encode(0x30, 1, 1, 1),                        // ADDC(R1, 1, R1)
+        encode(0x19, 1, 31, DATA_BASE),               // ST(R1, DATA_BASE)
+        encode(0x18, 1, 31, kernel + KERNEL_SCRATCH), // LD(R31, scratch, R1)
+        encode_rrr(0x1B, 31, 30, 0)                   // JMP(XP)
+    };
+
+    memcpy(c->memory + kernel + KERNEL_HANDLER, handler, sizeof(handler));
+}
+
+static void setup(Computer* c, const TestCase* t){
+
+    memcpy(c->memory, t->memory, TEST_SIZE);
+    memset(c->memory + TEST_SIZE, 0, 4); // written when an interrupt is delivered
+    memcpy(c->cpu.registers, t->registers, sizeof(t->registers));
+    c->cpu.program_counter = 0;
+    c->program_size = TEST_SIZE;
+    c->halted = false;
+    c->interrupt_raised = false;
+    c->pending_interrupt = 0;
+    c->retired = 0;
+    c->block_cycles = 0;
+    c->latest_accessed = -1;
+    c->extended_isa = t->mode != MODE_CLASSIC;
+    c->loop_idioms = true;
+
+    disable_aot(c);
+    disable_idle_detection(c);
+    memset(c->memory + c->program_memory_size + c->video_memory_size, 0, KERNEL_HANDLER);
+    disable_bus(c);
+
+    if(t->mode == MODE_INTERRUPTS){
+        load_handler(c);
+        enable_default_devices(c);
+        map_device(c, new_doorbell());
+    }
+}
+
+/* The reference: execute_step() one instruction at a time, with what
+   run_steps() does around it (a pending interrupt taken when it starts,
+   device events before each instruction). */
+static long reference_run(Computer* c, long max_steps){
+
+    long steps = 0;
+    uint32_t pending = c->pending_interrupt;
+
+    if(pending & INTERRUPT_PENDING){
+        c->pending_interrupt = 0;
+        deliver_interrupt(c, (char) (pending >> 8), (char) pending);
+    }
+
+    while(steps < max_steps && is_executing(c)){
+
+        if(c->retired >= c->next_device_event)
+            run_device_events(c);
+
+        execute_step(c);
+        steps++;
+    }
+
+    return steps;
+}
+
+static const EngineEntry reference = {"reference", NULL, reference_run};
+
+/* run_steps() interpreting fill and copy loops like any other code. */
+static long no_loop_idioms_run(Computer* c, long max_steps){
+
+    c->loop_idioms = false;
+
+    return run_steps(c, max_steps);
+}
+
+/* Attaches the translation of the current test, if it has one. */
+static bool aot_prepare(Computer* c){
+
+    if(aot_library[0] == '\0')
+        return false;
+
+    AotEngine* e = load_aot_engine(aot_library);
+
+    return e != NULL && attach_aot_engine(c, e);
+}
+
+static bool idle_prepare(Computer* c){
+
+    enable_idle_detection(c, true, 0);
+
+    return true;
+}
+
+/* run_steps() parking in idle loops. Only an interrupt can wake a
+   parked computer and none comes before the call returns, so it then
+   spins through the rest of the budget, as the reference does, skipping
+   iterations without parking. A computer parked while a device event is
+   scheduled would sleep through it: it stays parked, and the comparison
+   reports the missing steps. */
+static long idle_run(Computer* c, long max_steps){
+
+    long steps = run_steps(c, max_steps);
+
+    if(c->idle->parked && c->next_device_event == NO_DEVICE_EVENT){
+        idle_resume(c);
+        c->idle->park = false;
+        steps += run_steps(c, max_steps - steps);
+        c->idle->park = true;
+    }
+
+    return steps;
+}
+
+/* Translates the code of $t with $translate into a library in $dir,
+   whose path is stored in aot_library. Returns false on error. */
+static bool translate_test(const TestCase* t, const char* translate, const char* dir){
+
+    char image[4096], command[3 * 4096];
+
+    snprintf(image, sizeof(image), "%s/test.bin", dir);
+    snprintf(aot_library, sizeof(aot_library), "%s/test.so", dir);
+
+    FILE* fp = fopen(image, "wb");
+
+    if(fp == NULL || fwrite(t->memory, 1, CODE_SIZE, fp) != CODE_SIZE){
+        fprintf(stderr, "Error: Cannot write %s\n", image);
+        if(fp != NULL)
+            fclose(fp);
+        aot_library[0] = '\0';
+        return false;
+    }
+
+    fclose(fp);
+    snprintf(command, sizeof(command), "'%s' '%s' '%s' > /dev/null", translate, image, aot_library);
+
+    if(system(command) != 0){
+        fprintf(stderr, "Error: %s failed\n", command);
+        aot_library[0] = '\0';
+        return false;
+    }
+
+    return true;
+}
+
+/* Runs $t on $engine for $max_steps instructions, raising its injected
+   interrupts between two calls. Returns the number of instructions run. */
+static long run_test(const EngineEntry* engine, Computer* c, const TestCase* t, long max_steps){
+
+    long steps = 0;
+
+    for(int i = 0; i < t->nb_injections && t->injections[i].at < max_steps; i++){
+
+        if(t->injections[i].at > steps)
+            steps += engine->run(c, t->injections[i].at - steps);
+
+        raise_interrupt(c, INTERRUPT_KEY_PRESSED, t->injections[i].keyval);
+    }
+
+    return steps + engine->run(c, max_steps - steps);
+}
+
+/* Returns true if $a and $b are in the same architectural state. */
+static bool same_state(Computer* a, Computer* b){
+
+    long kernel = a->program_memory_size + a->video_memory_size;
+
+    return a->cpu.program_counter == b->cpu.program_counter
+        && a->halted == b->halted
+        && a->retired == b->retired
+        && a->latest_accessed == b->latest_accessed
+        && a->interrupt_raised == b->interrupt_raised
+        && a->pending_interrupt == b->pending_interrupt
+        && a->block_cycles == b->block_cycles
+        && memcmp(a->cpu.registers, b->cpu.registers, 31 * sizeof(int)) == 0
+        && memcmp(a->memory, b->memory, TEST_SIZE + 4) == 0
+        && memcmp(a->memory + kernel, b->memory + kernel, KERNEL_HANDLER) == 0;
+}
+
+/* Runs $t for $steps instructions on the reference and on $engine and
+   returns true if both end up in the same state. */
+static bool agree_after(const EngineEntry* engine, const TestCase* t,
+                        Computer* ref, Computer* cand, long steps){
+
+    setup(ref, t);
+    setup(cand, t);
+
+    if(engine->prepare != NULL && !engine->prepare(cand))
+        return true;
+
+    long n_ref = run_test(&reference, ref, t, steps);
+    long n_cand = run_test(engine, cand, t, steps);
+
+    return n_ref == n_cand && same_state(ref, cand);
+}
+
+/* Engines may execute several instructions at once (loop idioms), so the
+   first diverging instruction is found by bisecting on the step budget
+   rather than by single-stepping. */
+static void report_divergence(const EngineEntry* engine, const TestCase* t,
+                              Computer* ref, Computer* cand, long test, uint64_t seed, long max_steps){
+
+    char buf[64];
+    long good = 0, bad = max_steps; // agree after $good steps, disagree after $bad
+
+    while(bad - good > 1){
+        long mid = good + (bad - good) / 2;
+        if(agree_after(engine, t, ref, cand, mid))
+            good = mid;
+        else
+            bad = mid;
+    }
+
+    agree_after(engine, t, ref, cand, good);
+    long pc = ref->cpu.program_counter;
+    int instruction = get_word(ref, pc);
+
+    if(agree_after(engine, t, ref, cand, bad)){
+        printf("DIVERGENCE engine=%s seed=%llu test=%ld: final states differ but "
+               "bisection did not (engine ignores max_steps?)\n",
+               engine->name, (unsigned long long) seed, test);
+        return;
+    }
+
+    long n_ref = ref->retired, n_cand = cand->retired;
+    long kernel = ref->program_memory_size + ref->video_memory_size;
+
+    disassemble(instruction, buf);
+    printf("DIVERGENCE engine=%s seed=%llu test=%ld mode=%s step=%ld\n",
+           engine->name, (unsigned long long) seed, test, mode_names[t->mode], good);
+    printf("  at PC %.8lx: %.8x %s\n", pc, instruction, buf);
+    printf("  retired: reference %ld, %s %ld\n", n_ref, engine->name, n_cand);
+
+    if(ref->cpu.program_counter != cand->cpu.program_counter)
+        printf("  PC: reference %.8lx, %s %.8lx\n", ref->cpu.program_counter,
+               engine->name, cand->cpu.program_counter);
+
+    if(ref->halted != cand->halted)
+        printf("  halted: reference %d, %s %d\n", ref->halted, engine->name, cand->halted);
+
+    if(ref->latest_accessed != cand->latest_accessed)
+        printf("  latest_accessed: reference %.8lx, %s %.8lx\n", ref->latest_accessed,
+               engine->name, cand->latest_accessed);
+
+    if(ref->interrupt_raised != cand->interrupt_raised)
+        printf("  interrupt_raised: reference %d, %s %d\n", ref->interrupt_raised,
+               engine->name, cand->interrupt_raised);
+
+    if(ref->pending_interrupt != cand->pending_interrupt)
+        printf("  pending_interrupt: reference %.8x, %s %.8x\n", ref->pending_interrupt,
+               engine->name, cand->pending_interrupt);
+
+    if(ref->block_cycles != cand->block_cycles)
+        printf("  block_cycles: reference %llu, %s %llu\n", ref->block_cycles,
+               engine->name, cand->block_cycles);
+
+    for(int r = 0; r < 31; r++)
+        if(ref->cpu.registers[r] != cand->cpu.registers[r])
+            printf("  %s: reference %.8x, %s %.8x\n", reg_symbols[r],
+                   ref->cpu.registers[r], engine->name, cand->cpu.registers[r]);
+
+    for(long a = 0; a < TEST_SIZE + 4; a += 4)
+        if(memcmp(ref->memory + a, cand->memory + a, 4) != 0)
+            printf("  mem[%.8lx]: reference %.8x, %s %.8x\n", a,
+                   get_word(ref, a), engine->name, get_word(cand, a));
+
+    for(long a = kernel; a < kernel + KERNEL_HANDLER; a += 4)
+        if(memcmp(ref->memory + a, cand->memory + a, 4) != 0)
+            printf("  mem[%.8lx]: reference %.8x, %s %.8x\n", a,
+                   get_word(ref, a), engine->name, get_word(cand, a));
+
+    printf("  code around PC:\n");
+
+    for(long a = pc - 16; a <= pc + 16; a += 4){
+        if(a < 0 || a >= CODE_SIZE)
+            continue;
+        disassemble(t->memory[a] | t->memory[a + 1] << 8 | t->memory[a + 2] << 16
+                    | (int) ((unsigned) t->memory[a + 3] << 24), buf);
+        printf("  %s %.8lx  %s\n", a == pc ? ">" : " ", a, buf);
+    }
+}
+
+static double now_seconds(){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv){
+
+    uint64_t seed = (uint64_t) time(NULL);
+    long nb_tests = 100000;
+    long max_steps = 20000;
+    long aot_every = 500;
+
+    for(int i = 1; i < argc; i++){
+
+        if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 0);
+        else if(strcmp(argv[i], "--tests") == 0 && i + 1 < argc)
+            nb_tests = atol(argv[++i]);
+        else if(strcmp(argv[i], "--steps") == 0 && i + 1 < argc)
+            max_steps = atol(argv[++i]);
+        else if(strcmp(argv[i], "--aot-every") == 0 && i + 1 < argc)
+            aot_every = atol(argv[++i]);
+        else{
+            fprintf(stderr, "Usage: %s [--seed S] [--tests N] [--steps MAX_PER_TEST] "
+                            "[--aot-every N (0: never)]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    rng_state = seed ? seed : 1;
+
+    // tools/translate next to this program, libraries in a directory of our own
+    char translate[4096], dir[] = "/tmp/fuzz-aot-XXXXXX";
+    const char* slash = strrchr(argv[0], '/');
+
+    snprintf(translate, sizeof(translate), "%.*s/translate",
+             slash != NULL ? (int) (slash - argv[0]) : 1, slash != NULL ? argv[0] : ".");
+
+    if(aot_every > 0 && mkdtemp(dir) == NULL){
+        fprintf(stderr, "Error: Cannot create %s\n", dir);
+        return 1;
+    }
+
+    Computer ref, cand;
+    init_computer(&ref, PROGRAM_MEMORY, 0, KERNEL_MEMORY_SZ);
+    init_computer(&cand, PROGRAM_MEMORY, 0, KERNEL_MEMORY_SZ);
+
+    TestCase* t = malloc(sizeof(TestCase));
+    long long total = 0;
+    int failures = 0;
+    double start = now_seconds();
+
+    for(long test = 0; test < nb_tests && failures == 0; test++){
+
+        generate(t, max_steps);
+        aot_library[0] = '\0';
+
+        if(aot_every > 0 && test % aot_every == 0 && !translate_test(t, translate, dir)){
+            failures++;
+            break;
+        }
+
+        setup(&ref, t);
+        long n_ref = run_test(&reference, &ref, t, max_steps);
+        total += n_ref;
+
+        for(int e = 0; e < NB_ENGINES; e++){
+
+            setup(&cand, t);
+
+            if(engines[e].prepare != NULL && !engines[e].prepare(&cand))
+                continue;
+
+            long n_cand = run_test(&engines[e], &cand, t, max_steps);
+            total += n_cand;
+
+            if(n_cand != n_ref || !same_state(&ref, &cand)){
+                report_divergence(&engines[e], t, &ref, &cand, test, seed, max_steps);
+                failures++;
+                break;
+            }
+        }
+    }
+
+    double elapsed = now_seconds() - start;
+    printf("seed %llu: %lld instructions compared in %.2f s (%.2f M instr/s), %s\n",
+           (unsigned long long) seed, total, elapsed, elapsed > 0 ? total / elapsed / 1e6 : 0.0,
+           failures ? "DIVERGENCE FOUND" : "no divergence");
+
+    if(aot_every > 0){
+        char path[4096];
+        for(const char* const* f = (const char* const[]) {"test.bin", "test.c", "test.so", NULL}; *f != NULL; f++){
+            snprintf(path, sizeof(path), "%s/%s", dir, *f);
+            unlink(path);
+        }
+        rmdir(dir);
+    }
+
+    free(t);
+    free_computer(&ref);
+    free_computer(&cand);
+
+    return failures != 0;
+}
@@ -0,0 +1,574 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../emulator.h"
+#include "../assembler.h"
+#include "../replay.h"
+#include "../latency.h"
+#include "../keyboard_hle.h"
+#include "../savestate.h"
+#include "../history.h"
+#include "../smp.h"
+#include "../pipeline.h"
+#include "../cache.h"
+#include "../branch_predictor.h"
+#include "../video_export.h"
+#include "../framebuffer.h"
+#include "../mmio.h"
+#include "../aot.h"
+#include "../write_log.h"
+#include "../idle.h"
+
+/* Headless runner: loads a program (binary or assembly source) and an
+   optional interrupt handler and runs it without any GUI until it halts
+   or leaves its code, then dumps the CPU state. */
+
+static void usage(const char* prog){
+
+    fprintf(stderr,
+            "Usage: %s [options] program(.asm|.asm.bin)\n"
+            "       %s [options] --load STATE\n"
+            "  --handler FILE     interrupt handler (.asm or .asm.bin)\n"
+            "  --steps N          stop after N instructions\n"
+            "  --replay FILE      raise the keyboard interrupts recorded in FILE\n"
+            "  --latency          print interrupt latency statistics at the end\n"
+            "  --hle-keyboard     handle keyboard interrupts natively instead of with the handler\n"
+            "  --hle-check        run the handler and compare it with the native handling\n"
+            "  --load STATE       start from a save-state instead of a program\n"
+            "  --save STATE       save the final state\n"
+            "  --history          record the execution history (enabled by the --reverse options)\n"
+            "  --history-budget B bytes of undo log kept by the history\n"
+            "  --checkpoint-interval N\n"
+            "                     instructions between two history checkpoints\n"
+            "  --reverse-steps N  go back N instructions at the end\n"
+            "  --reverse-to-pc A  go back to the last time PC was A (hex) at the end\n"
+            "  --reverse-to-write A\n"
+            "                     go back to the last store into the word at A (hex) at the end\n"
+            "  --pipeline BYPASS  time the run on a 5-stage pipeline, BYPASS is full, mem or none\n"
+            "  --branch-penalty N cycles lost by taken branches and jumps (default 2)\n"
+            "  --caches           simulate 16 KB L1 instruction and data caches\n"
+            "  --l1i SPEC, --l1d SPEC, --l2 SPEC\n"
+            "                     cache geometry SIZE,WAYS,LINE[,wb|wt], e.g. 256k,8,64,wb (implies --caches)\n"
+            "  --predictor KIND   simulate a static, bimodal or gshare branch predictor\n"
+            "  --predictor-bits N 2^N counters for bimodal and gshare (default 12)\n"
+            "  --cpus N           run N processors sharing the memory, one thread each\n"
+            "  --aot LIB          run the program's code translated by tools/translate into LIB\n"
+            "  --devices          map the cycle counter and the interval timer (see mmio.h)\n"
+            "  --video FILE       record the screen into FILE, as Y4M if it ends with .y4m,\n"
+            "                     otherwise as a delta-encoded RGB stream (see video_export.h)\n"
+            "  --frame-instructions N\n"
+            "                     instructions between two video frames (default 1000000)\n"
+            "  --fps N            frame rate written in Y4M headers (default 30)\n"
+            "  --video-mode MODE  framebuffer WIDTHxHEIGHT[:rgb32|rgb565|indexed8] (default 600x400:rgb32)\n"
+            "  --last-writes N    log the memory writes and print the last N at the end\n"
+            "  --idle             skip the iterations of idle polling loops (see idle.h)\n"
+            "  --assemble-only    write program.bin and program.sym then exit\n"
+            "  --quiet            do not dump the registers\n"
+            "  --no-loop-idioms   interpret fill/copy loops instruction by instruction\n"
+            "  --extended-isa     accept LDB, STB, LDH, STH, FILL, COPY, SWAP, CAS and CPUID\n"
+            "                     (see emulator.h, always on with --cpus)\n",
+            prog, prog);
+}
+
+/* Number of instructions to run next: the rest of the run, cut at the
+   next video frame when recording one. */
+static long next_chunk(long steps, long max_steps, long frame_instructions){
+
+    long n = max_steps < 0 ? 1000000 : max_steps - steps;
+
+    if(frame_instructions > 0 && frame_instructions - steps % frame_instructions < n)
+        n = frame_instructions - steps % frame_instructions;
+
+    return n;
+}
+
+static double now_seconds(){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int assemble_only(const char* path){
+
+    Assembly a;
+
+    if(assemble_file(path, &a) < 0){
+        fprintf(stderr, "Error: %s\n", a.error);
+        free_assembly(&a);
+        return 1;
+    }
+
+    char out_path[4096];
+    snprintf(out_path, sizeof(out_path), "%s.bin", path);
+    FILE* out = fopen(out_path, "wb");
+    int ret = write_image(&a, out);
+
+    if(out != NULL)
+        fclose(out);
+
+    snprintf(out_path, sizeof(out_path), "%s.sym", path);
+    out = fopen(out_path, "w");
+    ret |= write_symbol_table(&a, out);
+
+    if(out != NULL)
+        fclose(out);
+
+    if(ret < 0)
+        fprintf(stderr, "Error: could not write the output of %s.\n", path);
+    else
+        printf("%s: %ld bytes, %d labels\n", path, a.size, a.nb_labels);
+
+    free_assembly(&a);
+
+    return ret < 0;
+}
+
+/* Loads $program and the optional interrupt $handler into $c. */
+static bool load_files(Computer* c, const char* program, const char* handler){
+
+    Assembly assembly;
+    FILE* fp = open_program(program, &assembly);
+
+    if(fp == NULL){
+        free_assembly(&assembly);
+        return false;
+    }
+
+    load(c, fp);
+    fclose(fp);
+    free_assembly(&assembly);
+
+    if(handler != NULL){
+
+        fp = open_program(handler, &assembly);
+
+        if(fp == NULL){
+            free_assembly(&assembly);
+            return false;
+        }
+
+        load_interrupt_handler(c, fp);
+        fclose(fp);
+        free_assembly(&assembly);
+    }
+
+    return true;
+}
+
+static void dump_state(Computer* c){
+
+    printf("PC  %.8lx%s\n", c->cpu.program_counter, c->halted ? " (halted)" : "");
+
+    for(int i = 0; i < 32; i++)
+        printf("%-4s%.8x%s", reg_symbols[i], get_register(c, i), (i % 4 == 3) ? "\n" : "  ");
+}
+
+/* Runs $program on $nb_cpus processors (see smp.h). */
+static int run_smp(int nb_cpus, const char* program, const char* handler,
+                   long max_steps, bool quiet, bool loop_idioms, bool devices){
+
+    Smp smp;
+    init_smp(&smp, nb_cpus, PROGRAM_MEMORY_SZ, VIDEO_MEMORY_SZ, KERNEL_MEMORY_SZ);
+
+    if(!load_files(&smp.cpus[0], program, handler)){
+        free_smp(&smp);
+        return 1;
+    }
+
+    for(int i = 0; i < nb_cpus; i++){
+        smp.cpus[i].loop_idioms = loop_idioms;
+        smp.cpus[i].extended_isa = true; // for SWAP, CAS and CPUID
+
+        // each processor has its own timer (see smp.h)
+        if(devices)
+            enable_default_devices(&smp.cpus[i]);
+    }
+
+    double start = now_seconds();
+    long steps = smp_run(&smp, max_steps < 0 ? __LONG_MAX__ : max_steps);
+    double elapsed = now_seconds() - start;
+
+    for(int i = 0; i < nb_cpus && !quiet; i++){
+        printf("CPU %d: %llu instructions\n", i, smp.cpus[i].retired);
+        dump_state(&smp.cpus[i]);
+    }
+
+    printf("%ld instructions on %d processors in %.3f s (%.2f MIPS)\n", steps, nb_cpus, elapsed,
+           elapsed > 0 ? steps / elapsed / 1e6 : 0.0);
+
+    free_smp(&smp);
+
+    return 0;
+}
+
+int main(int argc, char** argv){
+
+    const char* program = NULL;
+    const char* handler = NULL;
+    const char* replay_path = NULL;
+    const char* load_path = NULL;
+    const char* save_path = NULL;
+    long max_steps = -1;
+    bool only_assemble = false;
+    bool quiet = false;
+    bool loop_idioms = true;
+    bool latency = false;
+    int keyboard_hle = KEYBOARD_HLE_OFF;
+    int nb_cpus = 1;
+    int pipeline = -1;
+    int branch_penalty = 2;
+    bool caches = false;
+    bool has_l2 = false;
+    CacheConfig l1i = {16 * 1024, 2, 32, CACHE_WRITE_BACK};
+    CacheConfig l1d = {16 * 1024, 4, 32, CACHE_WRITE_BACK};
+    CacheConfig l2;
+    int predictor = -1;
+    int predictor_bits = 12;
+    bool history = false;
+    long history_budget = HISTORY_DEFAULT_BUDGET;
+    long checkpoint_interval = HISTORY_DEFAULT_INTERVAL;
+    long reverse_steps = 0;
+    long reverse_pc = -1;
+    long reverse_write = -1;
+    bool devices = false;
+    const char* aot_path = NULL;
+    const char* video_path = NULL;
+    long frame_instructions = 1000000;
+    int fps = 30;
+    int last_writes = 0;
+    bool idle = false;
+    bool extended_isa = false;
+    int video_width = 0, video_height = 0, video_mode_format = VIDEO_RGB32;
+
+    for(int i = 1; i < argc; i++){
+
+        if(strcmp(argv[i], "--handler") == 0 && i + 1 < argc)
+            handler = argv[++i];
+        else if(strcmp(argv[i], "--steps") == 0 && i + 1 < argc)
+            max_steps = atol(argv[++i]);
+        else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+            replay_path = argv[++i];
+        else if(strcmp(argv[i], "--load") == 0 && i + 1 < argc)
+            load_path = argv[++i];
+        else if(strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+            save_path = argv[++i];
+        else if(strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc){
+            i++;
+            pipeline = strcmp(argv[i], "full") == 0 ? PIPELINE_BYPASS_FULL
+                     : strcmp(argv[i], "mem") == 0 ? PIPELINE_BYPASS_MEM
+                     : strcmp(argv[i], "none") == 0 ? PIPELINE_BYPASS_NONE : -2;
+            if(pipeline == -2){
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--branch-penalty") == 0 && i + 1 < argc)
+            branch_penalty = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--caches") == 0)
+            caches = true;
+        else if(strcmp(argv[i], "--l1i") == 0 && i + 1 < argc && parse_cache_config(argv[i + 1], &l1i))
+            caches = ++i;
+        else if(strcmp(argv[i], "--l1d") == 0 && i + 1 < argc && parse_cache_config(argv[i + 1], &l1d))
+            caches = ++i;
+        else if(strcmp(argv[i], "--l2") == 0 && i + 1 < argc && parse_cache_config(argv[i + 1], &l2))
+            caches = has_l2 = ++i;
+        else if(strcmp(argv[i], "--predictor") == 0 && i + 1 < argc){
+            i++;
+            predictor = strcmp(argv[i], "static") == 0 ? PREDICTOR_STATIC
+                      : strcmp(argv[i], "bimodal") == 0 ? PREDICTOR_BIMODAL
+                      : strcmp(argv[i], "gshare") == 0 ? PREDICTOR_GSHARE : -2;
+            if(predictor == -2){
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--predictor-bits") == 0 && i + 1 < argc)
+            predictor_bits = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--cpus") == 0 && i + 1 < argc)
+            nb_cpus = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--aot") == 0 && i + 1 < argc)
+            aot_path = argv[++i];
+        else if(strcmp(argv[i], "--devices") == 0)
+            devices = true;
+        else if(strcmp(argv[i], "--video") == 0 && i + 1 < argc)
+            video_path = argv[++i];
+        else if(strcmp(argv[i], "--frame-instructions") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0)
+            frame_instructions = atol(argv[++i]);
+        else if(strcmp(argv[i], "--video-mode") == 0 && i + 1 < argc
+                && parse_video_mode(argv[i + 1], &video_width, &video_height, &video_mode_format))
+            i++;
+        else if(strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+            fps = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--last-writes") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            last_writes = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--idle") == 0)
+            idle = true;
+        else if(strcmp(argv[i], "--extended-isa") == 0)
+            extended_isa = true;
+        else if(strcmp(argv[i], "--assemble-only") == 0)
+            only_assemble = true;
+        else if(strcmp(argv[i], "--quiet") == 0)
+            quiet = true;
+        else if(strcmp(argv[i], "--no-loop-idioms") == 0)
+            loop_idioms = false;
+        else if(strcmp(argv[i], "--latency") == 0)
+            latency = true;
+        else if(strcmp(argv[i], "--hle-keyboard") == 0)
+            keyboard_hle = KEYBOARD_HLE_ON;
+        else if(strcmp(argv[i], "--hle-check") == 0)
+            keyboard_hle = KEYBOARD_HLE_CHECK;
+        else if(strcmp(argv[i], "--history") == 0)
+            history = true;
+        else if(strcmp(argv[i], "--history-budget") == 0 && i + 1 < argc)
+            history_budget = atol(argv[++i]);
+        else if(strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc)
+            checkpoint_interval = atol(argv[++i]);
+        else if(strcmp(argv[i], "--reverse-steps") == 0 && i + 1 < argc)
+            reverse_steps = atol(argv[++i]);
+        else if(strcmp(argv[i], "--reverse-to-pc") == 0 && i + 1 < argc)
+            reverse_pc = strtol(argv[++i], NULL, 16);
+        else if(strcmp(argv[i], "--reverse-to-write") == 0 && i + 1 < argc)
+            reverse_write = strtol(argv[++i], NULL, 16);
+        else if(argv[i][0] != '-' && program == NULL)
+            program = argv[i];
+        else{
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(program == NULL && (load_path == NULL || only_assemble)){
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(only_assemble)
+        return assemble_only(program);
+
+    if(nb_cpus > 1){
+
+        if(load_path != NULL || save_path != NULL || replay_path != NULL || latency || history
+           || keyboard_hle != KEYBOARD_HLE_OFF || pipeline >= 0 || caches || predictor >= 0 || reverse_steps > 0 || reverse_pc >= 0 || reverse_write >= 0
+           || video_path != NULL || aot_path != NULL || last_writes > 0 || idle || video_width > 0){
+            fprintf(stderr, "Error: --cpus only supports --handler, --devices, --steps, --quiet, --no-loop-idioms and --extended-isa\n");
+            return 1;
+        }
+
+        return run_smp(nb_cpus, program, handler, max_steps, quiet, loop_idioms, devices);
+    }
+
+    Computer computer;
+    init_computer(&computer, PROGRAM_MEMORY_SZ, VIDEO_MEMORY_SZ, KERNEL_MEMORY_SZ);
+
+    if(video_width > 0 && !set_video_mode(&computer, video_width, video_height, video_mode_format)){
+        free_computer(&computer);
+        return 1;
+    }
+
+    computer.loop_idioms = loop_idioms;
+    computer.extended_isa = extended_isa;
+
+    if(latency)
+        enable_latency_stats(&computer);
+
+    set_keyboard_hle(&computer, keyboard_hle);
+
+    // before loading: a save-state restores their state
+    if(devices)
+        enable_default_devices(&computer);
+
+    bool loaded = load_path != NULL ? load_state(&computer, load_path) == 0
+                                    : load_files(&computer, program, handler);
+
+    if(!loaded){
+        free_computer(&computer);
+        return 1;
+    }
+
+    if(aot_path != NULL){
+
+        AotEngine* engine = load_aot_engine(aot_path);
+
+        if(engine == NULL || !attach_aot_engine(&computer, engine)){
+            free_computer(&computer);
+            return 1;
+        }
+    }
+
+    if(pipeline >= 0)
+        enable_pipeline(&computer, pipeline, branch_penalty);
+
+    if(predictor >= 0)
+        enable_predictor(&computer, predictor, predictor_bits);
+
+    if(caches && enable_caches(&computer, &l1i, &l1d, has_l2 ? &l2 : NULL) == NULL){
+        free_computer(&computer);
+        return 1;
+    }
+
+    if(idle)
+        enable_idle_detection(&computer, false, 0);
+
+    if(last_writes > 0 && enable_write_log(&computer, WRITE_LOG_DEFAULT_LOG2) == NULL){
+        free_computer(&computer);
+        return 1;
+    }
+
+    if(history || reverse_steps > 0 || reverse_pc >= 0 || reverse_write >= 0)
+        enable_history(&computer, checkpoint_interval, history_budget);
+
+    InterruptReplay replay;
+
+    if(replay_path != NULL && !open_interrupt_replay(&replay, replay_path)){
+        free_computer(&computer);
+        return 1;
+    }
+
+    VideoExport video;
+    size_t video_path_length = video_path != NULL ? strlen(video_path) : 0;
+    int video_format = video_path_length >= 4 && strcmp(video_path + video_path_length - 4, ".y4m") == 0
+                     ? VIDEO_Y4M : VIDEO_DELTA;
+
+    if(video_path != NULL && !open_video_export(&video, &computer, video_path, video_format, frame_instructions, fps)){
+        if(replay_path != NULL)
+            close_interrupt_replay(&replay);
+        free_computer(&computer);
+        return 1;
+    }
+
+    long frame_chunk = video_path != NULL ? frame_instructions : 0;
+    long steps = 0;
+    double start = now_seconds();
+
+    if(replay_path != NULL){
+
+        long n;
+
+        do{
+            n = replay_steps(&computer, &replay, next_chunk(steps, max_steps, frame_chunk));
+            steps += n;
+
+            if(video_path != NULL && n > 0 && steps % frame_instructions == 0)
+                video_capture_frame(&video, &computer);
+
+        } while(n > 0 && (max_steps < 0 || steps < max_steps));
+    }
+
+    else{
+
+        while(is_executing(&computer) && (max_steps < 0 || steps < max_steps)){
+
+            steps += run_steps(&computer, next_chunk(steps, max_steps, frame_chunk));
+
+            if(video_path != NULL && steps % frame_instructions == 0)
+                video_capture_frame(&video, &computer);
+        }
+    }
+
+    double elapsed = now_seconds() - start;
+
+    if(video_path != NULL){
+
+        // the last, partial frame
+        if(steps % frame_instructions != 0 || video.submitted == 0)
+            video_capture_frame(&video, &computer);
+
+        close_video_export(&video);
+    }
+
+    if(computer.history != NULL && (reverse_steps > 0 || reverse_pc >= 0 || reverse_write >= 0)){
+
+        double reverse_start = now_seconds();
+        unsigned long long from = computer.retired;
+        bool reached = true;
+
+        if(reverse_steps > 0)
+            reached = history_seek(&computer, from > (unsigned long long) reverse_steps ? from - reverse_steps : 0);
+        else if(reverse_pc >= 0)
+            reached = reverse_continue(&computer, stop_at_pc, &reverse_pc);
+        else
+            reached = reverse_continue(&computer, stop_at_write, &reverse_write);
+
+        printf("went back %llu instructions in %.1f ms%s\n", from - computer.retired,
+               (now_seconds() - reverse_start) * 1e3, reached ? "" : " (start of the history)");
+    }
+
+    if(!quiet)
+        dump_state(&computer);
+
+    printf("%ld instructions in %.3f s (%.2f MIPS)\n", steps, elapsed,
+           elapsed > 0 ? steps / elapsed / 1e6 : 0.0);
+
+    if(latency){
+        char buf[2048];
+        format_latency_stats(computer.latency, buf, sizeof(buf));
+        fputs(buf, stdout);
+    }
+
+    if(computer.caches != NULL){
+        char buf[8192];
+        format_cache_stats(&computer, buf, sizeof(buf), 20);
+        fputs(buf, stdout);
+    }
+
+    if(computer.predictor != NULL){
+        char buf[8192];
+        format_predictor_stats(&computer, buf, sizeof(buf), 20);
+        fputs(buf, stdout);
+    }
+
+    if(computer.pipeline != NULL){
+        char buf[8192];
+        format_pipeline_stats(&computer, buf, sizeof(buf), 20);
+        fputs(buf, stdout);
+    }
+
+    if(computer.write_log != NULL){
+        char buf[65536];
+        format_write_log(&computer, buf, sizeof(buf), last_writes);
+        fputs(buf, stdout);
+    }
+
+    if(save_path != NULL){
+
+        double save_start = now_seconds();
+
+        if(save_state(&computer, save_path) == 0)
+            printf("state saved into %s in %.1f ms\n", save_path, (now_seconds() - save_start) * 1e3);
+    }
+
+    if(computer.hle_check != NULL)
+        printf("HLE check: %llu interrupts compared, %llu mismatches\n",
+               computer.hle_check->checked, computer.hle_check->mismatches);
+
+    if(computer.aot != NULL)
+        printf("translated code: %llu instructions (%.1f %%) in %llu runs%s\n", computer.aot->steps,
+               steps > 0 ? 100.0 * computer.aot->steps / steps : 0.0, computer.aot->runs,
+               computer.aot->dropped ? ", dropped (self-modifying code)" : "");
+
+    if(computer.idle != NULL){
+        char buf[256];
+        format_idle_stats(&computer, buf, sizeof(buf));
+        fputs(buf, stdout);
+    }
+
+    if(computer.bus != NULL)
+        printf("I/O: %llu device reads, %llu device writes\n", computer.bus->reads, computer.bus->writes);
+
+    if(video_path != NULL)
+        printf("%ld frames written into %s\n", video.encoded, video_path);
+
+    if(replay_path != NULL){
+        printf("%ld interrupts replayed%s\n", replay.nb_replayed,
+               replay.has_next ? " (recording not exhausted)" : "");
+        close_interrupt_replay(&replay);
+    }
+
+    free_computer(&computer);
+
+    return 0;
+}
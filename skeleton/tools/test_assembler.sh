@@ -0,0 +1,48 @@
+#!/bin/bash
+
+# Checks the assembler of headless (build it with compile.sh first):
+# the sample programs must assemble to the BSim images shipped in
+# skeleton/, and .include must accept bare and quoted file names.
+cd "$(dirname "$0")"
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+check(){
+
+    if [ "$2" -eq 0 ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        failed=1
+    fi
+}
+
+cp ../../beta-assembly/beta.uasm "$tmp"
+
+for program in fact fill_screen interrupt_handler; do
+    cp ../../beta-assembly/$program.asm "$tmp"
+    ./headless --assemble-only "$tmp/$program.asm" > /dev/null 2>&1 &&
+    cmp -s "$tmp/$program.asm.bin" ../$program.asm.bin
+    check "$program.asm" $?
+done
+
+mkdir "$tmp/with space"
+cp ../../beta-assembly/beta.uasm "$tmp/with space/macros.uasm"
+printf '.include beta.uasm\nADDC(R31, 5, R0)\nHALT()\n' > "$tmp/bare.asm"
+printf '.include "beta.uasm"\nADDC(R31, 5, R0)\nHALT()\n' > "$tmp/quoted.asm"
+printf '.include "with space/macros.uasm" | comment\nADDC(R31, 5, R0)\nHALT()\n' > "$tmp/space.asm"
+printf '.include "beta.uasm\nHALT()\n' > "$tmp/unterminated.asm"
+
+for program in bare quoted space; do
+    ./headless --assemble-only "$tmp/$program.asm" > /dev/null 2>&1
+    check ".include ($program)" $?
+done
+
+cmp -s "$tmp/bare.asm.bin" "$tmp/quoted.asm.bin" && cmp -s "$tmp/bare.asm.bin" "$tmp/space.asm.bin"
+check ".include (same binary)" $?
+
+! ./headless --assemble-only "$tmp/unterminated.asm" > /dev/null 2>&1
+check ".include (unterminated name rejected)" $?
+
+exit $failed
@@ -0,0 +1,156 @@
+/* Checks libbeta from a program linked with libbeta.a, as its users do
+   (build it with compile.sh first, run it from skeleton/tools): loading,
+   running, snapshots, the write callback and going back in time. */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../libbeta.h"
+
+/* Names the emulator core uses internally: libbeta.a must not define
+   them, or this program would not link. */
+void load(void){}
+void decode(void){}
+void init_computer(void){}
+
+static int failed = 0;
+
+static void check(const char* name, int ok){
+
+    printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+
+    if(!ok)
+        failed = 1;
+}
+
+/* Programs the interval timer (mmio.h) with a period of 200 instructions
+   and counts in R3 forever:
+       LD(R31, timer, R1)  ADDC(R31, 200, R2)  ST(R2, 0, R1)
+   loop: ADDC(R3, 1, R3)  BR(loop)
+   timer: LONG(0x40001000) */
+static const uint32_t timer_program[] = {
+    0x603f0014, 0xc05f00c8, 0x64410000, 0xc0630001, 0x77fffffe, 0x40001000
+};
+
+static int load_file(BetaMachine* m, const char* path, bool handler){
+
+    int fd = open(path, O_RDONLY);
+
+    if(fd < 0){
+        fprintf(stderr, "Error: could not open %s\n", path);
+        return -1;
+    }
+
+    int result = handler ? beta_load_handler_fd(m, fd) : beta_load_program_fd(m, fd);
+    close(fd);
+
+    return result;
+}
+
+/* Replays the writes reported by the callback on a copy of memory. */
+typedef struct {
+    unsigned char* memory;
+    long writes;
+    bool in_order;
+    uint64_t retired;
+} Shadow;
+
+static void on_write(void* data, uint32_t address, uint32_t length, int32_t value, uint64_t retired){
+
+    Shadow* s = data;
+
+    memcpy(s->memory + address, &value, length < 4 ? length : 4);
+    s->writes++;
+    s->in_order = s->in_order && retired >= s->retired;
+    s->retired = retired;
+}
+
+static void check_fact(void){
+
+    BetaMachine* m = beta_create(0, 0, BETA_VIDEO_RGB32, 0);
+
+    check("create", m != NULL);
+
+    if(m == NULL)
+        return;
+
+    check("load the program", load_file(m, "../fact.asm.bin", false) == 0);
+
+    uint32_t size = beta_memory_size(m);
+    Shadow s = {malloc(size), 0, true, 0};
+
+    beta_read_memory(m, 0, s.memory, size);
+    beta_set_write_callback(m, on_write, &s);
+
+    long steps = beta_run(m, 1000000);
+
+    check("run to the end", !beta_is_running(m) && steps > 0 && beta_retired(m) == (uint64_t) steps);
+    check("3! in R0", beta_get_register(m, 0) == 6);
+
+    unsigned char* memory = malloc(size);
+    beta_read_memory(m, 0, memory, size);
+
+    check("write callback", s.writes > 0 && s.in_order && s.retired <= (uint64_t) steps);
+    check("writes replayed", memcmp(memory, s.memory, size) == 0);
+
+    free(memory);
+    free(s.memory);
+    beta_destroy(m);
+}
+
+static void check_timer(void){
+
+    BetaMachine* m = beta_create(0, 0, BETA_VIDEO_RGB32, BETA_DEVICES | BETA_HISTORY);
+
+    if(m == NULL || beta_load_program(m, timer_program, sizeof(timer_program)) != 0 ||
+       load_file(m, "../interrupt_handler.asm.bin", true) != 0){
+        check("load the timer program", 0);
+        beta_destroy(m);
+        return;
+    }
+
+    beta_run(m, 1500);
+
+    uint32_t pc = beta_get_pc(m);
+    int32_t count = beta_get_register(m, 3);
+    uint64_t retired = beta_retired(m);
+
+    check("step back", beta_step_back(m, 500) == 500 && beta_retired(m) == retired - 500);
+    beta_run(m, 500);
+    check("run again after stepping back", beta_get_pc(m) == pc && beta_get_register(m, 3) == count &&
+                                           beta_retired(m) == retired);
+
+    BetaSnapshot* snapshot = beta_snapshot(m);
+
+    check("snapshot", snapshot != NULL);
+
+    if(snapshot == NULL){
+        beta_destroy(m);
+        return;
+    }
+
+    beta_run(m, 777);
+    pc = beta_get_pc(m);
+    count = beta_get_register(m, 3);
+    retired = beta_retired(m);
+
+    check("restore", beta_restore(m, snapshot) == 0 && beta_retired(m) == retired - 777);
+    beta_run(m, 777);
+    check("run again after restoring", beta_get_pc(m) == pc && beta_get_register(m, 3) == count &&
+                                       beta_retired(m) == retired);
+
+    beta_free_snapshot(snapshot);
+    beta_destroy(m);
+}
+
+int main(void){
+
+    check("API version", beta_api_version() == BETA_API_VERSION);
+    check_fact();
+    check_timer();
+
+    return failed;
+}
@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../emulator.h"
+#include "../aot.h"
+
+/* Static translator: turns a program image (.asm.bin) into C source for
+   an execution engine (see aot.h), and optionally compiles it.
+
+       translate program.asm.bin program.c
+       translate program.asm.bin program.so    (writes program.c too,
+                                                 then runs $CC, default cc)
+
+   Basic blocks are found by following, from address 0, both directions
+   of conditional branches, the targets of BR and the return addresses
+   of branches and jumps that link (RC != R31). Code only reached through
+   other indirect jumps is left to the interpreter. */
+
+typedef struct{
+
+    const unsigned char* bytes;
+    long size;     // bytes
+    long nb_words; // whole words
+    unsigned char* reached; // per word, translated
+    unsigned char* leader;  // per word, a block starts there
+    unsigned char* walked;  // per word, the block starting there was explored
+
+} Image;
+
+static inline int32_t word_at(Image* im, long addr){
+
+    int32_t word;
+    memcpy(&word, im->bytes + addr, 4);
+
+    return word;
+}
+
+/* Instructions the translated code leaves to the interpreter. */
+static bool is_interpreted(Instruction d){
+
+    switch(d.opcode){
+        case 0x00: // HALT
+        case 0x01: // CPUID
+        case 0x1A: // SWAP
+        case 0x1C: // CAS
+            return true;
+        case 0x23: // division by 0, which traps like in the interpreter
+            return d.rb == 31;
+        case 0x33:
+            return d.literal == 0;
+        case 0x18: case 0x19: case 0x1B: case 0x1D: case 0x1E: case 0x1F:
+            return false;
+        default:
+            // invalid opcodes
+            return !((d.opcode >= 0x20 && d.opcode <= 0x2E) || (d.opcode >= 0x30 && d.opcode <= 0x3E))
+                   || (d.opcode & 0xF) == 0x7 || (d.opcode & 0xF) == 0xB;
+    }
+}
+
+static bool is_memory(Instruction d){
+
+    return d.opcode == 0x18 || d.opcode == 0x19 || d.opcode == 0x1F;
+}
+
+static bool is_control(Instruction d){
+
+    return d.opcode == 0x1B || d.opcode == 0x1D || d.opcode == 0x1E;
+}
+
+static void find_blocks(Image* im){
+
+    long* stack = malloc((3 * im->nb_words + 1) * sizeof(long));
+    long top = 0;
+
+    stack[top++] = 0;
+
+    while(top > 0){
+
+        long start = stack[--top];
+
+        if(start < 0 || start % 4 != 0 || start / 4 >= im->nb_words || im->walked[start / 4])
+            continue;
+
+        im->walked[start / 4] = 1;
+        im->leader[start / 4] = 1;
+
+        for(long pc = start; pc / 4 < im->nb_words; pc += 4){
+
+            // joins a block explored before, which gets split there
+            if(pc != start && im->reached[pc / 4]){
+                im->leader[pc / 4] = 1;
+                break;
+            }
+
+            im->reached[pc / 4] = 1;
+            Instruction d = decode(word_at(im, pc));
+
+            if(is_interpreted(d)){
+                if(d.opcode == 0x01 || d.opcode == 0x1A || d.opcode == 0x1C) // CPUID, SWAP, CAS go on
+                    stack[top++] = pc + 4;
+                break;
+            }
+
+            if(!is_control(d))
+                continue;
+
+            if(d.opcode == 0x1D || d.opcode == 0x1E){
+
+                bool always = d.opcode == 0x1D && d.ra == 31;
+                bool never = d.opcode == 0x1E && d.ra == 31;
+
+                if(!never)
+                    stack[top++] = pc + 4 + 4 * (long) d.literal;
+                if(!always || d.rc != 31)
+                    stack[top++] = pc + 4;
+            }
+
+            else if(d.rc != 31) // JMP: only its return address is known
+                stack[top++] = pc + 4;
+
+            break;
+        }
+    }
+
+    free(stack);
+}
+
+/* Register operand: R31 reads as 0. */
+static const char* reg(int r, char* buf){
+
+    if(r == 31)
+        strcpy(buf, "0");
+    else
+        sprintf(buf, "r%d", r);
+
+    return buf;
+}
+
+/* Code leaving the translated code before the instruction at $pc, the
+   $remaining instructions of its block (counted by the block) not being
+   executed; $prev is the previous instruction of the block, if any. */
+static void emit_exit(FILE* out, long pc, long remaining, Instruction* prev, const char* reason){
+
+    fprintf(out, "    { pc = 0x%lx; ", pc);
+
+    if(remaining > 0)
+        fprintf(out, "steps -= %ld; ", remaining);
+
+    if(prev != NULL && !is_memory(*prev))
+        fprintf(out, "latest = 0x%lx; ", pc - 4);
+
+    fprintf(out, "s->exit_reason = %s; goto out; }\n", reason);
+}
+
+/* Jump to the block at $target, or leave if there is none. */
+static void emit_goto(FILE* out, Image* im, long target, const char* indent){
+
+    if(target >= 0 && target % 4 == 0 && target / 4 < im->nb_words && im->leader[target / 4])
+        fprintf(out, "%sgoto L_%lx;\n", indent, target);
+    else
+        fprintf(out, "%s{ pc = 0x%lx; s->exit_reason = AOT_EXIT_LEAVE; goto out; }\n", indent, target);
+}
+
+static void emit_alu(FILE* out, Instruction d, int rc){
+
+    char a[8], b[16];
+    const char* op;
+
+    reg(d.ra, a);
+
+    if(d.opcode >= 0x30)
+        sprintf(b, "(%d)", d.literal);
+    else
+        reg(d.rb, b);
+
+    switch(d.opcode & 0xF){
+        case 0x0: op = "+"; break;
+        case 0x1: op = "-"; break;
+        case 0x2: op = "*"; break;
+        case 0x3: fprintf(out, "    r%d = %s / %s;\n", rc, a, b); return;
+        case 0x4: fprintf(out, "    r%d = %s == %s;\n", rc, a, b); return;
+        case 0x5: fprintf(out, "    r%d = %s < %s;\n", rc, a, b); return;
+        case 0x6: fprintf(out, "    r%d = %s <= %s;\n", rc, a, b); return;
+        case 0x8: fprintf(out, "    r%d = %s & %s;\n", rc, a, b); return;
+        case 0x9: fprintf(out, "    r%d = %s | %s;\n", rc, a, b); return;
+        case 0xA: fprintf(out, "    r%d = %s ^ %s;\n", rc, a, b); return;
+        case 0xC: fprintf(out, "    r%d = (int32_t) ((uint32_t) %s << (%s & 0x1F));\n", rc, a, b); return;
+        // SHR is an arithmetic shift in the interpreter too
+        default:  fprintf(out, "    r%d = %s >> (%s & 0x1F);\n", rc, a, b); return;
+    }
+
+    fprintf(out, "    r%d = (int32_t) ((uint32_t) %s %s (uint32_t) %s);\n", rc, a, op, b);
+}
+
+/* Emits instruction $i (at $pc) of a block of $len instructions. */
+static void emit_instruction(FILE* out, Image* im, long pc, long i, long len, Instruction d, Instruction* prev){
+
+    char a[8], c[8];
+    long remaining = len - i;
+
+    switch(d.opcode){
+        case 0x18: // LD
+            fprintf(out, "    a = (int32_t) ((uint32_t) %s + (uint32_t) (%d));\n", reg(d.ra, a), d.literal);
+            fprintf(out, "    if((unsigned long) a > (unsigned long) (s->memory_size - 4))\n    ");
+            emit_exit(out, pc, remaining, prev, "AOT_EXIT_INTERPRET");
+            fprintf(out, "    memcpy(&r%d, s->memory + a, 4);\n    latest = a;\n", d.rc);
+            break;
+        case 0x19: // ST
+            fprintf(out, "    a = (int32_t) ((uint32_t) %s + (uint32_t) (%d));\n", reg(d.ra, a), d.literal);
+            fprintf(out, "    if((unsigned long) a > (unsigned long) (s->memory_size - 4)\n"
+                         "       || (a < %ld && (code[a >> 2] | code[(a + 3) >> 2])))\n    ", im->nb_words * 4);
+            emit_exit(out, pc, remaining, prev, "AOT_EXIT_INTERPRET");
+            fprintf(out, "    t = %s;\n    memcpy(s->memory + a, &t, 4);\n    latest = a;\n", reg(d.rc, c));
+            fprintf(out, "    if(a + 4 > s->video_start && a < s->video_end)\n        mark_dirty(s, a);\n");
+            break;
+        case 0x1F:{ // LDR
+            long target = pc + 4 + 4 * (long) d.literal;
+            fprintf(out, "    if(%ldL > s->video_end){\n", target);
+            fprintf(out, "        if(%ldL + 4 > s->memory_size)\n        ", target);
+            emit_exit(out, pc, remaining, prev, "AOT_EXIT_INTERPRET");
+            fprintf(out, "        t = %s;\n        memcpy(s->memory + %ldL, &t, 4);\n    } else {\n", reg(d.rc, c), target);
+            fprintf(out, "        if(%ldL < 0 || %ldL + 4 > s->memory_size)\n        ", target, target);
+            emit_exit(out, pc, remaining, prev, "AOT_EXIT_INTERPRET");
+            fprintf(out, "        memcpy(&r%d, s->memory + %ldL, 4);\n    }\n    latest = %ldL;\n", d.rc, target, target);
+            break;
+        }
+        case 0x1B: // JMP
+            fprintf(out, "    r%d = 0x%lx;\n", d.rc, pc + 4);
+            fprintf(out, "    pc = (long) ((uint32_t) %s & 0xFFFFFFFCu);\n", reg(d.ra, a));
+            fprintf(out, "    latest = 0x%lx;\n    goto dispatch;\n", pc);
+            break;
+        case 0x1D: // BEQ
+        case 0x1E: // BNE
+            fprintf(out, "    r%d = 0x%lx;\n    latest = 0x%lx;\n", d.rc, pc + 4, pc);
+            if(d.ra == 31 && d.opcode == 0x1D)
+                emit_goto(out, im, pc + 4 + 4 * (long) d.literal, "    ");
+            else{
+                if(d.ra != 31){
+                    fprintf(out, "    if(%s %s 0)\n", reg(d.ra, a), d.opcode == 0x1D ? "==" : "!=");
+                    emit_goto(out, im, pc + 4 + 4 * (long) d.literal, "        ");
+                }
+                emit_goto(out, im, pc + 4, "    ");
+            }
+            break;
+        default:
+            emit_alu(out, d, d.rc);
+    }
+}
+
+static void emit_block(FILE* out, Image* im, long start){
+
+    // the block ends after a branch or a jump, before an interpreted
+    // instruction or another block, or where translated code stops
+    long len = 0, end = start;
+    bool interpreted = false;
+
+    while(end / 4 < im->nb_words && im->reached[end / 4] && (end == start || !im->leader[end / 4])){
+
+        Instruction d = decode(word_at(im, end));
+
+        if(is_interpreted(d)){
+            interpreted = true;
+            break;
+        }
+
+        len++;
+        end += 4;
+
+        if(is_control(d))
+            break;
+    }
+
+    fprintf(out, "\nL_%lx:\n", start);
+
+    if(len > 0){
+        fprintf(out, "    if(max_steps - steps < %ld){ pc = 0x%lx; s->exit_reason = AOT_EXIT_BUDGET; goto out; }\n",
+                len, start);
+        fprintf(out, "    steps += %ld;\n", len);
+    }
+
+    Instruction prev, d;
+
+    for(long i = 0; i < len; i++){
+
+        long pc = start + 4 * i;
+        char text[64];
+
+        d = decode(word_at(im, pc));
+        disassemble(word_at(im, pc), text);
+        fprintf(out, "    /* %.8lx %s */\n", pc, text);
+        emit_instruction(out, im, pc, i, len, d, i > 0 ? &prev : NULL);
+        prev = d;
+    }
+
+    if(interpreted){
+        emit_exit(out, end, 0, len > 0 ? &prev : NULL, "AOT_EXIT_INTERPRET");
+        return;
+    }
+
+    if(len > 0 && is_control(d))
+        return;
+
+    // falls through into the next block
+    if(len > 0 && !is_memory(d))
+        fprintf(out, "    latest = 0x%lx;\n", end - 4);
+
+    emit_goto(out, im, end, "    ");
+}
+
+static void emit_bytes(FILE* out, const char* name, const unsigned char* bytes, long n){
+
+    fprintf(out, "const unsigned char %s[%ld] = {", name, n > 0 ? n : 1);
+
+    for(long i = 0; i < n; i++)
+        fprintf(out, "%s%d,", i % 24 == 0 ? "\n    " : "", bytes[i]);
+
+    fprintf(out, "%s};\n\n", n > 0 ? "\n" : "0");
+}
+
+static void translate(FILE* out, Image* im, const char* source){
+
+    fprintf(out, "/* Translated from %s by tools/translate, see aot.h. */\n\n", source);
+    fprintf(out, "#include <stdint.h>\n#include <string.h>\n\n");
+    fprintf(out, "%s\n\n", AOT_SOURCE(AOT_STATE_DEFINITION));
+    fprintf(out, "#define AOT_EXIT_BUDGET %d\n#define AOT_EXIT_LEAVE %d\n#define AOT_EXIT_INTERPRET %d\n\n",
+            AOT_EXIT_BUDGET, AOT_EXIT_LEAVE, AOT_EXIT_INTERPRET);
+
+    fprintf(out, "const int beta_aot_abi = %d;\n", AOT_ABI_VERSION);
+    fprintf(out, "const long beta_aot_image_size = %ld;\n\n", im->size);
+    emit_bytes(out, "beta_aot_image", im->bytes, im->size);
+    emit_bytes(out, "beta_aot_entries", im->leader, im->nb_words);
+
+    // translated words, plus one so that stores straddling the end can be tested
+    unsigned char* code = calloc(im->nb_words + 1, 1);
+    memcpy(code, im->reached, im->nb_words);
+    fprintf(out, "static ");
+    emit_bytes(out, "code", code, im->nb_words + 1);
+    free(code);
+
+    fprintf(out,
+            "/* mark_video_dirty() */\n"
+            "static inline void mark_dirty(AotState* s, long start){\n\n"
+            "    long end = start + 4;\n\n"
+            "    if(start < s->video_start)\n        start = s->video_start;\n"
+            "    if(end > s->video_end)\n        end = s->video_end;\n\n"
+            "    if(*s->dirty_start >= *s->dirty_end){\n"
+            "        *s->dirty_start = start;\n        *s->dirty_end = end;\n        return;\n    }\n\n"
+            "    if(start < *s->dirty_start)\n        *s->dirty_start = start;\n"
+            "    if(end > *s->dirty_end)\n        *s->dirty_end = end;\n}\n\n");
+
+    fprintf(out, "long beta_aot_run(AotState* s, long max_steps){\n\n");
+
+    for(int r = 0; r < 32; r++)
+        fprintf(out, "    int32_t r%d = s->registers[%d];\n", r, r);
+
+    fprintf(out, "    long pc = s->pc, latest = s->latest_accessed, steps = 0, a;\n"
+                 "    int32_t t;\n\n    (void) a;\n    (void) t;\n\n"
+                 "dispatch:\n    switch(pc){\n");
+
+    for(long w = 0; w < im->nb_words; w++)
+        if(im->leader[w])
+            fprintf(out, "        case 0x%lx: goto L_%lx;\n", w * 4, w * 4);
+
+    fprintf(out, "    }\n\n    s->exit_reason = AOT_EXIT_LEAVE;\n    goto out;\n");
+
+    for(long w = 0; w < im->nb_words; w++)
+        if(im->leader[w])
+            emit_block(out, im, w * 4);
+
+    fprintf(out, "\nout:\n");
+
+    for(int r = 0; r < 32; r++)
+        fprintf(out, "    s->registers[%d] = r%d;\n", r, r);
+
+    fprintf(out, "    s->pc = pc;\n    s->latest_accessed = latest;\n    s->retired += steps;\n\n"
+                 "    return steps;\n}\n");
+}
+
+static bool ends_with(const char* s, const char* suffix){
+
+    size_t n = strlen(s), m = strlen(suffix);
+
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+int main(int argc, char** argv){
+
+    if(argc != 3 || !(ends_with(argv[2], ".c") || ends_with(argv[2], ".so"))){
+        fprintf(stderr, "Usage: %s program.asm.bin output.c|output.so\n", argv[0]);
+        return 1;
+    }
+
+    FILE* fp = fopen(argv[1], "rb");
+
+    if(fp == NULL){
+        fprintf(stderr, "Error: Cannot open %s\n", argv[1]);
+        return 1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    unsigned char* bytes = malloc(size > 0 ? size : 1);
+
+    if(fread(bytes, 1, size, fp) != (size_t) size){
+        fprintf(stderr, "Error: Cannot read %s\n", argv[1]);
+        fclose(fp);
+        return 1;
+    }
+
+    fclose(fp);
+
+    Image im;
+    im.bytes = bytes;
+    im.size = size;
+    im.nb_words = size / 4;
+    im.reached = calloc(im.nb_words + 1, 1);
+    im.leader = calloc(im.nb_words + 1, 1);
+    im.walked = calloc(im.nb_words + 1, 1);
+
+    find_blocks(&im);
+
+    char source[4096];
+    bool build = ends_with(argv[2], ".so");
+
+    if(build)
+        snprintf(source, sizeof(source), "%.*s.c", (int) (strlen(argv[2]) - 3), argv[2]);
+    else
+        snprintf(source, sizeof(source), "%s", argv[2]);
+
+    FILE* out = fopen(source, "w");
+
+    if(out == NULL){
+        fprintf(stderr, "Error: Cannot create %s\n", source);
+        return 1;
+    }
+
+    translate(out, &im, argv[1]);
+    fclose(out);
+
+    long nb_blocks = 0, nb_translated = 0;
+
+    for(long w = 0; w < im.nb_words; w++){
+        nb_blocks += im.leader[w];
+        nb_translated += im.reached[w];
+    }
+
+    printf("%s: %ld of %ld words translated in %ld blocks\n", source, nb_translated, im.nb_words, nb_blocks);
+
+    free(bytes);
+    free(im.reached);
+    free(im.leader);
+    free(im.walked);
+
+    if(!build)
+        return 0;
+
+    const char* cc = getenv("CC") != NULL ? getenv("CC") : "cc";
+    char command[3 * 4096];
+
+    snprintf(command, sizeof(command), "%s -O2 -shared -fPIC -o '%s' '%s'", cc, argv[2], source);
+
+    if(system(command) != 0){
+        fprintf(stderr, "Error: %s failed\n", command);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,244 @@
+#include "video_export.h"
+#include "framebuffer.h"
+#include <string.h>
+
+static void put_u32(unsigned char* p, uint32_t value){
+
+    for(int i = 0; i < 4; i++)
+        p[i] = value >> (8 * i);
+}
+
+static void write_header(VideoExport* v, int fps){
+
+    if(v->format == VIDEO_Y4M){
+        fprintf(v->fp, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", v->width, v->height, fps);
+        return;
+    }
+
+    unsigned char header[24];
+
+    memcpy(header, "BVID", 4);
+    put_u32(header + 4, VIDEO_DELTA_VERSION);
+    put_u32(header + 8, v->width);
+    put_u32(header + 12, v->height);
+    put_u32(header + 16, v->frame_instructions);
+    put_u32(header + 20, (uint64_t) v->frame_instructions >> 32);
+    fwrite(header, 1, sizeof(header), v->fp);
+}
+
+/* BT.601, full range */
+static void convert_pixels(VideoExport* v, uint32_t* pixels, long first, long last){
+
+    long area = (long) v->width * v->height;
+    unsigned char* y_plane = v->planes;
+    unsigned char* u_plane = v->planes + area;
+    unsigned char* v_plane = v->planes + 2 * area;
+
+    for(long i = first; i < last; i++){
+
+        int r = pixels[i] & 0xff;
+        int g = (pixels[i] >> 8) & 0xff;
+        int b = (pixels[i] >> 16) & 0xff;
+
+        y_plane[i] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+        u_plane[i] = (-43 * r - 85 * g + 128 * b + 128 + (128 << 8)) >> 8;
+        v_plane[i] = (128 * r - 107 * g - 21 * b + 128 + (128 << 8)) >> 8;
+    }
+}
+
+static void encode_y4m(VideoExport* v, VideoFrame* f){
+
+    if(f->dirty_first < f->dirty_last)
+        convert_pixels(v, f->pixels, f->dirty_first, f->dirty_last);
+
+    fputs("FRAME\n", v->fp);
+    fwrite(v->planes, 1, 3L * v->width * v->height, v->fp);
+}
+
+static void encode_delta(VideoExport* v, VideoFrame* f){
+
+    unsigned char* out = v->runs + 4;
+    uint32_t nb_runs = 0;
+    long i = f->dirty_first;
+
+    while(i < f->dirty_last){
+
+        if(f->pixels[i] == v->previous[i]){
+            i++;
+            continue;
+        }
+
+        long start = i;
+
+        while(i < f->dirty_last && f->pixels[i] != v->previous[i])
+            i++;
+
+        put_u32(out, start);
+        put_u32(out + 4, i - start);
+        out += 8;
+
+        for(long j = start; j < i; j++){
+            *out++ = f->pixels[j];
+            *out++ = f->pixels[j] >> 8;
+            *out++ = f->pixels[j] >> 16;
+        }
+
+        memcpy(v->previous + start, f->pixels + start, (i - start) * 4);
+        nb_runs++;
+    }
+
+    put_u32(v->runs, nb_runs);
+    fwrite(v->runs, 1, out - v->runs, v->fp);
+}
+
+static void* encoder_thread(void* arg){
+
+    VideoExport* v = arg;
+
+    pthread_mutex_lock(&v->mutex);
+
+    while(true){
+
+        while(v->encoded == v->submitted && !v->closing)
+            pthread_cond_wait(&v->cond, &v->mutex);
+
+        if(v->encoded == v->submitted)
+            break;
+
+        VideoFrame* f = &v->frames[v->encoded % 2];
+
+        // the emulation thread does not touch a submitted frame
+        pthread_mutex_unlock(&v->mutex);
+
+        if(v->format == VIDEO_Y4M)
+            encode_y4m(v, f);
+        else
+            encode_delta(v, f);
+
+        pthread_mutex_lock(&v->mutex);
+        v->encoded++;
+        pthread_cond_broadcast(&v->cond);
+    }
+
+    pthread_mutex_unlock(&v->mutex);
+
+    return NULL;
+}
+
+bool open_video_export(VideoExport* v, Computer* c, const char* path, int format,
+                       long frame_instructions, int fps){
+
+    memset(v, 0, sizeof(VideoExport));
+
+    v->fp = fopen(path, "wb");
+
+    if(v->fp == NULL){
+        fprintf(stderr, "Error: Cannot create %s.\n", path);
+        return false;
+    }
+
+    long area = (long) c->video_width * c->video_height;
+
+    v->format = format;
+    v->width = c->video_width;
+    v->height = c->video_height;
+    v->frame_instructions = frame_instructions;
+
+    for(int i = 0; i < 2; i++)
+        v->frames[i].pixels = calloc(area, 4);
+
+    v->previous = calloc(area, 4);
+
+    if(format == VIDEO_Y4M){
+        v->planes = malloc(3 * area);
+        convert_pixels(v, v->previous, 0, area);
+    } else
+        v->runs = malloc(4 + area * (8 + 3));
+
+    // the first frame is compared with (and its buffers filled from) all of video memory
+    v->stale_first = 0;
+    v->stale_last = area;
+    palette_changed(c, v->palette);
+    mark_video_dirty(c, c->program_memory_size, c->program_memory_size + c->video_memory_size);
+
+    write_header(v, fps > 0 ? fps : 30);
+
+    pthread_mutex_init(&v->mutex, NULL);
+    pthread_cond_init(&v->cond, NULL);
+    pthread_create(&v->thread, NULL, encoder_thread, v);
+
+    return true;
+}
+
+void video_capture_frame(VideoExport* v, Computer* c){
+
+    long area = (long) v->width * v->height;
+    long start, end, first = 0, last = 0;
+
+    if(take_video_dirty(c, &start, &end))
+        video_range_pixels(c, start, end, &first, &last);
+
+    // every pixel may have changed color
+    if(palette_changed(c, v->palette)){
+        first = 0;
+        last = area;
+    }
+
+    pthread_mutex_lock(&v->mutex);
+
+    // only blocks if the encoder is still busy with the frame before the previous one
+    while(v->submitted - v->encoded >= 2)
+        pthread_cond_wait(&v->cond, &v->mutex);
+
+    pthread_mutex_unlock(&v->mutex);
+
+    VideoFrame* f = &v->frames[v->submitted % 2];
+
+    // this buffer holds the frame before the previous one: it misses what
+    // was written during the previous frame and this one
+    long copy_first = first, copy_last = last;
+
+    if(copy_first >= copy_last){
+        copy_first = v->stale_first;
+        copy_last = v->stale_last;
+    } else if(v->stale_first < v->stale_last){
+        if(v->stale_first < copy_first)
+            copy_first = v->stale_first;
+        if(v->stale_last > copy_last)
+            copy_last = v->stale_last;
+    }
+
+    if(copy_first < copy_last)
+        convert_framebuffer(c, copy_first, copy_last, f->pixels + copy_first, 0);
+
+    f->dirty_first = first;
+    f->dirty_last = last;
+    v->stale_first = first;
+    v->stale_last = last;
+
+    pthread_mutex_lock(&v->mutex);
+    v->submitted++;
+    pthread_cond_broadcast(&v->cond);
+    pthread_mutex_unlock(&v->mutex);
+}
+
+void close_video_export(VideoExport* v){
+
+    pthread_mutex_lock(&v->mutex);
+    v->closing = true;
+    pthread_cond_broadcast(&v->cond);
+    pthread_mutex_unlock(&v->mutex);
+
+    pthread_join(v->thread, NULL);
+    pthread_mutex_destroy(&v->mutex);
+    pthread_cond_destroy(&v->cond);
+
+    fclose(v->fp);
+
+    for(int i = 0; i < 2; i++)
+        free(v->frames[i].pixels);
+
+    free(v->previous);
+    free(v->planes);
+    free(v->runs);
+}
@@ -0,0 +1,81 @@
+#ifndef VIDEO_EXPORT_H__
+#define VIDEO_EXPORT_H__
+
+#include "emulator.h"
+#include <pthread.h>
+#include <stdint.h>
+
+/* Video export of the framebuffer (video memory, in any video mode, see
+   framebuffer.h), for runs without the GUI.
+
+   The emulation thread calls video_capture_frame() every N instructions;
+   it copies the video memory written since the previous frames into one
+   of two frame buffers and returns at once, unless the encoder thread is
+   two frames behind. The encoder thread writes the frames as:
+   - VIDEO_Y4M: YUV4MPEG2, 4:4:4, full frames (only the pixels that
+     changed are converted again);
+   - VIDEO_DELTA: a raw RGB stream where each frame only stores the runs
+     of pixels that differ from the previous frame:
+         header  "BVID", version (u32), width (u32), height (u32),
+                 instructions per frame (u64)
+         frame   number of runs (u32), then for each run its first pixel
+                 (u32), its length in pixels (u32) and length * 3 bytes
+                 of R, G, B
+     all little-endian, starting from a black frame. An unchanged frame
+     takes 4 bytes. */
+
+#define VIDEO_DELTA_VERSION 1
+
+enum{
+    VIDEO_Y4M,
+    VIDEO_DELTA
+};
+
+typedef struct{
+
+    uint32_t* pixels; // 0x00BBGGRR
+    long dirty_first, dirty_last; // pixels changed since the previous frame, [first, last[
+
+} VideoFrame;
+
+typedef struct{
+
+    FILE* fp;
+    int format;
+    int width, height;
+    long frame_instructions;
+
+    // frames[next % 2] is filled by the emulation thread while the encoder
+    // works on the other one
+    VideoFrame frames[2];
+    long submitted; // frames handed to the encoder
+    long encoded;   // frames written
+    bool closing;
+    long stale_first, stale_last; // video memory written during the previous frame
+    uint32_t palette[VIDEO_PALETTE_SZ]; // of the previous frame
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+
+    // encoder state
+    uint32_t* previous;
+    unsigned char* planes; // Y4M: Y, U and V planes
+    unsigned char* runs;   // VIDEO_DELTA output buffer
+
+} VideoExport;
+
+/* Opens $path for a video of $c's framebuffer with one frame every
+   $frame_instructions instructions and starts the encoder thread.
+   $fps is only written in Y4M headers. Returns false (reporting the
+   error) if the file cannot be created. */
+bool open_video_export(VideoExport* v, Computer* c, const char* path, int format,
+                       long frame_instructions, int fps);
+
+/* Hands the current content of $c's video memory to the encoder as the
+   next frame. Consumes $c's video dirty range (see take_video_dirty()). */
+void video_capture_frame(VideoExport* v, Computer* c);
+
+/* Waits for the encoder to write every frame, then closes the file. */
+void close_video_export(VideoExport* v);
+
+#endif
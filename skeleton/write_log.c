@@ -0,0 +1,113 @@
+#include "write_log.h"
+#include <string.h>
+
+WriteLog* enable_write_log(Computer* c, int log2_capacity){
+
+    disable_write_log(c);
+
+    WriteLog* log = calloc(1, sizeof(WriteLog));
+
+    if(log == NULL)
+        return NULL;
+
+    log->capacity = 1ULL << log2_capacity;
+    log->records = calloc(log->capacity, sizeof(WriteRecord));
+
+    if(log->records == NULL){
+        fprintf(stderr, "Error: could not allocate a log of %llu writes\n", log->capacity);
+        free(log);
+        return NULL;
+    }
+
+    c->write_log = log;
+
+    return log;
+}
+
+void disable_write_log(Computer* c){
+
+    if(c->write_log == NULL)
+        return;
+
+    free(c->write_log->records);
+    free(c->write_log);
+    c->write_log = NULL;
+}
+
+void init_write_cursor(WriteLog* log, WriteCursor* cursor){
+
+    cursor->next = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+    cursor->lost = 0;
+}
+
+long drain_writes(WriteLog* log, WriteCursor* cursor, WriteRecord* out, long max){
+
+    unsigned long long head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+
+    if(head - cursor->next > log->capacity){
+        cursor->lost += head - log->capacity - cursor->next;
+        cursor->next = head - log->capacity;
+    }
+
+    long n = head - cursor->next < (unsigned long long) max ? (long) (head - cursor->next) : max;
+
+    for(long i = 0; i < n; i++){
+
+        WriteRecord* r = &log->records[(cursor->next + i) & (log->capacity - 1)];
+        out[i].retired = __atomic_load_n(&r->retired, __ATOMIC_RELAXED);
+        out[i].address = __atomic_load_n(&r->address, __ATOMIC_RELAXED);
+        out[i].length = __atomic_load_n(&r->length, __ATOMIC_RELAXED);
+        out[i].value = __atomic_load_n(&r->value, __ATOMIC_RELAXED);
+    }
+
+    // the producer may have lapped us while we were copying: every record
+    // up to the one it is writing now (index head - capacity) is suspect
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    unsigned long long now = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+    long torn = 0;
+
+    if(now >= log->capacity && now - log->capacity + 1 > cursor->next){
+
+        torn = now - log->capacity + 1 - cursor->next;
+
+        if(torn > n)
+            torn = n;
+
+        memmove(out, out + torn, (n - torn) * sizeof(WriteRecord));
+        cursor->lost += torn;
+    }
+
+    cursor->next += n;
+
+    return n - torn;
+}
+
+void format_write_log(Computer* c, char* buf, size_t len, int n){
+
+    WriteLog* log = c->write_log;
+    size_t used = 0;
+
+    buf[0] = '\0';
+
+    if(log == NULL || len == 0)
+        return;
+
+    unsigned long long available = log->head < log->capacity ? log->head : log->capacity;
+
+    if((unsigned long long) n > available)
+        n = (int) available;
+
+    used += snprintf(buf + used, len - used, "last %d of %llu writes:\n", n, log->head);
+
+    for(unsigned long long i = log->head - n; i < log->head && used < len; i++){
+
+        WriteRecord* r = &log->records[i & (log->capacity - 1)];
+
+        if(r->length == 4)
+            used += snprintf(buf + used, len - used, "  %12llu  %.8x <- %.8x\n",
+                             r->retired, r->address, (unsigned) r->value);
+        else
+            used += snprintf(buf + used, len - used, "  %12llu  %.8x <- %.8x (%u bytes)\n",
+                             r->retired, r->address, (unsigned) r->value, r->length);
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef WRITE_LOG_H__
+#define WRITE_LOG_H__
+
+#include "emulator.h"
+#include <stdint.h>
+
+/* Log of guest memory writes.
+
+   While enabled, every store of the guest (ST, SWAP, CAS, LDR into
+   kernel memory, the words written when an interrupt is delivered, bulk
+   fill and copy loops and the native keyboard handler) appends a record
+   to a ring of 2^log2_capacity entries. The emulation thread is the only
+   producer and never waits: it fills the slot, then publishes it by
+   advancing head with a release store.
+
+   Any number of consumers (the screen, the memory view, tools) read the
+   ring through their own WriteCursor, without locking the computer, in
+   batches. A consumer falling more than a ring behind loses the oldest
+   records: drain_writes() skips them and counts them in the cursor, and
+   the consumer must then resynchronize from memory (e.g. with
+   take_video_dirty()). Records being overwritten while they are copied
+   are detected by reading head again afterwards, and are counted as lost
+   as well.
+
+   Host writes (load(), load_state(), history seeks) are not logged.
+
+   Translated code (see aot.h) does not log its stores: it does not run
+   while a log is attached. */
+
+typedef struct{
+
+    unsigned long long retired; // c -> retired after the writing instruction
+    uint32_t address;
+    uint32_t length; // bytes from address, 4 for a store; bulk loops log their whole range
+    int32_t value;   // word stored (the first one for bulk loops, the bytes little-endian if shorter)
+
+} WriteRecord;
+
+typedef struct WriteLog{
+
+    WriteRecord* records;
+    unsigned long long capacity; // a power of two
+    unsigned long long head;     // records ever logged, the next one goes to head % capacity
+
+} WriteLog;
+
+typedef struct{
+
+    unsigned long long next; // index of the next record to read
+    unsigned long long lost; // records overwritten before they were read
+
+} WriteCursor;
+
+#define WRITE_LOG_DEFAULT_LOG2 16
+
+/* Starts logging $c's writes into a ring of 2^$log2_capacity records,
+   replacing any previous log. Returns NULL if it cannot be allocated. */
+WriteLog* enable_write_log(Computer* c, int log2_capacity);
+
+/* Stops logging and frees the log. Consumers must be done with it. */
+void disable_write_log(Computer* c);
+
+/* Positions $cursor after the last record logged so far. */
+void init_write_cursor(WriteLog* log, WriteCursor* cursor);
+
+/* Copies at most $max records following $cursor, oldest first, into
+   $out and advances $cursor. Returns the number of records copied. */
+long drain_writes(WriteLog* log, WriteCursor* cursor, WriteRecord* out, long max);
+
+/* Writes the last (at most) $n records of $c's log into $buf, one per
+   line. */
+void format_write_log(Computer* c, char* buf, size_t len, int n);
+
+/* Called by the store paths after writing $length bytes at $addr. */
+static inline void log_write(Computer* c, long addr, long length, int32_t value){
+
+    WriteLog* log = c->write_log;
+
+    if(log == NULL)
+        return;
+
+    unsigned long long h = log->head;
+    WriteRecord* r = &log->records[h & (log->capacity - 1)];
+
+    // consumers may be copying the slot: relaxed atomics, published by head
+    __atomic_store_n(&r->retired, c->retired, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->address, (uint32_t) addr, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->length, (uint32_t) length, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&log->head, h + 1, __ATOMIC_RELEASE);
+}
+
+#endif